@@ -0,0 +1,81 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <bitshuffle.h>
+#include <lz4.h>
+
+#include "benchUtil.h"
+
+double bench_now(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + 1e-9 * (double)ts.tv_nsec;
+}
+
+void bench_write_be(uint8_t* p, uint64_t v, int bytes) {
+    for (int i = 0; i < bytes; i++)
+        p[i] = (uint8_t)(v >> (8 * (bytes - 1 - i)));
+}
+
+void bench_make_frame(void* frame, size_t width, size_t height,
+                      size_t elem_size) {
+    uint8_t* out = frame;
+    for (size_t i = 0; i < width * height; i++) {
+        unsigned v = rand() % 64 == 0 ? rand() % 200 : rand() % 2;
+        if (i % width % 1030 >= 1028)
+            v = 0xffffffff;
+        memcpy(out + i * elem_size, &v, elem_size);
+    }
+}
+
+size_t bench_bslz4_bound(size_t elems, size_t elem_size) {
+    return 12 + bshuf_compress_lz4_bound(elems, elem_size, 0);
+}
+
+size_t bench_compress_bslz4(const void* in, size_t elems, size_t elem_size,
+                            void* out) {
+    uint8_t* header = out;
+    bench_write_be(header, (uint64_t)elems * elem_size, 8);
+    bench_write_be(header + 8,
+                   bshuf_default_block_size(elem_size) * elem_size, 4);
+
+    int64_t r = bshuf_compress_lz4(in, header + 12, elems, elem_size, 0);
+    return r < 0 ? 0 : (size_t)r + 12;
+}
+
+size_t bench_lz4_bound(size_t bytes) {
+    return (size_t)LZ4_compressBound((int)bytes);
+}
+
+size_t bench_compress_lz4(const void* in, size_t bytes, void* out) {
+    int r = LZ4_compress_default(in, out, (int)bytes,
+                                 LZ4_compressBound((int)bytes));
+    return r <= 0 ? 0 : (size_t)r;
+}
+
+size_t bench_lz4_hdf5_bound(size_t bytes) {
+    const size_t blocks = (bytes + BENCH_LZ4_BLOCK_BYTES - 1) / BENCH_LZ4_BLOCK_BYTES;
+    return 12 + blocks * (4 + (size_t)LZ4_compressBound(BENCH_LZ4_BLOCK_BYTES));
+}
+
+size_t bench_compress_lz4_hdf5(const void* in, size_t bytes, void* out) {
+    uint8_t* buf = out;
+    bench_write_be(buf, bytes, 8);
+    bench_write_be(buf + 8, BENCH_LZ4_BLOCK_BYTES, 4);
+
+    size_t pos = 12;
+    for (size_t off = 0; off < bytes; off += BENCH_LZ4_BLOCK_BYTES) {
+        int n = (int)(bytes - off < BENCH_LZ4_BLOCK_BYTES
+                              ? bytes - off
+                              : BENCH_LZ4_BLOCK_BYTES);
+        int r = LZ4_compress_default((const char*)in + off,
+                                     (char*)buf + pos + 4, n,
+                                     LZ4_compressBound(n));
+        if (r <= 0)
+            return 0;
+        bench_write_be(buf + pos, (uint32_t)r, 4);
+        pos += 4 + (size_t)r;
+    }
+    return pos;
+}
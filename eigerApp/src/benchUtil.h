@@ -0,0 +1,48 @@
+#ifndef BENCH_UTIL_H
+#define BENCH_UTIL_H
+
+// Fixtures shared by the tests, benchmarks and simulators: a clock, frames
+// like a detector's and their compression the way the detector does it.
+// Each compression function returns the compressed size, or 0 on error, and
+// writes at most its bound.
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+// Block size of the LZ4 streams sent by Stream2
+#define BENCH_LZ4_BLOCK_BYTES (1 << 20)
+
+// Monotonic time in seconds
+double bench_now(void);
+
+// Writes the low bytes of v to p, most significant first
+void bench_write_be(uint8_t* p, uint64_t v, int bytes);
+
+// Fills width * height elements with mostly 0 and 1 counts with an
+// occasional hot pixel, and a gap of flagged pixels between modules every
+// 1030 pixels of a row. Draws from rand(), seed it for repeatable frames.
+void bench_make_frame(void* frame, size_t width, size_t height,
+                      size_t elem_size);
+
+// bitshuffle/LZ4 behind the 12 byte header, as sent by both interfaces
+size_t bench_bslz4_bound(size_t elems, size_t elem_size);
+size_t bench_compress_bslz4(const void* in, size_t elems, size_t elem_size,
+                            void* out);
+
+// A single LZ4 block, as sent by Stream
+size_t bench_lz4_bound(size_t bytes);
+size_t bench_compress_lz4(const void* in, size_t bytes, void* out);
+
+// The HDF5 LZ4 filter format, as sent by Stream2: the sizes, then each block
+// with its compressed size
+size_t bench_lz4_hdf5_bound(size_t bytes);
+size_t bench_compress_lz4_hdf5(const void* in, size_t bytes, void* out);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -0,0 +1,598 @@
+#include "bslz4.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <bitshuffle.h>
+#include <lz4.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define BSLZ4_X86
+#endif
+
+// Block size used by bshuf_compress_lz4() when none is given, in bytes
+enum { DEFAULT_BLOCK_BYTES = 8192, MIN_BLOCK_SIZE = 128 };
+
+// Blocks up to this size are decompressed with buffers on the stack
+enum { STACK_BLOCK_BYTES = 8192 };
+
+static uint64_t read_u64_be(const uint8_t* buf) {
+    return ((uint64_t)buf[0] << 56) | ((uint64_t)buf[1] << 48) |
+           ((uint64_t)buf[2] << 40) | ((uint64_t)buf[3] << 32) |
+           ((uint64_t)buf[4] << 24) | ((uint64_t)buf[5] << 16) |
+           ((uint64_t)buf[6] << 8) | (uint64_t)buf[7];
+}
+
+static uint32_t read_u32_be(const uint8_t* buf) {
+    return ((uint32_t)buf[0] << 24) | ((uint32_t)buf[1] << 16) |
+           ((uint32_t)buf[2] << 8) | (uint32_t)buf[3];
+}
+
+// A bit-shuffled block of n elements, n a multiple of 8, holds 8 * elem_size
+// rows of n / 8 bytes. Bit k of byte j of element i is in row 8 * j + k, at
+// bit i % 8 of byte i / 8.
+//
+// The kernels undo this one byte plane at a time. Plane j gets byte j of all
+// elements from rows 8 * j to 8 * j + 7: for each group of 8 elements the
+// corresponding byte of each of the 8 rows forms an 8x8 bit matrix, which is
+// transposed to give byte j of those 8 elements.
+typedef void (*unshuffle_fn)(const uint8_t* in,
+                             uint8_t* planes,
+                             size_t n,
+                             size_t elem_size);
+
+// Transposes the 8x8 bit matrix whose rows are the bytes of x.
+static uint64_t trans_bit_8x8(uint64_t x) {
+    uint64_t t;
+    t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+    x = x ^ t ^ (t << 7);
+    t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+    x = x ^ t ^ (t << 14);
+    t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+    x = x ^ t ^ (t << 28);
+    return x;
+}
+
+// Unshuffles the groups [g, row_len) of one plane.
+static void unshuffle_plane_scalar(const uint8_t* rows,
+                                   size_t row_len,
+                                   uint8_t* plane,
+                                   size_t g) {
+    for (; g < row_len; g++) {
+        uint64_t x = 0;
+        for (int k = 0; k < 8; k++)
+            x |= (uint64_t)rows[k * row_len + g] << (8 * k);
+        x = trans_bit_8x8(x);
+        for (int m = 0; m < 8; m++)
+            plane[8 * g + m] = (uint8_t)(x >> (8 * m));
+    }
+}
+
+static void unshuffle_scalar(const uint8_t* in,
+                             uint8_t* planes,
+                             size_t n,
+                             size_t elem_size) {
+    const size_t row_len = n / 8;
+    for (size_t j = 0; j < elem_size; j++)
+        unshuffle_plane_scalar(in + 8 * j * row_len, row_len, planes + j * n,
+                               0);
+}
+
+#ifdef BSLZ4_X86
+
+// The SIMD kernels load the bytes of 8 rows for 16, 32 or 64 consecutive
+// groups, interleave them so that each 64-bit lane holds one group's 8x8 bit
+// matrix, and transpose all lanes at once with the steps of trans_bit_8x8().
+
+#define TRANS_BIT_8X8_STEP(TYPE, PRE, SUF, x, shift, mask)                  \
+    do {                                                                    \
+        const TYPE t = PRE##_and_##SUF(                                     \
+                PRE##_xor_##SUF(x, PRE##_srli_epi64(x, shift)), mask);      \
+        x = PRE##_xor_##SUF(PRE##_xor_##SUF(x, t),                          \
+                            PRE##_slli_epi64(t, shift));                    \
+    } while (0)
+
+__attribute__((target("sse2"))) static inline __m128i trans_bit_8x8_sse2(
+        __m128i x) {
+    const __m128i m1 = _mm_set1_epi64x(0x00AA00AA00AA00AALL);
+    const __m128i m2 = _mm_set1_epi64x(0x0000CCCC0000CCCCLL);
+    const __m128i m3 = _mm_set1_epi64x(0x00000000F0F0F0F0LL);
+    TRANS_BIT_8X8_STEP(__m128i, _mm, si128, x, 7, m1);
+    TRANS_BIT_8X8_STEP(__m128i, _mm, si128, x, 14, m2);
+    TRANS_BIT_8X8_STEP(__m128i, _mm, si128, x, 28, m3);
+    return x;
+}
+
+__attribute__((target("sse2"))) static void unshuffle_sse2(const uint8_t* in,
+                                                           uint8_t* planes,
+                                                           size_t n,
+                                                           size_t elem_size) {
+    const size_t row_len = n / 8;
+    for (size_t j = 0; j < elem_size; j++) {
+        const uint8_t* rows = in + 8 * j * row_len;
+        uint8_t* plane = planes + j * n;
+        size_t g = 0;
+        for (; g + 16 <= row_len; g += 16) {
+            __m128i r[8], a[8], b[8], x[8];
+            for (int k = 0; k < 8; k++)
+                r[k] = _mm_loadu_si128((const __m128i*)(rows + k * row_len + g));
+
+            // 2 rows per group
+            for (int k = 0; k < 4; k++) {
+                a[2 * k] = _mm_unpacklo_epi8(r[2 * k], r[2 * k + 1]);
+                a[2 * k + 1] = _mm_unpackhi_epi8(r[2 * k], r[2 * k + 1]);
+            }
+            // 4 rows per group: groups 0-3, 4-7, 8-11, 12-15
+            for (int k = 0; k < 2; k++) {
+                b[4 * k] = _mm_unpacklo_epi16(a[4 * k], a[4 * k + 2]);
+                b[4 * k + 1] = _mm_unpackhi_epi16(a[4 * k], a[4 * k + 2]);
+                b[4 * k + 2] = _mm_unpacklo_epi16(a[4 * k + 1], a[4 * k + 3]);
+                b[4 * k + 3] = _mm_unpackhi_epi16(a[4 * k + 1], a[4 * k + 3]);
+            }
+            // 8 rows per group: groups 2i and 2i+1 in x[i]
+            for (int k = 0; k < 4; k++) {
+                x[2 * k] = _mm_unpacklo_epi32(b[k], b[k + 4]);
+                x[2 * k + 1] = _mm_unpackhi_epi32(b[k], b[k + 4]);
+            }
+
+            for (int i = 0; i < 8; i++)
+                _mm_storeu_si128((__m128i*)(plane + 8 * g + 16 * i),
+                                 trans_bit_8x8_sse2(x[i]));
+        }
+        unshuffle_plane_scalar(rows, row_len, plane, g);
+    }
+}
+
+__attribute__((target("avx2"))) static inline __m256i trans_bit_8x8_avx2(
+        __m256i x) {
+    const __m256i m1 = _mm256_set1_epi64x(0x00AA00AA00AA00AALL);
+    const __m256i m2 = _mm256_set1_epi64x(0x0000CCCC0000CCCCLL);
+    const __m256i m3 = _mm256_set1_epi64x(0x00000000F0F0F0F0LL);
+    TRANS_BIT_8X8_STEP(__m256i, _mm256, si256, x, 7, m1);
+    TRANS_BIT_8X8_STEP(__m256i, _mm256, si256, x, 14, m2);
+    TRANS_BIT_8X8_STEP(__m256i, _mm256, si256, x, 28, m3);
+    return x;
+}
+
+__attribute__((target("avx2"))) static void unshuffle_avx2(const uint8_t* in,
+                                                           uint8_t* planes,
+                                                           size_t n,
+                                                           size_t elem_size) {
+    const size_t row_len = n / 8;
+    for (size_t j = 0; j < elem_size; j++) {
+        const uint8_t* rows = in + 8 * j * row_len;
+        uint8_t* plane = planes + j * n;
+        size_t g = 0;
+        for (; g + 32 <= row_len; g += 32) {
+            __m256i r[8], a[8], b[8], x[8];
+            for (int k = 0; k < 8; k++)
+                r[k] = _mm256_loadu_si256(
+                        (const __m256i*)(rows + k * row_len + g));
+
+            // The same steps as unshuffle_sse2(), in each 128-bit lane
+            for (int k = 0; k < 4; k++) {
+                a[2 * k] = _mm256_unpacklo_epi8(r[2 * k], r[2 * k + 1]);
+                a[2 * k + 1] = _mm256_unpackhi_epi8(r[2 * k], r[2 * k + 1]);
+            }
+            for (int k = 0; k < 2; k++) {
+                b[4 * k] = _mm256_unpacklo_epi16(a[4 * k], a[4 * k + 2]);
+                b[4 * k + 1] = _mm256_unpackhi_epi16(a[4 * k], a[4 * k + 2]);
+                b[4 * k + 2] = _mm256_unpacklo_epi16(a[4 * k + 1], a[4 * k + 3]);
+                b[4 * k + 3] = _mm256_unpackhi_epi16(a[4 * k + 1], a[4 * k + 3]);
+            }
+            for (int k = 0; k < 4; k++) {
+                x[2 * k] = _mm256_unpacklo_epi32(b[k], b[k + 4]);
+                x[2 * k + 1] = _mm256_unpackhi_epi32(b[k], b[k + 4]);
+            }
+            for (int i = 0; i < 8; i++)
+                x[i] = trans_bit_8x8_avx2(x[i]);
+
+            // x[i] holds groups 2i, 2i+1 in its low lane and 16+2i, 17+2i in
+            // its high lane
+            for (int i = 0; i < 4; i++) {
+                _mm256_storeu_si256(
+                        (__m256i*)(plane + 8 * g + 32 * i),
+                        _mm256_permute2x128_si256(x[2 * i], x[2 * i + 1], 0x20));
+                _mm256_storeu_si256(
+                        (__m256i*)(plane + 8 * g + 128 + 32 * i),
+                        _mm256_permute2x128_si256(x[2 * i], x[2 * i + 1], 0x31));
+            }
+        }
+        unshuffle_plane_scalar(rows, row_len, plane, g);
+    }
+}
+
+__attribute__((target("avx512f,avx512bw"))) static inline __m512i
+trans_bit_8x8_avx512(__m512i x) {
+    const __m512i m1 = _mm512_set1_epi64(0x00AA00AA00AA00AALL);
+    const __m512i m2 = _mm512_set1_epi64(0x0000CCCC0000CCCCLL);
+    const __m512i m3 = _mm512_set1_epi64(0x00000000F0F0F0F0LL);
+    TRANS_BIT_8X8_STEP(__m512i, _mm512, si512, x, 7, m1);
+    TRANS_BIT_8X8_STEP(__m512i, _mm512, si512, x, 14, m2);
+    TRANS_BIT_8X8_STEP(__m512i, _mm512, si512, x, 28, m3);
+    return x;
+}
+
+__attribute__((target("avx512f,avx512bw"))) static void unshuffle_avx512(
+        const uint8_t* in,
+        uint8_t* planes,
+        size_t n,
+        size_t elem_size) {
+    const size_t row_len = n / 8;
+    for (size_t j = 0; j < elem_size; j++) {
+        const uint8_t* rows = in + 8 * j * row_len;
+        uint8_t* plane = planes + j * n;
+        size_t g = 0;
+        for (; g + 64 <= row_len; g += 64) {
+            __m512i r[8], a[8], b[8], x[8];
+            for (int k = 0; k < 8; k++)
+                r[k] = _mm512_loadu_si512(rows + k * row_len + g);
+
+            // The same steps as unshuffle_sse2(), in each 128-bit lane
+            for (int k = 0; k < 4; k++) {
+                a[2 * k] = _mm512_unpacklo_epi8(r[2 * k], r[2 * k + 1]);
+                a[2 * k + 1] = _mm512_unpackhi_epi8(r[2 * k], r[2 * k + 1]);
+            }
+            for (int k = 0; k < 2; k++) {
+                b[4 * k] = _mm512_unpacklo_epi16(a[4 * k], a[4 * k + 2]);
+                b[4 * k + 1] = _mm512_unpackhi_epi16(a[4 * k], a[4 * k + 2]);
+                b[4 * k + 2] = _mm512_unpacklo_epi16(a[4 * k + 1], a[4 * k + 3]);
+                b[4 * k + 3] = _mm512_unpackhi_epi16(a[4 * k + 1], a[4 * k + 3]);
+            }
+            for (int k = 0; k < 4; k++) {
+                x[2 * k] = _mm512_unpacklo_epi32(b[k], b[k + 4]);
+                x[2 * k + 1] = _mm512_unpackhi_epi32(b[k], b[k + 4]);
+            }
+            for (int i = 0; i < 8; i++)
+                x[i] = trans_bit_8x8_avx512(x[i]);
+
+            // Lane l of x[i] holds groups 16l+2i and 16l+2i+1. Gather lane l
+            // of x[0..3] for groups 16l to 16l+7, and of x[4..7] for groups
+            // 16l+8 to 16l+15.
+            for (int h = 0; h < 2; h++) {
+                const __m512i* y = &x[4 * h];
+                const __m512i lo01 =
+                        _mm512_shuffle_i64x2(y[0], y[1], _MM_SHUFFLE(1, 0, 1, 0));
+                const __m512i hi01 =
+                        _mm512_shuffle_i64x2(y[0], y[1], _MM_SHUFFLE(3, 2, 3, 2));
+                const __m512i lo23 =
+                        _mm512_shuffle_i64x2(y[2], y[3], _MM_SHUFFLE(1, 0, 1, 0));
+                const __m512i hi23 =
+                        _mm512_shuffle_i64x2(y[2], y[3], _MM_SHUFFLE(3, 2, 3, 2));
+                uint8_t* dst = plane + 8 * g + 64 * h;
+                _mm512_storeu_si512(dst, _mm512_shuffle_i64x2(
+                                                 lo01, lo23,
+                                                 _MM_SHUFFLE(2, 0, 2, 0)));
+                _mm512_storeu_si512(dst + 128, _mm512_shuffle_i64x2(
+                                                       lo01, lo23,
+                                                       _MM_SHUFFLE(3, 1, 3, 1)));
+                _mm512_storeu_si512(dst + 256, _mm512_shuffle_i64x2(
+                                                       hi01, hi23,
+                                                       _MM_SHUFFLE(2, 0, 2, 0)));
+                _mm512_storeu_si512(dst + 384, _mm512_shuffle_i64x2(
+                                                       hi01, hi23,
+                                                       _MM_SHUFFLE(3, 1, 3, 1)));
+            }
+        }
+        unshuffle_plane_scalar(rows, row_len, plane, g);
+    }
+}
+
+#endif  // BSLZ4_X86
+
+static unshuffle_fn get_unshuffle(enum bslz4_kernel kernel) {
+    switch (kernel) {
+#ifdef BSLZ4_X86
+        case BSLZ4_KERNEL_SSE2:
+            return unshuffle_sse2;
+        case BSLZ4_KERNEL_AVX2:
+            return unshuffle_avx2;
+        case BSLZ4_KERNEL_AVX512:
+            return unshuffle_avx512;
+#endif
+        default:
+            return unshuffle_scalar;
+    }
+}
+
+// Interleaves the byte planes of n elements into the elements.
+static void interleave_planes(const uint8_t* planes,
+                              uint8_t* out,
+                              size_t n,
+                              size_t elem_size) {
+    switch (elem_size) {
+        case 2: {
+            const uint8_t* p0 = planes;
+            const uint8_t* p1 = planes + n;
+            for (size_t i = 0; i < n; i++) {
+                out[2 * i] = p0[i];
+                out[2 * i + 1] = p1[i];
+            }
+            break;
+        }
+        case 4: {
+            const uint8_t* p0 = planes;
+            const uint8_t* p1 = planes + n;
+            const uint8_t* p2 = planes + 2 * n;
+            const uint8_t* p3 = planes + 3 * n;
+            for (size_t i = 0; i < n; i++) {
+                out[4 * i] = p0[i];
+                out[4 * i + 1] = p1[i];
+                out[4 * i + 2] = p2[i];
+                out[4 * i + 3] = p3[i];
+            }
+            break;
+        }
+        default:
+            for (size_t j = 0; j < elem_size; j++)
+                for (size_t i = 0; i < n; i++)
+                    out[i * elem_size + j] = planes[j * n + i];
+            break;
+    }
+}
+
+// Replaces the values v >= max - 1 with fill, returning how many there were.
+// Written without branches so that the compiler vectorises the loop. The
+// flags are counted in the pixel type, over chunks short enough that the
+// count cannot wrap, to avoid widening them.
+#define DEFINE_MASK(name, type, max)                                    \
+    static size_t name(const type* in, type* out, size_t size,          \
+                       type fill) {                                     \
+        const size_t chunk = (max) < 4096 ? (max) : 4096;               \
+        size_t count = 0;                                               \
+        for (size_t start = 0; start < size; start += chunk) {          \
+            const size_t end = size - start < chunk ? size : start + chunk; \
+            type chunk_count = 0;                                       \
+            for (size_t i = start; i < end; i++) {                      \
+                const type v = in[i];                                   \
+                const type flagged = v >= (type)((max) - 1);            \
+                chunk_count += flagged;                                 \
+                out[i] = flagged ? fill : v;                            \
+            }                                                           \
+            count += chunk_count;                                       \
+        }                                                               \
+        return count;                                                   \
+    }
+
+DEFINE_MASK(mask_u8, uint8_t, UINT8_MAX)
+DEFINE_MASK(mask_u16, uint16_t, UINT16_MAX)
+DEFINE_MASK(mask_u32, uint32_t, UINT32_MAX)
+
+void bslz4_mask_pixels(const void* in,
+                       void* out,
+                       size_t size,
+                       size_t elem_size,
+                       struct bslz4_mask* mask) {
+    switch (elem_size) {
+        case 1:
+            mask->count += mask_u8((const uint8_t*)in, (uint8_t*)out, size,
+                                   (uint8_t)mask->fill);
+            break;
+        case 2:
+            mask->count += mask_u16((const uint16_t*)in, (uint16_t*)out, size,
+                                    (uint16_t)mask->fill);
+            break;
+        case 4:
+            mask->count += mask_u32((const uint32_t*)in, (uint32_t*)out, size,
+                                    mask->fill);
+            break;
+        default:
+            if (in != out)
+                memcpy(out, in, size * elem_size);
+            break;
+    }
+}
+
+static int kernel_supported(enum bslz4_kernel kernel) {
+    switch (kernel) {
+        case BSLZ4_KERNEL_REFERENCE:
+        case BSLZ4_KERNEL_SCALAR:
+            return 1;
+#ifdef BSLZ4_X86
+        case BSLZ4_KERNEL_SSE2:
+            return __builtin_cpu_supports("sse2");
+        case BSLZ4_KERNEL_AVX2:
+            return __builtin_cpu_supports("avx2");
+        case BSLZ4_KERNEL_AVX512:
+            return __builtin_cpu_supports("avx512f") &&
+                   __builtin_cpu_supports("avx512bw");
+#endif
+        default:
+            return 0;
+    }
+}
+
+enum bslz4_kernel bslz4_resolve_kernel(enum bslz4_kernel kernel) {
+    if (kernel != BSLZ4_KERNEL_AUTO && kernel_supported(kernel))
+        return kernel;
+
+    const enum bslz4_kernel fastest[] = {
+            BSLZ4_KERNEL_AVX512, BSLZ4_KERNEL_AVX2, BSLZ4_KERNEL_SSE2};
+    for (size_t i = 0; i < sizeof(fastest) / sizeof(fastest[0]); i++) {
+        if (kernel_supported(fastest[i]))
+            return fastest[i];
+    }
+    return BSLZ4_KERNEL_SCALAR;
+}
+
+const char* bslz4_kernel_name(enum bslz4_kernel kernel) {
+    switch (kernel) {
+        case BSLZ4_KERNEL_AUTO:
+            return "Auto";
+        case BSLZ4_KERNEL_REFERENCE:
+            return "Reference";
+        case BSLZ4_KERNEL_SCALAR:
+            return "Scalar";
+        case BSLZ4_KERNEL_SSE2:
+            return "SSE2";
+        case BSLZ4_KERNEL_AVX2:
+            return "AVX2";
+        case BSLZ4_KERNEL_AVX512:
+            return "AVX512";
+        default:
+            return "Unknown";
+    }
+}
+
+// Decompresses the blocks that hold some of the elements [first, last), into
+// out or, when out is NULL, through sink.
+static int64_t decompress(const void* in,
+                          size_t in_size,
+                          void* out,
+                          size_t out_size,
+                          size_t elem_size,
+                          enum bslz4_kernel kernel,
+                          struct bslz4_mask* mask,
+                          size_t first,
+                          size_t last,
+                          bslz4_sink sink,
+                          void* arg) {
+    const uint8_t* ip = (const uint8_t*)in;
+    const uint8_t* const iend = ip + in_size;
+    uint8_t* op = (uint8_t*)out;
+
+    if (in_size < 12 || elem_size == 0)
+        return BSLZ4_ERROR_HEADER;
+
+    if (read_u64_be(ip) != out_size || out_size % elem_size != 0)
+        return BSLZ4_ERROR_SIZE;
+
+    size_t block_size = read_u32_be(ip + 8) / elem_size;
+    if (block_size == 0) {
+        // Same as bshuf_default_block_size()
+        block_size = DEFAULT_BLOCK_BYTES / elem_size / 8 * 8;
+        if (block_size < MIN_BLOCK_SIZE)
+            block_size = MIN_BLOCK_SIZE;
+    }
+    if (block_size % 8 != 0)
+        return BSLZ4_ERROR_HEADER;
+    ip += 12;
+
+    size_t remaining = out_size / elem_size;
+
+    kernel = bslz4_resolve_kernel(kernel);
+    if (kernel == BSLZ4_KERNEL_REFERENCE) {
+        if (out == NULL) {
+            // The library can only decompress everything
+            kernel = bslz4_resolve_kernel(BSLZ4_KERNEL_AUTO);
+        } else {
+            int64_t r = bshuf_decompress_lz4(ip, out, remaining, elem_size,
+                                             block_size);
+            if (r < 0)
+                return BSLZ4_ERROR_LZ4;
+            if (mask)
+                bslz4_mask_pixels(out, out, remaining, elem_size, mask);
+            return r + 12;
+        }
+    }
+    const unshuffle_fn unshuffle = get_unshuffle(kernel);
+
+    // LZ4 output, and the byte planes when elements are wider than a byte.
+    // Without out, the block is unshuffled into whichever is free.
+    uint8_t stack_buf[2 * STACK_BLOCK_BYTES];
+    uint8_t* buf = stack_buf;
+    const size_t block_bytes = block_size * elem_size;
+    if (block_bytes > STACK_BLOCK_BYTES) {
+        if ((buf = malloc(2 * block_bytes)) == NULL)
+            return BSLZ4_ERROR_OUT_OF_MEMORY;
+    }
+    uint8_t* const shuffled = buf;
+    uint8_t* const planes = buf + block_bytes;
+
+    int64_t result = 0;
+    size_t pos = 0;
+    while (remaining >= 8) {
+        // The last block is rounded down to a multiple of 8 elements
+        const size_t n = remaining < block_size ? remaining / 8 * 8 : block_size;
+        const size_t nbytes = n * elem_size;
+
+        if (pos >= last)
+            break;
+
+        if (iend - ip < 4) {
+            result = BSLZ4_ERROR_TRUNCATED;
+            goto done;
+        }
+        const uint32_t csize = read_u32_be(ip);
+        ip += 4;
+        if ((size_t)(iend - ip) < csize) {
+            result = BSLZ4_ERROR_TRUNCATED;
+            goto done;
+        }
+
+        if (pos + n > first) {
+            if (LZ4_decompress_safe((const char*)ip, (char*)shuffled,
+                                    (int)csize, (int)nbytes) != (int)nbytes) {
+                result = BSLZ4_ERROR_LZ4;
+                goto done;
+            }
+
+            uint8_t* const dst = out ? op : elem_size == 1 ? planes : shuffled;
+            if (elem_size == 1) {
+                unshuffle(shuffled, dst, n, 1);
+            } else {
+                unshuffle(shuffled, planes, n, elem_size);
+                interleave_planes(planes, dst, n, elem_size);
+            }
+            // Mask while the block is still in the cache
+            if (mask)
+                bslz4_mask_pixels(dst, dst, n, elem_size, mask);
+            if (sink)
+                sink(arg, dst, pos, n);
+        }
+        ip += csize;
+        op += nbytes;
+        pos += n;
+        remaining -= n;
+    }
+
+    // The last elements that do not fill a group of 8 are not compressed
+    if (remaining < 8 && pos < last) {
+        const size_t leftover = remaining * elem_size;
+        if ((size_t)(iend - ip) < leftover) {
+            result = BSLZ4_ERROR_TRUNCATED;
+            goto done;
+        }
+        uint8_t* const dst = out ? op : shuffled;
+        memcpy(dst, ip, leftover);
+        if (mask)
+            bslz4_mask_pixels(dst, dst, remaining, elem_size, mask);
+        if (sink)
+            sink(arg, dst, pos, remaining);
+        ip += leftover;
+    }
+    result = ip - (const uint8_t*)in;
+
+done:
+    if (buf != stack_buf)
+        free(buf);
+    return result;
+}
+
+int64_t bslz4_decompress(const void* in,
+                         size_t in_size,
+                         void* out,
+                         size_t out_size,
+                         size_t elem_size,
+                         enum bslz4_kernel kernel,
+                         struct bslz4_mask* mask) {
+    if (out == NULL)
+        return BSLZ4_ERROR_SIZE;
+    return decompress(in, in_size, out, out_size, elem_size, kernel, mask, 0,
+                      SIZE_MAX, NULL, NULL);
+}
+
+int64_t bslz4_decompress_range(const void* in,
+                               size_t in_size,
+                               size_t out_size,
+                               size_t elem_size,
+                               enum bslz4_kernel kernel,
+                               struct bslz4_mask* mask,
+                               size_t first,
+                               size_t last,
+                               bslz4_sink sink,
+                               void* arg) {
+    return decompress(in, in_size, NULL, out_size, elem_size, kernel, mask,
+                      first, last, sink, arg);
+}
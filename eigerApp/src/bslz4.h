@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Kernels that undo the bit shuffle of bitshuffle/LZ4 compressed data.
+enum bslz4_kernel {
+    // The fastest kernel supported by the CPU.
+    BSLZ4_KERNEL_AUTO = 0,
+    // bshuf_decompress_lz4() from the bitshuffle library.
+    BSLZ4_KERNEL_REFERENCE,
+    BSLZ4_KERNEL_SCALAR,
+    BSLZ4_KERNEL_SSE2,
+    BSLZ4_KERNEL_AVX2,
+    BSLZ4_KERNEL_AVX512,
+    BSLZ4_NUM_KERNELS,
+};
+
+enum bslz4_error {
+    BSLZ4_ERROR_HEADER = -1,
+    BSLZ4_ERROR_SIZE = -2,
+    BSLZ4_ERROR_TRUNCATED = -3,
+    BSLZ4_ERROR_LZ4 = -4,
+    BSLZ4_ERROR_OUT_OF_MEMORY = -5,
+};
+
+// Masking of the pixels the detector flags: gaps between modules and bad
+// pixels hold 2^N-1 and 2^N-2 for N-bit pixels.
+struct bslz4_mask {
+    // Value written to the flagged pixels, truncated to the pixel size
+    uint32_t fill;
+    // Incremented by the number of flagged pixels
+    size_t count;
+};
+
+// Gets the kernel that runs when the given one is requested. AUTO, and any
+// kernel the CPU does not support, give the fastest kernel it supports.
+enum bslz4_kernel bslz4_resolve_kernel(enum bslz4_kernel kernel);
+
+const char* bslz4_kernel_name(enum bslz4_kernel kernel);
+
+// Decompresses the output of bshuf_compress_lz4(), preceded by the 12 byte
+// header used by the detector and the bitshuffle HDF5 filter: the
+// uncompressed size in bytes as a big-endian uint64 and the block size in
+// bytes as a big-endian uint32.
+//
+// out_size must be the uncompressed size. If mask is not NULL the flagged
+// pixels are masked as each block is decompressed. Returns the number of
+// input bytes used, or a negative enum bslz4_error.
+int64_t bslz4_decompress(const void* in,
+                         size_t in_size,
+                         void* out,
+                         size_t out_size,
+                         size_t elem_size,
+                         enum bslz4_kernel kernel,
+                         struct bslz4_mask* mask);
+
+// Receives the decompressed elements [first, first + n).
+typedef void (*bslz4_sink)(void* arg, const void* data, size_t first, size_t n);
+
+// Like bslz4_decompress(), but only decompresses the blocks that hold some of
+// the elements [first, last), and passes each of them to sink instead of
+// writing out the whole data. Blocks before first are skipped without being
+// decompressed, and blocks after last are not read. The Reference kernel is
+// replaced by the fastest kernel. Returns the number of input bytes read, or
+// a negative enum bslz4_error.
+int64_t bslz4_decompress_range(const void* in,
+                               size_t in_size,
+                               size_t out_size,
+                               size_t elem_size,
+                               enum bslz4_kernel kernel,
+                               struct bslz4_mask* mask,
+                               size_t first,
+                               size_t last,
+                               bslz4_sink sink,
+                               void* arg);
+
+// Copies size pixels of elem_size 1, 2 or 4 bytes from in to out, masking
+// the flagged pixels. in and out may be the same.
+void bslz4_mask_pixels(const void* in,
+                       void* out,
+                       size_t size,
+                       size_t elem_size,
+                       struct bslz4_mask* mask);
+
+#if defined(__cplusplus)
+}
+#endif
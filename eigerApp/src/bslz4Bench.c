@@ -0,0 +1,81 @@
+// Measures the bitshuffle/LZ4 decompression throughput of each kernel.
+//
+// Usage: bslz4Bench [iterations] [pixels]
+//
+// The frames hold photon counts with a low mean, like most detector images,
+// compressed with bshuf_compress_lz4(). Throughput is in uncompressed MB/s,
+// without and with masking of the flagged pixels.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "benchUtil.h"
+#include "bslz4.h"
+
+enum { DEFAULT_ITERATIONS = 50, DEFAULT_PIXELS = 4 * 1024 * 1024 };
+
+int main(int argc, char** argv) {
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    size_t pixels = argc > 2 ? (size_t)atol(argv[2]) : DEFAULT_PIXELS;
+    if (iterations <= 0)
+        iterations = DEFAULT_ITERATIONS;
+    if (pixels == 0)
+        pixels = DEFAULT_PIXELS;
+
+    printf("%zu pixels, %ld iterations\n", pixels, iterations);
+    printf("%-6s %-10s %10s %10s\n", "bits", "kernel", "MB/s", "masked");
+
+    const size_t elem_sizes[] = {1, 2, 4};
+    for (size_t e = 0; e < sizeof(elem_sizes) / sizeof(elem_sizes[0]); e++) {
+        const size_t elem_size = elem_sizes[e];
+        const size_t bytes = pixels * elem_size;
+        uint8_t* frame = calloc(1, bytes);
+        uint8_t* compressed = malloc(bench_bslz4_bound(pixels, elem_size));
+        uint8_t* out = malloc(bytes);
+        if (frame == NULL || compressed == NULL || out == NULL)
+            return 1;
+
+        srand(1);
+        bench_make_frame(frame, pixels, 1, elem_size);
+
+        const size_t compressed_size = bench_compress_bslz4(frame, pixels,
+                                                            elem_size, compressed);
+        if (compressed_size == 0) {
+            fprintf(stderr, "bshuf_compress_lz4 failed\n");
+            return 1;
+        }
+
+        for (int k = BSLZ4_KERNEL_REFERENCE; k < BSLZ4_NUM_KERNELS; k++) {
+            const enum bslz4_kernel kernel = (enum bslz4_kernel)k;
+            if (bslz4_resolve_kernel(kernel) != kernel)
+                continue;
+
+            memset(out, 0, bytes);
+            if (bslz4_decompress(compressed, compressed_size, out, bytes,
+                                 elem_size, kernel, NULL) < 0 ||
+                memcmp(out, frame, bytes) != 0) {
+                fprintf(stderr, "%s: wrong result\n", bslz4_kernel_name(kernel));
+                return 1;
+            }
+
+            double mbs[2];
+            for (int masked = 0; masked < 2; masked++) {
+                struct bslz4_mask mask = {0, 0};
+                double start = bench_now();
+                for (long n = 0; n < iterations; n++)
+                    bslz4_decompress(compressed, compressed_size, out, bytes,
+                                     elem_size, kernel, masked ? &mask : NULL);
+                double elapsed = bench_now() - start;
+                mbs[masked] = 1e-6 * (double)bytes * iterations / elapsed;
+            }
+
+            printf("%-6zu %-10s %10.1f %10.1f\n", 8 * elem_size,
+                   bslz4_kernel_name(kernel), mbs[0], mbs[1]);
+        }
+
+        free(frame);
+        free(compressed);
+        free(out);
+    }
+    return 0;
+}
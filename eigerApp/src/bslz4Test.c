@@ -0,0 +1,317 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include <bitshuffle.h>
+#include <testMain.h>
+#include <epicsUnitTest.h>
+
+#include "benchUtil.h"
+#include "bslz4.h"
+#include "roibin.h"
+
+// Element counts covering empty data, data shorter than a group of 8
+// elements, partial last blocks and the uncompressed leftover elements.
+static const size_t sizes[] = {0, 7, 8, 9, 63, 64, 100, 1000, 2048,
+                               4096 + 13, 3 * 4096 + 1234 + 5, 100003};
+static const size_t elem_sizes[] = {1, 2, 4, 8};
+
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+#define NUM_ELEM_SIZES (sizeof(elem_sizes) / sizeof(elem_sizes[0]))
+#define NUM_PATTERNS 2
+
+static void fill(unsigned char* data, size_t bytes, size_t elem_size,
+                 int pattern) {
+    size_t i;
+    for (i = 0; i < bytes; i++) {
+        if (pattern == 0)
+            data[i] = (unsigned char)rand();
+        else  // Low counts, as in most detector images
+            data[i] = i % elem_size == 0 ? (unsigned char)(rand() % 4) : 0;
+    }
+}
+
+static void testKernel(enum bslz4_kernel kernel) {
+    size_t s, e;
+    int pattern;
+
+    for (e = 0; e < NUM_ELEM_SIZES; e++) {
+        for (s = 0; s < NUM_SIZES; s++) {
+            for (pattern = 0; pattern < NUM_PATTERNS; pattern++) {
+                const size_t elem_size = elem_sizes[e];
+                const size_t bytes = sizes[s] * elem_size;
+                unsigned char* data = malloc(bytes + 1);
+                unsigned char* compressed = malloc(bench_bslz4_bound(sizes[s], elem_size));
+                unsigned char* expected = malloc(bytes + 1);
+                unsigned char* out = malloc(bytes + 1);
+
+                fill(data, bytes, elem_size, pattern);
+                size_t compressed_size = bench_compress_bslz4(data, sizes[s], elem_size, compressed);
+
+                // The bitshuffle library is the reference
+                memset(expected, 0, bytes);
+                bshuf_decompress_lz4(compressed + 12, expected, sizes[s],
+                                     elem_size, 0);
+
+                memset(out, 0xA5, bytes);
+                int64_t r = bslz4_decompress(compressed, compressed_size, out,
+                                             bytes, elem_size, kernel, NULL);
+                testOk(r == (int64_t)compressed_size &&
+                       !memcmp(out, expected, bytes) && !memcmp(out, data, bytes),
+                       "%s %zu x %zu bytes, pattern %d",
+                       bslz4_kernel_name(kernel), sizes[s], elem_size, pattern);
+
+                free(data);
+                free(compressed);
+                free(expected);
+                free(out);
+            }
+        }
+    }
+}
+
+static void testErrors(enum bslz4_kernel kernel) {
+    const size_t size = 4096 + 13;
+    const size_t bytes = size * 2;
+    unsigned char* data = malloc(bytes);
+    unsigned char* compressed = malloc(bench_bslz4_bound(size, 2));
+    unsigned char* out = malloc(bytes);
+
+    fill(data, bytes, 2, 1);
+    size_t compressed_size = bench_compress_bslz4(data, size, 2, compressed);
+    const char* name = bslz4_kernel_name(kernel);
+
+    testOk(bslz4_decompress(compressed, compressed_size - 1, out, bytes, 2,
+                            kernel, NULL) < 0, "%s truncated data", name);
+    testOk(bslz4_decompress(compressed, 11, out, bytes, 2, kernel, NULL) ==
+           BSLZ4_ERROR_HEADER, "%s truncated header", name);
+    testOk(bslz4_decompress(compressed, compressed_size, out, bytes - 2, 2,
+                            kernel, NULL) == BSLZ4_ERROR_SIZE, "%s wrong size", name);
+
+    // Corrupt the first block's compressed size
+    compressed[12] = 0x7f;
+    testOk(bslz4_decompress(compressed, compressed_size, out, bytes, 2,
+                            kernel, NULL) < 0, "%s corrupt block size", name);
+
+    free(data);
+    free(compressed);
+    free(out);
+}
+
+// Sets every 10th pixel to 2^N-1 or 2^N-2, and returns the masked data and
+// the number of flagged pixels.
+static size_t flag(unsigned char* data, unsigned char* masked, size_t size,
+                   size_t elem_size, unsigned fill) {
+    size_t i, count = 0;
+    for (i = 0; i < size; i++) {
+        unsigned char* p = data + i * elem_size;
+        if (i % 10 == 3 || i % 10 == 7) {
+            memset(p, 0xff, elem_size);
+            if (i % 10 == 7)
+                p[0] = 0xfe;  // Little-endian 2^N-2
+            count++;
+            memcpy(masked + i * elem_size, &fill, elem_size);
+        } else {
+            memcpy(masked + i * elem_size, p, elem_size);
+        }
+    }
+    return count;
+}
+
+static void testMask(enum bslz4_kernel kernel) {
+    const size_t size = 3 * 4096 + 1234 + 5;
+    size_t e;
+
+    for (e = 0; e < 3; e++) {
+        const size_t elem_size = elem_sizes[e];
+        const size_t bytes = size * elem_size;
+        unsigned char* data = malloc(bytes);
+        unsigned char* masked = malloc(bytes);
+        unsigned char* compressed = malloc(bench_bslz4_bound(size, elem_size));
+        unsigned char* out = malloc(bytes);
+        struct bslz4_mask mask = {0x5a5a5a5a, 0};
+
+        fill(data, bytes, elem_size, 1);
+        size_t count = flag(data, masked, size, elem_size, mask.fill);
+        size_t compressed_size = bench_compress_bslz4(data, size, elem_size, compressed);
+
+        int64_t r = bslz4_decompress(compressed, compressed_size, out, bytes,
+                                     elem_size, kernel, &mask);
+        testOk(r == (int64_t)compressed_size && mask.count == count &&
+               !memcmp(out, masked, bytes),
+               "%s masks %zu of %zu pixels of %zu bytes",
+               bslz4_kernel_name(kernel), mask.count, size, elem_size);
+
+        free(data);
+        free(masked);
+        free(compressed);
+        free(out);
+    }
+}
+
+// Crops and bins a frame pixel by pixel, masking as roi_bin does
+static size_t roiBin(const unsigned char* data, unsigned* out, size_t width,
+                     size_t elem_size, const struct roi_bin* rb, unsigned fill) {
+    size_t x, y, count = 0;
+    const unsigned flagged = elem_size == 4 ? 0xfffffffeu :
+                             (1u << (8 * elem_size)) - 2;
+    const size_t out_width = roi_bin_out_width(rb);
+
+    memset(out, 0, out_width * roi_bin_out_height(rb) * sizeof(unsigned));
+    for (y = 0; y < rb->size_y; y++) {
+        for (x = 0; x < rb->size_x; x++) {
+            unsigned v = 0;
+            memcpy(&v, data + ((rb->min_y + y) * width + rb->min_x + x) *
+                                      elem_size, elem_size);
+            if (v >= flagged) {
+                v = fill;
+                count++;
+            }
+            out[y / rb->bin * out_width + x / rb->bin] += v;
+        }
+    }
+    return count;
+}
+
+static void testRoiBin(enum bslz4_kernel kernel) {
+    const size_t width = 1030, height = 37;
+    const size_t size = width * height;
+    // min_x, min_y, size_x, size_y, bin
+    static const size_t rois[][5] = {{13, 5, 700, 20, 1}, {100, 1, 0, 0, 3}};
+    size_t e, i, j;
+
+    for (e = 0; e < 3; e++) {
+        const size_t elem_size = elem_sizes[e];
+        const size_t bytes = size * elem_size;
+        unsigned char* data = malloc(bytes);
+        unsigned char* masked = malloc(bytes);
+        unsigned char* compressed = malloc(bench_bslz4_bound(size, elem_size));
+        unsigned* expected = malloc(size * sizeof(unsigned));
+        unsigned char* out = malloc(bytes);
+
+        fill(data, bytes, elem_size, 1);
+        flag(data, masked, size, elem_size, 0);
+        size_t compressed_size = bench_compress_bslz4(data, size, elem_size, compressed);
+
+        for (i = 0; i < sizeof(rois) / sizeof(rois[0]); i++) {
+            struct roi_bin rb;
+            struct bslz4_mask mask = {3, 0};
+            roi_bin_init(&rb, width, height, elem_size, rois[i][0], rois[i][1],
+                         rois[i][2], rois[i][3], rois[i][4]);
+            size_t count = roiBin(data, expected, width, elem_size, &rb,
+                                  mask.fill);
+
+            roi_bin_start(&rb, out, &mask);
+            int64_t r = bslz4_decompress_range(compressed, compressed_size,
+                                               bytes, elem_size, kernel, NULL,
+                                               roi_bin_first(&rb),
+                                               roi_bin_last(&rb), roi_bin_add,
+                                               &rb);
+
+            int same = 1;
+            const size_t n = roi_bin_out_width(&rb) * roi_bin_out_height(&rb);
+            for (j = 0; j < n; j++) {
+                unsigned v = 0;
+                memcpy(&v, out + j * elem_size, elem_size);
+                same = same && v == expected[j];
+            }
+            testOk(r > 0 && same && mask.count == count,
+                   "%s %zu x %zu ROI of %zu bytes, bin %zu",
+                   bslz4_kernel_name(kernel), rb.size_x, rb.size_y, elem_size,
+                   rb.bin);
+        }
+
+        free(data);
+        free(masked);
+        free(compressed);
+        free(expected);
+        free(out);
+    }
+}
+
+// Binned sums saturate at the largest pixel value instead of wrapping, also
+// when the pieces of the frame split the bins
+static void testRoiBinSaturates(void) {
+    const size_t width = 10, height = 4, piece = 3;
+    unsigned char data[10 * 4 * 4], out[5 * 2 * 4];
+    size_t e, i;
+
+    for (e = 0; e < 3; e++) {
+        const size_t elem_size = elem_sizes[e];
+        const unsigned max = elem_size == 4 ? 0xffffffffu :
+                             (1u << (8 * elem_size)) - 1;
+        // Four of them overflow a binned pixel, two do not
+        const unsigned value = max / 3;
+        struct roi_bin rb;
+        int same = 1;
+
+        // The bins of the second row of binned pixels only get two of them
+        for (i = 0; i < width * height; i++) {
+            unsigned v = i / width < 2 || i % 2 == 0 ? value : 0;
+            memcpy(data + i * elem_size, &v, elem_size);
+        }
+
+        roi_bin_init(&rb, width, height, elem_size, 0, 0, 0, 0, 2);
+        roi_bin_start(&rb, out, NULL);
+        for (i = 0; i < width * height; i += piece) {
+            size_t n = width * height - i < piece ? width * height - i : piece;
+            roi_bin_add(&rb, data + i * elem_size, i, n);
+        }
+
+        for (i = 0; i < 10; i++) {
+            unsigned v = 0;
+            memcpy(&v, out + i * elem_size, elem_size);
+            same = same && v == (i < 5 ? max : 2 * value);
+        }
+        testOk(same, "roi_bin saturates %zu byte sums", elem_size);
+    }
+}
+
+static void testMaskPixels(void) {
+    const size_t size = 1001;
+    unsigned char data[1001 * 2], masked[1001 * 2], out[1001 * 2];
+    struct bslz4_mask mask = {0, 0};
+
+    fill(data, sizeof(data), 2, 1);
+    size_t count = flag(data, masked, size, 2, mask.fill);
+
+    bslz4_mask_pixels(data, out, size, 2, &mask);
+    testOk(mask.count == count && !memcmp(out, masked, sizeof(out)),
+           "bslz4_mask_pixels copy");
+
+    mask.count = 0;
+    bslz4_mask_pixels(data, data, size, 2, &mask);
+    testOk(mask.count == count && !memcmp(data, masked, sizeof(data)),
+           "bslz4_mask_pixels in place");
+}
+
+MAIN(bslz4Test)
+{
+    int k, numKernels = 0;
+
+    for (k = BSLZ4_KERNEL_SCALAR; k < BSLZ4_NUM_KERNELS; k++) {
+        if (bslz4_resolve_kernel((enum bslz4_kernel)k) == k)
+            numKernels++;
+    }
+
+    testPlan(6 + numKernels * (NUM_ELEM_SIZES * NUM_SIZES * NUM_PATTERNS + 13));
+
+    testOk(bslz4_resolve_kernel(BSLZ4_KERNEL_AUTO) != BSLZ4_KERNEL_AUTO,
+           "Auto resolves to %s",
+           bslz4_kernel_name(bslz4_resolve_kernel(BSLZ4_KERNEL_AUTO)));
+
+    for (k = BSLZ4_KERNEL_SCALAR; k < BSLZ4_NUM_KERNELS; k++) {
+        const enum bslz4_kernel kernel = (enum bslz4_kernel)k;
+        if (bslz4_resolve_kernel(kernel) != kernel) {
+            testDiag("%s not supported by this CPU", bslz4_kernel_name(kernel));
+            continue;
+        }
+        testKernel(kernel);
+        testErrors(kernel);
+        testMask(kernel);
+        testRoiBin(kernel);
+    }
+    testRoiBinSaturates();
+    testMaskPixels();
+
+    return testDone();
+}
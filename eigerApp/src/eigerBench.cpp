@@ -0,0 +1,533 @@
+// Measures the time taken by the driver's functions on the path of each frame,
+// per call, so that a slower build is noticed before it is deployed.
+//
+// Usage: eigerBench [options]
+//
+//   -n iterations  Calls of each function (default 200, 100x that for the
+//                  functions that only parse headers)
+//   -x width       Width of the generated frames (default 1028)
+//   -y height      Height of the generated frames (default 1062)
+//   -i images      Images in the generated HDF5 data file (default 10)
+//   -m file        Stream2 image message, e.g. written out with
+//                  zmq_msg_data()/zmq_msg_size()
+//   -j file        Stream dimage_d header
+//   -b file        Stream frame data, compressed as the -j header says
+//   -h file        HDF5 data file, as downloaded from the FileWriter. Files
+//                  with compressed data need HDF5_PLUGIN_PATH to be set.
+//   -t file        TIFF image, as served by the Monitor
+//
+// The fixtures that are not given are generated: 16 bit frames of photon
+// counts, as eigerStreamSim sends, compressed as the detector does.
+// The steps are those of frameDecode.h, which the driver uses. Each is
+// reported in ns per call and in GB/s of the image data it produces, or of
+// its input if it produces none.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <string>
+#include <vector>
+
+#include <epicsTime.h>
+#include <hdf5.h>
+#include <hdf5_hl.h>
+
+#include "cbor.h"
+#include "ADDriver.h"
+#include "streamApi.h"
+#include "frameDecode.h"
+#include "rfc3339.h"
+#include "benchUtil.h"
+
+#define DEFAULT_ITERATIONS  200
+#define HEADER_ITERATIONS   100
+
+typedef std::vector<char> buffer_t;
+
+static void report (const char *name, double seconds, long iterations, size_t bytes)
+{
+    printf("%-28s %12.1f ns/op %8.2f GB/s\n", name, 1e9*seconds/iterations,
+            seconds > 0 ? 1e-9*bytes*iterations/seconds : 0.0);
+}
+
+static double elapsed (epicsTimeStamp const & start)
+{
+    epicsTimeStamp now;
+    epicsTimeGetCurrent(&now);
+    return epicsTimeDiffInSeconds(&now, &start);
+}
+
+static int readFile (const char *path, buffer_t & buf)
+{
+    FILE *file = fopen(path, "rb");
+    if(!file)
+    {
+        perror(path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    buf.resize(ftell(file));
+    fseek(file, 0, SEEK_SET);
+    size_t n = buf.empty() ? 0 : fread(&buf[0], 1, buf.size(), file);
+    fclose(file);
+    if(buf.empty() || n != buf.size())
+    {
+        fprintf(stderr, "%s: read failed\n", path);
+        return -1;
+    }
+    return 0;
+}
+
+// Frames and their compression are shared with the simulators, see benchUtil.h
+static void makeFrame (size_t width, size_t height, std::vector<uint16_t> & frame)
+{
+    frame.resize(width*height);
+    srand(1);
+    bench_make_frame(&frame[0], width, height, sizeof(frame[0]));
+}
+
+static void compressLZ4 (const char *in, size_t size, buffer_t & out)
+{
+    out.resize(bench_lz4_bound(size));
+    out.resize(bench_compress_lz4(in, size, &out[0]));
+}
+
+static void compressLZ4HDF5 (const char *in, size_t size, buffer_t & out)
+{
+    out.resize(bench_lz4_hdf5_bound(size));
+    out.resize(bench_compress_lz4_hdf5(in, size, &out[0]));
+}
+
+static void compressBSLZ4 (const uint16_t *in, size_t pixels, buffer_t & out)
+{
+    out.resize(bench_bslz4_bound(pixels, sizeof(*in)));
+    out.resize(bench_compress_bslz4(in, pixels, sizeof(*in), &out[0]));
+}
+
+// An image message with one threshold, in the order of the detector's fields
+static void makeStream2Message (size_t width, size_t height, buffer_t const & blob,
+        buffer_t & out)
+{
+    CborEncoder enc, map, userData, data, multidim, dims, compression;
+
+    out.resize(blob.size() + 1024);
+    cbor_encoder_init(&enc, (uint8_t *)&out[0], out.size(), 0);
+    cbor_encode_tag(&enc, CborSignatureTag);
+    cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+    cbor_encode_text_stringz(&map, "type");
+    cbor_encode_text_stringz(&map, "image");
+    cbor_encode_text_stringz(&map, "image_id");
+    cbor_encode_uint(&map, 1);
+    cbor_encode_text_stringz(&map, "series_id");
+    cbor_encode_uint(&map, 1);
+    cbor_encode_text_stringz(&map, "series_unique_id");
+    cbor_encode_text_stringz(&map, "eigerBench");
+    cbor_encode_text_stringz(&map, "series_date");
+    cbor_encode_tag(&map, CborDateTimeStringTag);
+    cbor_encode_text_stringz(&map, "2024-01-19T10:32:12.345678Z");
+    const char *times[] = {"start_time", "stop_time", "real_time"};
+    for(size_t i = 0; i < sizeof(times)/sizeof(times[0]); ++i)
+    {
+        CborEncoder array;
+        cbor_encode_text_stringz(&map, times[i]);
+        cbor_encoder_create_array(&map, &array, 2);
+        cbor_encode_uint(&array, 500000);
+        cbor_encode_uint(&array, 1000000000);
+        cbor_encoder_close_container(&map, &array);
+    }
+    cbor_encode_text_stringz(&map, "user_data");
+    cbor_encoder_create_map(&map, &userData, 0);
+    cbor_encoder_close_container(&map, &userData);
+    cbor_encode_text_stringz(&map, "data");
+    cbor_encoder_create_map(&map, &data, 1);
+    cbor_encode_text_stringz(&data, "threshold_1");
+    cbor_encode_tag(&data, 40);
+    cbor_encoder_create_array(&data, &multidim, 2);
+    cbor_encoder_create_array(&multidim, &dims, 2);
+    cbor_encode_uint(&dims, height);
+    cbor_encode_uint(&dims, width);
+    cbor_encoder_close_container(&multidim, &dims);
+    cbor_encode_tag(&multidim, STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN);
+    cbor_encode_tag(&multidim, 56500);
+    cbor_encoder_create_array(&multidim, &compression, 3);
+    cbor_encode_text_stringz(&compression, "bslz4");
+    cbor_encode_uint(&compression, 2);
+    cbor_encode_byte_string(&compression, (const uint8_t *)&blob[0], blob.size());
+    cbor_encoder_close_container(&multidim, &compression);
+    cbor_encoder_close_container(&data, &multidim);
+    cbor_encoder_close_container(&map, &data);
+    cbor_encoder_close_container(&enc, &map);
+
+    out.resize(cbor_encoder_get_buffer_size(&enc, (uint8_t *)&out[0]));
+}
+
+// An HDF5 data file with the layout of the FileWriter's, built in memory
+static int makeH5File (size_t width, size_t height, size_t images,
+        std::vector<uint16_t> const & frame, buffer_t & out)
+{
+    hsize_t dims[3] = {images, height, width};
+    hsize_t chunk[3] = {1, height, width};
+    hsize_t count[3] = {1, height, width};
+    hsize_t offset[3] = {0, 0, 0};
+
+    hid_t fapl = H5Pcreate(H5P_FILE_ACCESS);
+    H5Pset_fapl_core(fapl, 1 << 20, 0);
+    hid_t fId = H5Fcreate("eigerBench.h5", H5F_ACC_TRUNC, H5P_DEFAULT, fapl);
+    H5Pclose(fapl);
+    if(fId < 0)
+        return -1;
+
+    hid_t entry = H5Gcreate2(fId, "/entry", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    hid_t group = H5Gcreate2(fId, "/entry/data", H5P_DEFAULT, H5P_DEFAULT, H5P_DEFAULT);
+    hid_t dSpace = H5Screate_simple(3, dims, NULL);
+    hid_t mSpace = H5Screate_simple(3, count, NULL);
+    hid_t dcpl = H5Pcreate(H5P_DATASET_CREATE);
+    H5Pset_chunk(dcpl, 3, chunk);
+    hid_t dId = H5Dcreate2(fId, "/entry/data/data", H5T_NATIVE_UINT16, dSpace,
+            H5P_DEFAULT, dcpl, H5P_DEFAULT);
+
+    for(offset[0] = 0; offset[0] < images; ++offset[0])
+    {
+        H5Sselect_hyperslab(dSpace, H5S_SELECT_SET, offset, NULL, count, NULL);
+        H5Dwrite(dId, H5T_NATIVE_UINT16, mSpace, dSpace, H5P_DEFAULT, &frame[0]);
+    }
+
+    H5Dclose(dId);
+    H5Pclose(dcpl);
+    H5Sclose(mSpace);
+    H5Sclose(dSpace);
+    H5Gclose(group);
+    H5Gclose(entry);
+    H5Fflush(fId, H5F_SCOPE_GLOBAL);
+
+    ssize_t size = H5Fget_file_image(fId, NULL, 0);
+    if(size > 0)
+    {
+        out.resize(size);
+        size = H5Fget_file_image(fId, &out[0], out.size());
+    }
+    H5Fclose(fId);
+    return size > 0 ? 0 : -1;
+}
+
+// A little-endian TIFF with the tags tiffParseImage() reads, like the Monitor's
+static void makeTiffFile (size_t width, size_t height, std::vector<uint16_t> const & frame,
+        buffer_t & out)
+{
+    enum { NUM_TAGS = 8, IFD_OFFSET = 8, DATA_OFFSET = IFD_OFFSET + 2 + NUM_TAGS*12 + 4 };
+    size_t dataLen = width*height*sizeof(uint32_t);
+    const uint32_t tags[NUM_TAGS][4] = {
+        {256, 4, 1, (uint32_t)width},   // ImageWidth
+        {257, 4, 1, (uint32_t)height},  // ImageLength
+        {258, 3, 1, 32},                // BitsPerSample
+        {259, 3, 1, 1},                 // Compression: none
+        {262, 3, 1, 1},                 // PhotometricInterpretation
+        {273, 4, 1, DATA_OFFSET},       // StripOffsets
+        {278, 4, 1, (uint32_t)height},  // RowsPerStrip
+        {279, 4, 1, (uint32_t)dataLen}, // StripByteCounts
+    };
+
+    out.assign(DATA_OFFSET + dataLen, 0);
+    memcpy(&out[0], "II*\0", 4);
+    uint32_t ifd = IFD_OFFSET;
+    memcpy(&out[4], &ifd, 4);
+    uint16_t numTags = NUM_TAGS;
+    memcpy(&out[IFD_OFFSET], &numTags, 2);
+    for(int i = 0; i < NUM_TAGS; ++i)
+    {
+        char *t = &out[IFD_OFFSET + 2 + i*12];
+        uint16_t id = (uint16_t)tags[i][0], type = (uint16_t)tags[i][1];
+        memcpy(t, &id, 2);
+        memcpy(t + 2, &type, 2);
+        memcpy(t + 4, &tags[i][2], 4);
+        memcpy(t + 8, &tags[i][3], 4);
+    }
+    uint32_t *pixels = (uint32_t *)&out[DATA_OFFSET];
+    for(size_t i = 0; i < width*height; ++i)
+        pixels[i] = frame[i] == 0xffff ? 0xffffffff : frame[i];
+}
+
+static NDDataType_t stream2DataType (uint64_t tag, size_t *elemSize)
+{
+    switch(tag)
+    {
+    case STREAM2_TYPED_ARRAY_UINT8:                *elemSize = 1; return NDUInt8;
+    case STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN: *elemSize = 2; return NDUInt16;
+    default:                                       *elemSize = 4; return NDUInt32;
+    }
+}
+
+static void benchStream2 (buffer_t const & message, long iterations)
+{
+    const uint8_t *buf = (const uint8_t *)&message[0];
+    stream2_msg *msg;
+    epicsTimeStamp start;
+
+    if(stream2_parse_msg(buf, message.size(), &msg))
+    {
+        fprintf(stderr, "Stream2 message: parse error\n");
+        return;
+    }
+
+    epicsTimeGetCurrent(&start);
+    for(long n = 0; n < iterations*HEADER_ITERATIONS; ++n)
+    {
+        stream2_msg *m;
+        stream2_parse_msg(buf, message.size(), &m);
+        stream2_free_msg(m);
+    }
+    report("stream2_parse_msg", elapsed(start), iterations*HEADER_ITERATIONS,
+            message.size());
+
+    struct stream2_arena arena;
+    stream2_arena_init(&arena);
+    epicsTimeGetCurrent(&start);
+    for(long n = 0; n < iterations*HEADER_ITERATIONS; ++n)
+    {
+        stream2_msg *m;
+        stream2_arena_reset(&arena);
+        stream2_parse_msg_arena(buf, message.size(), &arena,
+                STREAM2_IMAGE_IMAGE_ID | STREAM2_IMAGE_DATA, &m);
+    }
+    report("stream2_parse_msg_arena", elapsed(start), iterations*HEADER_ITERATIONS,
+            message.size());
+    stream2_arena_free(&arena);
+
+    stream2_image_msg *imageMsg = (stream2_image_msg *)msg;
+    if(msg->type == STREAM2_MSG_IMAGE && imageMsg->data.len)
+    {
+        stream2_multidim_array *array = &imageMsg->data.ptr[0].data;
+        stream2_bytes *data = &array->array.data;
+        const char *algorithm = data->compression.algorithm;
+        size_t elemSize;
+        NDDataType_t dataType = stream2DataType(array->array.tag, &elemSize);
+        size_t size = array->dim[0]*array->dim[1]*elemSize;
+
+        if(algorithm && *algorithm)
+        {
+            std::string name = std::string("stream2Uncompress ") + algorithm;
+            buffer_t dest(size);
+            epicsTimeGetCurrent(&start);
+            for(long n = 0; n < iterations; ++n)
+                stream2Uncompress(data->ptr, &dest[0], algorithm, data->len, size,
+                        dataType, BSLZ4_KERNEL_AUTO, NULL, NULL);
+            report(name.c_str(), elapsed(start), iterations, size);
+        }
+    }
+    stream2_free_msg(msg);
+}
+
+static void benchUncompress2 (buffer_t const & blob, const char *encoding, size_t size,
+        long iterations)
+{
+    std::string name = std::string("stream2Uncompress ") + encoding;
+    buffer_t dest(size);
+    epicsTimeStamp start;
+
+    epicsTimeGetCurrent(&start);
+    for(long n = 0; n < iterations; ++n)
+        stream2Uncompress((const unsigned char *)&blob[0], &dest[0], encoding,
+                blob.size(), size, NDUInt16, BSLZ4_KERNEL_AUTO, NULL, NULL);
+    report(name.c_str(), elapsed(start), iterations, size);
+}
+
+static void benchStream (buffer_t const & header, buffer_t & blob, long iterations)
+{
+    stream_frame_t frame;
+    epicsTimeStamp start;
+
+    if(streamParseShape(&header[0], header.size(), &frame))
+    {
+        fprintf(stderr, "Stream header: parse error\n");
+        return;
+    }
+
+    epicsTimeGetCurrent(&start);
+    for(long n = 0; n < iterations*HEADER_ITERATIONS; ++n)
+        streamParseShape(&header[0], header.size(), &frame);
+    report("streamParseShape", elapsed(start), iterations*HEADER_ITERATIONS,
+            header.size());
+
+    if(blob.empty())
+        return;
+
+    std::string name = std::string("streamUncompress ") + frame.encoding;
+    buffer_t dest(frame.uncompressedSize);
+    epicsTimeGetCurrent(&start);
+    for(long n = 0; n < iterations; ++n)
+        streamUncompress(&blob[0], &dest[0], frame.encoding, blob.size(),
+                frame.uncompressedSize, frame.dataType, BSLZ4_KERNEL_AUTO, NULL, NULL);
+    report(name.c_str(), elapsed(start), iterations, frame.uncompressedSize);
+}
+
+static void benchRfc3339 (long iterations)
+{
+    const char *timestamps[] = {
+        "2024-01-19T10:32:12.345678Z",
+        "2025-01-23T12:34:56.789-04:00",
+        "2025-01-23 12:34:56.789+05:30",
+    };
+    const size_t numTimestamps = sizeof(timestamps)/sizeof(timestamps[0]);
+    size_t bytes = 0;
+    epicsTimeStamp start;
+
+    for(size_t i = 0; i < numTimestamps; ++i)
+        bytes += strlen(timestamps[i]);
+
+    epicsTimeGetCurrent(&start);
+    for(long n = 0; n < iterations*HEADER_ITERATIONS; ++n)
+        rfc3339::parseRfc3339Timestamp(timestamps[n % numTimestamps]);
+    report("parseRfc3339Timestamp", elapsed(start), iterations*HEADER_ITERATIONS,
+            bytes/numTimestamps);
+}
+
+// The reads of parseH5File(), into one buffer instead of NDArrays
+static size_t readH5File (buffer_t & file, buffer_t & dest)
+{
+    unsigned flags = H5LT_FILE_IMAGE_DONT_COPY | H5LT_FILE_IMAGE_DONT_RELEASE;
+    h5_frames_t frames;
+    size_t bytes = 0;
+
+    hid_t fId = H5LTopen_file_image(&file[0], file.size(), flags);
+    if(fId < 0)
+        return 0;
+
+    if(!h5OpenFrames(fId, &frames))
+    {
+        size_t frameBytes = frames.width*frames.height*H5Tget_size(frames.dType);
+        dest.resize(frameBytes);
+        for(size_t i = 0; i < frames.nImages; ++i)
+            for(size_t j = 0; j < frames.nThresh; ++j)
+                if(!h5SelectFrame(&frames, i, j) &&
+                        H5Dread(frames.dId, frames.dType, frames.mSpace, frames.dSpace,
+                        H5P_DEFAULT, &dest[0]) >= 0)
+                    bytes += frameBytes;
+        h5CloseFrames(&frames);
+    }
+    H5Fclose(fId);
+    return bytes;
+}
+
+static void benchFiles (buffer_t & h5File, buffer_t & tiffFile, long iterations)
+{
+    buffer_t dest;
+    tiff_image_t image;
+    epicsTimeStamp start;
+
+    size_t h5Bytes = readH5File(h5File, dest);
+    if(!h5Bytes)
+        fprintf(stderr, "HDF5 file: no images read\n");
+    else
+    {
+        epicsTimeGetCurrent(&start);
+        for(long n = 0; n < iterations; ++n)
+            readH5File(h5File, dest);
+        report("h5OpenFrames+H5Dread", elapsed(start), iterations, h5Bytes);
+    }
+
+    const char *error = tiffParseImage(&tiffFile[0], tiffFile.size(), &image);
+    if(error)
+    {
+        fprintf(stderr, "TIFF file: %s\n", error);
+        return;
+    }
+
+    dest.resize(image.dataLen);
+    epicsTimeGetCurrent(&start);
+    for(long n = 0; n < iterations; ++n)
+    {
+        tiffParseImage(&tiffFile[0], tiffFile.size(), &image);
+        memcpy(&dest[0], image.data, image.dataLen);
+    }
+    report("tiffParseImage+memcpy", elapsed(start), iterations, image.dataLen);
+}
+
+static void usage (void)
+{
+    fprintf(stderr,
+            "Usage: eigerBench [-n iterations] [-x width] [-y height] [-i images]\n"
+            "                  [-m stream2.cbor] [-j header.json] [-b frame]\n"
+            "                  [-h data.h5] [-t monitor.tif]\n");
+}
+
+int main (int argc, char *argv[])
+{
+    long iterations = DEFAULT_ITERATIONS;
+    size_t width = 1028, height = 1062, images = 10;
+    buffer_t message, header, blob, h5File, tiffFile;
+    int opt;
+
+    while((opt = getopt(argc, argv, "n:x:y:i:m:j:b:h:t:")) != -1)
+    {
+        switch(opt)
+        {
+        case 'n': iterations = atol(optarg); break;
+        case 'x': width = strtoul(optarg, NULL, 0); break;
+        case 'y': height = strtoul(optarg, NULL, 0); break;
+        case 'i': images = strtoul(optarg, NULL, 0); break;
+        case 'm': if(readFile(optarg, message))  return 1; break;
+        case 'j': if(readFile(optarg, header))   return 1; break;
+        case 'b': if(readFile(optarg, blob))     return 1; break;
+        case 'h': if(readFile(optarg, h5File))   return 1; break;
+        case 't': if(readFile(optarg, tiffFile)) return 1; break;
+        default:  usage(); return 1;
+        }
+    }
+    if(iterations <= 0 || !width || !height || !images)
+    {
+        usage();
+        return 1;
+    }
+
+    std::vector<uint16_t> frame;
+    makeFrame(width, height, frame);
+    const char *pFrame = (const char *)&frame[0];
+    size_t frameBytes = frame.size()*sizeof(frame[0]);
+
+    buffer_t lz4, lz4HDF5, bslz4;
+    compressLZ4(pFrame, frameBytes, lz4);
+    compressLZ4HDF5(pFrame, frameBytes, lz4HDF5);
+    compressBSLZ4(&frame[0], frame.size(), bslz4);
+
+    printf("%ld iterations, generated frames %lux%lu uint16\n", iterations,
+            (unsigned long)width, (unsigned long)height);
+
+    // Stream2
+    if(message.empty())
+        makeStream2Message(width, height, bslz4, message);
+    benchStream2(message, iterations);
+    benchUncompress2(lz4HDF5, "lz4", frameBytes, iterations);
+
+    // Stream
+    if(header.empty())
+    {
+        char json[256];
+        const char *encodings[] = {"lz4<", "bs16-lz4<"};
+        buffer_t *blobs[] = {&lz4, &bslz4};
+        for(int i = 0; i < 2; ++i)
+        {
+            int len = snprintf(json, sizeof(json), "{\"htype\":\"dimage_d-1.0\","
+                    "\"shape\":[%lu,%lu],\"type\":\"uint16\",\"encoding\":\"%s\","
+                    "\"size\":%lu}", (unsigned long)width, (unsigned long)height,
+                    encodings[i], (unsigned long)blobs[i]->size());
+            header.assign(json, json + len);
+            benchStream(header, *blobs[i], iterations);
+        }
+    }
+    else
+        benchStream(header, blob, iterations);
+
+    benchRfc3339(iterations);
+
+    // FileWriter and Monitor
+    if(h5File.empty() && makeH5File(width, height, images, frame, h5File))
+    {
+        fprintf(stderr, "failed to create HDF5 file image\n");
+        return 1;
+    }
+    if(tiffFile.empty())
+        makeTiffFile(width, height, frame, tiffFile);
+    benchFiles(h5File, tiffFile, iterations);
+
+    return 0;
+}
@@ -12,6 +12,7 @@
 #include <epicsExport.h>
 #include <epicsThread.h>
 #include <epicsMessageQueue.h>
+#include <epicsStdio.h>
 #include <iocsh.h>
 #include <string.h>
 #include <math.h>
@@ -22,6 +23,7 @@
 #include <fcntl.h>
 
 #include <limits>
+#include <algorithm>
 
 #include <hdf5.h>
 #include <hdf5_hl.h>
@@ -30,6 +32,8 @@
 #include "eigerDetector.h"
 #include "restApi.h"
 #include "streamApi.h"
+#include "h5PartialFile.h"
+#include "frameDecode.h"
 
 // Set this flag if you are using the pre-release firmware that supports External Gate mode
 #define HAVE_EXTG_FIRMWARE      1
@@ -50,6 +54,33 @@
 // Maximum asyn address
 #define MAX_ASYN_ADDRESS        (MONITOR_ASYN_ADDRESS+1)
 
+// Stream decompression workers
+#define MAX_STREAM_WORKERS      16
+#define DEFAULT_STREAM_WORKERS  4
+
+// Bounds for the number of ZMQ messages buffered by the stream receive thread
+#define MIN_STREAM_RING_SIZE    4
+#define MAX_STREAM_RING_SIZE    65536
+
+// Largest binning of the stream frames
+#define MAX_STREAM_BIN          16
+
+// Largest number of placeholder NDArrays for one gap in the stream frame ids
+#define MAX_STREAM_PLACEHOLDERS 1024
+
+// Seconds between updates of the stream latency parameters
+#define STREAM_LAT_PERIOD       0.5
+
+// Threads downloading FileWriter files at once
+#define MAX_DOWNLOAD_WORKERS    8
+
+// Size in MB of the chunks of a parallel FileWriter download
+#define DEFAULT_FW_CHUNK_SIZE   8
+#define MAX_FW_CHUNK_SIZE       1024
+
+// Directory of the parameter metadata cache, not used if unset
+#define PARAM_CACHE_DIR_ENV     "EIGER_PARAM_CACHE_DIR"
+
 // Error message formatters
 #define ERR(msg) asynPrint(pasynUserSelf, ASYN_TRACE_ERROR, "%s::%s: %s\n", \
     driverName, functionName, msg)
@@ -86,35 +117,91 @@ typedef struct
     mode_t filePerms;
 }acquisition_t;
 
-typedef struct
+typedef struct file
 {
     char name[MAX_BUF_SIZE];
     char *data;
     size_t len;
+    size_t size;                // As waitFile() found it
     bool save, parse, remove;
+    bool downloaded, failed;    // Protected by mParseOrderMutex
+    size_t reserved;            // Bytes of the memory budget it holds
     size_t refCount;
     uid_t uid, gid;
     mode_t perms;
+
+    // Parsed as it downloads: the download worker tells parseTask through
+    // these how much of data has been received, until the download is over
+    bool incremental;
+    std::atomic<size_t> received;
+    bool finished, truncated;   // Protected by progressMutex, as are data and len
+    epicsMutex progressMutex;
+    epicsEvent progressEvent;
 }file_t;
 
-typedef struct
+// Called by RestAPI as a file that is parsed while it downloads arrives
+static void downloadProgressC (void *arg, const char *buf, size_t size,
+        size_t received)
+{
+    file_t *file = (file_t *) arg;
+
+    file->progressMutex.lock();
+    file->data = (char *) buf;
+    file->len  = size;
+    file->received.store(received, std::memory_order_release);
+    file->progressMutex.unlock();
+    file->progressEvent.signal();
+}
+
+// Frames are handed to the workers round-robin. A worker may decode its frame
+// at any time, but it only issues the NDArray callbacks after the previous
+// worker in the ring has signaled its cbEvent, so the callbacks stay in frame
+// order.
+typedef struct stream_worker
 {
     size_t id;
     eigerDetector *detector;
     epicsMessageQueue *jobQueue, *doneQueue;
     epicsEvent *cbEvent, *nextCbEvent;
+    std::vector<char> scratch;  // For the decoders, see stream_decode_t
 }stream_worker_t;
 
-typedef struct
+// Jobs are returned to streamTask through the done queue and reused, together
+// with the memory their frame holds, for later frames.
+//
+// A job decodes the thresholds [firstThresh, firstThresh+numThresh) of the
+// frame owned by its parent job. The thresholds of a Stream2 frame are split
+// into one job per threshold, so they are decoded by several workers at once.
+// The parent holds one reference for each job of its frame. The job that
+// drops the last one frees the frame and returns the parent.
+//
+// When frames were lost right before the job's frame, numPlaceholders
+// zero-filled NDArrays are called back before it for each threshold.
+typedef struct stream_job
 {
-    void *data;
-    size_t compressedSize, uncompressedSize;
-    size_t dims[2];
-    NDDataType_t type;
+    int streamVersion;
+    stream_decode_t decode;
+    int zeroCopy;
+    int numPlaceholders;
+    Stream2API *stream2API;
+    stream_frame_t frame;
+    struct stream_job *parent;
+    int firstThresh, numThresh;
+    std::atomic<int> refCount;
 }stream_job_t;
 
 static const char *driverName = "eigerDetector";
 
+static const char *streamLatStageNames[StreamLatNumStages] = {
+    "Parse", "Decode", "Callback", "Total"
+};
+
+static uint64_t elapsedNs (const epicsTimeStamp *end, const epicsTimeStamp *start)
+{
+    double diff = epicsTimeDiffInSeconds(end, start);
+    return diff > 0 ? (uint64_t) (diff * 1e9) : 0;
+}
+
 static void controlTaskC (void *drvPvt)
 {
     ((eigerDetector *)drvPvt)->controlTask();
@@ -155,6 +242,12 @@ static void streamTaskC (void *drvPvt)
     ((eigerDetector *)drvPvt)->streamTask();
 }
 
+static void streamWorkerTaskC (void *drvPvt)
+{
+    stream_worker_t *worker = (stream_worker_t *)drvPvt;
+    worker->detector->streamWorkerTask(worker);
+}
+
 static void restartTaskC (void *drvPvt)
 {
     ((eigerDetector *)drvPvt)->restartTask();
@@ -171,7 +264,8 @@ static void initializeTaskC (void *drvPvt)
  * collect the detector data, and sets reasonable default values for the
  * parameters defined in this class, asynNDArrayDriver, and ADDriver.
  * \param[in] portName The name of the asyn port driver to be created.
- * \param[in] serverHostname The IP or url of the detector webserver.
+ * \param[in] serverHostname The IP or url of the detector webserver,
+ *            optionally followed by :port if it is not on port 80.
  * \param[in] maxBuffers The maximum number of NDArray buffers that the
  *            NDArrayPool for this driver is allowed to allocate. Set this to
  *            -1 to allow an unlimited number of buffers.
@@ -182,10 +276,16 @@ static void initializeTaskC (void *drvPvt)
  *            ASYN_CANBLOCK is set in asynFlags.
  * \param[in] stackSize The stack size for the asyn port driver thread if
  *            ASYN_CANBLOCK is set in asynFlags.
+ * \param[in] numControlSockets The number of keep-alive connections to the
+ *            REST interface for parameter, status and command requests.
+ *            0 for the default of 5.
+ * \param[in] numBulkSockets The number of keep-alive connections to the
+ *            REST interface for FileWriter and Monitor downloads. 0 for the
+ *            default of 4.
  */
 eigerDetector::eigerDetector (const char *portName, const char *serverHostname,
         int maxBuffers, size_t maxMemory, int priority,
-        int stackSize)
+        int stackSize, int numControlSockets, int numBulkSockets)
 
     : ADDriver(portName, MAX_ASYN_ADDRESS, 0, maxBuffers, maxMemory,
                0, 0,             /* No interfaces beyond ADDriver.cpp */
@@ -193,19 +293,31 @@ eigerDetector::eigerDetector (const char *portName, const char *serverHostname,
                ASYN_MULTIDEVICE, /* ASYN_MULTIDEVICE=1 */
                1,                /* autoConnect=1 */
                priority, stackSize),
-    mApi(serverHostname, 80),
-    mStreamAPI(0), mStream2API(0),
+    mApi(serverHostname, 80, numControlSockets > 0 ? numControlSockets : 0,
+         numBulkSockets > 0 ? numBulkSockets : 0),
+    mStreamAPI(0), mStream2API(0), mStreamBusy(false), mStreamChangePending(false),
+    mStreamArrayPool(new StreamArrayPool(this)),
     mStartEvent(), mStopEvent(), mTriggerEvent(), mPollDoneEvent(),
     mPollQueue(1, sizeof(acquisition_t)),
     mDownloadQueue(DEFAULT_QUEUE_CAPACITY, sizeof(file_t *)),
     mParseQueue(DEFAULT_QUEUE_CAPACITY, sizeof(file_t *)),
     mSaveQueue(DEFAULT_QUEUE_CAPACITY, sizeof(file_t *)),
     mReapQueue(DEFAULT_QUEUE_CAPACITY*2, sizeof(file_t *)),
-    mFrameNumber(0), mFsUid(getuid()), mFsGid(getgid()),
+    mStreamDoneQueue(MAX_STREAM_WORKERS*(DEFAULT_QUEUE_CAPACITY+1), sizeof(stream_job_t *)),
+    mFrameNumber(0), mNumDownloadWorkers(0), mMemInFlight(0), mMemHighWater(0),
+    mNumStreamWorkers(0), mNextStreamWorker(0), mParamFetchTime(0.0),
+    mParamCacheLoaded(false),
+    mFsUid(getuid()), mFsGid(getgid()),
     mParams(this, &mApi, pasynUserSelf)
 {
     const char *functionName = "eigerDetector";
+    epicsTimeStamp startupStart, startupEnd;
+    epicsTimeGetCurrent(&startupStart);
     strncpy(mHostname, serverHostname, sizeof(mHostname)-1);
+    // The stream interfaces have their own ports on the same host
+    char *port = strchr(mHostname, ':');
+    if(port)
+        *port = '\0';
 
     // Get API version
     mAPIVersion = mApi.getAPIVersion();
@@ -275,13 +387,54 @@ eigerDetector::eigerDetector (const char *portName, const char *serverHostname,
     mFileOwner      = mParams.create(EigFileOwnerStr,      asynParamOctet);
     mFileOwnerGroup = mParams.create(EigFileOwnerGroupStr, asynParamOctet);
     mFilePerms      = mParams.create(EigFilePermsStr,      asynParamInt32);
+    mFWChunkSize    = mParams.create(EigFWChunkSizeStr,    asynParamInt32);
+    mFWDownloadParallel = mParams.create(EigFWDownloadParallelStr, asynParamInt32);
+    mFWDownloadRate = mParams.create(EigFWDownloadRateStr, asynParamFloat64);
+    mFWDownloadWorkers = mParams.create(EigFWDownloadWorkersStr, asynParamInt32);
+    mFWMemBudget    = mParams.create(EigFWMemBudgetStr,    asynParamInt32);
+    mFWMemInFlight  = mParams.create(EigFWMemInFlightStr,  asynParamFloat64);
+    mFWMemHighWater = mParams.create(EigFWMemHighWaterStr, asynParamFloat64);
+    mFWIncrementalParse = mParams.create(EigFWIncrementalParseStr, asynParamInt32);
     mMonitorTimeout = mParams.create(EigMonitorTimeoutStr, asynParamInt32);
     mRestart        = mParams.create(EigRestartStr,        asynParamInt32);
     mInitialize     = mParams.create(EigInitializeStr,     asynParamInt32);
     mStreamDecompress = mParams.create(EigStreamDecompressStr, asynParamInt32);
+    mStreamDecompThreads = mParams.create(EigStreamDecompThreadsStr, asynParamInt32);
+    mStreamZeroCopy = mParams.create(EigStreamZeroCopyStr, asynParamInt32);
+    mStreamRingSize = mParams.create(EigStreamRingSizeStr, asynParamInt32);
+    mStreamRingUsed = mParams.create(EigStreamRingUsedStr, asynParamInt32);
+    mStreamRingOverflows = mParams.create(EigStreamRingOverflowsStr, asynParamInt32);
+    mStreamBSKernel = mParams.create(EigStreamBSKernelStr, asynParamInt32);
+    mStreamBSKernelActive = mParams.create(EigStreamBSKernelActiveStr, asynParamInt32);
+    mStreamROIEnable = mParams.create(EigStreamROIEnableStr, asynParamInt32);
+    mStreamROIMinX  = mParams.create(EigStreamROIMinXStr,  asynParamInt32);
+    mStreamROIMinY  = mParams.create(EigStreamROIMinYStr,  asynParamInt32);
+    mStreamROISizeX = mParams.create(EigStreamROISizeXStr, asynParamInt32);
+    mStreamROISizeY = mParams.create(EigStreamROISizeYStr, asynParamInt32);
+    mStreamBin      = mParams.create(EigStreamBinStr,      asynParamInt32);
+    mStreamMissing  = mParams.create(EigStreamMissingStr,  asynParamInt32);
+    mStreamFirstMissing = mParams.create(EigStreamFirstMissingStr, asynParamInt32);
+    mStreamDuplicates = mParams.create(EigStreamDuplicatesStr, asynParamInt32);
+    mStreamReordered = mParams.create(EigStreamReorderedStr, asynParamInt32);
+    mStreamFillGaps = mParams.create(EigStreamFillGapsStr, asynParamInt32);
+    mStreamLatP50[StreamLatParse] = mParams.create(EigStreamLatParseP50Str, asynParamFloat64);
+    mStreamLatP99[StreamLatParse] = mParams.create(EigStreamLatParseP99Str, asynParamFloat64);
+    mStreamLatMax[StreamLatParse] = mParams.create(EigStreamLatParseMaxStr, asynParamFloat64);
+    mStreamLatP50[StreamLatDecode] = mParams.create(EigStreamLatDecodeP50Str, asynParamFloat64);
+    mStreamLatP99[StreamLatDecode] = mParams.create(EigStreamLatDecodeP99Str, asynParamFloat64);
+    mStreamLatMax[StreamLatDecode] = mParams.create(EigStreamLatDecodeMaxStr, asynParamFloat64);
+    mStreamLatP50[StreamLatCallback] = mParams.create(EigStreamLatCallbackP50Str, asynParamFloat64);
+    mStreamLatP99[StreamLatCallback] = mParams.create(EigStreamLatCallbackP99Str, asynParamFloat64);
+    mStreamLatMax[StreamLatCallback] = mParams.create(EigStreamLatCallbackMaxStr, asynParamFloat64);
+    mStreamLatP50[StreamLatTotal] = mParams.create(EigStreamLatTotalP50Str, asynParamFloat64);
+    mStreamLatP99[StreamLatTotal] = mParams.create(EigStreamLatTotalP99Str, asynParamFloat64);
+    mStreamLatMax[StreamLatTotal] = mParams.create(EigStreamLatTotalMaxStr, asynParamFloat64);
+    mStartupTime    = mParams.create(EigStartupTimeStr,    asynParamFloat64);
     mWavelengthEpsilon = mParams.create(EigWavelengthEpsilonStr, asynParamFloat64);
     mEnergyEpsilon  = mParams.create(EigEnergyEpsilonStr,  asynParamFloat64);
     mSignedData     = mParams.create(EigSignedDataStr,     asynParamInt32);
+    mMaskFlagged    = mParams.create(EigMaskFlaggedStr,    asynParamInt32);
+    mMaskFill       = mParams.create(EigMaskFillStr,       asynParamInt32);
     mStreamAsTsSource = mParams.create(EigStreamAsTsSourceStr, asynParamInt32);
 
     // Metadata
@@ -441,9 +594,7 @@ eigerDetector::eigerDetector (const char *portName, const char *serverHostname,
             epicsThreadGetStackSize(epicsThreadStackMedium),
             (EPICSTHREADFUNC)pollTaskC, this) == NULL);
 
-    status |= (epicsThreadCreate("eigerDownloadTask", epicsThreadPriorityMedium,
-            epicsThreadGetStackSize(epicsThreadStackMedium),
-            (EPICSTHREADFUNC)downloadTaskC, this) == NULL);
+    status |= startDownloadWorkers(1);
 
     status |= (epicsThreadCreate("eigerParseTask", epicsThreadPriorityMedium,
             epicsThreadGetStackSize(epicsThreadStackMedium),
@@ -475,6 +626,11 @@ eigerDetector::eigerDetector (const char *portName, const char *serverHostname,
 
     if(status)
         ERR("epicsThreadCreate failure for some task");
+
+    epicsTimeGetCurrent(&startupEnd);
+    mStartupTime->put(epicsTimeDiffInSeconds(&startupEnd, &startupStart));
+    FLOW_ARGS("startup time %f, parameter fetch time %f",
+            epicsTimeDiffInSeconds(&startupEnd, &startupStart), mParamFetchTime);
 }
 
 /* Called when asyn clients call pasynInt32->write().
@@ -537,6 +693,68 @@ asynStatus eigerDetector::writeInt32 (asynUser *pasynUser, epicsInt32 value)
         mTriggerEvent.signal();
     else if (function == mFilePerms->getIndex())
         status = (asynStatus) mFilePerms->put(value & 0666);
+    else if (function == mFWChunkSize->getIndex())
+    {
+        if (value < 1) value = 1;
+        if (value > MAX_FW_CHUNK_SIZE) value = MAX_FW_CHUNK_SIZE;
+        status = (asynStatus) mFWChunkSize->put(value);
+    }
+    else if (function == mFWDownloadWorkers->getIndex())
+    {
+        // Takes effect at the start of the next series
+        if (value < 1) value = 1;
+        if (value > MAX_DOWNLOAD_WORKERS) value = MAX_DOWNLOAD_WORKERS;
+        status = (asynStatus) mFWDownloadWorkers->put(value);
+    }
+    else if (function == mFWMemBudget->getIndex())
+    {
+        if (value < 0) value = 0;
+        status = (asynStatus) mFWMemBudget->put(value);
+        mMemEvent.signal();
+    }
+    else if (function == mFWDownloadParallel->getIndex())
+    {
+        // Each chunk in flight takes a bulk connection
+        int maxParallel = (int) fileWriterSockets();
+        if (value < 1) value = 1;
+        if (value > maxParallel) value = maxParallel;
+        status = (asynStatus) mFWDownloadParallel->put(value);
+    }
+    else if (function == mStreamDecompThreads->getIndex())
+    {
+        // Takes effect at the start of the next series
+        if (value < 1) value = 1;
+        if (value > MAX_STREAM_WORKERS) value = MAX_STREAM_WORKERS;
+        status = (asynStatus) mStreamDecompThreads->put(value);
+    }
+    else if (function == mStreamRingSize->getIndex())
+    {
+        // Takes effect the next time the Stream API object is created
+        if (value < MIN_STREAM_RING_SIZE) value = MIN_STREAM_RING_SIZE;
+        if (value > MAX_STREAM_RING_SIZE) value = MAX_STREAM_RING_SIZE;
+        status = (asynStatus) mStreamRingSize->put(value);
+    }
+    else if (function == mStreamBSKernel->getIndex())
+    {
+        // Kernels the CPU does not support fall back to the fastest one it does
+        if (value < BSLZ4_KERNEL_AUTO || value >= BSLZ4_NUM_KERNELS)
+            value = BSLZ4_KERNEL_AUTO;
+        status = (asynStatus) mStreamBSKernel->put(value);
+        mStreamBSKernelActive->put(bslz4_resolve_kernel((bslz4_kernel) value));
+    }
+    else if (function == mStreamROIMinX->getIndex() || function == mStreamROIMinY->getIndex() ||
+             function == mStreamROISizeX->getIndex() || function == mStreamROISizeY->getIndex())
+    {
+        // Sizes of 0 extend the region to the edge of the frame
+        if (value < 0) value = 0;
+        status = (asynStatus) mParams.getByIndex(function)->put(value);
+    }
+    else if (function == mStreamBin->getIndex())
+    {
+        if (value < 1) value = 1;
+        if (value > MAX_STREAM_BIN) value = MAX_STREAM_BIN;
+        status = (asynStatus) mStreamBin->put(value);
+    }
     else if ((mEigerModel == Eiger2 || mEigerModel == Pilatus4) && (function == mHVReset->getIndex())) {
         double resetTime;
         mHVResetTime->get(resetTime);
@@ -551,37 +769,12 @@ asynStatus eigerDetector::writeInt32 (asynUser *pasynUser, epicsInt32 value)
     else if ((p = mParams.getByIndex(function))) {
         status = (asynStatus) p->put(value);
         if ((p == mDataSource) || (p ==mStreamVersion)) {
-            int dataSource;
-            mDataSource->get(dataSource);
-            if (dataSource == SOURCE_STREAM) {
-                // When switching DataSource to stream we need to create a StreamAPI object if it does not exist
-                int streamVersion;
-                mStreamVersion->get(streamVersion);
-                if (streamVersion == STREAM_VERSION_STREAM) {
-                    if (!mStreamAPI) {
-                        mStreamAPI = new StreamAPI(mHostname);
-                    }
-                 } else {
-                    if (!mStream2API) {
-                          mStream2API = new Stream2API(mHostname);;
-                    }
-                }
-                // It also seems to be necessary to disable and enable stream
-                mStreamEnable->put(0);
-                mStreamEnable->put(1);
-            } else {
-                // When switching DataSource to anything other than stream we need to delete the StreamAPI or Stream2API object
-                // if it exists, so that we are no longer receiving zmq messages.
-                // This allows other clients to receive all messages from the zmq stream.
-                if (mStreamAPI) {
-                    delete mStreamAPI;
-                    mStreamAPI = 0;
-                }
-                if (mStream2API) {
-                    delete mStream2API;
-                    mStream2API = 0;
-                }
-            }
+            // streamTask and its workers use the stream objects without the
+            // lock, so while they run it is left to streamTask to change them
+            if (mStreamBusy)
+                mStreamChangePending = true;
+            else
+                updateStreamAPI();
         }
     }
     else if(function < mFirstParam)
@@ -792,6 +985,25 @@ void eigerDetector::report (FILE *fp, int details)
         getIntegerParam(NDDataType, &dataType);
         fprintf(fp, "  NX, NY:            %d  %d\n", nx, ny);
         fprintf(fp, "  Data type:         %d\n", dataType);
+        fprintf(fp, "  Download workers:  %lu\n", (unsigned long)mNumDownloadWorkers);
+        fprintf(fp, "  Stream workers:    %lu\n", (unsigned long)mStreamWorkers.size());
+        double startupTime;
+        mStartupTime->get(startupTime);
+        fprintf(fp, "  Startup time (s):  %.3f, of which %.3f fetching parameters\n",
+                startupTime, mParamFetchTime);
+        if(!mParamCachePath.empty())
+            fprintf(fp, "  Parameter cache:   %s (%s)\n", mParamCachePath.c_str(),
+                    mParamCacheLoaded ? "loaded" : "written");
+        mApi.report(fp, details);
+        fprintf(fp, "  Stream latency (ms):  %8s %8s %8s %8s\n", "count", "p50", "p99", "max");
+        for (int i = 0; i < StreamLatNumStages; ++i) {
+            const LatencyHistogram &hist = mStreamLat[i];
+            fprintf(fp, "    %-18s %8llu %8.3f %8.3f %8.3f\n", streamLatStageNames[i],
+                    (unsigned long long)hist.count(), hist.quantile(0.5)/1e6,
+                    hist.quantile(0.99)/1e6, hist.max()/1e6);
+            if (details > 1)
+                hist.print(fp, "      ");
+        }
     }
 
     // Invoke the base class method
@@ -1107,14 +1319,40 @@ void eigerDetector::pollTask (void)
     int pendingFiles;
     size_t totalFiles, i;
     file_t *files;
+    int numDownloadWorkers, parallel;
+    bool incremental;
+    size_t fileSize;
 
     for(;;)
     {
         mPollQueue.receive(&acquisition, sizeof(acquisition));
 
+        lock();
+        mFWDownloadWorkers->get(numDownloadWorkers);
+        mFWDownloadParallel->get(parallel);
+        mFWIncrementalParse->get(incremental);
+        unlock();
+
+        // Every worker may have parallel chunks in flight, more than there
+        // are connections for would only queue behind each other
+        parallel = std::min(parallel, (int) fileWriterSockets());
+        if(numDownloadWorkers * parallel > (int) fileWriterSockets())
+        {
+            numDownloadWorkers = std::max(1, (int) fileWriterSockets() / parallel);
+            FLOW_ARGS("limited to %d download workers of %d connections each",
+                    numDownloadWorkers, parallel);
+        }
+        startDownloadWorkers((size_t) numDownloadWorkers);
+
+        // Nothing is in flight between series
+        mMemMutex.lock();
+        mMemHighWater = mMemInFlight;
+        mMemMutex.unlock();
+        publishMemory();
+
         // Generate files list
         totalFiles = acquisition.nDataFiles + 1;
-        files = (file_t*) calloc(totalFiles, sizeof(*files));
+        files = new file_t[totalFiles]();
 
         for(i = 0; i < totalFiles; ++i)
         {
@@ -1122,7 +1360,10 @@ void eigerDetector::pollTask (void)
 
             files[i].save     = acquisition.saveFiles;
             files[i].parse    = isMaster ? false : acquisition.parseFiles;
-            files[i].refCount = files[i].save + files[i].parse;
+            files[i].incremental = files[i].parse && incremental;
+            // A file parsed as it downloads is also held by its download
+            // worker, as the parser may be done with it before the download
+            files[i].refCount = files[i].save + files[i].parse + files[i].incremental;
             files[i].remove   = acquisition.removeFiles;
             files[i].uid      = mFsUid;
             files[i].gid      = mFsGid;
@@ -1149,16 +1390,34 @@ void eigerDetector::pollTask (void)
             file_t *curFile = &files[i];
 
             FLOW_ARGS("file=%s", curFile->name);
-            if(!mApi.waitFile(curFile->name, 1.0))
+            if(!mApi.waitFile(curFile->name, 1.0, &fileSize))
             {
                 FLOW_ARGS("file=%s exists", curFile->name);
+                curFile->size = fileSize;
                 if(curFile->save || curFile->parse)
                 {
+                    // Files are only held whole in memory if they are parsed.
+                    // Waiting here holds back the following files too, so
+                    // the budget is taken in file order.
+                    if(curFile->parse)
+                        curFile->reserved = fileSize;
+                    else
+                        curFile->reserved = std::min(fileSize,
+                                (size_t) SAVE_BUFFER_SIZE * (size_t) parallel);
+                    reserveMemory(curFile->reserved);
+
                     lock();
                     mPendingFiles->get(pendingFiles);
                     mPendingFiles->put(pendingFiles+1);
                     unlock();
 
+                    if(curFile->parse)
+                    {
+                        mParseOrderMutex.lock();
+                        mParseOrder.push_back(curFile);
+                        mParseOrderMutex.unlock();
+                    }
+
                     mDownloadQueue.send(&curFile, sizeof(curFile));
                 }
                 else if(curFile->remove)
@@ -1188,7 +1447,7 @@ void eigerDetector::pollTask (void)
         FLOW("done waiting for pending files");
 
         // All pending files were processed and reaped
-        free(files);
+        delete [] files;
         mPollComplete = i == totalFiles;
         mPollDoneEvent.signal();
     }
@@ -1198,28 +1457,214 @@ void eigerDetector::downloadTask (void)
 {
     const char *functionName = "downloadTask";
     file_t *file;
+    epicsTimeStamp start, end;
+    int chunkSize, parallel;
+    bool failed, saved;
+    uid_t currentFsUid = getuid();
+    uid_t currentFsGid = getgid();
 
     for(;;)
     {
         mDownloadQueue.receive(&file, sizeof(file_t *));
 
+        // Sent by startDownloadWorkers to stop one worker
+        if(!file)
+            return;
+
         FLOW_ARGS("file=%s", file->name);
 
-        // Download the file
-        if(mApi.getFile(file->name, &file->data, &file->len))
+        lock();
+        mFWChunkSize->get(chunkSize);
+        mFWDownloadParallel->get(parallel);
+        unlock();
+
+        // Set during the series, it is shared out between the workers
+        parallel = std::min(parallel,
+                std::max(1, (int) (fileWriterSockets() / mNumDownloadWorkers)));
+
+        // Download the file. One that is only saved goes straight from the
+        // socket to the local file, without being held in memory.
+        epicsTimeGetCurrent(&start);
+        saved = file->save && !file->parse;
+        if(saved)
         {
-            ERR_ARGS("underlying getFile(%s) failed", file->name);
-            mReapQueue.send(&file, sizeof(file));
+            int fd = openSaveFile(file, &currentFsUid, &currentFsGid);
+            failed = fd < 0 || mApi.saveFile(file->name, fd, &file->len,
+                    file->size, (size_t) chunkSize << 20, (size_t) parallel);
+            if(fd >= 0)
+                close(fd);
+            if(failed)
+            {
+                ERR_ARGS("underlying saveFile(%s) failed", file->name);
+                file->remove = false;
+            }
+        }
+        else if(file->incremental)
+        {
+            char *data = NULL;
+            size_t len = 0;
+
+            // Handed to parseTask, in file order, before it arrives, so that
+            // its frames are published as they do
+            parseReady(file, false);
+            failed = mApi.getFile(file->name, &data, &len, file->size,
+                    (size_t) chunkSize << 20, (size_t) parallel,
+                    downloadProgressC, file);
+            if(failed)
+                ERR_ARGS("underlying getFile(%s) failed", file->name);
+
+            file->progressMutex.lock();
+            file->data = data;
+            if(!failed)
+                file->len = len;
+            file->finished = true;
+            file->truncated = failed;
+            file->progressMutex.unlock();
+            file->progressEvent.signal();
         }
         else
         {
-            if(file->parse)
-                mParseQueue.send(&file, sizeof(file_t *));
+            failed = mApi.getFile(file->name, &file->data, &file->len,
+                    file->size, (size_t) chunkSize << 20, (size_t) parallel);
+            if(failed)
+                ERR_ARGS("underlying getFile(%s) failed", file->name);
+        }
 
-            if(file->save)
-                mSaveQueue.send(&file, sizeof(file_t *));
+        if(!failed)
+        {
+            epicsTimeGetCurrent(&end);
+            double elapsed = epicsTimeDiffInSeconds(&end, &start);
+            if(elapsed > 0.0)
+            {
+                lock();
+                mFWDownloadRate->put(file->len / elapsed / 1e6);
+                unlock();
+            }
         }
+
+        if(saved)
+            mReapQueue.send(&file, sizeof(file));
+        else
+            downloadDone(file, failed);
+
+        // Nothing writes to the file any more
+        if(file->incremental)
+            mReapQueue.send(&file, sizeof(file));
+    }
+}
+
+void eigerDetector::updateStreamAPI (void)
+{
+    int dataSource;
+    mDataSource->get(dataSource);
+    if (dataSource == SOURCE_STREAM) {
+        // When switching DataSource to stream we need to create a StreamAPI object if it does not exist
+        int streamVersion, ringSize;
+        mStreamVersion->get(streamVersion);
+        mStreamRingSize->get(ringSize);
+        if (streamVersion == STREAM_VERSION_STREAM) {
+            if (!mStreamAPI) {
+                mStreamAPI = new StreamAPI(mHostname, ringSize);
+            }
+         } else {
+            if (!mStream2API) {
+                  mStream2API = new Stream2API(mHostname, ringSize);
+            }
+        }
+        // It also seems to be necessary to disable and enable stream
+        mStreamEnable->put(0);
+        mStreamEnable->put(1);
+    } else {
+        // When switching DataSource to anything other than stream we need to delete the StreamAPI or Stream2API object
+        // if it exists, so that we are no longer receiving zmq messages.
+        // This allows other clients to receive all messages from the zmq stream.
+        if (mStreamAPI) {
+            delete mStreamAPI;
+            mStreamAPI = 0;
+        }
+        if (mStream2API) {
+            delete mStream2API;
+            mStream2API = 0;
+        }
+    }
+}
+
+size_t eigerDetector::fileWriterSockets (void)
+{
+    size_t numSockets = mApi.getNumSockets(LaneBulk);
+    return numSockets > 1 ? numSockets - 1 : 1;
+}
+
+asynStatus eigerDetector::startDownloadWorkers (size_t numWorkers)
+{
+    const char *functionName = "startDownloadWorkers";
+
+    if(numWorkers < 1)
+        numWorkers = 1;
+    if(numWorkers > MAX_DOWNLOAD_WORKERS)
+        numWorkers = MAX_DOWNLOAD_WORKERS;
+
+    while(mNumDownloadWorkers < numWorkers)
+    {
+        char name[32];
+        epicsSnprintf(name, sizeof(name), "eigerDownloadTask%lu",
+                (unsigned long) mNumDownloadWorkers);
+        if(epicsThreadCreate(name, epicsThreadPriorityMedium,
+                epicsThreadGetStackSize(epicsThreadStackMedium),
+                (EPICSTHREADFUNC)downloadTaskC, this) == NULL)
+        {
+            ERR_ARGS("epicsThreadCreate failure for %s", name);
+            return asynError;
+        }
+        ++mNumDownloadWorkers;
+    }
+
+    // No files are queued between series, so each of these stops a worker
+    while(mNumDownloadWorkers > numWorkers)
+    {
+        file_t *stop = NULL;
+        mDownloadQueue.send(&stop, sizeof(stop));
+        --mNumDownloadWorkers;
+    }
+
+    FLOW_ARGS("using %lu download workers", (unsigned long) mNumDownloadWorkers);
+    return asynSuccess;
+}
+
+// Each stage the file was meant for gets it, or reaps it if the download
+// failed, so that refCount always drops to zero. A file parsed incrementally
+// was already handed to parseTask, which sees how its download ended.
+void eigerDetector::downloadDone (file_t *file, bool failed)
+{
+    if(file->save)
+    {
+        if(failed)
+            mReapQueue.send(&file, sizeof(file));
+        else
+            mSaveQueue.send(&file, sizeof(file));
+    }
+
+    if(file->parse && !file->incremental)
+        parseReady(file, failed);
+}
+
+// Downloads finish in any order, so files wait in mParseOrder for the ones
+// queued before them, and frames are still published in order
+void eigerDetector::parseReady (file_t *file, bool failed)
+{
+    mParseOrderMutex.lock();
+    file->downloaded = true;
+    file->failed = failed;
+    while(!mParseOrder.empty() && mParseOrder.front()->downloaded)
+    {
+        file_t *next = mParseOrder.front();
+        mParseOrder.pop_front();
+        if(next->failed)
+            mReapQueue.send(&next, sizeof(next));
+        else
+            mParseQueue.send(&next, sizeof(next));
     }
+    mParseOrderMutex.unlock();
 }
 
 void eigerDetector::parseTask (void)
@@ -1233,7 +1678,12 @@ void eigerDetector::parseTask (void)
 
         FLOW_ARGS("file=%s", file->name);
 
-        if(parseH5File(file->data, file->len))
+        if(file->incremental)
+        {
+            if(parseH5FileIncremental(file))
+                ERR_ARGS("underlying parseH5FileIncremental(%s) failed", file->name);
+        }
+        else if(parseH5File(file->data, file->len))
         {
             ERR_ARGS("underlying parseH5File(%s) failed", file->name);
         }
@@ -1242,10 +1692,69 @@ void eigerDetector::parseTask (void)
     }
 }
 
+// Opens the local file a downloaded file is saved to, as its owner and with
+// its permissions. The filesystem UID and GID are set per thread, so the
+// caller keeps the current ones in fsUid and fsGid.
+int eigerDetector::openSaveFile (file_t *file, uid_t *fsUid, uid_t *fsGid)
+{
+    const char *functionName = "openSaveFile";
+    char fullFileName[MAX_FILENAME_LEN];
+    int fd;
+
+    FLOW_ARGS("file=%s uid=%d gid=%d", file->name, file->uid, file->gid);
+
+    if(file->uid != *fsUid)
+    {
+        FLOW_ARGS("setting FS UID to %d", file->uid);
+        setfsuid(file->uid);
+        *fsUid = (uid_t)setfsuid(file->uid);
+
+        if(*fsUid != file->uid)
+            ERR_ARGS("[file=%s] failed to set uid", file->name);
+
+    }
+
+    if(file->gid != *fsGid)
+    {
+        FLOW_ARGS("setting FS GID to %d", file->gid);
+        setfsgid(file->gid);
+        *fsGid = (uid_t)setfsgid(file->gid);
+
+        if(*fsGid != file->gid)
+            ERR_ARGS("[file=%s] failed to set gid", file->name);
+
+    }
+
+    lock();
+    setStringParam(NDFileName, file->name);
+    setStringParam(NDFileTemplate, "%s%s");
+    createFileName(sizeof(fullFileName), fullFileName);
+    setStringParam(NDFullFileName, fullFileName);
+    callParamCallbacks();
+    unlock();
+
+    fd = open(fullFileName, O_WRONLY | O_CREAT, file->perms);
+    if(fd < 0)
+    {
+        ERR_ARGS("[file=%s] unable to open file to be written\n[%s]",
+                file->name, fullFileName);
+        perror("open");
+        return -1;
+    }
+
+    if(fchmod(fd, file->perms) < 0)
+    {
+        ERR_ARGS("[file=%s] failed to set permissions %o", file->name,
+                file->perms);
+        perror("fchmod");
+    }
+
+    return fd;
+}
+
 void eigerDetector::saveTask (void)
 {
     const char *functionName = "saveTask";
-    char fullFileName[MAX_FILENAME_LEN];
     file_t *file;
     uid_t currentFsUid = getuid();
     uid_t currentFsGid = getgid();
@@ -1258,55 +1767,13 @@ void eigerDetector::saveTask (void)
 
         mSaveQueue.receive(&file, sizeof(file_t *));
 
-        FLOW_ARGS("file=%s uid=%d gid=%d", file->name, file->uid, file->gid);
-
-        if(file->uid != currentFsUid)
-        {
-            FLOW_ARGS("setting FS UID to %d", file->uid);
-            setfsuid(file->uid);
-            currentFsUid = (uid_t)setfsuid(file->uid);
-
-            if(currentFsUid != file->uid)
-                ERR_ARGS("[file=%s] failed to set uid", file->name);
-
-        }
-
-        if(file->gid != currentFsGid)
-        {
-            FLOW_ARGS("setting FS GID to %d", file->gid);
-            setfsgid(file->gid);
-            currentFsGid = (uid_t)setfsgid(file->gid);
-
-            if(currentFsGid != file->gid)
-                ERR_ARGS("[file=%s] failed to set gid", file->name);
-
-        }
-
-        lock();
-        setStringParam(NDFileName, file->name);
-        setStringParam(NDFileTemplate, "%s%s");
-        createFileName(sizeof(fullFileName), fullFileName);
-        setStringParam(NDFullFileName, fullFileName);
-        callParamCallbacks();
-        unlock();
-
-        fd = open(fullFileName, O_WRONLY | O_CREAT, file->perms);
+        fd = openSaveFile(file, &currentFsUid, &currentFsGid);
         if(fd < 0)
         {
-            ERR_ARGS("[file=%s] unable to open file to be written\n[%s]",
-                    file->name, fullFileName);
-            perror("open");
             file->remove = false;
             goto reap;
         }
 
-        if(fchmod(fd, file->perms) < 0)
-        {
-            ERR_ARGS("[file=%s] failed to set permissions %o", file->name,
-                    file->perms);
-            perror("fchmod");
-        }
-
         total_written = 0;
         while(total_written < file->len)
         {
@@ -1328,6 +1795,63 @@ reap:
     }
 }
 
+// A file larger than the whole budget waits until nothing else is in flight
+// and then goes alone, so that it cannot wait forever
+void eigerDetector::reserveMemory (size_t bytes)
+{
+    const char *functionName = "reserveMemory";
+    int budget;
+    bool waited = false;
+
+    for(;;)
+    {
+        lock();
+        mFWMemBudget->get(budget);
+        unlock();
+
+        size_t limit = (size_t) budget << 20;
+        mMemMutex.lock();
+        if(!limit || !mMemInFlight || mMemInFlight + bytes <= limit)
+            break;
+        mMemMutex.unlock();
+
+        if(!waited)
+            FLOW_ARGS("waiting for %lu bytes to be freed", (unsigned long) bytes);
+        waited = true;
+        mMemEvent.wait();
+    }
+
+    mMemInFlight += bytes;
+    if(mMemInFlight > mMemHighWater)
+        mMemHighWater = mMemInFlight;
+    mMemMutex.unlock();
+
+    publishMemory();
+}
+
+void eigerDetector::releaseMemory (size_t bytes)
+{
+    mMemMutex.lock();
+    mMemInFlight -= bytes;
+    mMemMutex.unlock();
+
+    mMemEvent.signal();
+    publishMemory();
+}
+
+void eigerDetector::publishMemory (void)
+{
+    mMemMutex.lock();
+    double inFlight = mMemInFlight / 1048576.0;
+    double highWater = mMemHighWater / 1048576.0;
+    mMemMutex.unlock();
+
+    lock();
+    mFWMemInFlight->put(inFlight);
+    mFWMemHighWater->put(highWater);
+    unlock();
+}
+
 void eigerDetector::reapTask (void)
 {
     const char *functionName = "reapTask";
@@ -1353,6 +1877,7 @@ void eigerDetector::reapTask (void)
                 file->data = NULL;
                 FLOW_ARGS("file=%s reaped", file->name);
             }
+            releaseMemory(file->reserved);
 
             lock();
             mPendingFiles->get(pendingFiles);
@@ -1398,12 +1923,13 @@ void eigerDetector::streamTask (void)
 {
     const char *functionName = "streamTask";
 
-    lock();
+    // Receiving and parsing the frames is done without holding the lock. It is
+    // only taken to read the settings and update the status parameters.
     for(;;)
     {
-        unlock();
         mStreamEvent.wait();
         lock();
+        mStreamBusy = true;
 
         int streamVersion;
         mStreamVersion->get(streamVersion);
@@ -1412,23 +1938,60 @@ void eigerDetector::streamTask (void)
         int streamAsTsSource;
         mStreamAsTsSource->get(streamAsTsSource);
 
+        int numWorkers;
+        mStreamDecompThreads->get(numWorkers);
+
+        // Number of frames handed to the workers that are not done yet
+        size_t pendingJobs = 0;
+        stream_job_t *doneJob;
+
        if (((streamVersion == STREAM_VERSION_STREAM) && !mStreamAPI) ||
            ((streamVersion == STREAM_VERSION_STREAM2) && !mStream2API)) {
             ERR("mStreamAPI is null, Stream API not enabled?");
+            mStreamBusy = false;
+            unlock();
             continue;
         }
+
         int err;
         stream_header_t header = {};
         int numThresholds = 1;
+        StreamReceiver *receiver = (streamVersion == STREAM_VERSION_STREAM) ?
+                mStreamAPI->getReceiver() : mStream2API->getReceiver();
+        // Overflows are reported per acquisition
+        size_t ringOverflows = receiver->overflows();
+        mStreamRingUsed->put((int) receiver->occupancy());
+        mStreamRingOverflows->put(0);
+
+        // Frame ids start from 0 in each series
+        StreamFrameTracker tracker;
+        mStreamMissing->put(0);
+        mStreamFirstMissing->put(-1);
+        mStreamDuplicates->put(0);
+        mStreamReordered->put(0);
+
+        // No worker is running, so the histograms can be reset
+        for(int i = 0; i < StreamLatNumStages; ++i)
+            mStreamLat[i].reset();
+        publishStreamLatency();
+        epicsTimeStamp latPublished;
+        epicsTimeGetCurrent(&latPublished);
+        callParamCallbacks();
+        unlock();
+
+        if(startStreamWorkers((size_t) numWorkers))
+        {
+            ERR("failed to start stream workers");
+            goto end;
+        }
+
         for(;;)
         {
-            unlock();
             if (streamVersion == STREAM_VERSION_STREAM) {
                 err = mStreamAPI->getHeader(&header, 1);
             } else {
                 err = mStream2API->getHeader(&header, 1);
             }
-            lock();
             if ( err == STREAM_SUCCESS) {
                 break;
             } else if (err == STREAM_WRONG_HTYPE) {
@@ -1464,15 +2027,13 @@ void eigerDetector::streamTask (void)
         for(;;)
         {
             int endFrames;
-             for(;;)
+            for(;;)
             {
-               unlock();
-               if (streamVersion == STREAM_VERSION_STREAM) {
+                if (streamVersion == STREAM_VERSION_STREAM) {
                     err = mStreamAPI->waitFrame(&endFrames);
                 } else {
                     err = mStream2API->waitFrame(&endFrames, &numThresholds);
                 }
-                lock();
                 if (err == STREAM_SUCCESS) {
                     break;
                 } else if (err == STREAM_ERROR) {
@@ -1494,28 +2055,213 @@ void eigerDetector::streamTask (void)
                 break;
             }
 
-            for (int thresh=0; thresh<numThresholds; thresh++) {
-                NDArray *pArray;
-                int decompress;
-                mStreamDecompress->get(decompress);
-                bool tsIsSet = false;
-                if (streamVersion == STREAM_VERSION_STREAM) {
-                    err = mStreamAPI->getFrame(&pArray, pNDArrayPool, decompress);
-                } else {
-                    err = mStream2API->getFrame(&pArray, pNDArrayPool, thresh, decompress, streamAsTsSource);
-                    tsIsSet = streamAsTsSource;
+            stream_job_t *job = newStreamJob();
+            job->streamVersion = streamVersion;
+            job->stream2API = mStream2API;
+
+            if (streamVersion == STREAM_VERSION_STREAM) {
+                err = mStreamAPI->readFrame(&job->frame);
+            } else {
+                err = mStream2API->readFrame(&job->frame, streamAsTsSource);
+            }
+            bool stale = false;
+            uint64_t gap = err ? 0 : tracker.add(job->frame.frame, &stale);
+
+            lock();
+            int fillGaps;
+            mStreamFillGaps->get(fillGaps);
+            job->numPlaceholders = fillGaps ?
+                    (int) std::min(gap, (uint64_t) MAX_STREAM_PLACEHOLDERS) : 0;
+            mStreamMissing->put((int) tracker.missing());
+            mStreamFirstMissing->put((int) tracker.firstMissing());
+            mStreamDuplicates->put((int) tracker.duplicates());
+            mStreamReordered->put((int) tracker.reordered());
+            epicsTimeStamp now;
+            epicsTimeGetCurrent(&now);
+            if (epicsTimeDiffInSeconds(&now, &latPublished) >= STREAM_LAT_PERIOD) {
+                publishStreamLatency();
+                latPublished = now;
+                callParamCallbacks();
+            }
+            else if (gap)
+                callParamCallbacks();
+            int bsKernel;
+            mStreamDecompress->get(job->decode.decompress);
+            mStreamBSKernelActive->get(bsKernel);
+            job->decode.bsKernel = (bslz4_kernel) bsKernel;
+            mMaskFlagged->get(job->decode.maskFlagged);
+            mMaskFill->get(job->decode.maskFill);
+            mStreamROIEnable->get(job->decode.roi);
+            mStreamROIMinX->get(job->decode.roiMinX);
+            mStreamROIMinY->get(job->decode.roiMinY);
+            mStreamROISizeX->get(job->decode.roiSizeX);
+            mStreamROISizeY->get(job->decode.roiSizeY);
+            mStreamBin->get(job->decode.roiBin);
+            mStreamZeroCopy->get(job->zeroCopy);
+            mStreamRingUsed->put((int) receiver->occupancy());
+            mStreamRingOverflows->put((int) (receiver->overflows() - ringOverflows));
+            unlock();
+
+            // With the gaps filled, placeholders have already been called
+            // back for a late frame, and the frame itself for a duplicate.
+            // Calling it back again would shift the index of every frame
+            // after it in the file plugins.
+            if(err || (fillGaps && stale))
+            {
+                if(err)
+                    ERR("failed to read frame");
+                else
+                    FLOW_ARGS("dropping late or duplicate frame %lu",
+                            (unsigned long) job->frame.frame);
+                if (streamVersion == STREAM_VERSION_STREAM)
+                    StreamAPI::freeFrame(&job->frame);
+                else
+                    Stream2API::freeFrame(&job->frame);
+                mFreeStreamJobs.push_back(job);
+                continue;
+            }
+
+            // Give each threshold of a Stream2 frame its own job, so that the
+            // thresholds are decoded in parallel. The jobs go to consecutive
+            // workers, which keeps the callbacks in threshold order.
+            int numJobs = 1;
+            if (streamVersion == STREAM_VERSION_STREAM2 && mNumStreamWorkers > 1)
+                numJobs = std::min(std::max(job->frame.numThresholds, 1), MAX_THRESHOLDS);
+
+            job->parent = job;
+            job->firstThresh = 0;
+            job->numThresh = numJobs > 1 ? 1 : job->frame.numThresholds;
+            job->refCount = numJobs;
+
+            for(int i = 0; i < numJobs; ++i)
+            {
+                stream_job_t *thisJob = job;
+                if(i > 0)
+                {
+                    thisJob = newStreamJob();
+                    thisJob->streamVersion = job->streamVersion;
+                    thisJob->decode = job->decode;
+                    thisJob->zeroCopy = job->zeroCopy;
+                    thisJob->numPlaceholders = job->numPlaceholders;
+                    thisJob->stream2API = job->stream2API;
+                    thisJob->parent = job;
+                    thisJob->firstThresh = i;
+                    thisJob->numThresh = 1;
                 }
-                int imageCounter, numImagesCounter, arrayCallbacks;
+
+                // Hand the job to the next worker in the ring. This blocks if
+                // the worker is still busy with earlier frames.
+                stream_worker_t *worker = mStreamWorkers[mNextStreamWorker];
+                mNextStreamWorker = (mNextStreamWorker + 1) % mNumStreamWorkers;
+
+                worker->jobQueue->send(&thisJob, sizeof(thisJob));
+                ++pendingJobs;
+            }
+            while(mStreamDoneQueue.tryReceive(&doneJob, sizeof(doneJob)) > 0)
+            {
+                mFreeStreamJobs.push_back(doneJob);
+                --pendingJobs;
+            }
+        }
+
+end:
+        // Wait for the workers to issue the callbacks for all pending frames
+        FLOW_ARGS("waiting for %lu pending frames", pendingJobs);
+        while(pendingJobs)
+        {
+            mStreamDoneQueue.receive(&doneJob, sizeof(doneJob));
+            mFreeStreamJobs.push_back(doneJob);
+            --pendingJobs;
+        }
+
+        lock();
+        mStreamDropped->fetch();
+        publishStreamLatency();
+        // Nothing uses the stream objects any more
+        mStreamBusy = false;
+        if (mStreamChangePending) {
+            mStreamChangePending = false;
+            updateStreamAPI();
+        }
+        callParamCallbacks();
+        unlock();
+
+        mStreamDoneEvent.signal();
+    }
+}
+
+void eigerDetector::streamWorkerTask (stream_worker_t *worker)
+{
+    const char *functionName = "streamWorkerTask";
+    stream_job_t *job;
+    NDArray *pArrays[MAX_THRESHOLDS];
+
+    for(;;)
+    {
+        worker->jobQueue->receive(&job, sizeof(job));
+        stream_frame_t *frame = &job->parent->frame;
+        job->decode.scratch = &worker->scratch;
+
+        // Decode this job's thresholds without holding the lock
+        int numArrays = job->numThresh;
+        if(job->firstThresh + numArrays > MAX_THRESHOLDS)
+        {
+            ERR_ARGS("frame %lu has %d thresholds, only decoding %d",
+                    frame->frame, job->firstThresh + numArrays, MAX_THRESHOLDS);
+            numArrays = std::max(MAX_THRESHOLDS - job->firstThresh, 0);
+        }
+
+        for(int i = 0; i < numArrays; ++i)
+        {
+            int err;
+            int thresh = job->firstThresh + i;
+            pArrays[i] = NULL;
+            if (job->streamVersion == STREAM_VERSION_STREAM) {
+                err = StreamAPI::decodeFrame(frame, &pArrays[i],
+                        pNDArrayPool, job->decode);
+            } else {
+                err = job->stream2API->decodeFrame(frame, thresh,
+                        &pArrays[i], pNDArrayPool, job->decode,
+                        job->zeroCopy ? mStreamArrayPool : NULL);
+            }
+            if(err)
+                ERR_ARGS("failed to decode frame %lu threshold %d",
+                        frame->frame, thresh);
+        }
+        epicsTimeStamp decodeTime;
+        epicsTimeGetCurrent(&decodeTime);
+
+        // Wait for the previous frame to be called back
+        worker->cbEvent->wait();
+        lock();
+
+        int arrayCallbacks, signedData;
+        getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
+        mSignedData->get(signedData);
+
+        for (int i=0; i<numArrays; i++) {
+            int thresh = job->firstThresh + i;
+            NDArray *pFrameArray = pArrays[i];
+            if (!pFrameArray)
+                continue;
+
+            // The placeholders for the frames lost before this one come first
+            for (int n = job->numPlaceholders; n >= 0; --n) {
+                NDArray *pArray = n ? allocPlaceholder(pFrameArray) : pFrameArray;
+                if (!pArray) {
+                    ERR("failed to allocate placeholder NDArray");
+                    continue;
+                }
+
+                bool tsIsSet = frame->hasTimeStamp && pArray == pFrameArray;
+                int imageCounter, numImagesCounter;
                 getIntegerParam(NDArrayCounter, &imageCounter);
                 getIntegerParam(ADNumImagesCounter, &numImagesCounter);
-                getIntegerParam(NDArrayCallbacks, &arrayCallbacks);
 
                 // The data returned from the StreamAPIs is unsigned.
                 // Bad pixels and gaps are very large positive numbers, which makes autoscaling difficult
                 // Optionally change the data type to signed.
                 // This improves autoscaling, but reduces the count range by 2X.
-                int signedData;
-                mSignedData->get(signedData);
                 if (signedData) {
                     int dataType = pArray->dataType;
                     switch (pArray->dataType) {
@@ -1546,26 +2292,141 @@ void eigerDetector::streamTask (void)
                 // Get any attributes that have been defined for this driver
                 this->getAttributes(pArray->pAttributeList);
 
-                // Call the NDArray callback
+                setIntegerParam(NDArrayCounter, ++imageCounter);
+                setIntegerParam(ADNumImagesCounter, ++numImagesCounter);
+                callParamCallbacks();
+
+                // Call the NDArray callback without the lock. The callback order
+                // is kept because this worker holds the callback token.
+                unlock();
                 if (arrayCallbacks) {
                     doCallbacksGenericPointer(pArray, NDArrayData, 0);
                     doCallbacksGenericPointer(pArray, NDArrayData, thresh+1);
                 }
-                setIntegerParam(NDArrayCounter, ++imageCounter);
-                setIntegerParam(ADNumImagesCounter, ++numImagesCounter);
-
-                callParamCallbacks();
                 pArray->release();
+                lock();
             }
         }
 
-end:
-        mStreamDropped->fetch();
+        unlock();
+        worker->nextCbEvent->signal();
+
+        // The parse stage is counted once for each frame, the others for
+        // each job
+        epicsTimeStamp callbackTime;
+        epicsTimeGetCurrent(&callbackTime);
+        if(job == job->parent)
+            mStreamLat[StreamLatParse].record(elapsedNs(&frame->parseTime, &frame->recvTime));
+        mStreamLat[StreamLatDecode].record(elapsedNs(&decodeTime, &frame->parseTime));
+        mStreamLat[StreamLatCallback].record(elapsedNs(&callbackTime, &decodeTime));
+        mStreamLat[StreamLatTotal].record(elapsedNs(&callbackTime, &frame->recvTime));
+
+        stream_job_t *parent = job->parent;
+        if(job != parent)
+            worker->doneQueue->send(&job, sizeof(job));
+
+        if(--parent->refCount == 0)
+        {
+            if (parent->streamVersion == STREAM_VERSION_STREAM)
+                StreamAPI::freeFrame(frame);
+            else
+                Stream2API::freeFrame(frame);
+            worker->doneQueue->send(&parent, sizeof(parent));
+        }
+    }
+}
 
-        mStreamDoneEvent.signal();
+stream_job_t *eigerDetector::newStreamJob (void)
+{
+    if(mFreeStreamJobs.empty())
+        return new stream_job_t();
+
+    stream_job_t *job = mFreeStreamJobs.back();
+    mFreeStreamJobs.pop_back();
+    return job;
+}
+
+void eigerDetector::publishStreamLatency (void)
+{
+    // In ms
+    for(int i = 0; i < StreamLatNumStages; ++i)
+    {
+        mStreamLatP50[i]->put(mStreamLat[i].quantile(0.5) / 1e6);
+        mStreamLatP99[i]->put(mStreamLat[i].quantile(0.99) / 1e6);
+        mStreamLatMax[i]->put(mStreamLat[i].max() / 1e6);
     }
 }
 
+NDArray *eigerDetector::allocPlaceholder (NDArray *pArray)
+{
+    size_t dims[ND_ARRAY_MAX_DIMS];
+    for(int i = 0; i < pArray->ndims; ++i)
+        dims[i] = pArray->dims[i].size;
+
+    NDArray *pPlaceholder = pNDArrayPool->alloc(pArray->ndims, dims,
+            pArray->dataType, 0, NULL);
+    if(!pPlaceholder)
+        return NULL;
+
+    for(int i = 0; i < pArray->ndims; ++i)
+        pPlaceholder->dims[i] = pArray->dims[i];
+    memset(pPlaceholder->pData, 0, pPlaceholder->dataSize);
+
+    int placeholder = 1;
+    pPlaceholder->pAttributeList->add("Placeholder", "Stands in for a lost frame",
+            NDAttrInt32, &placeholder);
+    return pPlaceholder;
+}
+
+asynStatus eigerDetector::startStreamWorkers (size_t numWorkers)
+{
+    const char *functionName = "startStreamWorkers";
+
+    if(numWorkers < 1)
+        numWorkers = 1;
+    if(numWorkers > MAX_STREAM_WORKERS)
+        numWorkers = MAX_STREAM_WORKERS;
+
+    while(mStreamWorkers.size() < numWorkers)
+    {
+        stream_worker_t *worker = new stream_worker_t;
+        worker->id          = mStreamWorkers.size();
+        worker->detector    = this;
+        worker->jobQueue    = new epicsMessageQueue(DEFAULT_QUEUE_CAPACITY, sizeof(stream_job_t *));
+        worker->doneQueue   = &mStreamDoneQueue;
+        worker->cbEvent     = new epicsEvent();
+        worker->nextCbEvent = worker->cbEvent;
+
+        char name[32];
+        epicsSnprintf(name, sizeof(name), "eigerStreamWorker%lu", (unsigned long)worker->id);
+        if(epicsThreadCreate(name, epicsThreadPriorityMedium,
+                epicsThreadGetStackSize(epicsThreadStackMedium),
+                (EPICSTHREADFUNC)streamWorkerTaskC, worker) == NULL)
+        {
+            ERR_ARGS("epicsThreadCreate failure for %s", name);
+            delete worker->jobQueue;
+            delete worker->cbEvent;
+            delete worker;
+            return asynError;
+        }
+        mStreamWorkers.push_back(worker);
+    }
+
+    // All workers are idle here, so the ring can be relinked safely. The
+    // callback token starts at the first worker.
+    for(size_t i = 0; i < mStreamWorkers.size(); ++i)
+    {
+        mStreamWorkers[i]->cbEvent->tryWait();
+        mStreamWorkers[i]->nextCbEvent = mStreamWorkers[(i+1) % numWorkers]->cbEvent;
+    }
+    mStreamWorkers[0]->cbEvent->signal();
+    mNumStreamWorkers = numWorkers;
+    mNextStreamWorker = 0;
+
+    FLOW_ARGS("using %lu stream workers", numWorkers);
+    return asynSuccess;
+}
+
 void eigerDetector::initializeTask()
 {
     const char *functionName = "initializeTask";
@@ -1620,10 +2481,44 @@ void eigerDetector::restartTask()
 
 asynStatus eigerDetector::initParams (void)
 {
+    const char *functionName = "initParams";
     int status = asynSuccess;
 
+    epicsTimeStamp fetchStart, fetchEnd;
+    epicsTimeGetCurrent(&fetchStart);
+
+    // The type, access mode, limits and allowed values of the parameters only
+    // change with the firmware, so they are cached per detector and firmware
+    const char *cacheDir = getenv(PARAM_CACHE_DIR_ENV);
+    string serialNumber, firmwareVersion;
+    if(cacheDir && *cacheDir && !mSerialNumber->fetch(serialNumber) &&
+       !mFirmwareVersion->fetch(firmwareVersion))
+    {
+        string key = serialNumber + "_" + firmwareVersion;
+        std::replace_if(key.begin(), key.end(), ::isspace, '_');
+        std::replace(key.begin(), key.end(), '/', '_');
+        mParamCachePath = string(cacheDir) + "/eigerParams_" + key + ".txt";
+        mParamCacheLoaded = !mParams.loadMetadata(mParamCachePath);
+        FLOW_ARGS("parameter cache %s %s", mParamCachePath.c_str(),
+                mParamCacheLoaded ? "loaded" : "not found");
+    }
+
     mParams.fetchAll();
 
+    // Rewritten whenever it lacked a parameter, e.g. one a newer driver adds
+    if(!mParamCachePath.empty() && mParams.metadataFetched())
+    {
+        if(mParams.saveMetadata(mParamCachePath))
+        {
+            ERR_ARGS("unable to write parameter cache %s", mParamCachePath.c_str());
+            mParamCachePath.clear();
+        }
+        else
+            mParamCacheLoaded = false;
+    }
+    epicsTimeGetCurrent(&fetchEnd);
+    mParamFetchTime = epicsTimeDiffInSeconds(&fetchEnd, &fetchStart);
+
     // Get the sensor size without ROI
     string roiMode;
     int maxSizeX, maxSizeY;
@@ -1664,6 +2559,35 @@ asynStatus eigerDetector::initParams (void)
     mFileOwner->put("");
     mFileOwnerGroup->put("");
     mFilePerms->put(0644);
+    mFWChunkSize->put(DEFAULT_FW_CHUNK_SIZE);
+    mFWDownloadParallel->put(1);
+    mFWDownloadRate->put(0.0);
+    mFWDownloadWorkers->put(1);
+    mFWMemBudget->put(0);
+    mFWMemInFlight->put(0.0);
+    mFWMemHighWater->put(0.0);
+    mFWIncrementalParse->put(0);
+    mStreamDecompThreads->put(DEFAULT_STREAM_WORKERS);
+    mStreamZeroCopy->put(0);
+    mStreamRingSize->put(DEFAULT_RING_SIZE);
+    mStreamRingUsed->put(0);
+    mStreamRingOverflows->put(0);
+    mStreamBSKernel->put(BSLZ4_KERNEL_AUTO);
+    mStreamBSKernelActive->put(bslz4_resolve_kernel(BSLZ4_KERNEL_AUTO));
+    mMaskFlagged->put(0);
+    mMaskFill->put(0);
+    mStreamROIEnable->put(0);
+    mStreamROIMinX->put(0);
+    mStreamROIMinY->put(0);
+    mStreamROISizeX->put(0);
+    mStreamROISizeY->put(0);
+    mStreamBin->put(1);
+    mStreamMissing->put(0);
+    mStreamFirstMissing->put(-1);
+    mStreamDuplicates->put(0);
+    mStreamReordered->put(0);
+    mStreamFillGaps->put(0);
+    publishStreamLatency();
 
     // Auto Summation should always be true (SIMPLON API Reference v1.3.0)
     mAutoSummation->put(true);
@@ -1680,23 +2604,8 @@ asynStatus eigerDetector::initParams (void)
 asynStatus eigerDetector::parseH5File (char *buf, size_t bufLen)
 {
     const char *functionName = "parseH5File";
-    asynStatus status = asynSuccess;
-
-    int imageCounter, numImagesCounter, arrayCallbacks;
-    hid_t fId, dId, dSpace, dType, mSpace;
-    int nDims;
-    int i, j;
-    herr_t err;
-    size_t nImages=0, nThresh=0, width=0, height=0;
-    #define MAX_HDF5_DIMS 4
-    hsize_t dims[MAX_HDF5_DIMS], count[MAX_HDF5_DIMS], offset[MAX_HDF5_DIMS] = {0};
-    size_t ndDims[2];
-    int activeThresholds[MAX_THRESHOLDS];
-    double thresholdEnergy[MAX_THRESHOLDS];
-    int nextThreshold = 0;
-    bool threshEnable;
-
-    NDDataType_t ndType;
+    asynStatus status;
+    hid_t fId;
 
     unsigned flags = H5LT_FILE_IMAGE_DONT_COPY | H5LT_FILE_IMAGE_DONT_RELEASE;
 
@@ -1705,91 +2614,216 @@ asynStatus eigerDetector::parseH5File (char *buf, size_t bufLen)
     if(fId < 0)
     {
         ERR("unable to open memory as file");
-        goto end;
+        return asynError;
     }
 
-    // Access dataset 'data'
-    dId = H5Dopen2(fId, "/entry/data/data", H5P_DEFAULT);
-    if(dId < 0)
+    status = parseH5Frames(fId, NULL);
+    H5Fclose(fId);
+    return status;
+}
+
+// The file is read through a driver that fails the reads of bytes not
+// received yet, which the HDF5 library reports as errors. They are expected
+// here, so the library is kept quiet, and each read that fails is tried
+// again once more of the file has arrived.
+asynStatus eigerDetector::parseH5FileIncremental (file_t *file)
+{
+    const char *functionName = "parseH5FileIncremental";
+    asynStatus status = asynError;
+    size_t seen = 0;
+    hid_t fapl, fId;
+    H5E_auto2_t errFunc;
+    void *errData;
+
+    // Nothing can be read before the first bytes arrive
+    if(!waitH5Progress(file, &seen))
     {
-        ERR("unable to open '/entry/data/data'. Will try '/entry/data'");
+        ERR_ARGS("[file=%s] download failed", file->name);
+        return asynError;
+    }
 
-        dId = H5Dopen2(fId, "/entry/data", H5P_DEFAULT);
-        if(dId < 0)
+    file->progressMutex.lock();
+    fapl = h5_partial_fapl(file->data, file->len, &file->received);
+    file->progressMutex.unlock();
+    if(fapl < 0)
+    {
+        ERR_ARGS("[file=%s] unable to set up the partial file driver", file->name);
+        return asynError;
+    }
+
+    H5Eget_auto2(H5E_DEFAULT, &errFunc, &errData);
+    H5Eset_auto2(H5E_DEFAULT, NULL, NULL);
+
+    // Opens once the superblock and root group have arrived
+    do
+        fId = H5Fopen(file->name, H5F_ACC_RDONLY, fapl);
+    while(fId < 0 && waitH5Progress(file, &seen));
+
+    if(fId < 0)
+    {
+        ERR_ARGS("[file=%s] unable to open file", file->name);
+    }
+    else
+    {
+        status = parseH5Frames(fId, file);
+        H5Fclose(fId);
+    }
+
+    H5Eset_auto2(H5E_DEFAULT, errFunc, errData);
+    H5Pclose(fapl);
+    return status;
+}
+
+bool eigerDetector::waitH5Progress (file_t *file, size_t *seen)
+{
+    if(!file)
+        return false;
+
+    for(;;)
+    {
+        file->progressMutex.lock();
+        size_t received = file->received.load(std::memory_order_relaxed);
+        bool finished = file->finished;
+        file->progressMutex.unlock();
+
+        if(received > *seen)
         {
-            ERR("unable to open '/entry/data' dataset");
-            goto closeFile;
+            *seen = received;
+            return true;
         }
+        if(finished)
+            return false;
+
+        file->progressEvent.wait();
     }
+}
+
+// The chunk index is read as far as it has arrived, so a chunk is found once
+// both its index entry and its bytes are in. Chunks that were never written
+// read as the fill value and need no waiting for.
+asynStatus eigerDetector::waitH5Chunks (file_t *file, hid_t dId, int nDims,
+        const hsize_t *chunkDims, const hsize_t *offset, const hsize_t *count,
+        size_t *seen)
+{
+#if H5_VERSION_GE(1,10,5)
+    if(chunkDims)
+    {
+        hsize_t coord[MAX_HDF5_DIMS];
+        int k;
+
+        for(k = 0; k < nDims; ++k)
+            coord[k] = offset[k] / chunkDims[k] * chunkDims[k];
+
+        for(;;)
+        {
+            for(;;)
+            {
+                unsigned filterMask;
+                haddr_t addr;
+                hsize_t size;
+
+                if(H5Dget_chunk_info_by_coord(dId, coord, &filterMask, &addr, &size) >= 0 &&
+                   (addr == HADDR_UNDEF || addr + size <= file->received.load()))
+                    break;
+                if(!waitH5Progress(file, seen))
+                    return asynError;
+            }
+
+            // Next chunk of the hyperslab, the last dimension first
+            for(k = nDims - 1; k >= 0; --k)
+            {
+                coord[k] += chunkDims[k];
+                if(coord[k] < offset[k] + count[k])
+                    break;
+                coord[k] = offset[k] / chunkDims[k] * chunkDims[k];
+            }
+            if(k < 0)
+                return asynSuccess;
+        }
+    }
+#endif
+
+    // Where the data is is not known, so wait for all of it
+    while(waitH5Progress(file, seen));
+
+    file->progressMutex.lock();
+    bool truncated = file->truncated;
+    file->progressMutex.unlock();
+    return truncated ? asynError : asynSuccess;
+}
+
+const char *h5OpenFrames (hid_t fId, h5_frames_t *frames)
+{
+    const char *error = NULL;
+    hsize_t dims[MAX_HDF5_DIMS];
+    hid_t dId, dType, dSpace;
+
+    memset(frames, 0, sizeof(*frames));
+
+    // Access dataset 'data'
+    dId = H5Dopen2(fId, "/entry/data/data", H5P_DEFAULT);
+    if(dId < 0)
+        dId = H5Dopen2(fId, "/entry/data", H5P_DEFAULT);
+    if(dId < 0)
+        return "unable to open '/entry/data/data' nor '/entry/data' dataset";
 
     // Get dataset number of dimensions
-    err = H5LTget_dataset_ndims(dId, ".", &nDims);
-    if(err)
+    if(H5LTget_dataset_ndims(dId, ".", &frames->nDims))
     {
-        ERR("couldn't read dataset ndims");
+        error = "couldn't read dataset ndims";
         goto closeDataset;
     }
 
-    if ((nDims < 3) || (nDims > 4))
+    if ((frames->nDims < 3) || (frames->nDims > 4))
     {
-        ERR("number of dimensions must be 3 or 4");
+        error = "number of dimensions must be 3 or 4";
         goto closeDataset;
     }
 
     // Get dataset dimensions
-    err = H5LTget_dataset_info(dId, ".", dims, NULL, NULL);
-    if(err)
+    if(H5LTget_dataset_info(dId, ".", dims, NULL, NULL))
     {
-        ERR("couldn't read dataset info");
+        error = "couldn't read dataset info";
         goto closeDataset;
     }
 
-    if (nDims == 3) {
-      nImages  = dims[0];
-      nThresh  = 1;
-      height   = dims[1];
-      width    = dims[2];
-      count[0] = 1;
-      count[1] = height;
-      count[2] = width;
-    }
-    else if (nDims == 4) {
-      nImages = dims[0];
-      nThresh = dims[1];
-      height  = dims[2];
-      width   = dims[3];
-      count[0] = 1;
-      count[1] = 1;
-      count[2] = height;
-      count[3] = width;
-    }
-    ndDims[0] = width;
-    ndDims[1] = height;
-
-    // Get dataset type
+    if (frames->nDims == 3) {
+      frames->nImages  = dims[0];
+      frames->nThresh  = 1;
+      frames->height   = dims[1];
+      frames->width    = dims[2];
+      frames->count[0] = 1;
+      frames->count[1] = frames->height;
+      frames->count[2] = frames->width;
+    }
+    else {
+      frames->nImages  = dims[0];
+      frames->nThresh  = dims[1];
+      frames->height   = dims[2];
+      frames->width    = dims[3];
+      frames->count[0] = 1;
+      frames->count[1] = 1;
+      frames->count[2] = frames->height;
+      frames->count[3] = frames->width;
+    }
+
+    // Get dataset type, the data in the file is unsigned
     dType = H5Dget_type(dId);
     if(dType < 0)
     {
-        ERR("couldn't get dataset type");
+        error = "couldn't get dataset type";
         goto closeDataset;
     }
 
-    // Parse dataset type
-    // The data returned in the HDF5 file is unsigned.
-    // Bad pixels and gaps are very large positive numbers, which makes autoscaling difficult
-    // Optionally change the data type to signed.
-    // This improves autoscaling, but reduces the count range by 2X.
-    int signedData;
-    mSignedData->get(signedData);
     if(H5Tequal(dType, H5T_NATIVE_UINT32) > 0)
-        ndType = signedData ? NDInt32 : NDUInt32;
+        frames->dataType = NDUInt32;
     else if(H5Tequal(dType, H5T_NATIVE_UINT16) > 0)
-        ndType = signedData ? NDInt16 : NDUInt16;
+        frames->dataType = NDUInt16;
     else if(H5Tequal(dType, H5T_NATIVE_UINT8) > 0)
-        ndType = signedData ? NDInt8 : NDUInt8;
+        frames->dataType = NDUInt8;
     else
     {
-        ERR("invalid data type");
+        error = "invalid data type";
         goto closeDataType;
     }
 
@@ -1797,16 +2831,100 @@ asynStatus eigerDetector::parseH5File (char *buf, size_t bufLen)
     dSpace = H5Dget_space(dId);
     if(dSpace < 0)
     {
-        ERR("couldn't get dataspace");
+        error = "couldn't get dataspace";
         goto closeDataType;
     }
 
     // Create memspace
-    mSpace = H5Screate_simple(nDims, count, NULL);
-    if(mSpace < 0)
+    frames->mSpace = H5Screate_simple(frames->nDims, frames->count, NULL);
+    if(frames->mSpace < 0)
+    {
+        error = "failed to create memSpace";
+        goto closeDataSpace;
+    }
+
+    frames->dId = dId;
+    frames->dType = dType;
+    frames->dSpace = dSpace;
+    return NULL;
+
+closeDataSpace:
+    H5Sclose(dSpace);
+closeDataType:
+    H5Tclose(dType);
+closeDataset:
+    H5Dclose(dId);
+    return error;
+}
+
+herr_t h5SelectFrame (h5_frames_t *frames, size_t image, size_t thresh)
+{
+    frames->offset[0] = image;
+    if (frames->nDims == 4) frames->offset[1] = thresh;
+    return H5Sselect_hyperslab(frames->dSpace, H5S_SELECT_SET, frames->offset,
+            NULL, frames->count, NULL);
+}
+
+void h5CloseFrames (h5_frames_t *frames)
+{
+    H5Sclose(frames->mSpace);
+    H5Sclose(frames->dSpace);
+    H5Tclose(frames->dType);
+    H5Dclose(frames->dId);
+}
+
+asynStatus eigerDetector::parseH5Frames (hid_t fId, file_t *file)
+{
+    const char *functionName = "parseH5Frames";
+    asynStatus status = asynSuccess;
+
+    int imageCounter, numImagesCounter, arrayCallbacks;
+    hid_t dcpl;
+    size_t i, j;
+    herr_t err;
+    h5_frames_t frames;
+    const char *error;
+    hsize_t chunkDims[MAX_HDF5_DIMS];
+    bool chunked;
+    size_t ndDims[2];
+    int activeThresholds[MAX_THRESHOLDS];
+    double thresholdEnergy[MAX_THRESHOLDS];
+    int nextThreshold = 0;
+    bool threshEnable;
+    size_t seen = file ? file->received.load() : 0;
+
+    NDDataType_t ndType;
+
+    // Access dataset 'data', once its header has arrived
+    do
+        error = h5OpenFrames(fId, &frames);
+    while(error && waitH5Progress(file, &seen));
+    if(error)
     {
-        ERR("failed to create memSpace");
-        goto closeMemSpace;
+        ERR(error);
+        goto end;
+    }
+    ndDims[0] = frames.width;
+    ndDims[1] = frames.height;
+
+    // Bad pixels and gaps are very large positive numbers, which makes autoscaling difficult
+    // Optionally change the data type to signed.
+    // This improves autoscaling, but reduces the count range by 2X.
+    int signedData, maskFlagged, maskFill;
+    mSignedData->get(signedData);
+    mMaskFlagged->get(maskFlagged);
+    mMaskFill->get(maskFill);
+    ndType = frames.dataType;
+    if(signedData)
+        ndType = ndType == NDUInt32 ? NDInt32 : ndType == NDUInt16 ? NDInt16 : NDInt8;
+
+    // Frames are found in the chunk index of a file being downloaded
+    chunked = false;
+    if(file && (dcpl = H5Dget_create_plist(frames.dId)) >= 0)
+    {
+        chunked = H5Pget_layout(dcpl) == H5D_CHUNKED &&
+                H5Pget_chunk(dcpl, frames.nDims, chunkDims) == frames.nDims;
+        H5Pclose(dcpl);
     }
 
     // Determine active thresholds and energies so we can create attributes like Stream2 interface does
@@ -1840,9 +2958,9 @@ asynStatus eigerDetector::parseH5File (char *buf, size_t bufLen)
     }
     getIntegerParam(NDArrayCounter, &imageCounter);
     getIntegerParam(ADNumImagesCounter, &numImagesCounter);
-    for(i=0; i < (int)nImages; i++)
+    for(i=0; i < frames.nImages; i++)
     {
-        for(j=0; j < (int)nThresh; j++)
+        for(j=0; j < frames.nThresh; j++)
         {
             NDArray *pImage;
 
@@ -1854,19 +2972,29 @@ asynStatus eigerDetector::parseH5File (char *buf, size_t bufLen)
             }
 
             // Select the hyperslab
-            offset[0] = i;
-            if (nDims == 4) offset[1] = j;
-            err = H5Sselect_hyperslab(dSpace, H5S_SELECT_SET, offset, NULL,
-                    count, NULL);
-            if(err < 0)
+            if(h5SelectFrame(&frames, i, j) < 0)
             {
                 ERR("couldn't select hyperslab");
                 pImage->release();
                 break;
             }
 
+            // While the file downloads, wait for the chunks of the image
+            if(file && waitH5Chunks(file, frames.dId, frames.nDims,
+                    chunked ? chunkDims : NULL, frames.offset, frames.count, &seen))
+            {
+                ERR_ARGS("[file=%s] download failed before image %lu", file->name,
+                        (unsigned long) i);
+                pImage->release();
+                status = asynError;
+                goto closeFrames;
+            }
+
             // and finally read the image
-            err = H5Dread(dId, dType, mSpace, dSpace, H5P_DEFAULT, pImage->pData);
+            do
+                err = H5Dread(frames.dId, frames.dType, frames.mSpace, frames.dSpace,
+                        H5P_DEFAULT, pImage->pData);
+            while(err < 0 && waitH5Progress(file, &seen));
             if(err < 0)
             {
                 ERR("couldn't read image");
@@ -1874,6 +3002,19 @@ asynStatus eigerDetector::parseH5File (char *buf, size_t bufLen)
                 break;
             }
 
+            // Mask the gap and bad pixels
+            if (maskFlagged)
+            {
+                NDArrayInfo_t info;
+                struct bslz4_mask mask = {(uint32_t) maskFill, 0};
+                pImage->getInfo(&info);
+                bslz4_mask_pixels(pImage->pData, pImage->pData, info.nElements,
+                        info.bytesPerElement, &mask);
+                epicsInt32 maskedPixels = (epicsInt32) mask.count;
+                pImage->pAttributeList->add("MaskedPixels", "Masked gap and bad pixels",
+                        NDAttrInt32, &maskedPixels);
+            }
+
             // Put the frame number and time stamp into the buffer
             pImage->uniqueId = imageCounter;
             updateTimeStamps(pImage);
@@ -1897,7 +3038,7 @@ asynStatus eigerDetector::parseH5File (char *buf, size_t bufLen)
                         driverName, functionName);
 
                 doCallbacksGenericPointer(pImage, NDArrayData, 0);
-                if (nDims == 4) doCallbacksGenericPointer(pImage, NDArrayData, offset[1]+1);
+                if (frames.nDims == 4) doCallbacksGenericPointer(pImage, NDArrayData, j+1);
             }
 
             setIntegerParam(NDArrayCounter, ++imageCounter);
@@ -1908,14 +3049,8 @@ asynStatus eigerDetector::parseH5File (char *buf, size_t bufLen)
         }
     }
 
-closeMemSpace:
-    H5Sclose(mSpace);
-closeDataType:
-    H5Tclose(dType);
-closeDataset:
-    H5Dclose(dId);
-closeFile:
-    H5Fclose(fId);
+closeFrames:
+    h5CloseFrames(&frames);
 end:
     return status;
 }
@@ -1923,16 +3058,10 @@ end:
 /*
  * Makes lots of assumptions on the file layout
  */
-asynStatus eigerDetector::parseTiffFile (char *buf, size_t len)
+const char *tiffParseImage (const char *buf, size_t len, tiff_image_t *image)
 {
-    static int uniqueId = 1;
-    const char *functionName = "parseTiffFile";
-
     if(*(uint32_t*)buf != 0x0002A4949)
-    {
-        ERR("wrong tiff header");
-        return asynError;
-    }
+        return "wrong tiff header";
 
     uint32_t offset     = *((uint32_t*)(buf+4));
     uint16_t numEntries = *((uint16_t*)(buf+offset));
@@ -1947,41 +3076,57 @@ asynStatus eigerDetector::parseTiffFile (char *buf, size_t len)
 
     tag_t *tags = (tag_t*)(buf + offset + 2);
 
-    size_t width = 0, height = 0, depth = 0, dataLen = 0, stripOffset = 0;
+    size_t depth = 0, stripOffset = 0;
 
+    image->width = image->height = image->dataLen = 0;
     for(size_t i = 0; i < numEntries; ++i)
     {
         switch(tags[i].id)
         {
-        case 256: width       = tags[i].offset; break;
-        case 257: height      = tags[i].offset; break;
-        case 258: depth       = tags[i].offset; break;
-        case 273: stripOffset = tags[i].offset; break;
-        case 279: dataLen     = tags[i].offset; break;
+        case 256: image->width   = tags[i].offset; break;
+        case 257: image->height  = tags[i].offset; break;
+        case 258: depth          = tags[i].offset; break;
+        case 273: stripOffset    = tags[i].offset; break;
+        case 279: image->dataLen = tags[i].offset; break;
         }
     }
 
-    if(!width || !height || !depth || !dataLen)
-    {
-        ERR("missing tags");
-        return asynError;
-    }
+    if(!image->width || !image->height || !depth || !image->dataLen)
+        return "missing tags";
 
-    NDDataType_t dataType;
     switch(depth)
     {
 
-    case 8:  dataType = NDUInt8;    break;
-    case 16: dataType = NDUInt16;   break;
-    case 32: dataType = NDUInt32;   break;
+    case 8:  image->dataType = NDUInt8;    break;
+    case 16: image->dataType = NDUInt16;   break;
+    case 32: image->dataType = NDUInt32;   break;
     default:
-        ERR_ARGS("unexpected bit depth=%lu", depth);
+        return "unexpected bit depth";
+    }
+
+    if(!stripOffset) return "missing StripOffsets tag";
+    if(stripOffset + image->dataLen > len) return "pixel data out of range";
+    image->data = buf + stripOffset;
+
+    return NULL;
+}
+
+asynStatus eigerDetector::parseTiffFile (char *buf, size_t len)
+{
+    static int uniqueId = 1;
+    const char *functionName = "parseTiffFile";
+    const char *error;
+    tiff_image_t image;
+
+    if((error = tiffParseImage(buf, len, &image)))
+    {
+        ERR(error);
         return asynError;
     }
 
-    size_t dims[2] = {width, height};
+    size_t dims[2] = {image.width, image.height};
 
-    NDArray *pImage = pNDArrayPool->alloc(2, dims, dataType, 0, NULL);
+    NDArray *pImage = pNDArrayPool->alloc(2, dims, image.dataType, 0, NULL);
     if(!pImage)
     {
         ERR("couldn't allocate NDArray");
@@ -1991,9 +3136,7 @@ asynStatus eigerDetector::parseTiffFile (char *buf, size_t len)
     pImage->uniqueId = uniqueId++;
     updateTimeStamps(pImage);
 
-    if(!stripOffset) { ERR("missing StripOffsets tag"); return asynError; }
-    if(stripOffset + dataLen > len) { ERR("pixel data out of range"); return asynError; }
-    memcpy(pImage->pData, buf + stripOffset, dataLen);
+    memcpy(pImage->pData, image.data, image.dataLen);
     doCallbacksGenericPointer(pImage, NDArrayData, MONITOR_ASYN_ADDRESS);
     pImage->release();
 
@@ -2132,9 +3275,11 @@ asynStatus eigerDetector::drvUserCreate(asynUser *pasynUser, const char *drvInfo
 }
 
 extern "C" int eigerDetectorConfig(const char *portName, const char *serverPort,
-                                   int maxBuffers, size_t maxMemory, int priority, int stackSize)
+                                   int maxBuffers, size_t maxMemory, int priority, int stackSize,
+                                   int numControlSockets, int numBulkSockets)
 {
-    new eigerDetector(portName, serverPort, maxBuffers, maxMemory, priority, stackSize);
+    new eigerDetector(portName, serverPort, maxBuffers, maxMemory, priority, stackSize,
+                      numControlSockets, numBulkSockets);
     return asynSuccess;
 }
 
@@ -2145,16 +3290,20 @@ static const iocshArg eigerDetectorConfigArg2 = {"maxBuffers", iocshArgInt};
 static const iocshArg eigerDetectorConfigArg3 = {"maxMemory", iocshArgInt};
 static const iocshArg eigerDetectorConfigArg4 = {"priority", iocshArgInt};
 static const iocshArg eigerDetectorConfigArg5 = {"stackSize", iocshArgInt};
+static const iocshArg eigerDetectorConfigArg6 = {"numControlSockets", iocshArgInt};
+static const iocshArg eigerDetectorConfigArg7 = {"numBulkSockets", iocshArgInt};
 static const iocshArg * const eigerDetectorConfigArgs[] = {
     &eigerDetectorConfigArg0, &eigerDetectorConfigArg1, &eigerDetectorConfigArg2,
-    &eigerDetectorConfigArg3, &eigerDetectorConfigArg4, &eigerDetectorConfigArg5};
+    &eigerDetectorConfigArg3, &eigerDetectorConfigArg4, &eigerDetectorConfigArg5,
+    &eigerDetectorConfigArg6, &eigerDetectorConfigArg7};
 
-static const iocshFuncDef configeigerDetector = {"eigerDetectorConfig", 6, eigerDetectorConfigArgs};
+static const iocshFuncDef configeigerDetector = {"eigerDetectorConfig", 8, eigerDetectorConfigArgs};
 
 static void configeigerDetectorCallFunc(const iocshArgBuf *args)
 {
     eigerDetectorConfig(args[0].sval, args[1].sval, args[2].ival,
-                        args[3].ival, args[4].ival, args[5].ival);
+                        args[3].ival, args[4].ival, args[5].ival,
+                        args[6].ival, args[7].ival);
 }
 
 static void eigerDetectorRegister(void)
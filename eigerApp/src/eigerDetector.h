@@ -2,12 +2,16 @@
 #define EIGER_DETECTOR_H
 
 #include <atomic>
+#include <deque>
 #include <map>
 #include <vector>
 
+#include <hdf5.h>
+
 #include "restApi.h"
 #include "streamApi.h"
 #include "eigerParam.h"
+#include "latencyHistogram.h"
 
 typedef enum {
   Eiger1,
@@ -15,6 +19,19 @@ typedef enum {
   Pilatus4,
 } eigerModel_t;
 
+struct file;
+struct stream_worker;
+struct stream_job;
+
+// Stages of the stream path whose latency is measured
+typedef enum {
+  StreamLatParse,       // Received from the socket -> parsed
+  StreamLatDecode,      // Parsed -> decoded by a worker
+  StreamLatCallback,    // Decoded -> NDArray callbacks returned
+  StreamLatTotal,       // Received from the socket -> NDArray callbacks returned
+  StreamLatNumStages
+} streamLatStage_t;
+
 // areaDetector NDArray data source
 #define EigDataSourceStr           "DATA_SOURCE"
 
@@ -29,6 +46,14 @@ typedef enum {
 #define EigFWStateStr              "FW_STATE"
 #define EigFWImgNumStartStr        "FW_IMG_NUM_START"
 #define EigFWHD5FormatStr          "FWHDF5_FORMAT"
+#define EigFWChunkSizeStr          "FW_CHUNK_SIZE"
+#define EigFWDownloadParallelStr   "FW_DOWNLOAD_PARALLEL"
+#define EigFWDownloadRateStr       "FW_DOWNLOAD_RATE"
+#define EigFWDownloadWorkersStr    "FW_DOWNLOAD_WORKERS"
+#define EigFWMemBudgetStr          "FW_MEM_BUDGET"
+#define EigFWMemInFlightStr        "FW_MEM_IN_FLIGHT"
+#define EigFWMemHighWaterStr       "FW_MEM_HIGH_WATER"
+#define EigFWIncrementalParseStr   "FW_INCREMENTAL_PARSE"
 
 // Acquisition Metadata Parameters
 #define EigWavelengthStr           "WAVELENGTH"
@@ -83,6 +108,8 @@ typedef enum {
 #define EigHVResetStr              "HV_RESET"
 #define EigHVStateStr              "HV_STATE"
 #define EigSignedDataStr           "SIGNED_DATA"
+#define EigMaskFlaggedStr          "MASK_FLAGGED"
+#define EigMaskFillStr             "MASK_FILL"
 
 // File Saving Parameters
 #define EigSaveFilesStr            "SAVE_FILES"
@@ -103,6 +130,37 @@ typedef enum {
 #define EigStreamDecompressStr     "STREAM_DECOMPRESS"
 #define EigStreamVersionStr        "STREAM_VERSION"
 #define EigStreamAsTsSourceStr     "STREAM_AS_TIMESTAMP_SOURCE"
+#define EigStreamDecompThreadsStr  "STREAM_DECOMPRESS_THREADS"
+#define EigStreamZeroCopyStr       "STREAM_ZERO_COPY"
+#define EigStreamRingSizeStr       "STREAM_RING_SIZE"
+#define EigStreamRingUsedStr       "STREAM_RING_USED"
+#define EigStreamRingOverflowsStr  "STREAM_RING_OVERFLOWS"
+#define EigStreamBSKernelStr       "STREAM_BS_KERNEL"
+#define EigStreamBSKernelActiveStr "STREAM_BS_KERNEL_ACTIVE"
+#define EigStreamROIEnableStr      "STREAM_ROI_ENABLE"
+#define EigStreamROIMinXStr        "STREAM_ROI_MIN_X"
+#define EigStreamROIMinYStr        "STREAM_ROI_MIN_Y"
+#define EigStreamROISizeXStr       "STREAM_ROI_SIZE_X"
+#define EigStreamROISizeYStr       "STREAM_ROI_SIZE_Y"
+#define EigStreamBinStr            "STREAM_BIN"
+#define EigStreamMissingStr        "STREAM_MISSING"
+#define EigStreamFirstMissingStr   "STREAM_FIRST_MISSING"
+#define EigStreamDuplicatesStr     "STREAM_DUPLICATES"
+#define EigStreamReorderedStr      "STREAM_REORDERED"
+#define EigStreamFillGapsStr       "STREAM_FILL_GAPS"
+#define EigStreamLatParseP50Str    "STREAM_LAT_PARSE_P50"
+#define EigStreamLatParseP99Str    "STREAM_LAT_PARSE_P99"
+#define EigStreamLatParseMaxStr    "STREAM_LAT_PARSE_MAX"
+#define EigStreamLatDecodeP50Str   "STREAM_LAT_DECODE_P50"
+#define EigStreamLatDecodeP99Str   "STREAM_LAT_DECODE_P99"
+#define EigStreamLatDecodeMaxStr   "STREAM_LAT_DECODE_MAX"
+#define EigStreamLatCallbackP50Str "STREAM_LAT_CALLBACK_P50"
+#define EigStreamLatCallbackP99Str "STREAM_LAT_CALLBACK_P99"
+#define EigStreamLatCallbackMaxStr "STREAM_LAT_CALLBACK_MAX"
+#define EigStreamLatTotalP50Str    "STREAM_LAT_TOTAL_P50"
+#define EigStreamLatTotalP99Str    "STREAM_LAT_TOTAL_P99"
+#define EigStreamLatTotalMaxStr    "STREAM_LAT_TOTAL_MAX"
+#define EigStartupTimeStr          "STARTUP_TIME"
 
 // Epsilon Parameters (minimum amount of change allowed)
 #define EigWavelengthEpsilonStr    "WAVELENGTH_EPSILON"
@@ -113,7 +171,8 @@ class eigerDetector : public ADDriver
 {
 public:
     eigerDetector(const char *portName, const char *serverHostname,
-                  int maxBuffers, size_t maxMemory, int priority, int stackSize);
+                  int maxBuffers, size_t maxMemory, int priority, int stackSize,
+                  int numControlSockets, int numBulkSockets);
 
     // These are the methods that we override from ADDriver
     virtual asynStatus writeInt32  (asynUser *pasynUser, epicsInt32 value);
@@ -133,6 +192,7 @@ public:
     void reapTask     (void);
     void monitorTask  (void);
     void streamTask   (void);
+    void streamWorkerTask (struct stream_worker *worker);
     void restartTask();
     void initializeTask();
 
@@ -178,8 +238,38 @@ protected:
     EigerParam *mFileOwner;
     EigerParam *mFileOwnerGroup;
     EigerParam *mFilePerms;
+    EigerParam *mFWChunkSize;
+    EigerParam *mFWDownloadParallel;
+    EigerParam *mFWDownloadRate;
+    EigerParam *mFWDownloadWorkers;
+    EigerParam *mFWMemBudget;
+    EigerParam *mFWMemInFlight;
+    EigerParam *mFWMemHighWater;
+    EigerParam *mFWIncrementalParse;
     EigerParam *mMonitorTimeout;
     EigerParam *mStreamDecompress;
+    EigerParam *mStreamDecompThreads;
+    EigerParam *mStreamZeroCopy;
+    EigerParam *mStreamRingSize;
+    EigerParam *mStreamRingUsed;
+    EigerParam *mStreamRingOverflows;
+    EigerParam *mStreamBSKernel;
+    EigerParam *mStreamBSKernelActive;
+    EigerParam *mStreamROIEnable;
+    EigerParam *mStreamROIMinX;
+    EigerParam *mStreamROIMinY;
+    EigerParam *mStreamROISizeX;
+    EigerParam *mStreamROISizeY;
+    EigerParam *mStreamBin;
+    EigerParam *mStreamMissing;
+    EigerParam *mStreamFirstMissing;
+    EigerParam *mStreamDuplicates;
+    EigerParam *mStreamReordered;
+    EigerParam *mStreamFillGaps;
+    EigerParam *mStreamLatP50[StreamLatNumStages];
+    EigerParam *mStreamLatP99[StreamLatNumStages];
+    EigerParam *mStreamLatMax[StreamLatNumStages];
+    EigerParam *mStartupTime;
     EigerParam *mRestart;
     EigerParam *mInitialize;
     EigerParam *mHVResetTime;
@@ -187,6 +277,8 @@ protected:
     EigerParam *mWavelengthEpsilon;
     EigerParam *mEnergyEpsilon;
     EigerParam *mSignedData;
+    EigerParam *mMaskFlagged;
+    EigerParam *mMaskFill;
 
     // Eiger parameters: metadata
     EigerParam *mDescription;
@@ -264,18 +356,40 @@ private:
     RestAPI mApi;
     StreamAPI *mStreamAPI;
     Stream2API *mStream2API;
+    // Whether streamTask is using the stream objects, and whether DataSource
+    // or StreamVersion changed meanwhile. Protected by the driver lock.
+    bool mStreamBusy, mStreamChangePending;
+    StreamArrayPool *mStreamArrayPool;
     eigerModel_t mEigerModel;
     eigerAPIVersion_t mAPIVersion;
     epicsEvent mStartEvent, mStopEvent, mTriggerEvent, mStreamEvent, mStreamDoneEvent,
             mPollDoneEvent, mRestartEvent, mInitializeEvent;
     epicsMessageQueue mPollQueue, mDownloadQueue, mParseQueue, mSaveQueue,
-            mReapQueue;
+            mReapQueue, mStreamDoneQueue;
     std::atomic<bool> mPollStop;
     // Access to this variable is synchronized by mPollQueue and mPollDoneEvent
     bool mPollComplete;
     // Access to this variable is synchronized by mStreamEvent and mStreamDoneEvent
     bool mStreamComplete;
     unsigned int mFrameNumber;
+    // Download workers. Only started and stopped by pollTask.
+    size_t mNumDownloadWorkers;
+    // Files to be parsed, in the order they were queued for download
+    std::deque<struct file *> mParseOrder;
+    epicsMutex mParseOrderMutex;
+    // Memory taken by the files between pollTask and reapTask
+    size_t mMemInFlight, mMemHighWater;
+    epicsMutex mMemMutex;
+    epicsEvent mMemEvent;
+    // Stream decompression workers. Only accessed by streamTask.
+    std::vector<struct stream_worker *> mStreamWorkers;
+    std::vector<struct stream_job *> mFreeStreamJobs;
+    size_t mNumStreamWorkers, mNextStreamWorker;
+    // Recorded into by the stream workers, reset at the start of each acquisition
+    LatencyHistogram mStreamLat[StreamLatNumStages];
+    double mParamFetchTime;
+    std::string mParamCachePath;
+    bool mParamCacheLoaded;
     uid_t mFsUid, mFsGid;
     EigerParamSet mParams;
     int mFirstParam;
@@ -287,6 +401,48 @@ private:
     // File parsers
     asynStatus parseH5File   (char *buf, size_t len);
     asynStatus parseTiffFile (char *buf, size_t len);
+    // Parse a data file while it is still being downloaded
+    asynStatus parseH5FileIncremental (struct file *file);
+    // Publish the frames of an open data file. With a file being
+    // downloaded, each frame is waited for until it has been received.
+    asynStatus parseH5Frames (hid_t fId, struct file *file);
+    // Wait for more of a file being downloaded than seen bytes to have
+    // been received. False once the download is over and all was seen.
+    bool waitH5Progress (struct file *file, size_t *seen);
+    // Wait for the chunks of a dataset that hold a hyperslab to have been
+    // received, or for the whole file without chunkDims
+    asynStatus waitH5Chunks (struct file *file, hid_t dId, int nDims,
+            const hsize_t *chunkDims, const hsize_t *offset,
+            const hsize_t *count, size_t *seen);
+
+    // Create or delete the stream objects to match DataSource and
+    // StreamVersion. Called with the lock held while streamTask is idle.
+    void updateStreamAPI (void);
+    // Bulk connections FileWriter downloads may take at once, leaving one
+    // for the Monitor images
+    size_t fileWriterSockets (void);
+    // Start or stop download workers so that numWorkers are running
+    asynStatus startDownloadWorkers (size_t numWorkers);
+    // Hand a downloaded file on to saveTask and, in file order, to parseTask
+    void downloadDone (struct file *file, bool failed);
+    // Hand a file on to parseTask in file order, once it is downloaded or,
+    // parsed incrementally, as its download starts
+    void parseReady (struct file *file, bool failed);
+    int openSaveFile (struct file *file, uid_t *fsUid, uid_t *fsGid);
+    // Wait for bytes to fit in the FileWriter memory budget and take them,
+    // and give them back
+    void reserveMemory (size_t bytes);
+    void releaseMemory (size_t bytes);
+    void publishMemory (void);
+
+    // Spawn stream decompression workers as needed and link the first
+    // numWorkers of them in a callback ordering ring
+    asynStatus startStreamWorkers (size_t numWorkers);
+    struct stream_job *newStreamJob (void);
+    // Zero-filled NDArray like pArray, in place of a frame that was lost
+    NDArray *allocPlaceholder (NDArray *pArray);
+    // Put the stream latency percentiles into the parameters
+    void publishStreamLatency (void);
 
     // Read some detector status parameters
     asynStatus eigerStatus (void);
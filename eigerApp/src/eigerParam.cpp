@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
 #include <vector>
 #include <stdexcept>
 #include <algorithm>
@@ -8,6 +10,7 @@
 
 #include <frozen.h>
 #include <ADDriver.h>
+#include <epicsThread.h>
 #include <math.h>
 #include "eigerParam.h"
 
@@ -32,6 +35,8 @@
 #define MAX_MESSAGE_SIZE 512
 #define MAX_JSON_TOKENS 100
 
+#define METADATA_CACHE_HEADER "# eigerParam metadata 1"
+
 using std::string;
 using std::vector;
 using std::map;
@@ -309,7 +314,8 @@ EigerParam::EigerParam (EigerParamSet *set, string const & asynName,
 : mSet(set), mAsynName(asynName), mAsynType(asynType), mSubSystem(ss),
   mName(name), mRemote(!mName.empty()), mAsynIndex(-1),
   mType(EIGER_P_UNINIT), mAccessMode(), mMin(), mMax(), mEnumValues(),
-  mCriticalValues(), mEpsilon(0.0), mCustomEnum(false)
+  mCriticalValues(), mEpsilon(0.0), mCustomEnum(false), mPrefetched(false),
+  mPrefetchStatus(EXIT_SUCCESS), mPrefetchValue()
 {
     const char *functionName = "EigerParam";
 
@@ -432,6 +438,13 @@ int EigerParam::baseFetch (string & rawValue, int timeout)
     if(mAccessMode == EIGER_ACC_WO)
         return EXIT_SUCCESS;
 
+    if(mPrefetched)
+    {
+        mPrefetched = false;
+        rawValue = mPrefetchValue;
+        return mPrefetchStatus;
+    }
+
     string buffer;
     mSet->getApi()->get(mSubSystem, mName, buffer, timeout);
 
@@ -477,30 +490,33 @@ int EigerParam::baseFetch (string & rawValue, int timeout)
         else
             mEnumValues = parseArray(tokens, "allowed_values");
         mCriticalValues = parseArray(tokens, "critical_values");
-    }
 
-    if(mType == EIGER_P_INT || mType == EIGER_P_UINT || mType == EIGER_P_DOUBLE)
-    {
-        if(parseMinMax(tokens, "min", mMin))
+        if(mType == EIGER_P_INT || mType == EIGER_P_UINT || mType == EIGER_P_DOUBLE)
         {
-            const char *msg = "unable to parse min limit";
-            ERR_ARGS("[param=%s] %s\n[%s]", mName.c_str(), msg, buffer.c_str());
-            return EXIT_FAILURE;
-        }
+            if(parseMinMax(tokens, "min", mMin))
+            {
+                const char *msg = "unable to parse min limit";
+                ERR_ARGS("[param=%s] %s\n[%s]", mName.c_str(), msg, buffer.c_str());
+                mType = EIGER_P_UNINIT;     // Parsed again by the next fetch
+                return EXIT_FAILURE;
+            }
 
-        if(parseMinMax(tokens, "max", mMax))
+            if(parseMinMax(tokens, "max", mMax))
+            {
+                const char *msg = "unable to parse max limit";
+                ERR_ARGS("[param=%s] %s\n[%s]", mName.c_str(), msg, buffer.c_str());
+                mType = EIGER_P_UNINIT;     // Parsed again by the next fetch
+                return EXIT_FAILURE;
+            }
+        }
+        else if(mType == EIGER_P_ENUM)
         {
-            const char *msg = "unable to parse max limit";
-            ERR_ARGS("[param=%s] %s\n[%s]", mName.c_str(), msg, buffer.c_str());
-            return EXIT_FAILURE;
+            mMin.exists = true;
+            mMax.exists = true;
+            mMin.valInt = 0;
+            mMax.valInt = (int) (mEnumValues.size() - 1);
         }
-    }
-    else if(mType == EIGER_P_ENUM)
-    {
-        mMin.exists = true;
-        mMax.exists = true;
-        mMin.valInt = 0;
-        mMax.valInt = (int) (mEnumValues.size() - 1);
+        mSet->mMetadataFetched = true;
     }
 
     if(parseValue(tokens, rawValue))
@@ -514,6 +530,94 @@ int EigerParam::baseFetch (string & rawValue, int timeout)
     return EXIT_SUCCESS;
 }
 
+// Only the parameters that fetch() gets from the detector
+bool EigerParam::canPrefetch (void)
+{
+    return mRemote && mType != EIGER_P_COMMAND && mAccessMode != EIGER_ACC_WO &&
+           (mAsynType == asynParamInt32 || mAsynType == asynParamFloat64 ||
+            mAsynType == asynParamOctet);
+}
+
+// Does the round trip and parsing of baseFetch() without touching the asyn
+// parameter, so that it can run on any thread
+void EigerParam::prefetch (void)
+{
+    mPrefetchStatus = baseFetch(mPrefetchValue);
+    mPrefetched = true;
+}
+
+// Fields separated by tabs: subsystem, name, type, access mode, whether
+// there is a min and its value, the same for max, the number of allowed
+// values and the values, the number of critical values and the values
+void EigerParam::saveMetadata (FILE *fp)
+{
+    eiger_min_max_t *limits[2] = {&mMin, &mMax};
+
+    fprintf(fp, "%d\t%s\t%d\t%d", (int) mSubSystem, mName.c_str(), (int) mType,
+            (int) mAccessMode);
+    for(int i = 0; i < 2; ++i)
+    {
+        if(mType == EIGER_P_DOUBLE)
+            fprintf(fp, "\t%d\t%.17g", limits[i]->exists, limits[i]->valDouble);
+        else
+            fprintf(fp, "\t%d\t%d", limits[i]->exists, limits[i]->valInt);
+    }
+
+    // Custom enums are set by the driver
+    vector<string> const & enumValues = mCustomEnum ? vector<string>() : mEnumValues;
+    fprintf(fp, "\t%lu", (unsigned long) enumValues.size());
+    for(size_t i = 0; i < enumValues.size(); ++i)
+        fprintf(fp, "\t%s", enumValues[i].c_str());
+
+    fprintf(fp, "\t%lu", (unsigned long) mCriticalValues.size());
+    for(size_t i = 0; i < mCriticalValues.size(); ++i)
+        fprintf(fp, "\t%s", mCriticalValues[i].c_str());
+    fprintf(fp, "\n");
+}
+
+int EigerParam::loadMetadata (vector<string> const & fields)
+{
+    const char *functionName = "loadMetadata";
+
+    if(fields.size() < 10)
+        goto invalid;
+    {
+        int type = atoi(fields[2].c_str());
+        int accessMode = atoi(fields[3].c_str());
+        size_t numEnumValues = strtoul(fields[8].c_str(), NULL, 10);
+        if(type <= EIGER_P_UNINIT || type > EIGER_P_COMMAND ||
+           accessMode < EIGER_ACC_RO || accessMode > EIGER_ACC_WO ||
+           fields.size() < 10 + numEnumValues)
+            goto invalid;
+
+        size_t numCriticalValues = strtoul(fields[9 + numEnumValues].c_str(), NULL, 10);
+        if(fields.size() != 10 + numEnumValues + numCriticalValues)
+            goto invalid;
+
+        mType = (eiger_param_type_t) type;
+        mAccessMode = (eiger_access_mode_t) accessMode;
+
+        eiger_min_max_t *limits[2] = {&mMin, &mMax};
+        for(int i = 0; i < 2; ++i)
+        {
+            limits[i]->exists = atoi(fields[4 + 2*i].c_str()) != 0;
+            if(mType == EIGER_P_DOUBLE)
+                limits[i]->valDouble = atof(fields[5 + 2*i].c_str());
+            else
+                limits[i]->valInt = atoi(fields[5 + 2*i].c_str());
+        }
+
+        if(!mCustomEnum)
+            mEnumValues.assign(fields.begin() + 9, fields.begin() + 9 + numEnumValues);
+        mCriticalValues.assign(fields.begin() + 10 + numEnumValues, fields.end());
+        return EXIT_SUCCESS;
+    }
+
+invalid:
+    ERR_ARGS("[param=%s] invalid cached metadata", mAsynName.c_str());
+    return EXIT_FAILURE;
+}
+
 int EigerParam::fetch (bool & value, int timeout)
 {
     const char *functionName = "fetch<bool>";
@@ -944,9 +1048,16 @@ int EigerParam::put (const char * value, int timeout)
     return put(string(value), timeout);
 }
 
+static void prefetchTaskC (void *set)
+{
+    ((EigerParamSet *)set)->prefetchTask();
+}
+
 EigerParamSet::EigerParamSet (asynPortDriver *portDriver, RestAPI *api,
         asynUser *user)
-: mPortDriver(portDriver), mApi(api), mUser(user), mDetConfigMap(), mAsynMap()
+: mPortDriver(portDriver), mApi(api), mUser(user), mDetConfigMap(), mAsynMap(),
+  mPrefetchList(), mPrefetchNext(0), mPrefetchRunning(0), mPrefetchDone(),
+  mMetadataFetched(false)
 {}
 
 EigerParam *EigerParamSet::create(string const & asynName,
@@ -993,17 +1104,137 @@ asynUser *EigerParamSet::getUser (void)
     return mUser;
 }
 
+// The round trips are made by as many threads as there are control
+// connections, and the asyn parameters are then set from this thread
 int EigerParamSet::fetchAll (void)
 {
     int status = EXIT_SUCCESS;
 
     eiger_asyn_map_t::iterator it;
+    mPrefetchList.clear();
     for(it = mAsynMap.begin(); it != mAsynMap.end(); ++it)
+        if(it->second->canPrefetch())
+            mPrefetchList.push_back(it->second);
+
+    size_t numThreads = std::min(mApi->getNumSockets(LaneControl), mPrefetchList.size());
+    if(numThreads > 1)
+    {
+        mPrefetchNext = 0;
+        mPrefetchRunning = numThreads;
+        for(size_t i = 0; i < numThreads; ++i)
+        {
+            // Whatever is left is fetched by fetch() below
+            if(!epicsThreadCreate("eigerParamFetch", epicsThreadPriorityMedium,
+                    epicsThreadGetStackSize(epicsThreadStackSmall),
+                    prefetchTaskC, this) && --mPrefetchRunning == 0)
+                mPrefetchDone.signal();
+        }
+        mPrefetchDone.wait();
+    }
+
+    for(it = mAsynMap.begin(); it != mAsynMap.end(); ++it)
+    {
         status |= it->second->fetch();
+        it->second->mPrefetched = false;
+    }
 
     return status;
 }
 
+int EigerParamSet::loadMetadata (string const & path)
+{
+    FILE *fp = fopen(path.c_str(), "r");
+    if(!fp)
+        return EXIT_FAILURE;
+
+    char *line = NULL;
+    size_t lineSize = 0;
+    ssize_t len;
+    map<string, vector<string> > entries;
+
+    len = getline(&line, &lineSize, fp);
+    if(len < 0 || strncmp(line, METADATA_CACHE_HEADER "\n", len))
+    {
+        free(line);
+        fclose(fp);
+        return EXIT_FAILURE;
+    }
+
+    while((len = getline(&line, &lineSize, fp)) > 0)
+    {
+        if(line[len-1] == '\n')
+            line[--len] = '\0';
+
+        vector<string> fields;
+        std::istringstream stream(string(line, len));
+        string field;
+        while(std::getline(stream, field, '\t'))
+            fields.push_back(field);
+
+        if(fields.size() >= 2)
+            entries[fields[0] + "/" + fields[1]] = fields;
+    }
+    free(line);
+    fclose(fp);
+
+    // Parameters that are not in the file are found out when fetched
+    int status = EXIT_SUCCESS;
+    eiger_asyn_map_t::iterator it;
+    for(it = mAsynMap.begin(); it != mAsynMap.end(); ++it)
+    {
+        EigerParam *p = it->second;
+        if(!p->mRemote || p->mType != EIGER_P_UNINIT)
+            continue;
+
+        std::ostringstream key;
+        key << p->mSubSystem << "/" << p->mName;
+        map<string, vector<string> >::iterator entry(entries.find(key.str()));
+        if(entry != entries.end())
+            status |= p->loadMetadata(entry->second);
+    }
+
+    return status;
+}
+
+int EigerParamSet::saveMetadata (string const & path)
+{
+    // Written aside and renamed, so that a reader never sees half a file
+    string tmpPath = path + ".tmp";
+    FILE *fp = fopen(tmpPath.c_str(), "w");
+    if(!fp)
+        return EXIT_FAILURE;
+
+    mMetadataFetched = false;
+    fprintf(fp, "%s\n", METADATA_CACHE_HEADER);
+
+    eiger_asyn_map_t::iterator it;
+    for(it = mAsynMap.begin(); it != mAsynMap.end(); ++it)
+        if(it->second->mRemote && it->second->mType != EIGER_P_UNINIT)
+            it->second->saveMetadata(fp);
+
+    if(fclose(fp) || rename(tmpPath.c_str(), path.c_str()))
+    {
+        remove(tmpPath.c_str());
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
+
+bool EigerParamSet::metadataFetched (void)
+{
+    return mMetadataFetched;
+}
+
+void EigerParamSet::prefetchTask (void)
+{
+    size_t i;
+    while((i = mPrefetchNext++) < mPrefetchList.size())
+        mPrefetchList[i]->prefetch();
+
+    if(--mPrefetchRunning == 0)
+        mPrefetchDone.signal();
+}
+
 int EigerParamSet::fetchParams (vector<string> const & params)
 {
     int status = EXIT_SUCCESS;
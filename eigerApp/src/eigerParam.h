@@ -4,6 +4,8 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <atomic>
+#include <epicsEvent.h>
 #include <asynPortDriver.h>
 #include <frozen.h>
 
@@ -59,6 +61,12 @@ private:
     double mEpsilon;
     bool mCustomEnum;
 
+    // Raw value fetched ahead by EigerParamSet::fetchAll(), taken by the
+    // next baseFetch() instead of a round trip
+    bool mPrefetched;
+    int mPrefetchStatus;
+    std::string mPrefetchValue;
+
     std::vector<std::string> parseArray (struct json_token *tokens,
             std::string const & name = "");
     int parseType (struct json_token *tokens, eiger_param_type_t & type);
@@ -91,6 +99,16 @@ private:
     int baseFetch (std::string & rawValue, int timeout = DEFAULT_TIMEOUT);
     int basePut (std::string const & rawValue, int timeout = DEFAULT_TIMEOUT);
 
+    bool canPrefetch (void);
+    void prefetch (void);
+
+    // The type, access mode, limits and allowed and critical values, as one
+    // line of the metadata cache
+    void saveMetadata (FILE *fp);
+    int loadMetadata (std::vector<std::string> const & fields);
+
+    friend class EigerParamSet;
+
 public:
     EigerParam (EigerParamSet *set, std::string const & asynName,
             asynParamType asynType, sys_t ss = (sys_t) 0,
@@ -137,6 +155,18 @@ private:
     eiger_param_map_t mDetConfigMap;
     eiger_asyn_map_t mAsynMap;
 
+    // Parameters being fetched by the fetchAll() threads
+    std::vector<EigerParam*> mPrefetchList;
+    std::atomic<size_t> mPrefetchNext;
+    std::atomic<size_t> mPrefetchRunning;
+    epicsEvent mPrefetchDone;
+
+    // Set when the metadata of a parameter had to be fetched because the
+    // cache did not have it
+    std::atomic<bool> mMetadataFetched;
+
+    friend class EigerParam;
+
 public:
     EigerParamSet (asynPortDriver *portDriver, RestAPI *api, asynUser *user);
 
@@ -149,6 +179,16 @@ public:
     EigerParam *getByIndex (int index);
     asynUser *getUser (void);
     int fetchAll (void);
+    void prefetchTask (void);
+
+    // The metadata of the remote parameters only changes with the firmware,
+    // so it is kept in a file that spares parsing it again at each startup.
+    // loadMetadata() fails if the file does not exist or is not valid.
+    // metadataFetched() tells whether a parameter was missing from it since
+    // the last saveMetadata().
+    int loadMetadata (std::string const & path);
+    int saveMetadata (std::string const & path);
+    bool metadataFetched (void);
 
     int fetchParams (std::vector<std::string> const & params);
 };
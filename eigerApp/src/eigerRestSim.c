@@ -0,0 +1,917 @@
+// Answers the SIMPLON REST interface like a detector's DCU, so that the
+// driver's parameter, FileWriter and Monitor paths can be run and timed
+// without a detector. Point the driver at the host this runs on, with
+// host:port if the port is not 80.
+//
+// Usage: eigerRestSim [options]
+//
+//   -p port      Port to listen on (default 80)
+//   -a version   API version, 1.6.0 or 1.8.0 (default 1.8.0)
+//   -m model     Detector description (default "Dectris EIGER2 Si 4M")
+//   -x width     Detector width (default 2068)
+//   -y height    Detector height (default 2162)
+//   -l ms        Latency of each parameter request (default 0)
+//   -A ms        Arm latency (default 0)
+//   -I ms        Initialize latency (default 0)
+//   -s bytes     Size of each image in the data files (default width *
+//                height / 2, a typical compressed size)
+//   -M bytes     Size of the master file (default 1 MiB)
+//   -r MB/s      Rate at which files are sent, 0 for as fast as possible
+//                (default 0)
+//   -H file      Send this file as the master file of every series
+//   -D file      Send this file as every data file, e.g. a recorded one that
+//                the driver can parse
+//   -t scale     Scale of the time the internal triggers take, 0 to make the
+//                images available at once (default 1)
+//   -v 1|2       Initial stream format, Stream or Stream2 (default 2)
+//
+// Parameters hold the values they are given. Arm starts a series, each
+// internal trigger takes nimages * frame_time and the FileWriter makes each
+// data file available once its images have been taken. Without -H and -D the
+// files are filled with zeros, which is enough to measure downloads and
+// saving but not parsing. External trigger modes take no images.
+//
+// Data files are also served in parts to GETs with a "Range: bytes=a-b"
+// header, as the driver's parallel downloads request them. The -r rate
+// applies to each connection, like the limit of a single TCP stream.
+//
+// Every response with no file in it is sent with a single write, as the
+// driver reads it with a single recv. Each request and the bytes sent are
+// counted and printed at each disarm.
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "benchUtil.h"
+
+enum { MAX_REQUEST = 4096, MAX_RESPONSE = 512, MAX_VALUE = 128,
+       MAX_PATH = 256, CHUNK_BYTES = 1 << 20 };
+
+struct options {
+    int port;
+    const char* api;
+    const char* model;
+    long width, height;
+    double latency, arm_latency, init_latency;
+    size_t image_size, master_size;
+    double rate;
+    const char* master_file;
+    const char* data_file;
+    double time_scale;
+    int stream_version;
+};
+
+// A parameter of one of the config or status subsystems
+struct param {
+    const char* sys;
+    const char* name;
+    const char* type;
+    const char* access;
+    const char* allowed;
+    const char* min;
+    const char* max;
+    char value[MAX_VALUE];
+};
+
+static struct param params[] = {
+    {"detector/config", "description", "string", "r", NULL, NULL, NULL, ""},
+    {"detector/config", "software_version", "string", "r", NULL, NULL, NULL, "\"1.8.0\""},
+    {"detector/config", "eiger_fw_version", "string", "r", NULL, NULL, NULL, "\"release-2022.1.2\""},
+    {"detector/config", "detector_number", "string", "r", NULL, NULL, NULL, "\"E-32-0000\""},
+    {"detector/config", "x_pixels_in_detector", "uint", "r", NULL, NULL, NULL, ""},
+    {"detector/config", "y_pixels_in_detector", "uint", "r", NULL, NULL, NULL, ""},
+    {"detector/config", "x_pixel_size", "float", "r", NULL, NULL, NULL, "7.5e-05"},
+    {"detector/config", "y_pixel_size", "float", "r", NULL, NULL, NULL, "7.5e-05"},
+    {"detector/config", "sensor_material", "string", "r", NULL, NULL, NULL, "\"Si\""},
+    {"detector/config", "sensor_thickness", "float", "r", NULL, NULL, NULL, "0.00045"},
+    {"detector/config", "bit_depth_image", "uint", "r", NULL, NULL, NULL, "16"},
+    {"detector/config", "detector_readout_time", "float", "r", NULL, NULL, NULL, "1e-07"},
+    {"detector/config", "countrate_correction_count_cutoff", "uint", "r", NULL, NULL, NULL, "126634"},
+    {"detector/config", "count_time", "float", "rw", NULL, "3e-06", "3600", "0.5"},
+    {"detector/config", "frame_time", "float", "rw", NULL, "0.00025", "3600", "0.5"},
+    {"detector/config", "nimages", "uint", "rw", NULL, "1", "2000000000", "1"},
+    {"detector/config", "ntrigger", "uint", "rw", NULL, "1", "2000000000", "1"},
+    {"detector/config", "nexpi", "uint", "rw", NULL, "1", "1000", "1"},
+    {"detector/config", "trigger_mode", "string", "rw", "[\"exte\", \"extg\", \"exts\", \"inte\", \"ints\"]", NULL, NULL, "\"ints\""},
+    {"detector/config", "trigger_start_delay", "float", "rw", NULL, "0", "3600", "0"},
+    {"detector/config", "extg_mode", "string", "rw", "[\"double\", \"single\"]", NULL, NULL, "\"double\""},
+    {"detector/config", "compression", "string", "rw", "[\"lz4\", \"bslz4\"]", NULL, NULL, "\"bslz4\""},
+    {"detector/config", "roi_mode", "string", "rw", "[\"disabled\", \"4M\"]", NULL, NULL, "\"disabled\""},
+    {"detector/config", "counting_mode", "string", "rw", "[\"normal\", \"retrigger\"]", NULL, NULL, "\"retrigger\""},
+    {"detector/config", "auto_summation", "bool", "rw", NULL, NULL, NULL, "true"},
+    {"detector/config", "countrate_correction_applied", "bool", "rw", NULL, NULL, NULL, "true"},
+    {"detector/config", "flatfield_correction_applied", "bool", "rw", NULL, NULL, NULL, "true"},
+    {"detector/config", "pixel_mask_applied", "bool", "rw", NULL, NULL, NULL, "true"},
+    {"detector/config", "photon_energy", "float", "rw", NULL, "3000", "100000", "8041"},
+    {"detector/config", "wavelength", "float", "rw", NULL, "0.12", "4.1", "1.5419"},
+    {"detector/config", "threshold_energy", "float", "rw", NULL, "1500", "100000", "4020.5"},
+    {"detector/config", "threshold/1/mode", "string", "rw", "[\"enabled\", \"disabled\"]", NULL, NULL, "\"enabled\""},
+    {"detector/config", "threshold/2/energy", "float", "rw", NULL, "1500", "100000", "8041"},
+    {"detector/config", "threshold/2/mode", "string", "rw", "[\"enabled\", \"disabled\"]", NULL, NULL, "\"disabled\""},
+    {"detector/config", "threshold/3/energy", "float", "rw", NULL, "1500", "100000", "12000"},
+    {"detector/config", "threshold/3/mode", "string", "rw", "[\"enabled\", \"disabled\"]", NULL, NULL, "\"disabled\""},
+    {"detector/config", "threshold/4/energy", "float", "rw", NULL, "1500", "100000", "16000"},
+    {"detector/config", "threshold/4/mode", "string", "rw", "[\"enabled\", \"disabled\"]", NULL, NULL, "\"disabled\""},
+    {"detector/config", "threshold/difference/mode", "string", "rw", "[\"enabled\", \"disabled\"]", NULL, NULL, "\"disabled\""},
+    {"detector/config", "beam_center_x", "float", "rw", NULL, NULL, NULL, "1034"},
+    {"detector/config", "beam_center_y", "float", "rw", NULL, NULL, NULL, "1081"},
+    {"detector/config", "detector_distance", "float", "rw", NULL, NULL, NULL, "0.1"},
+    {"detector/config", "chi_start", "float", "rw", NULL, NULL, NULL, "0"},
+    {"detector/config", "chi_increment", "float", "rw", NULL, NULL, NULL, "0"},
+    {"detector/config", "kappa_start", "float", "rw", NULL, NULL, NULL, "0"},
+    {"detector/config", "kappa_increment", "float", "rw", NULL, NULL, NULL, "0"},
+    {"detector/config", "omega_start", "float", "rw", NULL, NULL, NULL, "0"},
+    {"detector/config", "omega_increment", "float", "rw", NULL, NULL, NULL, "0"},
+    {"detector/config", "phi_start", "float", "rw", NULL, NULL, NULL, "0"},
+    {"detector/config", "phi_increment", "float", "rw", NULL, NULL, NULL, "0"},
+    {"detector/config", "two_theta_start", "float", "rw", NULL, NULL, NULL, "0"},
+    {"detector/config", "two_theta_increment", "float", "rw", NULL, NULL, NULL, "0"},
+    {"detector/status", "state", "string", "r", NULL, NULL, NULL, "\"idle\""},
+    {"detector/status", "error", "list", "r", NULL, NULL, NULL, "[]"},
+    {"detector/status", "board_000/th0_temp", "float", "r", NULL, NULL, NULL, "31.5"},
+    {"detector/status", "board_000/th0_humidity", "float", "r", NULL, NULL, NULL, "4.2"},
+    {"detector/status", "high_voltage/state", "string", "r", NULL, NULL, NULL, "\"READY\""},
+    {"detector/status", "builder/dcu_buffer_free", "float", "r", NULL, NULL, NULL, "100"},
+    {"detector/status", "link_0", "string", "r", NULL, NULL, NULL, "\"up\""},
+    {"detector/status", "link_1", "string", "r", NULL, NULL, NULL, "\"up\""},
+    {"detector/status", "link_2", "string", "r", NULL, NULL, NULL, "\"up\""},
+    {"detector/status", "link_3", "string", "r", NULL, NULL, NULL, "\"up\""},
+    {"filewriter/config", "mode", "string", "rw", "[\"disabled\", \"enabled\"]", NULL, NULL, "\"enabled\""},
+    {"filewriter/config", "compression_enabled", "bool", "rw", NULL, NULL, NULL, "true"},
+    {"filewriter/config", "name_pattern", "string", "rw", NULL, NULL, NULL, "\"series_$id\""},
+    {"filewriter/config", "nimages_per_file", "uint", "rw", NULL, "0", "1000000", "1000"},
+    {"filewriter/config", "image_nr_start", "uint", "rw", NULL, "0", "1000000", "1"},
+    {"filewriter/config", "format", "string", "rw", "[\"legacy\", \"v2024.2\"]", NULL, NULL, "\"legacy\""},
+    {"filewriter/status", "state", "string", "r", NULL, NULL, NULL, "\"ready\""},
+    {"filewriter/status", "buffer_free", "uint", "r", NULL, NULL, NULL, "100000000000"},
+    {"monitor/config", "mode", "string", "rw", "[\"disabled\", \"enabled\"]", NULL, NULL, "\"enabled\""},
+    {"monitor/config", "buffer_size", "uint", "rw", NULL, "1", "1000", "1"},
+    {"monitor/status", "state", "string", "r", NULL, NULL, NULL, "\"normal\""},
+    {"stream/config", "mode", "string", "rw", "[\"disabled\", \"enabled\"]", NULL, NULL, "\"enabled\""},
+    {"stream/config", "format", "string", "rw", "[\"legacy\", \"cbor\"]", NULL, NULL, ""},
+    {"stream/config", "header_detail", "string", "rw", "[\"all\", \"basic\", \"none\"]", NULL, NULL, "\"basic\""},
+    {"stream/config", "header_appendix", "string", "rw", NULL, NULL, NULL, "\"\""},
+    {"stream/config", "image_appendix", "string", "rw", NULL, NULL, NULL, "\"\""},
+    {"stream/status", "state", "string", "r", NULL, NULL, NULL, "\"ready\""},
+    {"stream/status", "dropped", "uint", "r", NULL, NULL, NULL, "0"},
+};
+
+enum { NUM_PARAMS = sizeof(params) / sizeof(params[0]) };
+
+// State of the current series, protected by lock
+struct series {
+    int armed;
+    int sequence_id;
+    long images;       // Images taken by the triggers that have finished
+    long total;        // Images the series is meant to take
+    long per_file;
+    int triggering;
+    double trigger_start, trigger_images_time;
+    long trigger_images;
+    int stop;
+    long monitor_images;
+};
+
+struct stats {
+    long requests, params, commands, heads, files, deletes, monitors;
+    size_t bytes;
+};
+
+static struct options opt;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static struct series series;
+static struct stats stats;
+static uint8_t* master_buf;
+static uint8_t* data_buf;
+static size_t data_file_size;   // Size of the -D file
+
+static void sleep_for(double s) {
+    if (s <= 0)
+        return;
+    struct timespec ts;
+    ts.tv_sec = (time_t)s;
+    ts.tv_nsec = (long)((s - (double)ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) == -1 && errno == EINTR)
+        ;
+}
+
+static struct param* find_param(const char* sys, const char* name) {
+    for (int i = 0; i < NUM_PARAMS; i++)
+        if (strcmp(params[i].sys, sys) == 0 && strcmp(params[i].name, name) == 0)
+            return &params[i];
+    return NULL;
+}
+
+static void set_value(const char* sys, const char* name, const char* fmt, ...)
+    __attribute__((format(printf, 3, 4)));
+
+static void set_value(const char* sys, const char* name, const char* fmt, ...) {
+    struct param* p = find_param(sys, name);
+    va_list args;
+    va_start(args, fmt);
+    vsnprintf(p->value, sizeof(p->value), fmt, args);
+    va_end(args);
+}
+
+static double value_double(const char* sys, const char* name) {
+    return atof(find_param(sys, name)->value);
+}
+
+static int value_is(const char* sys, const char* name, const char* value) {
+    return strcmp(find_param(sys, name)->value, value) == 0;
+}
+
+// Images taken so far in the series, called with lock held
+static long images_taken(void) {
+    long images = series.images;
+    if (series.triggering) {
+        long n = series.trigger_images;
+        if (series.trigger_images_time > 0) {
+            double t = (bench_now() - series.trigger_start) / series.trigger_images_time;
+            if (t < n)
+                n = (long)t;
+        }
+        images += n;
+    }
+    return images;
+}
+
+// Writes all of buf, returns -1 if the connection was lost
+static int write_all(int fd, const void* buf, size_t len) {
+    const char* p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return -1;
+        p += n;
+        len -= (size_t)n;
+    }
+    return 0;
+}
+
+// Sends the whole response in a single write
+static int respond(int fd, int code, const char* reason, const char* type,
+                   const char* body) {
+    char buf[MAX_RESPONSE];
+    size_t body_len = body ? strlen(body) : 0;
+    int n = snprintf(buf, sizeof(buf),
+                     "HTTP/1.1 %d %s\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n\r\n%s",
+                     code, reason, type, body_len, body ? body : "");
+    if (n < 0 || (size_t)n >= sizeof(buf)) {
+        fprintf(stderr, "response too long for the driver: %s\n", body);
+        return -1;
+    }
+    return write_all(fd, buf, (size_t)n);
+}
+
+static int respond_json(int fd, const char* body) {
+    return respond(fd, 200, "OK", "application/json; charset=utf-8", body);
+}
+
+static int not_found(int fd) {
+    return respond(fd, 404, "Not Found", "text/html", NULL);
+}
+
+// Byte range of a GET, from its Range header
+struct range {
+    int set;
+    size_t first, last;
+};
+
+// Sends a file of size bytes from buf, repeating it if it is shorter, or
+// only the part of it in range
+static int send_file(int fd, const char* type, const uint8_t* buf,
+                     size_t buf_size, size_t size, int head,
+                     const struct range* range) {
+    char header[MAX_RESPONSE];
+    size_t first = 0;
+    int n;
+
+    if (range && range->set) {
+        if (range->first > range->last || range->first >= size)
+            return respond(fd, 416, "Range Not Satisfiable", "text/html", NULL);
+        size_t last = range->last < size ? range->last : size - 1;
+        n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 206 Partial Content\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Range: bytes %zu-%zu/%zu\r\n"
+                     "Content-Length: %zu\r\n\r\n",
+                     type, range->first, last, size, last - range->first + 1);
+        first = range->first;
+        size = last - range->first + 1;
+    } else {
+        n = snprintf(header, sizeof(header),
+                     "HTTP/1.1 200 OK\r\n"
+                     "Content-Type: %s\r\n"
+                     "Content-Length: %zu\r\n\r\n",
+                     type, size);
+    }
+    if (write_all(fd, header, (size_t)n))
+        return -1;
+    if (head)
+        return 0;
+
+    double start = bench_now();
+    size_t sent = 0;
+    while (sent < size) {
+        size_t chunk = size - sent;
+        size_t off = (first + sent) % buf_size;
+        if (chunk > buf_size - off)
+            chunk = buf_size - off;
+        if (chunk > CHUNK_BYTES)
+            chunk = CHUNK_BYTES;
+        if (write_all(fd, buf + off, chunk))
+            return -1;
+        sent += chunk;
+        if (opt.rate > 0)
+            sleep_for(start + (double)sent / (opt.rate * 1e6) - bench_now());
+    }
+
+    pthread_mutex_lock(&lock);
+    stats.bytes += size;
+    pthread_mutex_unlock(&lock);
+    return 0;
+}
+
+static int get_param(int fd, const char* sys, const char* name) {
+    char body[MAX_RESPONSE];
+    int n;
+
+    pthread_mutex_lock(&lock);
+    struct param* p = find_param(sys, name);
+    if (p == NULL) {
+        pthread_mutex_unlock(&lock);
+        return not_found(fd);
+    }
+    n = snprintf(body, sizeof(body), "{\"value\": %s, \"value_type\": \"%s\"",
+                 p->value, p->type);
+    if (strstr(sys, "config"))
+        n += snprintf(body + n, sizeof(body) - n, ", \"access_mode\": \"%s\"",
+                      p->access);
+    if (p->allowed)
+        n += snprintf(body + n, sizeof(body) - n, ", \"allowed_values\": %s",
+                      p->allowed);
+    if (p->min)
+        n += snprintf(body + n, sizeof(body) - n, ", \"min\": %s", p->min);
+    if (p->max)
+        n += snprintf(body + n, sizeof(body) - n, ", \"max\": %s", p->max);
+    snprintf(body + n, sizeof(body) - n, "}");
+    pthread_mutex_unlock(&lock);
+
+    return respond_json(fd, body);
+}
+
+// Takes the value out of {"value": <value>}
+static int parse_value(const char* body, char* value, size_t size) {
+    const char* p = strstr(body, "\"value\"");
+    if (p == NULL)
+        return -1;
+    p = strchr(p + 7, ':');
+    if (p == NULL)
+        return -1;
+    ++p;
+    while (*p == ' ')
+        ++p;
+    const char* end = strrchr(p, '}');
+    if (end == NULL)
+        return -1;
+    while (end > p && end[-1] == ' ')
+        --end;
+    if ((size_t)(end - p) >= size)
+        return -1;
+    memcpy(value, p, (size_t)(end - p));
+    value[end - p] = '\0';
+    return 0;
+}
+
+static int put_param(int fd, const char* sys, const char* name, const char* body) {
+    char value[MAX_VALUE], reply[MAX_RESPONSE];
+
+    if (parse_value(body, value, sizeof(value)))
+        return respond(fd, 400, "Bad Request", "text/html", NULL);
+
+    pthread_mutex_lock(&lock);
+    struct param* p = find_param(sys, name);
+    if (p == NULL || strcmp(p->access, "rw")) {
+        pthread_mutex_unlock(&lock);
+        return p ? respond(fd, 400, "Bad Request", "text/html", NULL)
+                 : not_found(fd);
+    }
+    snprintf(p->value, sizeof(p->value), "%s", value);
+
+    // The detector replies with the parameters that changed, which the
+    // driver fetches again
+    if (strcmp(sys, "detector/config") == 0 &&
+        (strcmp(name, "photon_energy") == 0 || strcmp(name, "wavelength") == 0)) {
+        double e = strcmp(name, "wavelength") == 0
+                       ? 12398.42 / atof(value) : atof(value);
+        set_value(sys, "photon_energy", "%g", e);
+        set_value(sys, "wavelength", "%g", 12398.42 / e);
+        set_value(sys, "threshold_energy", "%g", e / 2);
+        snprintf(reply, sizeof(reply),
+                 "[\"photon_energy\", \"threshold_energy\", \"wavelength\"]");
+    } else if (strcmp(sys, "detector/config") == 0 && strcmp(name, "count_time") == 0 &&
+               value_double(sys, "frame_time") < atof(value)) {
+        set_value(sys, "frame_time", "%s", value);
+        snprintf(reply, sizeof(reply), "[\"count_time\", \"frame_time\"]");
+    } else
+        snprintf(reply, sizeof(reply), "[\"%s\"]", name);
+    pthread_mutex_unlock(&lock);
+
+    return respond_json(fd, reply);
+}
+
+static int arm(int fd) {
+    char reply[64];
+
+    sleep_for(opt.arm_latency);
+
+    pthread_mutex_lock(&lock);
+    ++series.sequence_id;
+    series.armed = 1;
+    series.images = 0;
+    series.monitor_images = 0;
+    series.stop = 0;
+    series.total = (long)value_double("detector/config", "nimages") *
+                   (long)value_double("detector/config", "ntrigger");
+    series.per_file = (long)value_double("filewriter/config", "nimages_per_file");
+    if (series.per_file <= 0)
+        series.per_file = series.total;
+    set_value("detector/status", "state", "\"ready\"");
+    snprintf(reply, sizeof(reply), "{\"sequence id\": %d}", series.sequence_id);
+    pthread_mutex_unlock(&lock);
+
+    return respond_json(fd, reply);
+}
+
+static int trigger(int fd, const char* body) {
+    char value[MAX_VALUE] = "";
+    double exposure = 0;
+    long images;
+    double time;
+
+    if (body[0] && parse_value(body, value, sizeof(value)) == 0)
+        exposure = atof(value);
+
+    pthread_mutex_lock(&lock);
+    if (!series.armed) {
+        pthread_mutex_unlock(&lock);
+        return respond(fd, 400, "Bad Request", "text/html", NULL);
+    }
+    if (exposure > 0) {
+        // inte: one image per trigger
+        images = 1;
+        time = exposure;
+    } else {
+        images = (long)value_double("detector/config", "nimages");
+        time = images * value_double("detector/config", "frame_time");
+    }
+    series.triggering = 1;
+    series.trigger_start = bench_now();
+    series.trigger_images = images;
+    series.trigger_images_time = opt.time_scale * time / images;
+    set_value("detector/status", "state", "\"acquire\"");
+    set_value("filewriter/status", "state", "\"acquire\"");
+    pthread_mutex_unlock(&lock);
+
+    // Return early when the series is stopped
+    double end = bench_now() + opt.time_scale * time;
+    for (;;) {
+        double left = end - bench_now();
+        pthread_mutex_lock(&lock);
+        int stop = series.stop;
+        pthread_mutex_unlock(&lock);
+        if (left <= 0 || stop)
+            break;
+        sleep_for(left < 0.01 ? left : 0.01);
+    }
+
+    pthread_mutex_lock(&lock);
+    series.images = images_taken();
+    series.triggering = 0;
+    set_value("detector/status", "state", "\"ready\"");
+    set_value("filewriter/status", "state", "\"ready\"");
+    pthread_mutex_unlock(&lock);
+
+    return respond_json(fd, NULL);
+}
+
+static void print_stats(void) {
+    printf("series %d: %ld images, %ld requests (%ld parameters, %ld commands, "
+           "%ld HEAD, %ld files, %ld DELETE, %ld monitor), %.1f MB of files\n",
+           series.sequence_id, series.images, stats.requests, stats.params,
+           stats.commands, stats.heads, stats.files, stats.deletes,
+           stats.monitors, 1e-6 * (double)stats.bytes);
+    fflush(stdout);
+    memset(&stats, 0, sizeof(stats));
+}
+
+static int command(int fd, const char* sys, const char* name, const char* body) {
+    if (strcmp(sys, "detector/command") == 0) {
+        if (strcmp(name, "arm") == 0)
+            return arm(fd);
+        if (strcmp(name, "trigger") == 0)
+            return trigger(fd, body);
+        if (strcmp(name, "initialize") == 0) {
+            sleep_for(opt.init_latency);
+            pthread_mutex_lock(&lock);
+            set_value("detector/status", "state", "\"idle\"");
+            pthread_mutex_unlock(&lock);
+            return respond_json(fd, NULL);
+        }
+        if (strcmp(name, "disarm") == 0 || strcmp(name, "cancel") == 0 ||
+            strcmp(name, "abort") == 0) {
+            pthread_mutex_lock(&lock);
+            series.stop = 1;
+            if (strcmp(name, "cancel")) {
+                series.armed = 0;
+                set_value("detector/status", "state", "\"idle\"");
+            }
+            if (strcmp(name, "disarm") == 0)
+                print_stats();
+            pthread_mutex_unlock(&lock);
+            return respond_json(fd, NULL);
+        }
+        if (strcmp(name, "wait") == 0 || strcmp(name, "status_update") == 0 ||
+            strcmp(name, "hv_reset") == 0)
+            return respond_json(fd, NULL);
+    } else if (strcmp(sys, "filewriter/command") == 0 && strcmp(name, "clear") == 0)
+        return respond_json(fd, NULL);
+    else if (strcmp(sys, "system/command") == 0 && strcmp(name, "restart") == 0)
+        return respond_json(fd, NULL);
+    return not_found(fd);
+}
+
+// Answers HEAD and GET of the series' files as they become available
+static int data(int fd, const char* name, int head, const struct range* range) {
+    const char* suffix;
+    int master = 0;
+    long n = 0;
+
+    if ((suffix = strstr(name, "_master.h5")) && suffix[10] == '\0')
+        master = 1;
+    else if (!((suffix = strstr(name, "_data_")) &&
+               sscanf(suffix, "_data_%6ld.h5", &n) == 1 && n > 0))
+        return not_found(fd);
+
+    pthread_mutex_lock(&lock);
+    int available = value_is("filewriter/config", "mode", "\"enabled\"") &&
+                    series.sequence_id > 0;
+    size_t size = master ? opt.master_size : data_file_size;
+    if (available && !master) {
+        long first = (n - 1) * series.per_file;
+        long last = first + series.per_file;
+        if (last > series.total)
+            last = series.total;
+        available = first < series.total && images_taken() >= last;
+        if (!opt.data_file)
+            size = (size_t)(last - first) * opt.image_size;
+    }
+    pthread_mutex_unlock(&lock);
+
+    if (!available)
+        return not_found(fd);
+    if (master)
+        return send_file(fd, "application/hdf5", master_buf, opt.master_size,
+                         size, head, range);
+    return send_file(fd, "application/hdf5", data_buf,
+                     opt.data_file ? data_file_size : CHUNK_BYTES, size, head,
+                     range);
+}
+
+// A little-endian uint32 TIFF of the whole detector, like the Monitor's
+static int monitor_image(int fd, long timeout_ms) {
+    double end = bench_now() + 1e-3 * (double)timeout_ms;
+    for (;;) {
+        pthread_mutex_lock(&lock);
+        long images = images_taken();
+        int enabled = value_is("monitor/config", "mode", "\"enabled\"");
+        int fresh = enabled && images > series.monitor_images;
+        if (fresh)
+            series.monitor_images = images;
+        pthread_mutex_unlock(&lock);
+        if (fresh)
+            break;
+        if (bench_now() >= end)
+            return not_found(fd);
+        sleep_for(0.01);
+    }
+
+    enum { NUM_TAGS = 8, IFD_OFFSET = 8, DATA_OFFSET = IFD_OFFSET + 2 + NUM_TAGS * 12 + 4 };
+    size_t data_len = (size_t)opt.width * (size_t)opt.height * 4;
+    size_t size = DATA_OFFSET + data_len;
+    uint8_t* buf = calloc(1, size);
+    if (buf == NULL)
+        return not_found(fd);
+
+    const uint32_t tags[NUM_TAGS][4] = {
+        {256, 4, 1, (uint32_t)opt.width},   // ImageWidth
+        {257, 4, 1, (uint32_t)opt.height},  // ImageLength
+        {258, 3, 1, 32},                    // BitsPerSample
+        {259, 3, 1, 1},                     // Compression: none
+        {262, 3, 1, 1},                     // PhotometricInterpretation
+        {273, 4, 1, DATA_OFFSET},           // StripOffsets
+        {278, 4, 1, (uint32_t)opt.height},  // RowsPerStrip
+        {279, 4, 1, (uint32_t)data_len},    // StripByteCounts
+    };
+    memcpy(buf, "II*\0", 4);
+    uint32_t ifd = IFD_OFFSET;
+    memcpy(buf + 4, &ifd, 4);
+    uint16_t count = NUM_TAGS;
+    memcpy(buf + IFD_OFFSET, &count, 2);
+    for (int i = 0; i < NUM_TAGS; i++) {
+        uint8_t* t = buf + IFD_OFFSET + 2 + i * 12;
+        uint16_t id = (uint16_t)tags[i][0], type = (uint16_t)tags[i][1];
+        memcpy(t, &id, 2);
+        memcpy(t + 2, &type, 2);
+        memcpy(t + 4, &tags[i][2], 4);
+        memcpy(t + 8, &tags[i][3], 4);
+    }
+    uint32_t* pixels = (uint32_t*)(buf + DATA_OFFSET);
+    for (size_t i = 0; i < data_len / 4; i++)
+        pixels[i] = (uint32_t)(i % 7 == 0);
+
+    int r = send_file(fd, "application/tiff", buf, size, size, 0, NULL);
+    free(buf);
+    return r;
+}
+
+// Routes a request. Returns -1 to close the connection.
+static int handle(int fd, const char* method, const char* path, const char* body,
+                  const struct range* range) {
+    char sys[MAX_PATH], name[MAX_PATH], api[32], module[32], kind[32];
+    int get = strcmp(method, "GET") == 0, put = strcmp(method, "PUT") == 0;
+    int head = strcmp(method, "HEAD") == 0;
+
+    pthread_mutex_lock(&lock);
+    ++stats.requests;
+    pthread_mutex_unlock(&lock);
+
+    if (strncmp(path, "/data/", 6) == 0) {
+        pthread_mutex_lock(&lock);
+        if (head)
+            ++stats.heads;
+        else if (get)
+            ++stats.files;
+        else
+            ++stats.deletes;
+        pthread_mutex_unlock(&lock);
+
+        if (strcmp(method, "DELETE") == 0)
+            return respond(fd, 204, "No Content", "text/html", NULL);
+        if (get || head)
+            return data(fd, path + 6, head, range);
+        return not_found(fd);
+    }
+
+    if (strcmp(path, "/detector/api/version") == 0 ||
+        strcmp(path, "/detector/api/version/") == 0) {
+        char reply[64];
+        snprintf(reply, sizeof(reply),
+                 "{\"value\": \"%s\", \"value_type\": \"string\"}", opt.api);
+        return respond_json(fd, reply);
+    }
+
+    // /<module>/api/<version>/<kind>/<name>
+    int n = 0;
+    if (sscanf(path, "/%31[^/]/api/%31[^/]/%31[^/]/%n", module, api, kind, &n) != 3 ||
+        n == 0 || strcmp(api, opt.api))
+        return not_found(fd);
+    snprintf(name, sizeof(name), "%s", path + n);
+    snprintf(sys, sizeof(sys), "%s/%s", module, kind);
+
+    if (strcmp(kind, "images") == 0 && strcmp(module, "monitor") == 0 && get) {
+        long timeout = 500;
+        const char* t = strstr(name, "timeout=");
+        if (t)
+            timeout = atol(t + 8);
+        pthread_mutex_lock(&lock);
+        ++stats.monitors;
+        pthread_mutex_unlock(&lock);
+        return monitor_image(fd, timeout);
+    }
+
+    if (strcmp(kind, "command") == 0 && put) {
+        pthread_mutex_lock(&lock);
+        ++stats.commands;
+        pthread_mutex_unlock(&lock);
+        return command(fd, sys, name, body);
+    }
+
+    if (strcmp(kind, "config") == 0 || strcmp(kind, "status") == 0) {
+        pthread_mutex_lock(&lock);
+        ++stats.params;
+        pthread_mutex_unlock(&lock);
+        sleep_for(opt.latency);
+        if (get)
+            return get_param(fd, sys, name);
+        if (put)
+            return put_param(fd, sys, name, body);
+    }
+    return not_found(fd);
+}
+
+// Serves the requests of one connection until it is closed
+static void* connection(void* arg) {
+    int fd = (int)(intptr_t)arg;
+    char buf[MAX_REQUEST + 1];
+    size_t len = 0;
+
+    for (;;) {
+        char* end = NULL;
+        while ((buf[len] = '\0', end = strstr(buf, "\r\n\r\n")) == NULL) {
+            if (len == MAX_REQUEST)
+                goto done;
+            ssize_t n = recv(fd, buf + len, MAX_REQUEST - len, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                goto done;
+            len += (size_t)n;
+        }
+
+        char method[16], path[MAX_PATH];
+        if (sscanf(buf, "%15s %255s", method, path) != 2)
+            break;
+
+        size_t content_length = 0;
+        struct range range = {0, 0, 0};
+        for (char* line = strstr(buf, "\r\n"); line && line < end;
+             line = strstr(line + 2, "\r\n")) {
+            if (strncasecmp(line + 2, "Content-Length:", 15) == 0)
+                content_length = (size_t)strtoul(line + 17, NULL, 10);
+            else if (strncasecmp(line + 2, "Range:", 6) == 0 &&
+                     sscanf(line + 8, " bytes=%zu-%zu", &range.first, &range.last) == 2)
+                range.set = 1;
+        }
+
+        size_t header_len = (size_t)(end - buf) + 4;
+        if (header_len + content_length > MAX_REQUEST)
+            break;
+        while (len < header_len + content_length) {
+            ssize_t n = recv(fd, buf + len, MAX_REQUEST - len, 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                goto done;
+            len += (size_t)n;
+        }
+
+        char body[MAX_REQUEST + 1];
+        memcpy(body, buf + header_len, content_length);
+        body[content_length] = '\0';
+
+        if (handle(fd, method, path, body, &range))
+            break;
+
+        // Keep what was received of the next request
+        len -= header_len + content_length;
+        memmove(buf, buf + header_len + content_length, len);
+    }
+done:
+    close(fd);
+    return NULL;
+}
+
+static int read_file(const char* path, uint8_t** buf, size_t* size) {
+    FILE* f = fopen(path, "rb");
+    struct stat st;
+    if (f == NULL || fstat(fileno(f), &st) || st.st_size == 0) {
+        fprintf(stderr, "can't read %s\n", path);
+        if (f)
+            fclose(f);
+        return -1;
+    }
+    *size = (size_t)st.st_size;
+    *buf = malloc(*size);
+    int err = *buf == NULL || fread(*buf, 1, *size, f) != *size;
+    fclose(f);
+    if (err)
+        fprintf(stderr, "can't read %s\n", path);
+    return err ? -1 : 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: eigerRestSim [-p port] [-a 1.6.0|1.8.0] [-m model] [-x width] "
+            "[-y height]\n"
+            "                    [-l ms] [-A ms] [-I ms] [-s bytes] [-M bytes] "
+            "[-r MB/s]\n"
+            "                    [-H master file] [-D data file] [-t scale] "
+            "[-v 1|2]\n");
+}
+
+int main(int argc, char** argv) {
+    int c;
+
+    opt.port = 80;
+    opt.api = "1.8.0";
+    opt.model = "Dectris EIGER2 Si 4M";
+    opt.width = 2068;
+    opt.height = 2162;
+    opt.master_size = 1 << 20;
+    opt.time_scale = 1;
+    opt.stream_version = 2;
+
+    while ((c = getopt(argc, argv, "p:a:m:x:y:l:A:I:s:M:r:H:D:t:v:h")) != -1) {
+        switch (c) {
+            case 'p': opt.port = atoi(optarg); break;
+            case 'a': opt.api = optarg; break;
+            case 'm': opt.model = optarg; break;
+            case 'x': opt.width = atol(optarg); break;
+            case 'y': opt.height = atol(optarg); break;
+            case 'l': opt.latency = 1e-3 * atof(optarg); break;
+            case 'A': opt.arm_latency = 1e-3 * atof(optarg); break;
+            case 'I': opt.init_latency = 1e-3 * atof(optarg); break;
+            case 's': opt.image_size = (size_t)atol(optarg); break;
+            case 'M': opt.master_size = (size_t)atol(optarg); break;
+            case 'r': opt.rate = atof(optarg); break;
+            case 'H': opt.master_file = optarg; break;
+            case 'D': opt.data_file = optarg; break;
+            case 't': opt.time_scale = atof(optarg); break;
+            case 'v': opt.stream_version = atoi(optarg); break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if ((strcmp(opt.api, "1.6.0") && strcmp(opt.api, "1.8.0")) ||
+        opt.width <= 0 || opt.height <= 0 || opt.master_size == 0 ||
+        opt.time_scale < 0 || (opt.stream_version != 1 && opt.stream_version != 2)) {
+        usage();
+        return 1;
+    }
+    if (opt.image_size == 0)
+        opt.image_size = (size_t)(opt.width * opt.height / 2);
+
+    set_value("detector/config", "description", "\"%s\"", opt.model);
+    set_value("detector/config", "software_version", "\"%s\"", opt.api);
+    set_value("detector/config", "x_pixels_in_detector", "%ld", opt.width);
+    set_value("detector/config", "y_pixels_in_detector", "%ld", opt.height);
+    set_value("stream/config", "format", "\"%s\"",
+              opt.stream_version == 2 ? "cbor" : "legacy");
+
+    if (opt.master_file) {
+        if (read_file(opt.master_file, &master_buf, &opt.master_size))
+            return 1;
+    } else if ((master_buf = calloc(1, opt.master_size)) == NULL)
+        return 1;
+    if (opt.data_file) {
+        if (read_file(opt.data_file, &data_buf, &data_file_size))
+            return 1;
+    } else if ((data_buf = calloc(1, CHUNK_BYTES)) == NULL)
+        return 1;
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int on = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons((uint16_t)opt.port);
+    if (bind(server, (struct sockaddr*)&addr, sizeof(addr)) || listen(server, 64)) {
+        fprintf(stderr, "can't listen on port %d: %s\n", opt.port, strerror(errno));
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    printf("SIMPLON %s on port %d\n", opt.api, opt.port);
+    fflush(stdout);
+
+    for (;;) {
+        int fd = accept(server, NULL, NULL);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            fprintf(stderr, "accept: %s\n", strerror(errno));
+            return 1;
+        }
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        pthread_t thread;
+        pthread_attr_t attr;
+        pthread_attr_init(&attr);
+        pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+        if (pthread_create(&thread, &attr, connection, (void*)(intptr_t)fd))
+            close(fd);
+        pthread_attr_destroy(&attr);
+    }
+}
@@ -0,0 +1,91 @@
+#!/bin/sh
+# Finds the highest frame rate the driver's stream path sustains without
+# dropping frames, using eigerStreamSim as the detector's stream interface.
+#
+# Usage: eigerStreamBench.sh [-n frames] [-r "rates ..."] prefix [sim options]
+#
+#   prefix     Record prefix of the driver, e.g. 13EIG1:cam1:
+#   -n frames  Frames per rate (default 2000)
+#   -r rates   Frame rates to try in order, 0 for as fast as the simulator
+#              can send (default "100 200 500 1000 2000 5000 10000 0")
+#
+# The remaining options are passed to eigerStreamSim (bit depth, size,
+# compression, thresholds, stream version). The driver must have been
+# started with this host as its hostname, DataSource=Stream and the
+# StreamVersion that matches the simulator, and its REST interface must be
+# answered so that Acquire arms and runs, e.g. by eigerRestSim -t 0.
+#
+# Each rate is run with the simulator in drop mode, so a driver that does
+# not keep up loses frames as it would with a detector. A rate passes if
+# the simulator dropped nothing, the driver saw no missing frames and every
+# frame reached the plugins.
+
+SIM=${EIGER_STREAM_SIM:-$(dirname "$0")/O.${EPICS_HOST_ARCH:-linux-x86_64}/eigerStreamSim}
+FRAMES=2000
+RATES="100 200 500 1000 2000 5000 10000 0"
+
+while getopts n:r: opt; do
+    case $opt in
+        n) FRAMES=$OPTARG ;;
+        r) RATES=$OPTARG ;;
+        *) sed -n '4,10p' "$0"; exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+if [ $# -lt 1 ]; then
+    sed -n '4,10p' "$0"
+    exit 1
+fi
+P=$1
+shift
+
+THRESHOLDS=1
+for arg in "$@"; do
+    case $prev in -t) THRESHOLDS=$arg ;; esac
+    prev=$arg
+done
+
+LOG=$(mktemp)
+trap 'rm -f "$LOG"' EXIT
+
+best=""
+caput -t "${P}NumImages" "$FRAMES" > /dev/null
+caput -t "${P}NumTriggers" 1 > /dev/null
+
+printf "%8s %10s %10s %10s %8s %8s %8s\n" \
+       "rate" "frames/s" "MB/s" "sent MB/s" "dropped" "missing" "arrays"
+for rate in $RATES; do
+    before=$(caget -t "${P}ArrayCounter_RBV")
+
+    "$SIM" -d -n "$FRAMES" -r "$rate" -w 2 "$@" > "$LOG" &
+    sim=$!
+    # Acquire completes once the driver has seen the end of the series
+    caput -c -w 600 -t "${P}Acquire" 1 > /dev/null
+    wait $sim
+
+    after=$(caget -t "${P}ArrayCounter_RBV")
+    missing=$(caget -t "${P}StreamMissing_RBV")
+    arrays=$((after - before))
+
+    # series 1: <sent> sent, <dropped> dropped, <s> s, <fps> frames/s,
+    # <MB/s> MB/s uncompressed, <MB/s> MB/s sent
+    read -r dropped fps mbs sent <<END
+$(tail -1 "$LOG" | tr -d , | awk '{ print $5, $9, $11, $14 }')
+END
+
+    printf "%8s %10s %10s %10s %8s %8s %8s\n" \
+           "$rate" "$fps" "$mbs" "$sent" "$dropped" "$missing" "$arrays"
+
+    if [ "$dropped" != 0 ] || [ "$missing" != 0 ] ||
+       [ "$arrays" -ne $((FRAMES * THRESHOLDS)) ]; then
+        break
+    fi
+    best="$fps frames/s, $mbs MB/s uncompressed, $sent MB/s received"
+done
+
+if [ -n "$best" ]; then
+    echo "Sustained without drops: $best"
+else
+    echo "Dropped frames at every rate"
+    exit 1
+fi
@@ -0,0 +1,521 @@
+// Serves Stream2 (CBOR) or Stream (JSON and blob) series on a ZMQ PUSH
+// socket, like the detector, so that the driver's stream path can be
+// benchmarked without a detector. Point the driver at the host this runs on.
+//
+// Usage: eigerStreamSim [options] [message file ...]
+//
+//   -v 1|2       Stream version (default 2)
+//   -p port      Port to bind (default 31001 for Stream2, 9999 for Stream)
+//   -n frames    Frames per series (default 1000)
+//   -s series    Number of series (default 1)
+//   -w seconds   Pause before each series (default 1)
+//   -r rate      Frames per second, 0 for as fast as possible (default 0)
+//   -x width     Frame width (default 1028)
+//   -y height    Frame height (default 1062)
+//   -b bits      Bit depth 8, 16 or 32 (default 16)
+//   -c codec     none, lz4 or bslz4 (default bslz4)
+//   -t count     Thresholds per frame, Stream2 only (default 1)
+//   -d           Drop frames when the driver does not keep up, as the
+//                detector does, instead of waiting for it
+//
+// The frames hold photon counts with a low mean and gaps of flagged pixels
+// between modules. With message files, each file is sent as it is as one
+// ZMQ message, in order, at the frame rate: a recorded series is replayed by
+// giving its messages, e.g. written out with zmq_msg_data()/zmq_msg_size(),
+// in the order they were received.
+//
+// At the end of each series the number of frames sent and dropped, the
+// frame rate and the throughput are printed.
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <zmq.h>
+
+#include "benchUtil.h"
+#include "cbor.h"
+#include "stream2.h"
+
+enum { NUM_FRAMES = 8 };
+
+enum codec { CODEC_NONE, CODEC_LZ4, CODEC_BSLZ4 };
+
+struct options {
+    int version;
+    int port;
+    long frames;
+    long series;
+    double wait;
+    double rate;
+    size_t width, height, elem_size;
+    enum codec codec;
+    int thresholds;
+    int drop;
+};
+
+struct blob {
+    uint8_t* buf;
+    size_t size;
+};
+
+struct stats {
+    long sent, dropped;
+    size_t bytes;
+};
+
+static void sleep_until(double t) {
+    struct timespec ts;
+    ts.tv_sec = (time_t)t;
+    ts.tv_nsec = (long)((t - (double)ts.tv_sec) * 1e9);
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+        ;
+}
+
+// Compresses a frame the way the detector does for the given stream version
+static int compress(const struct options* opt, const uint8_t* in,
+                    struct blob* out) {
+    const size_t pixels = opt->width * opt->height;
+    const size_t bytes = pixels * opt->elem_size;
+
+    switch (opt->codec) {
+        case CODEC_NONE:
+            out->buf = malloc(bytes);
+            if (out->buf == NULL)
+                return -1;
+            memcpy(out->buf, in, bytes);
+            out->size = bytes;
+            return 0;
+
+        case CODEC_BSLZ4:
+            out->buf = malloc(bench_bslz4_bound(pixels, opt->elem_size));
+            if (out->buf == NULL)
+                return -1;
+            out->size = bench_compress_bslz4(in, pixels, opt->elem_size, out->buf);
+            return out->size ? 0 : -1;
+
+        case CODEC_LZ4:
+            // A single LZ4 block for Stream, the HDF5 filter format for Stream2
+            out->buf = malloc(opt->version == 1 ? bench_lz4_bound(bytes)
+                                                : bench_lz4_hdf5_bound(bytes));
+            if (out->buf == NULL)
+                return -1;
+            out->size = opt->version == 1
+                                ? bench_compress_lz4(in, bytes, out->buf)
+                                : bench_compress_lz4_hdf5(in, bytes, out->buf);
+            return out->size ? 0 : -1;
+    }
+    return -1;
+}
+
+static int make_frames(const struct options* opt, struct blob* frames) {
+    const size_t pixels = opt->width * opt->height;
+    uint8_t* frame = malloc(pixels * opt->elem_size);
+    if (frame == NULL)
+        return -1;
+
+    srand(1);
+    for (int f = 0; f < NUM_FRAMES; f++) {
+        bench_make_frame(frame, opt->width, opt->height, opt->elem_size);
+        if (compress(opt, frame, &frames[f])) {
+            free(frame);
+            return -1;
+        }
+    }
+    free(frame);
+    return 0;
+}
+
+static const char* dtype_name(size_t elem_size) {
+    return elem_size == 1 ? "uint8" : elem_size == 2 ? "uint16" : "uint32";
+}
+
+static CborTag dtype_tag(size_t elem_size) {
+    return elem_size == 1   ? STREAM2_TYPED_ARRAY_UINT8
+           : elem_size == 2 ? STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN
+                            : STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN;
+}
+
+static CborError encode_array_2_uint64(CborEncoder* map, const char* key,
+                                       uint64_t a, uint64_t b) {
+    CborEncoder array;
+    CborError e = cbor_encode_text_stringz(map, key);
+    e |= cbor_encoder_create_array(map, &array, 2);
+    e |= cbor_encode_uint(&array, a);
+    e |= cbor_encode_uint(&array, b);
+    e |= cbor_encoder_close_container(map, &array);
+    return e;
+}
+
+static size_t encode_start_msg(const struct options* opt, uint8_t* buf,
+                               size_t size, uint64_t series_id) {
+    CborEncoder enc, map, thresholds;
+    CborError e;
+
+    cbor_encoder_init(&enc, buf, size, 0);
+    e = cbor_encode_tag(&enc, CborSignatureTag);
+    e |= cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "start");
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, series_id);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, "eigerStreamSim");
+    e |= cbor_encode_text_stringz(&map, "image_dtype");
+    e |= cbor_encode_text_stringz(&map, dtype_name(opt->elem_size));
+    e |= cbor_encode_text_stringz(&map, "image_size_x");
+    e |= cbor_encode_uint(&map, opt->width);
+    e |= cbor_encode_text_stringz(&map, "image_size_y");
+    e |= cbor_encode_uint(&map, opt->height);
+    e |= cbor_encode_text_stringz(&map, "number_of_images");
+    e |= cbor_encode_uint(&map, (uint64_t)opt->frames);
+    e |= cbor_encode_text_stringz(&map, "threshold_energy");
+    e |= cbor_encoder_create_map(&map, &thresholds, (size_t)opt->thresholds);
+    for (int i = 0; i < opt->thresholds; i++) {
+        char channel[32];
+        snprintf(channel, sizeof(channel), "threshold_%d", i + 1);
+        e |= cbor_encode_text_stringz(&thresholds, channel);
+        e |= cbor_encode_double(&thresholds, 4000.0 * (i + 1));
+    }
+    e |= cbor_encoder_close_container(&map, &thresholds);
+    e |= cbor_encoder_close_container(&enc, &map);
+
+    return e ? 0 : cbor_encoder_get_buffer_size(&enc, buf);
+}
+
+static size_t encode_image_msg(const struct options* opt, uint8_t* buf,
+                               size_t size, uint64_t series_id,
+                               uint64_t image_id, const struct blob* frames) {
+    CborEncoder enc, map, user_data, data, multidim, dims, compression;
+    CborError e;
+
+    cbor_encoder_init(&enc, buf, size, 0);
+    e = cbor_encode_tag(&enc, CborSignatureTag);
+    e |= cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "image");
+    e |= cbor_encode_text_stringz(&map, "image_id");
+    e |= cbor_encode_uint(&map, image_id);
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, series_id);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, "eigerStreamSim");
+    e |= cbor_encode_text_stringz(&map, "series_date");
+    e |= cbor_encode_tag(&map, CborDateTimeStringTag);
+    e |= cbor_encode_text_stringz(&map, "2024-01-19T10:32:12.345678Z");
+    e |= encode_array_2_uint64(&map, "start_time", image_id * 1000000,
+                               1000000000);
+    e |= encode_array_2_uint64(&map, "stop_time", image_id * 1000000 + 500000,
+                               1000000000);
+    e |= encode_array_2_uint64(&map, "real_time", 500000, 1000000000);
+    e |= cbor_encode_text_stringz(&map, "user_data");
+    e |= cbor_encoder_create_map(&map, &user_data, 0);
+    e |= cbor_encoder_close_container(&map, &user_data);
+    e |= cbor_encode_text_stringz(&map, "data");
+    e |= cbor_encoder_create_map(&map, &data, (size_t)opt->thresholds);
+    for (int i = 0; i < opt->thresholds; i++) {
+        const struct blob* frame = &frames[(image_id + i) % NUM_FRAMES];
+        char channel[32];
+        snprintf(channel, sizeof(channel), "threshold_%d", i + 1);
+        e |= cbor_encode_text_stringz(&data, channel);
+        e |= cbor_encode_tag(&data, 40);
+        e |= cbor_encoder_create_array(&data, &multidim, 2);
+        e |= cbor_encoder_create_array(&multidim, &dims, 2);
+        e |= cbor_encode_uint(&dims, opt->height);
+        e |= cbor_encode_uint(&dims, opt->width);
+        e |= cbor_encoder_close_container(&multidim, &dims);
+        e |= cbor_encode_tag(&multidim, dtype_tag(opt->elem_size));
+        if (opt->codec == CODEC_NONE) {
+            e |= cbor_encode_byte_string(&multidim, frame->buf, frame->size);
+        } else {
+            e |= cbor_encode_tag(&multidim, 56500);
+            e |= cbor_encoder_create_array(&multidim, &compression, 3);
+            e |= cbor_encode_text_stringz(
+                    &compression, opt->codec == CODEC_LZ4 ? "lz4" : "bslz4");
+            e |= cbor_encode_uint(&compression, opt->elem_size);
+            e |= cbor_encode_byte_string(&compression, frame->buf, frame->size);
+            e |= cbor_encoder_close_container(&multidim, &compression);
+        }
+        e |= cbor_encoder_close_container(&data, &multidim);
+    }
+    e |= cbor_encoder_close_container(&map, &data);
+    e |= cbor_encoder_close_container(&enc, &map);
+
+    return e ? 0 : cbor_encoder_get_buffer_size(&enc, buf);
+}
+
+static size_t encode_end_msg(uint8_t* buf, size_t size, uint64_t series_id) {
+    CborEncoder enc, map;
+    CborError e;
+
+    cbor_encoder_init(&enc, buf, size, 0);
+    e = cbor_encode_tag(&enc, CborSignatureTag);
+    e |= cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "end");
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, series_id);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, "eigerStreamSim");
+    e |= cbor_encoder_close_container(&enc, &map);
+
+    return e ? 0 : cbor_encoder_get_buffer_size(&enc, buf);
+}
+
+// Sends a message, or a part of one if more is set. Only the first part of a
+// frame may be dropped; ZMQ then also takes the other parts.
+static int send_part(void* sock, const void* buf, size_t size, int more, int drop) {
+    int flags = (more ? ZMQ_SNDMORE : 0) | (drop ? ZMQ_DONTWAIT : 0);
+    if (zmq_send(sock, buf, size, flags) >= 0)
+        return 0;
+    if (errno != EAGAIN)
+        fprintf(stderr, "zmq_send: %s\n", zmq_strerror(errno));
+    return -1;
+}
+
+static int send_str(void* sock, const char* str, int more) {
+    return send_part(sock, str, strlen(str), more, 0);
+}
+
+// Sends frame image_id, returning 1 if it was dropped
+static int send_frame(const struct options* opt, void* sock, uint8_t* buf,
+                      size_t size, uint64_t series_id, uint64_t image_id,
+                      const struct blob* frames, struct stats* stats) {
+    if (opt->version == 2) {
+        size_t n = encode_image_msg(opt, buf, size, series_id, image_id, frames);
+        if (n == 0) {
+            fprintf(stderr, "failed to encode image message\n");
+            return -1;
+        }
+        if (send_part(sock, buf, n, 0, opt->drop))
+            return 1;
+        stats->bytes += n;
+        return 0;
+    }
+
+    const struct blob* frame = &frames[image_id % NUM_FRAMES];
+    const char* encoding = opt->codec == CODEC_NONE  ? "<"
+                           : opt->codec == CODEC_LZ4 ? "lz4<"
+                           : opt->elem_size == 1     ? "bs8-lz4<"
+                           : opt->elem_size == 2     ? "bs16-lz4<"
+                                                     : "bs32-lz4<";
+    char header[256], shape[256], config[256];
+    snprintf(header, sizeof(header),
+             "{\"htype\":\"dimage-1.0\",\"series\":%llu,\"frame\":%llu,\"hash\":\"\"}",
+             (unsigned long long)series_id, (unsigned long long)image_id);
+    snprintf(shape, sizeof(shape),
+             "{\"htype\":\"dimage_d-1.0\",\"shape\":[%zu,%zu],\"type\":\"%s\","
+             "\"encoding\":\"%s\",\"size\":%zu}",
+             opt->width, opt->height, dtype_name(opt->elem_size), encoding,
+             frame->size);
+    snprintf(config, sizeof(config),
+             "{\"htype\":\"dconfig-1.0\",\"start_time\":%llu,\"stop_time\":%llu,"
+             "\"real_time\":500000}",
+             (unsigned long long)image_id * 1000000,
+             (unsigned long long)image_id * 1000000 + 500000);
+
+    if (send_part(sock, header, strlen(header), 1, opt->drop))
+        return 1;
+    if (send_str(sock, shape, 1) ||
+        send_part(sock, frame->buf, frame->size, 1, 0) ||
+        send_str(sock, config, 0))
+        return -1;
+    stats->bytes += strlen(header) + strlen(shape) + frame->size + strlen(config);
+    return 0;
+}
+
+static int send_series(const struct options* opt, void* sock, uint64_t series_id,
+                       const struct blob* frames, struct stats* stats) {
+    size_t size = 4096;
+    for (int i = 0; i < NUM_FRAMES; i++) {
+        if (size < 4096 + frames[i].size * (size_t)opt->thresholds)
+            size = 4096 + frames[i].size * (size_t)opt->thresholds;
+    }
+    uint8_t* buf = malloc(size);
+    if (buf == NULL)
+        return -1;
+
+    int err = 0;
+    if (opt->version == 2) {
+        size_t n = encode_start_msg(opt, buf, size, series_id);
+        err = n == 0 || send_part(sock, buf, n, 0, 0);
+    } else {
+        char header[128];
+        snprintf(header, sizeof(header),
+                 "{\"htype\":\"dheader-1.0\",\"series\":%llu,\"header_detail\":\"none\"}",
+                 (unsigned long long)series_id);
+        err = send_str(sock, header, 0);
+    }
+
+    double start = bench_now();
+    for (long i = 0; i < opt->frames && !err; i++) {
+        if (opt->rate > 0)
+            sleep_until(start + (double)i / opt->rate);
+        int r = send_frame(opt, sock, buf, size, series_id, (uint64_t)i, frames,
+                           stats);
+        if (r < 0)
+            err = 1;
+        else if (r)
+            stats->dropped++;
+        else
+            stats->sent++;
+    }
+    double elapsed = bench_now() - start;
+
+    if (!err) {
+        if (opt->version == 2) {
+            size_t n = encode_end_msg(buf, size, series_id);
+            err = n == 0 || send_part(sock, buf, n, 0, 0);
+        } else {
+            char end[128];
+            snprintf(end, sizeof(end),
+                     "{\"htype\":\"dseries_end-1.0\",\"series\":%llu}",
+                     (unsigned long long)series_id);
+            err = send_str(sock, end, 0);
+        }
+    }
+    free(buf);
+
+    const double pixel_bytes = (double)(opt->width * opt->height * opt->elem_size) *
+                               (opt->version == 2 ? opt->thresholds : 1);
+    printf("series %llu: %ld sent, %ld dropped, %.3f s, %.1f frames/s, "
+           "%.1f MB/s uncompressed, %.1f MB/s sent\n",
+           (unsigned long long)series_id, stats->sent, stats->dropped, elapsed,
+           stats->sent / elapsed, 1e-6 * pixel_bytes * stats->sent / elapsed,
+           1e-6 * (double)stats->bytes / elapsed);
+    fflush(stdout);
+    return err ? -1 : 0;
+}
+
+// Replays message files, one ZMQ message each
+static int send_files(const struct options* opt, void* sock, char** paths,
+                      int num_paths) {
+    double start = bench_now();
+    size_t bytes = 0;
+    for (int i = 0; i < num_paths; i++) {
+        FILE* file = fopen(paths[i], "rb");
+        if (file == NULL) {
+            perror(paths[i]);
+            return -1;
+        }
+        fseek(file, 0, SEEK_END);
+        size_t size = (size_t)ftell(file);
+        fseek(file, 0, SEEK_SET);
+        uint8_t* buf = malloc(size + 1);
+        if (buf == NULL || fread(buf, 1, size, file) != size) {
+            fprintf(stderr, "%s: read failed\n", paths[i]);
+            fclose(file);
+            free(buf);
+            return -1;
+        }
+        fclose(file);
+
+        if (opt->rate > 0)
+            sleep_until(start + (double)i / opt->rate);
+        int err = send_part(sock, buf, size, 0, 0);
+        free(buf);
+        if (err)
+            return -1;
+        bytes += size;
+    }
+    double elapsed = bench_now() - start;
+    printf("%d messages, %.3f s, %.1f messages/s, %.1f MB/s sent\n", num_paths,
+           elapsed, num_paths / elapsed, 1e-6 * (double)bytes / elapsed);
+    return 0;
+}
+
+static void usage(void) {
+    fprintf(stderr,
+            "Usage: eigerStreamSim [-v 1|2] [-p port] [-n frames] [-s series] "
+            "[-w seconds]\n"
+            "                      [-r rate] [-x width] [-y height] [-b 8|16|32]\n"
+            "                      [-c none|lz4|bslz4] [-t thresholds] [-d] "
+            "[message file ...]\n");
+}
+
+int main(int argc, char** argv) {
+    struct options opt = {2, 0, 1000, 1, 1.0, 0.0, 1028, 1062, 2, CODEC_BSLZ4, 1, 0};
+    int c;
+
+    while ((c = getopt(argc, argv, "v:p:n:s:w:r:x:y:b:c:t:dh")) != -1) {
+        switch (c) {
+            case 'v': opt.version = atoi(optarg); break;
+            case 'p': opt.port = atoi(optarg); break;
+            case 'n': opt.frames = atol(optarg); break;
+            case 's': opt.series = atol(optarg); break;
+            case 'w': opt.wait = atof(optarg); break;
+            case 'r': opt.rate = atof(optarg); break;
+            case 'x': opt.width = (size_t)atol(optarg); break;
+            case 'y': opt.height = (size_t)atol(optarg); break;
+            case 'b': opt.elem_size = (size_t)atoi(optarg) / 8; break;
+            case 't': opt.thresholds = atoi(optarg); break;
+            case 'd': opt.drop = 1; break;
+            case 'c':
+                if (strcmp(optarg, "none") == 0)
+                    opt.codec = CODEC_NONE;
+                else if (strcmp(optarg, "lz4") == 0)
+                    opt.codec = CODEC_LZ4;
+                else if (strcmp(optarg, "bslz4") == 0)
+                    opt.codec = CODEC_BSLZ4;
+                else {
+                    usage();
+                    return 1;
+                }
+                break;
+            default:
+                usage();
+                return 1;
+        }
+    }
+    if ((opt.version != 1 && opt.version != 2) || opt.frames < 0 ||
+        opt.width == 0 || opt.height == 0 || opt.thresholds < 1 ||
+        (opt.elem_size != 1 && opt.elem_size != 2 && opt.elem_size != 4)) {
+        usage();
+        return 1;
+    }
+    if (opt.version == 1)
+        opt.thresholds = 1;
+    if (opt.port == 0)
+        opt.port = opt.version == 2 ? 31001 : 9999;
+
+    void* ctx = zmq_ctx_new();
+    void* sock = zmq_socket(ctx, ZMQ_PUSH);
+    char addr[64];
+    snprintf(addr, sizeof(addr), "tcp://*:%d", opt.port);
+    if (zmq_bind(sock, addr)) {
+        fprintf(stderr, "zmq_bind %s: %s\n", addr, zmq_strerror(errno));
+        return 1;
+    }
+    // Keep the messages that are not sent yet when exiting
+    int linger = -1;
+    zmq_setsockopt(sock, ZMQ_LINGER, &linger, sizeof(linger));
+    printf("Stream%s on %s\n", opt.version == 2 ? "2" : "", addr);
+    fflush(stdout);
+
+    int err = 0;
+    if (optind < argc) {
+        if (opt.wait > 0)
+            sleep_until(bench_now() + opt.wait);
+        err = send_files(&opt, sock, argv + optind, argc - optind);
+    } else {
+        struct blob frames[NUM_FRAMES];
+        if (make_frames(&opt, frames)) {
+            fprintf(stderr, "failed to make frames\n");
+            return 1;
+        }
+        for (long s = 0; s < opt.series && !err; s++) {
+            struct stats stats = {0, 0, 0};
+            if (opt.wait > 0)
+                sleep_until(bench_now() + opt.wait);
+            err = send_series(&opt, sock, (uint64_t)s + 1, frames, &stats);
+        }
+        for (int i = 0; i < NUM_FRAMES; i++)
+            free(frames[i].buf);
+    }
+
+    zmq_close(sock);
+    zmq_ctx_destroy(ctx);
+    return err ? 1 : 0;
+}
@@ -0,0 +1,66 @@
+#ifndef FRAME_DECODE_H
+#define FRAME_DECODE_H
+
+#include <stddef.h>
+#include <hdf5.h>
+
+#include "streamApi.h"
+
+// The steps of getting frames out of the detector's messages and files that
+// need none of the driver's state. Internal to the driver, and shared with
+// eigerBench to time them.
+
+#define MAX_HDF5_DIMS 4
+
+// Reads the dims, type, encoding and sizes of a Stream frame from its
+// dimage_d message
+int streamParseShape (const char *data, size_t size, stream_frame_t *frame);
+
+// Decompress the data of a Stream frame, or of a threshold of a Stream2
+// image, into dest, or into roi if it is not NULL. See stream_decode_t for
+// scratch.
+int streamUncompress (char *pInput, char *dest, const char *encoding,
+        size_t compressedSize, size_t uncompressedSize, NDDataType_t dataType,
+        bslz4_kernel bsKernel, struct bslz4_mask *mask, struct roi_bin *roi,
+        std::vector<char> *scratch = NULL);
+int stream2Uncompress (const unsigned char *pInput, char *dest, const char *encoding,
+        size_t compressedSize, size_t uncompressedSize, NDDataType_t dataType,
+        bslz4_kernel bsKernel, struct bslz4_mask *mask, struct roi_bin *roi,
+        std::vector<char> *scratch = NULL);
+
+// The data set of the images of a FileWriter data file: nImages x width x
+// height, or nImages x nThresh x width x height
+typedef struct
+{
+    hid_t dId, dType, dSpace, mSpace;
+    NDDataType_t dataType;  // Unsigned, as the detector writes it
+    int nDims;
+    size_t nImages, nThresh, width, height;
+    hsize_t count[MAX_HDF5_DIMS];
+    hsize_t offset[MAX_HDF5_DIMS];
+} h5_frames_t;
+
+// Opens the data set of the images of an open file. Returns NULL on success,
+// or what went wrong, and then leaves nothing open.
+const char *h5OpenFrames (hid_t fId, h5_frames_t *frames);
+
+// Selects threshold thresh of image image to be read with
+// H5Dread(frames->dId, frames->dType, frames->mSpace, frames->dSpace, ...)
+herr_t h5SelectFrame (h5_frames_t *frames, size_t image, size_t thresh);
+
+void h5CloseFrames (h5_frames_t *frames);
+
+// The image of a TIFF file served by the Monitor
+typedef struct
+{
+    size_t width, height;
+    NDDataType_t dataType;
+    const char *data;
+    size_t dataLen;
+} tiff_image_t;
+
+// Finds the image in a TIFF file. Returns NULL on success, or what is wrong
+// with the file.
+const char *tiffParseImage (const char *buf, size_t len, tiff_image_t *image);
+
+#endif
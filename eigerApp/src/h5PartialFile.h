@@ -0,0 +1,20 @@
+#ifndef H5_PARTIAL_FILE_H
+#define H5_PARTIAL_FILE_H
+
+#include <stddef.h>
+#include <atomic>
+#include <hdf5.h>
+
+// HDF5 file driver over a memory image of a file that is still being
+// received from its start. Reads of bytes past those received so far fail
+// instead of seeing garbage, so the library can be used on the file as it
+// arrives: opening it or reading a dataset fails until the metadata or the
+// chunks needed have been received, and succeeds once they have.
+//
+// Returns a file access property list to open the file read-only with, to be
+// closed with H5Pclose, or a negative value on error. buf must hold size
+// bytes and, like received, outlive the file opened.
+hid_t h5_partial_fapl (const char *buf, size_t size,
+        const std::atomic<size_t> *received);
+
+#endif
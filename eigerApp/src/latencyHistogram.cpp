@@ -0,0 +1,86 @@
+#include "latencyHistogram.h"
+
+// Values below SUB_BUCKETS have a bucket each. Above that the bucket of a
+// value is given by its highest set bit and the SUB_BITS bits below it.
+int LatencyHistogram::bucket (uint64_t ns)
+{
+    if(ns < SUB_BUCKETS)
+        return (int) ns;
+
+    int msb = 63 - __builtin_clzll(ns);
+    if(msb >= MAX_BITS)
+        return NUM_BUCKETS - 1;
+    return (msb - SUB_BITS + 1) * SUB_BUCKETS +
+           (int) ((ns >> (msb - SUB_BITS)) & (SUB_BUCKETS - 1));
+}
+
+uint64_t LatencyHistogram::bucketLow (int i)
+{
+    if(i < SUB_BUCKETS)
+        return (uint64_t) i;
+
+    int msb = i / SUB_BUCKETS + SUB_BITS - 1;
+    return (uint64_t) (SUB_BUCKETS + i % SUB_BUCKETS) << (msb - SUB_BITS);
+}
+
+void LatencyHistogram::reset (void)
+{
+    for(int i = 0; i < NUM_BUCKETS; ++i)
+        mCounts[i].store(0, std::memory_order_relaxed);
+    mMax.store(0, std::memory_order_relaxed);
+}
+
+void LatencyHistogram::record (uint64_t ns)
+{
+    mCounts[bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+
+    uint64_t max = mMax.load(std::memory_order_relaxed);
+    while(ns > max && !mMax.compare_exchange_weak(max, ns, std::memory_order_relaxed))
+        ;
+}
+
+uint64_t LatencyHistogram::count (void) const
+{
+    uint64_t total = 0;
+    for(int i = 0; i < NUM_BUCKETS; ++i)
+        total += mCounts[i].load(std::memory_order_relaxed);
+    return total;
+}
+
+uint64_t LatencyHistogram::quantile (double q) const
+{
+    uint64_t total = count();
+    if(!total)
+        return 0;
+
+    // Rank of the value, counting from 1
+    uint64_t rank = (uint64_t) (q * total + 0.5);
+    if(rank < 1)
+        rank = 1;
+    if(rank > total)
+        rank = total;
+
+    uint64_t seen = 0;
+    for(int i = 0; i < NUM_BUCKETS; ++i)
+    {
+        seen += mCounts[i].load(std::memory_order_relaxed);
+        if(seen >= rank)
+        {
+            // The last bucket holds everything that is too large
+            uint64_t high = i == NUM_BUCKETS - 1 ? max() : bucketHigh(i);
+            return high < max() ? high : max();
+        }
+    }
+    return max();
+}
+
+void LatencyHistogram::print (FILE *fp, const char *indent) const
+{
+    for(int i = 0; i < NUM_BUCKETS; ++i)
+    {
+        uint64_t n = mCounts[i].load(std::memory_order_relaxed);
+        if(n)
+            fprintf(fp, "%s%12.3f - %12.3f us: %llu\n", indent,
+                    bucketLow(i) / 1e3, bucketHigh(i) / 1e3, (unsigned long long) n);
+    }
+}
@@ -0,0 +1,42 @@
+#ifndef LATENCY_HISTOGRAM_H
+#define LATENCY_HISTOGRAM_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <atomic>
+
+// Histogram of latencies in ns that can be recorded into from any number of
+// threads without locking. Like an HDR histogram, each power of two is split
+// into the same number of buckets, so every value is known to within 1/16
+// (about 6%) from 1 ns up to over an hour.
+class LatencyHistogram
+{
+public:
+    LatencyHistogram (void) { reset(); }
+
+    // Not safe while another thread records
+    void reset (void);
+    void record (uint64_t ns);
+
+    uint64_t count (void) const;
+    uint64_t max (void) const { return mMax.load(std::memory_order_relaxed); }
+    // Smallest value that is not below the fraction q of the recorded values,
+    // rounded up to the end of its bucket. 0 if nothing was recorded.
+    uint64_t quantile (double q) const;
+
+    // Prints the non-empty buckets
+    void print (FILE *fp, const char *indent) const;
+
+private:
+    enum { SUB_BITS = 4, SUB_BUCKETS = 1 << SUB_BITS, MAX_BITS = 42,
+           NUM_BUCKETS = (MAX_BITS - SUB_BITS + 1) * SUB_BUCKETS };
+
+    static int bucket (uint64_t ns);
+    static uint64_t bucketLow (int i);
+    static uint64_t bucketHigh (int i) { return bucketLow(i + 1) - 1; }
+
+    std::atomic<uint64_t> mCounts[NUM_BUCKETS];
+    std::atomic<uint64_t> mMax;
+};
+
+#endif
@@ -1,6 +1,9 @@
 #include "restApi.h"
 
 #include <stdexcept>
+#include <atomic>
+#include <algorithm>
+#include <vector>
 
 #include <stdlib.h>
 #include <stdio.h>
@@ -11,7 +14,9 @@
 #include <epicsThread.h>
 #include <epicsTime.h>
 
+#include <errno.h>
 #include <fcntl.h>
+#include <unistd.h>
 
 #define EOL                     "\r\n"      // End of Line
 #define EOL_LEN                 2           // End of Line Length
@@ -55,6 +60,13 @@
     "Content-Length: 0" EOL \
     "Accept: %s" EOH
 
+#define REQUEST_GET_RANGE\
+    "GET %s%s HTTP/1.1" EOL \
+    "Host: %s" EOL\
+    "Content-Length: 0" EOL \
+    "Range: bytes=%lu-%lu" EOL \
+    "Accept: %s" EOH
+
 #define REQUEST_PUT\
     "PUT %s%s HTTP/1.1" EOL \
     "Host: %s" EOL\
@@ -77,11 +89,39 @@ using std::string;
 typedef struct socket
 {
     SOCKET fd;
-    epicsMutex mutex;
+    lane_t lane;
+    bool busy;              // Checked out, protected by mPoolMutex
     bool closed;
     size_t retries;
+
+    // Reuse statistics
+    size_t requests, connects, bytes;
 } socket_t;
 
+static const char *laneNames[LaneCount] = {"control", "bulk"};
+
+// A file downloaded in chunks by the calling thread and parallel-1 helpers, each
+// taking the next chunk until there are none left
+typedef struct range_download
+{
+    RestAPI *api;
+    const char *name;
+    char *buf;
+    int fd;
+    size_t size, chunkSize, numChunks;
+    std::atomic<size_t> nextChunk;
+    std::atomic<bool> failed;
+    std::atomic<size_t> running;    // The last one to finish signals done
+    epicsEvent done;
+
+    // Progress of the chunks from the start of the file that are all in
+    download_progress_t progress;
+    void *progressArg;
+    epicsMutex progressMutex;
+    std::vector<bool> chunkDone;
+    size_t chunksDone;
+} range_download_t;
+
 typedef struct request
 {
     char *data;
@@ -234,23 +274,45 @@ int RestAPI::buildDataName (int n, const char *pattern, int seqId, char *buf, si
 
 // Public members
 
-RestAPI::RestAPI (std::string const & hostname, int port, size_t numSockets) :
-    mHostname(hostname), mPort(port), mNumSockets(numSockets),
-    mSockets(new socket_t[numSockets])
+RestAPI::RestAPI (std::string const & hostname, int port, size_t numControlSockets,
+        size_t numBulkSockets) :
+    mHostname(hostname), mPort(port)
 {
+    // A port given as host:port overrides the default one
+    size_t colon = mHostname.rfind(':');
+    if(colon != string::npos)
+    {
+        mPort = atoi(mHostname.c_str() + colon + 1);
+        mHostname.erase(colon);
+    }
+
     memset(&mAddress, 0, sizeof(mAddress));
 
     if(hostToIPAddr(mHostname.c_str(), &mAddress.sin_addr))
         throw std::runtime_error("invalid hostname");
 
     mAddress.sin_family = AF_INET;
-    mAddress.sin_port = htons(port);
+    mAddress.sin_port = htons(mPort);
+
+    mNumSockets[LaneControl] = numControlSockets ? numControlSockets : DEFAULT_CONTROL_SOCKETS;
+    mNumSockets[LaneBulk]    = numBulkSockets ? numBulkSockets : DEFAULT_BULK_SOCKETS;
 
-    for(size_t i = 0; i < mNumSockets; ++i)
+    for(int lane = 0; lane < LaneCount; ++lane)
     {
-        mSockets[i].closed = true;
-        mSockets[i].fd = -1;
-        mSockets[i].retries = 0;
+        mSockets[lane] = new socket_t[mNumSockets[lane]];
+        mWaits[lane] = mTimeouts[lane] = 0;
+        mMaxWait[lane] = 0.0;
+
+        for(size_t i = 0; i < mNumSockets[lane]; ++i)
+        {
+            socket_t *s = &mSockets[lane][i];
+            s->fd = -1;
+            s->lane = (lane_t) lane;
+            s->busy = false;
+            s->closed = true;
+            s->retries = 0;
+            s->requests = s->connects = s->bytes = 0;
+        }
     }
 
     // Define REST URIs based on API version
@@ -289,6 +351,17 @@ RestAPI::RestAPI (std::string const & hostname, int port, size_t numSockets) :
     mSysStr[SSSysCommand] = "/system/api/" + api + "/command/";
 }
 
+RestAPI::~RestAPI (void)
+{
+    for(int lane = 0; lane < LaneCount; ++lane)
+    {
+        for(size_t i = 0; i < mNumSockets[lane]; ++i)
+            if(!mSockets[lane][i].closed)
+                close(mSockets[lane][i].fd);
+        delete [] mSockets[lane];
+    }
+}
+
 int RestAPI::restart (void)
 {
     return put(SSSysCommand, "restart", "", NULL, DEFAULT_TIMEOUT_INIT);
@@ -426,7 +499,7 @@ int RestAPI::getFileSize (const char *filename, size_t *size)
     return EXIT_SUCCESS;
 }
 
-int RestAPI::waitFile (const char *filename, double timeout)
+int RestAPI::waitFile (const char *filename, double timeout, size_t *size)
 {
     const char *functionName = "waitFile";
 
@@ -455,7 +528,11 @@ int RestAPI::waitFile (const char *filename, double timeout)
         }
 
         if(response.code == 200)
+        {
+            if(size)
+                *size = response.contentLength;
             return EXIT_SUCCESS;
+        }
 
         if(response.code != 404)
         {
@@ -471,9 +548,87 @@ int RestAPI::waitFile (const char *filename, double timeout)
     return EXIT_FAILURE;
 }
 
-int RestAPI::getFile (const char *filename, char **buf, size_t *bufSize)
+int RestAPI::getFile (const char *filename, char **buf, size_t *bufSize,
+        size_t fileSize, size_t chunkSize, size_t parallel,
+        download_progress_t progress, void *progressArg)
+{
+    return downloadFile(filename, buf, -1, bufSize, fileSize, chunkSize, parallel,
+            progress, progressArg);
+}
+
+int RestAPI::saveFile (const char *filename, int fd, size_t *savedSize,
+        size_t fileSize, size_t chunkSize, size_t parallel)
 {
-    return getBlob(SSData, filename, buf, bufSize, DATA_HDF5);
+    return downloadFile(filename, NULL, fd, savedSize, fileSize, chunkSize, parallel);
+}
+
+int RestAPI::downloadFile (const char *filename, char **buf, int fd, size_t *size,
+        size_t fileSize, size_t chunkSize, size_t parallel,
+        download_progress_t progress, void *progressArg)
+{
+    const char *functionName = "downloadFile";
+
+    parallel = std::min(parallel, mNumSockets[LaneBulk]);
+    if(parallel < 2 || !chunkSize || fileSize <= chunkSize)
+        return getBlob(SSData, filename, buf, size, DATA_HDF5, 0, 0, fd, progress, progressArg);
+
+    range_download_t download;
+    download.api       = this;
+    download.name      = filename;
+    download.fd        = fd;
+    download.size      = fileSize;
+    download.chunkSize = chunkSize;
+    download.numChunks = (fileSize + chunkSize - 1) / chunkSize;
+    download.nextChunk = 0;
+    download.failed    = false;
+    download.progress  = fd < 0 ? progress : NULL;
+    download.progressArg = progressArg;
+    download.chunksDone = 0;
+    download.buf       = NULL;
+    if(download.progress)
+        download.chunkDone.resize(download.numChunks);
+    if(fd < 0 && !(download.buf = (char*) malloc(fileSize)))
+    {
+        ERR_ARGS("[file=%s] malloc(%lu) failed", filename, fileSize);
+        return EXIT_FAILURE;
+    }
+
+    parallel = std::min(parallel, download.numChunks);
+    download.running = parallel;
+    for(size_t i = 1; i < parallel; ++i)
+    {
+        if(!epicsThreadCreate("eigerRange", epicsThreadPriorityMedium,
+                epicsThreadGetStackSize(epicsThreadStackMedium),
+                (EPICSTHREADFUNC) rangeTask, &download))
+        {
+            ERR("epicsThreadCreate failure for range download");
+            if(--download.running == 0)
+                download.done.signal();
+        }
+    }
+
+    getRanges(&download);
+    download.done.wait();
+
+    if(download.failed && download.progress)
+    {
+        // What was received may still be being read
+        ERR_ARGS("[file=%s] ranged download failed", filename);
+        *buf = download.buf;
+        return EXIT_FAILURE;
+    }
+
+    if(download.failed)
+    {
+        free(download.buf);
+        ERR_ARGS("[file=%s] ranged download failed, getting the whole file", filename);
+        return getBlob(SSData, filename, buf, size, DATA_HDF5, 0, 0, fd);
+    }
+
+    if(buf)
+        *buf = download.buf;
+    *size = download.size;
+    return EXIT_SUCCESS;
 }
 
 int RestAPI::deleteFile (const char *filename)
@@ -514,8 +669,163 @@ int RestAPI::getMonitorImage (char **buf, size_t *bufSize, size_t timeout)
     return getBlob(SSMonImages, param, buf, bufSize, DATA_TIFF);
 }
 
+void RestAPI::report (FILE *fp, int details)
+{
+    fprintf(fp, "  REST connections to %s:%d\n", mHostname.c_str(), mPort);
+
+    mPoolMutex.lock();
+    for(int lane = 0; lane < LaneCount; ++lane)
+    {
+        fprintf(fp, "    %-8s %lu sockets, %lu waits for a free one (max %.3f s), %lu timeouts\n",
+                laneNames[lane], (unsigned long) mNumSockets[lane],
+                (unsigned long) mWaits[lane], mMaxWait[lane], (unsigned long) mTimeouts[lane]);
+
+        if(details < 2)
+            continue;
+
+        for(size_t i = 0; i < mNumSockets[lane]; ++i)
+        {
+            socket_t *s = &mSockets[lane][i];
+            fprintf(fp, "      %2lu: %lu requests over %lu connections, %.1f MB received%s\n",
+                    (unsigned long) i, (unsigned long) s->requests,
+                    (unsigned long) s->connects, s->bytes/1e6, s->busy ? ", busy" : "");
+        }
+    }
+    mPoolMutex.unlock();
+}
+
+// Writes all of len bytes to fd at offset
+static int writeAt (int fd, const char *buf, size_t len, size_t offset)
+{
+    while(len)
+    {
+        ssize_t written = pwrite(fd, buf, len, (off_t) offset);
+        if(written < 0 && errno == EINTR)
+            continue;
+        if(written <= 0)
+            return EXIT_FAILURE;
+        buf += written;
+        len -= written;
+        offset += written;
+    }
+    return EXIT_SUCCESS;
+}
+
 // Private members
 
+void RestAPI::rangeTask (void *download)
+{
+    range_download_t *d = (range_download_t *) download;
+    d->api->getRanges(d);
+}
+
+void RestAPI::getRanges (range_download_t *d)
+{
+    size_t chunk;
+
+    while(!d->failed && (chunk = d->nextChunk++) < d->numChunks)
+    {
+        size_t offset = chunk * d->chunkSize;
+        size_t length = std::min(d->chunkSize, d->size - offset);
+        char *dest = d->buf ? d->buf + offset : NULL;
+        size_t received;
+
+        if(getBlob(SSData, d->name, &dest, &received, DATA_HDF5, offset, length, d->fd))
+            d->failed = true;
+        else if(d->progress)
+        {
+            // Chunks complete out of order, only those from the start count
+            d->progressMutex.lock();
+            d->chunkDone[chunk] = true;
+            size_t before = d->chunksDone;
+            while(d->chunksDone < d->numChunks && d->chunkDone[d->chunksDone])
+                ++d->chunksDone;
+            if(d->chunksDone > before)
+                d->progress(d->progressArg, d->buf, d->size,
+                        std::min(d->chunksDone * d->chunkSize, d->size));
+            d->progressMutex.unlock();
+        }
+    }
+
+    if(--d->running == 0)
+        d->done.signal();
+}
+
+// Takes a free socket of the lane, preferring one that is still connected.
+// Waits up to timeout seconds, or forever if it is negative, for one to be
+// checked in when they are all busy.
+socket_t *RestAPI::checkout (lane_t lane, int timeout)
+{
+    const char *functionName = "checkout";
+    socket_t *s = NULL;
+    bool waited = false;
+    epicsTimeStamp start, now;
+
+    epicsTimeGetCurrent(&start);
+    mPoolMutex.lock();
+
+    for(;;)
+    {
+        size_t numFree = 0;
+        for(size_t i = 0; i < mNumSockets[lane]; ++i)
+        {
+            socket_t *candidate = &mSockets[lane][i];
+            if(candidate->busy)
+                continue;
+            if(!s || (s->closed && !candidate->closed))
+                s = candidate;
+            ++numFree;
+        }
+
+        epicsTimeGetCurrent(&now);
+        double elapsed = epicsTimeDiffInSeconds(&now, &start);
+
+        if(s)
+        {
+            s->busy = true;
+            if(waited)
+            {
+                ++mWaits[lane];
+                if(elapsed > mMaxWait[lane])
+                    mMaxWait[lane] = elapsed;
+            }
+            mPoolMutex.unlock();
+
+            // Pass on the wakeup if checkins were merged into one signal
+            if(numFree > 1)
+                mPoolEvent[lane].signal();
+            return s;
+        }
+
+        if(timeout >= 0 && elapsed >= timeout)
+        {
+            ++mTimeouts[lane];
+            mPoolMutex.unlock();
+            ERR_ARGS("no free %s socket after %d seconds", laneNames[lane], timeout);
+            return NULL;
+        }
+
+        waited = true;
+        mPoolMutex.unlock();
+        if(timeout < 0)
+            mPoolEvent[lane].wait();
+        else
+            mPoolEvent[lane].wait(timeout - elapsed);
+        mPoolMutex.lock();
+    }
+}
+
+void RestAPI::checkin (socket_t *s)
+{
+    s->retries = 0;
+
+    mPoolMutex.lock();
+    s->busy = false;
+    mPoolMutex.unlock();
+
+    mPoolEvent[s->lane].signal();
+}
+
 int RestAPI::connect (socket_t *s)
 {
     const char *functionName = "connect";
@@ -571,6 +881,7 @@ int RestAPI::connect (socket_t *s)
 
     setNonBlock(s, false);
     s->closed = false;
+    ++s->connects;
     return EXIT_SUCCESS;
 }
 
@@ -593,23 +904,11 @@ int RestAPI::doRequest (const request_t *request, response_t *response, int time
     struct timeval *pRecvTimeout = NULL;
     fd_set fds;
 
-    socket_t *s = NULL;
-    bool gotSocket = false;
-
-    for(size_t i = 0; i < mNumSockets && !gotSocket; ++i)
-    {
-        s = &mSockets[i];
-        if(s->mutex.tryLock())
-            gotSocket = true;
-    }
-
-    if(!gotSocket)
-    {
-        ERR("no available socket");
-        status = EXIT_FAILURE;
-        goto end;
-    }
+    socket_t *s = checkout(LaneControl, timeout);
+    if(!s)
+        return EXIT_FAILURE;
 
+again:
     if(s->closed)
     {
         if(connect(s))
@@ -627,18 +926,19 @@ int RestAPI::doRequest (const request_t *request, response_t *response, int time
         else
         {
             ERR("failed to send");
+            close(s->fd);
             s->closed = true;
             status = EXIT_FAILURE;
             goto end;
         }
     }
 
+    FD_ZERO(&fds);
+    FD_SET(s->fd, &fds);
     if(timeout >= 0)
     {
         recvTimeout.tv_sec = timeout;
         recvTimeout.tv_usec = 0;
-        FD_ZERO(&fds);
-        FD_SET(s->fd, &fds);
         pRecvTimeout = &recvTimeout;
     }
 
@@ -646,23 +946,30 @@ int RestAPI::doRequest (const request_t *request, response_t *response, int time
     if(ret <= 0)
     {
         ERR(ret ? "select() failed" : "timed out");
+        // A late response must not be taken for the one to the next request
+        close(s->fd);
+        s->closed = true;
         status = EXIT_FAILURE;
         goto end;
     }
 
-    if((received = recv(s->fd, response->data, response->dataLen, 0) <= 0))
+    if((received = recv(s->fd, response->data, response->dataLen, 0)) <= 0)
     {
         if(s->retries++ < MAX_HTTP_RETRIES)
             goto retry;
         else
         {
             ERR("failed to recv");
+            close(s->fd);
+            s->closed = true;
             status = EXIT_FAILURE;
             goto end;
         }
     }
 
     response->actualLen = (size_t) received;
+    ++s->requests;
+    s->bytes += received;
 
     if((status = parseHeader(response)))
     {
@@ -677,15 +984,13 @@ int RestAPI::doRequest (const request_t *request, response_t *response, int time
     }
 
 end:
-    s->retries = 0;
-    s->mutex.unlock();
+    checkin(s);
     return status;
 
 retry:
     close(s->fd);
     s->closed = true;
-    s->mutex.unlock();
-    return doRequest(request, response, timeout);
+    goto again;
 }
 
 int RestAPI::put (sys_t sys, string const & param, string const & value,
@@ -770,43 +1075,40 @@ int RestAPI::get (sys_t sys, string const & param, string & value, int timeout)
 }
 
 int RestAPI::getBlob (sys_t sys, const char *name, char **buf, size_t *bufSize,
-        const char *accept)
+        const char *accept, size_t offset, size_t length, int fd,
+        download_progress_t progress, void *progressArg)
 {
     const char *functionName = "getBlob";
     int status = EXIT_SUCCESS;
     int received;
     size_t remaining;
     char *bufp;
+    char *saveBuf = NULL;
 
     request_t request = {};
     char requestBuf[MAX_MESSAGE_SIZE];
     request.data      = requestBuf;
     request.dataLen   = sizeof(requestBuf);
-    request.actualLen = epicsSnprintf(request.data, request.dataLen,
-            REQUEST_GET_FILE, mSysStr[sys].c_str(), name, mHostname.c_str(), accept);
+    if(length)
+        request.actualLen = epicsSnprintf(request.data, request.dataLen,
+                REQUEST_GET_RANGE, mSysStr[sys].c_str(), name, mHostname.c_str(),
+                (unsigned long) offset, (unsigned long) (offset + length - 1), accept);
+    else
+        request.actualLen = epicsSnprintf(request.data, request.dataLen,
+                REQUEST_GET_FILE, mSysStr[sys].c_str(), name, mHostname.c_str(), accept);
 
     response_t response = {};
     char responseBuf[MAX_MESSAGE_SIZE];
     response.data    = responseBuf;
     response.dataLen = sizeof(responseBuf);
 
-    socket_t *s = NULL;
-    bool gotSocket = false;
-
-    for(size_t i = 0; i < mNumSockets && !gotSocket; ++i)
-    {
-        s = &mSockets[i];
-        if(s->mutex.tryLock())
-            gotSocket = true;
-    }
-
-    if(!gotSocket)
-    {
-        ERR("no available socket");
-        status = EXIT_FAILURE;
-        goto end;
-    }
+    // A file download waits its turn behind the others however long they
+    // take, the driver keeps their number within the lane
+    socket_t *s = checkout(LaneBulk, sys == SSData ? -1 : DEFAULT_TIMEOUT);
+    if(!s)
+        return EXIT_FAILURE;
 
+again:
     if(s->closed)
     {
         if(connect(s))
@@ -825,6 +1127,8 @@ int RestAPI::getBlob (sys_t sys, const char *name, char **buf, size_t *bufSize,
         else
         {
             ERR("failed to send");
+            close(s->fd);
+            s->closed = true;
             status = EXIT_FAILURE;
             goto end;
         }
@@ -838,6 +1142,8 @@ int RestAPI::getBlob (sys_t sys, const char *name, char **buf, size_t *bufSize,
         else
         {
             ERR_ARGS("[sys=%d file=%s] failed to receive first part", sys, name);
+            close(s->fd);
+            s->closed = true;
             status = EXIT_FAILURE;
             goto end;
         }
@@ -849,19 +1155,92 @@ int RestAPI::getBlob (sys_t sys, const char *name, char **buf, size_t *bufSize,
         goto end;
     }
 
-    if(response.code != 200)
+    ++s->requests;
+    s->bytes += received;
+
+    // A server that ignores the range answers 200 with the whole file
+    if(response.code != (length ? 206 : 200) ||
+       (length && response.contentLength != length))
     {
-        if(sys != SSMonImages)
+        if(length)
+            ERR_ARGS("[sys=%d file=%s] server returned error code %d to a ranged request",
+                    sys, name, response.code);
+        else if(sys != SSMonImages)
             ERR_ARGS("[sys=%d file=%s] file not found", sys, name);
+        // The connection can only be reused once the whole body was read
+        if(response.reconnect || response.headerLen + response.contentLength > (size_t) received)
+        {
+            close(s->fd);
+            s->closed = true;
+        }
         status = EXIT_FAILURE;
         goto end;
     }
 
+    if(fd >= 0)
+    {
+        // Write what we already received, then the rest through saveBuf
+        *bufSize = received - response.headerLen;
+        if(writeAt(fd, response.content, *bufSize, offset))
+            goto writeFailed;
+
+        if(*bufSize < response.contentLength && !saveBuf)
+        {
+            saveBuf = (char*)malloc(SAVE_BUFFER_SIZE);
+            if(!saveBuf)
+            {
+                ERR_ARGS("[sys=%d file=%s] malloc(%d) failed", sys, name, SAVE_BUFFER_SIZE);
+                close(s->fd);
+                s->closed = true;
+                status = EXIT_FAILURE;
+                goto end;
+            }
+        }
+
+        while(*bufSize < response.contentLength)
+        {
+            received = recv(s->fd, saveBuf,
+                    std::min((size_t) SAVE_BUFFER_SIZE, response.contentLength - *bufSize), 0);
+
+            if(received <= 0)
+            {
+                *bufSize = 0;
+
+                if(s->retries++ < MAX_HTTP_RETRIES)
+                    goto retry;
+                else
+                {
+                    ERR_ARGS("[sys=%d file=%s] failed to receive second part", sys, name);
+                    close(s->fd);
+                    s->closed = true;
+                    status = EXIT_FAILURE;
+                    goto end;
+                }
+            }
+
+            if(writeAt(fd, saveBuf, received, offset + *bufSize))
+                goto writeFailed;
+
+            *bufSize += received;
+            s->bytes += received;
+        }
+
+        if(response.reconnect)
+        {
+            close(s->fd);
+            s->closed = true;
+        }
+        goto end;
+    }
+
     // Create the receive buffer and copy over what we already received
-    *buf = (char*)malloc(response.contentLength);
+    if(!length)
+        *buf = (char*)malloc(response.contentLength);
     if(!*buf)
     {
         ERR_ARGS("[sys=%d file=%s] malloc(%lu) failed", sys, name, response.contentLength);
+        close(s->fd);
+        s->closed = true;
         status = EXIT_FAILURE;
         goto end;
     }
@@ -869,6 +1248,8 @@ int RestAPI::getBlob (sys_t sys, const char *name, char **buf, size_t *bufSize,
     // Assume that we got the whole header
     *bufSize = received - response.headerLen;
     memcpy(*buf, response.content, *bufSize);
+    if(progress)
+        progress(progressArg, *buf, response.contentLength, *bufSize);
 
     // Get the rest of the content (MSG_WAITALL can fail!)
     remaining = response.contentLength - *bufSize;
@@ -876,19 +1257,28 @@ int RestAPI::getBlob (sys_t sys, const char *name, char **buf, size_t *bufSize,
 
     while(remaining)
     {
-        received = recv(s->fd, bufp, remaining, MSG_WAITALL);
+        // Progress is reported every PROGRESS_STEP bytes
+        received = recv(s->fd, bufp,
+                progress ? std::min(remaining, (size_t) PROGRESS_STEP) : remaining,
+                MSG_WAITALL);
 
         if(received <= 0)
         {
-            free(*buf);
-            *buf = NULL;
+            // With progress, the buffer may still be being read
+            if(!length && !progress)
+            {
+                free(*buf);
+                *buf = NULL;
+            }
             *bufSize = 0;
 
-            if(s->retries++ < MAX_HTTP_RETRIES)
+            if(!progress && s->retries++ < MAX_HTTP_RETRIES)
                 goto retry;
             else
             {
                 ERR_ARGS("[sys=%d file=%s] failed to receive second part", sys, name);
+                close(s->fd);
+                s->closed = true;
                 status = EXIT_FAILURE;
                 goto end;
             }
@@ -896,6 +1286,10 @@ int RestAPI::getBlob (sys_t sys, const char *name, char **buf, size_t *bufSize,
 
         remaining -= received;
         bufp += received;
+        s->bytes += received;
+        if(progress)
+            progress(progressArg, *buf, response.contentLength,
+                    response.contentLength - remaining);
     }
 
     *bufSize = response.contentLength;
@@ -907,14 +1301,22 @@ int RestAPI::getBlob (sys_t sys, const char *name, char **buf, size_t *bufSize,
     }
 
 end:
-    s->retries = 0;
-    s->mutex.unlock();
+    free(saveBuf);
+    checkin(s);
     return status;
 
 retry:
     close(s->fd);
     s->closed = true;
-    s->mutex.unlock();
-    return getBlob(sys, name, buf, bufSize, accept);
+    goto again;
+
+writeFailed:
+    ERR_ARGS("[sys=%d file=%s] failed to write to local file [%s]", sys, name,
+            strerror(errno));
+    // The rest of the content is not read
+    close(s->fd);
+    s->closed = true;
+    status = EXIT_FAILURE;
+    goto end;
 }
 
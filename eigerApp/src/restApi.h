@@ -1,12 +1,24 @@
 #ifndef REST_API_H
 #define REST_API_H
 
+#include <stdio.h>
 #include <string>
 #include <epicsMutex.h>
+#include <epicsEvent.h>
 #include <osiSock.h>
 
 #define DEFAULT_TIMEOUT     20      // seconds
 
+#define DEFAULT_CONTROL_SOCKETS 5
+#define DEFAULT_BULK_SOCKETS    4
+
+// Buffer through which each connection writes a file it saves
+#define SAVE_BUFFER_SIZE    (1024*1024)
+
+// Least growth of a file downloaded into memory between calls to its progress
+// function
+#define PROGRESS_STEP       (1024*1024)
+
 #define MAX_CHANGED_PARAMS  32
 #define MAX_PARAM_NAME      64
 
@@ -36,10 +48,28 @@ typedef enum
     SSCount,
 } sys_t;
 
+// Lanes of the connection pool. File and Monitor image downloads have
+// connections of their own, so that a long download never holds up the
+// parameter, status and command requests.
+typedef enum
+{
+    LaneControl,
+    LaneBulk,
+
+    LaneCount,
+} lane_t;
+
 // Forward declarations
 typedef struct request  request_t;
 typedef struct response response_t;
 typedef struct socket   socket_t;
+typedef struct range_download range_download_t;
+
+// Called as each contiguous prefix of a file downloaded into memory has been
+// received, with the buffer it is received into, the size of the file and the
+// length of that prefix
+typedef void (*download_progress_t) (void *arg, const char *buf, size_t size,
+        size_t received);
 
 class RestAPI
 {
@@ -47,23 +77,52 @@ private:
     std::string mHostname;
     int mPort;
     struct sockaddr_in mAddress;
-    size_t mNumSockets;
-    socket_t *mSockets;
     std::string mSysStr[SSCount];
     eigerAPIVersion_t mAPIVersion;
 
+    // Keep-alive connections of each lane. A request checks out a free
+    // connection of its lane, waiting for one to be checked in if they are
+    // all busy.
+    size_t mNumSockets[LaneCount];
+    socket_t *mSockets[LaneCount];
+    epicsMutex mPoolMutex;
+    epicsEvent mPoolEvent[LaneCount];
+    size_t mWaits[LaneCount], mTimeouts[LaneCount];
+    double mMaxWait[LaneCount];
+
+    socket_t *checkout (lane_t lane, int timeout);
+    void checkin (socket_t *s);
+
     int connect (socket_t *s);
     int setNonBlock (socket_t *s, bool nonBlock);
 
     int doRequest (const request_t *request, response_t *response, int timeout = DEFAULT_TIMEOUT);
 
-    int getBlob (sys_t sys, const char *name, char **buf, size_t *bufSize, const char *accept);
+    // With a length, gets only the length bytes at offset, into the buffer
+    // *buf already points to. With an fd, writes the content to that file at
+    // offset as it arrives instead, and buf is not used. A progress function
+    // is called as the content arrives.
+    int getBlob (sys_t sys, const char *name, char **buf, size_t *bufSize, const char *accept,
+            size_t offset = 0, size_t length = 0, int fd = -1,
+            download_progress_t progress = NULL, void *progressArg = NULL);
+
+    // Downloads a file into a buffer or, with an fd, into that file
+    int downloadFile (const char *filename, char **buf, int fd, size_t *size,
+            size_t fileSize, size_t chunkSize, size_t parallel,
+            download_progress_t progress = NULL, void *progressArg = NULL);
+
+    // Gets the chunks of a parallel download until there are none left
+    void getRanges (range_download_t *download);
+    static void rangeTask (void *download);
 
 public:
     static int buildMasterName (const char *pattern, int seqId, char *buf, size_t bufSize);
     static int buildDataName   (int n, const char *pattern, int seqId, char *buf, size_t bufSize);
 
-    RestAPI (std::string const & hostname, int port=80, size_t numSockets=5);
+    RestAPI (std::string const & hostname, int port=80,
+            size_t numControlSockets=DEFAULT_CONTROL_SOCKETS,
+            size_t numBulkSockets=DEFAULT_BULK_SOCKETS);
+    ~RestAPI (void);
 
     int get (sys_t sys, std::string const & param, std::string & value, int timeout = DEFAULT_TIMEOUT);
     int put (sys_t sys, std::string const & param, std::string const & value = "", std::string * reply = NULL, int timeout = DEFAULT_TIMEOUT);
@@ -81,11 +140,34 @@ public:
     eigerAPIVersion_t getAPIVersion(void);
 
     int getFileSize (const char *filename, size_t *size);
-    int waitFile    (const char *filename, double timeout = DEFAULT_TIMEOUT);
-    int getFile     (const char *filename, char **buf, size_t *bufSize);
+    int waitFile    (const char *filename, double timeout = DEFAULT_TIMEOUT,
+                     size_t *size = NULL);
+    // fileSize is the size of the file as waitFile() returned it, or 0 if
+    // it is not known. When it is known and larger than chunkSize, and
+    // parallel > 1, the file is downloaded as chunks requested with Range
+    // headers over up to parallel bulk connections at once. If a chunk
+    // fails, the whole file is downloaded again in one request.
+    // A progress function is called each time the part received from the
+    // start of the file grows, by at least PROGRESS_STEP bytes or a chunk,
+    // so that it can be read while the rest arrives. In that case a failed
+    // download is not retried, and the buffer passed to the function is
+    // left in *buf even on failure, for the caller to free.
+    int getFile     (const char *filename, char **buf, size_t *bufSize,
+                     size_t fileSize = 0, size_t chunkSize = 0, size_t parallel = 1,
+                     download_progress_t progress = NULL, void *progressArg = NULL);
+    // Like getFile, but writes the file to fd as it arrives, so that only
+    // SAVE_BUFFER_SIZE bytes per connection are held in memory
+    int saveFile    (const char *filename, int fd, size_t *savedSize,
+                     size_t fileSize = 0, size_t chunkSize = 0, size_t parallel = 1);
     int deleteFile  (const char *filename);
 
     int getMonitorImage  (char **buf, size_t *bufSize, size_t timeout = 500);
+
+    size_t getNumSockets (lane_t lane) const { return mNumSockets[lane]; }
+
+    // Prints the checkout waits of each lane and, with details > 1, the
+    // requests and connections of each socket
+    void report (FILE *fp, int details);
 };
 
 #endif
@@ -0,0 +1,146 @@
+#include "roibin.h"
+
+#include <stdint.h>
+#include <string.h>
+
+int roi_bin_init(struct roi_bin* rb,
+                 size_t width,
+                 size_t height,
+                 size_t elem_size,
+                 size_t min_x,
+                 size_t min_y,
+                 size_t size_x,
+                 size_t size_y,
+                 size_t bin) {
+    if (bin == 0)
+        bin = 1;
+    if (min_x >= width || min_y >= height)
+        return -1;
+    if (size_x == 0 || size_x > width - min_x)
+        size_x = width - min_x;
+    if (size_y == 0 || size_y > height - min_y)
+        size_y = height - min_y;
+    size_x = size_x / bin * bin;
+    size_y = size_y / bin * bin;
+    if (size_x == 0 || size_y == 0)
+        return -1;
+
+    rb->width = width;
+    rb->height = height;
+    rb->elem_size = elem_size;
+    rb->min_x = min_x;
+    rb->min_y = min_y;
+    rb->size_x = size_x;
+    rb->size_y = size_y;
+    rb->bin = bin;
+    rb->out = NULL;
+    rb->mask = NULL;
+    return 0;
+}
+
+void roi_bin_start(struct roi_bin* rb, void* out, struct bslz4_mask* mask) {
+    rb->out = out;
+    rb->mask = mask;
+    // Binned pixels are sums
+    if (rb->bin > 1)
+        memset(out, 0,
+               roi_bin_out_width(rb) * roi_bin_out_height(rb) * rb->elem_size);
+}
+
+// Adds n pixels starting at column x of the region to a row of binned
+// pixels, masking the flagged pixels on the way. The pixels of each bin are
+// summed in 64 bits and added to the binned pixel saturating, which is the
+// same as saturating the whole sum since no pixel is negative.
+#define DEFINE_BIN_ROW(name, type, max)                                 \
+    static void name(const type* in, type* out, size_t n, size_t x,     \
+                     size_t bin, struct bslz4_mask* mask) {             \
+        size_t ox = x / bin, k = x % bin;                               \
+        size_t count = 0;                                               \
+        uint64_t sum = 0;                                               \
+        const type fill = mask ? (type)mask->fill : 0;                  \
+        for (size_t i = 0; i < n; i++) {                                \
+            type v = in[i];                                             \
+            if (mask && v >= (type)((max) - 1)) {                       \
+                v = fill;                                               \
+                count++;                                                \
+            }                                                           \
+            sum += v;                                                   \
+            if (++k == bin || i == n - 1) {                             \
+                sum += out[ox];                                         \
+                out[ox] = sum > (max) ? (type)(max) : (type)sum;        \
+                sum = 0;                                                \
+            }                                                           \
+            if (k == bin) {                                             \
+                k = 0;                                                  \
+                ox++;                                                   \
+            }                                                           \
+        }                                                               \
+        if (mask)                                                       \
+            mask->count += count;                                       \
+    }
+
+DEFINE_BIN_ROW(bin_row_u8, uint8_t, UINT8_MAX)
+DEFINE_BIN_ROW(bin_row_u16, uint16_t, UINT16_MAX)
+DEFINE_BIN_ROW(bin_row_u32, uint32_t, UINT32_MAX)
+
+// Adds the n pixels at in, starting at column x and row y of the region.
+static void add_row(struct roi_bin* rb,
+                    const uint8_t* in,
+                    size_t n,
+                    size_t x,
+                    size_t y) {
+    const size_t es = rb->elem_size;
+    const size_t out_width = roi_bin_out_width(rb);
+
+    if (rb->bin == 1) {
+        uint8_t* out = (uint8_t*)rb->out + (y * out_width + x) * es;
+        if (rb->mask)
+            bslz4_mask_pixels(in, out, n, es, rb->mask);
+        else
+            memcpy(out, in, n * es);
+        return;
+    }
+
+    uint8_t* out = (uint8_t*)rb->out + y / rb->bin * out_width * es;
+    switch (es) {
+        case 1:
+            bin_row_u8(in, out, n, x, rb->bin, rb->mask);
+            break;
+        case 2:
+            bin_row_u16((const uint16_t*)in, (uint16_t*)out, n, x, rb->bin,
+                        rb->mask);
+            break;
+        case 4:
+            bin_row_u32((const uint32_t*)in, (uint32_t*)out, n, x, rb->bin,
+                        rb->mask);
+            break;
+    }
+}
+
+void roi_bin_add(void* arg, const void* data, size_t first, size_t n) {
+    struct roi_bin* rb = (struct roi_bin*)arg;
+    const uint8_t* in = (const uint8_t*)data;
+    const size_t end = first + n;
+    const size_t x0 = rb->min_x, x1 = rb->min_x + rb->size_x;
+
+    size_t row = first / rb->width;
+    if (row < rb->min_y)
+        row = rb->min_y;
+    for (; row < rb->min_y + rb->size_y; row++) {
+        const size_t row_start = row * rb->width;
+        if (row_start >= end)
+            break;
+
+        // Part of the region in this row that is in [first, end)
+        size_t c0 = row_start + x0, c1 = row_start + x1;
+        if (c0 < first)
+            c0 = first;
+        if (c1 > end)
+            c1 = end;
+        if (c0 >= c1)
+            continue;
+
+        add_row(rb, in + (c0 - first) * rb->elem_size, c1 - c0,
+                c0 - row_start - x0, row - rb->min_y);
+    }
+}
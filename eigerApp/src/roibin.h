@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "bslz4.h"
+
+#if defined(__cplusplus)
+extern "C" {
+#endif
+
+// Crops a frame to a region of interest and sums bin x bin pixels, from
+// pieces of the frame in any order. Pixels are unsigned integers of 1, 2 or 4
+// bytes, and sums saturate at the largest value of the pixel type.
+struct roi_bin {
+    size_t width, height, elem_size;
+    size_t min_x, min_y, size_x, size_y, bin;
+
+    void* out;
+    struct bslz4_mask* mask;
+};
+
+// Sets up the crop of a width x height frame. A size of 0 extends the region
+// to the edge of the frame. The region is clipped to the frame, and its size
+// rounded down to a multiple of bin. Returns -1 if nothing is left.
+int roi_bin_init(struct roi_bin* rb,
+                 size_t width,
+                 size_t height,
+                 size_t elem_size,
+                 size_t min_x,
+                 size_t min_y,
+                 size_t size_x,
+                 size_t size_y,
+                 size_t bin);
+
+static inline size_t roi_bin_out_width(const struct roi_bin* rb) {
+    return rb->size_x / rb->bin;
+}
+
+static inline size_t roi_bin_out_height(const struct roi_bin* rb) {
+    return rb->size_y / rb->bin;
+}
+
+// Range of frame elements that holds the region
+static inline size_t roi_bin_first(const struct roi_bin* rb) {
+    return rb->min_y * rb->width + rb->min_x;
+}
+
+static inline size_t roi_bin_last(const struct roi_bin* rb) {
+    return (rb->min_y + rb->size_y - 1) * rb->width + rb->min_x + rb->size_x;
+}
+
+// Starts a frame. out must hold roi_bin_out_width() x roi_bin_out_height()
+// pixels. If mask is not NULL the flagged pixels in the region are masked.
+void roi_bin_start(struct roi_bin* rb, void* out, struct bslz4_mask* mask);
+
+// Adds the frame elements [first, first + n). Matches bslz4_sink, so it can
+// be given to bslz4_decompress_range().
+void roi_bin_add(void* rb, const void* data, size_t first, size_t n);
+
+#if defined(__cplusplus)
+}
+#endif
@@ -1,7 +1,6 @@
 #define __STDC_WANT_IEC_60559_TYPES_EXT__
 #include "stream2.h"
 
-#include <assert.h>
 #include <float.h>
 #if FLT16_MANT_DIG > 0 || __FLT16_MANT_DIG__ > 0
 #else
@@ -16,7 +15,252 @@
 
 #include "cbor.h"
 
-enum { MAX_KEY_LEN = 64 };
+// Map keys and message types known to the parser. Keys are looked up by
+// lookup_key() in place in the message buffer, so they are never copied.
+enum key {
+    KEY_UNKNOWN,
+    KEY_ARM_DATE,
+    KEY_BEAM_CENTER_X,
+    KEY_BEAM_CENTER_Y,
+    KEY_CHANNELS,
+    KEY_CHI,
+    KEY_COUNT_TIME,
+    KEY_COUNTRATE_CORRECTION_ENABLED,
+    KEY_COUNTRATE_CORRECTION_LOOKUP_TABLE,
+    KEY_DATA,
+    KEY_DETECTOR_DESCRIPTION,
+    KEY_DETECTOR_SERIAL_NUMBER,
+    KEY_DETECTOR_TRANSLATION,
+    KEY_END,
+    KEY_FLATFIELD,
+    KEY_FLATFIELD_ENABLED,
+    KEY_FRAME_TIME,
+    KEY_GONIOMETER,
+    KEY_IMAGE,
+    KEY_IMAGE_DTYPE,
+    KEY_IMAGE_ID,
+    KEY_IMAGE_SIZE_X,
+    KEY_IMAGE_SIZE_Y,
+    KEY_INCIDENT_ENERGY,
+    KEY_INCIDENT_WAVELENGTH,
+    KEY_INCREMENT,
+    KEY_KAPPA,
+    KEY_NUMBER_OF_IMAGES,
+    KEY_OMEGA,
+    KEY_PHI,
+    KEY_PIXEL_MASK,
+    KEY_PIXEL_MASK_ENABLED,
+    KEY_PIXEL_SIZE_X,
+    KEY_PIXEL_SIZE_Y,
+    KEY_REAL_TIME,
+    KEY_SATURATION_VALUE,
+    KEY_SENSOR_MATERIAL,
+    KEY_SENSOR_THICKNESS,
+    KEY_SERIES_DATE,
+    KEY_SERIES_ID,
+    KEY_SERIES_UNIQUE_ID,
+    KEY_START,
+    KEY_START_TIME,
+    KEY_STOP_TIME,
+    KEY_THRESHOLD_ENERGY,
+    KEY_TWO_THETA,
+    KEY_TYPE,
+    KEY_USER_DATA,
+    KEY_VIRTUAL_PIXEL_INTERPOLATION_ENABLED,
+};
+
+// Switches on the length and then the first byte of the key, which leaves at
+// most a few fixed-size comparisons.
+static enum key lookup_key(const char* key, size_t len) {
+#define KEY(name, id) \
+    if (memcmp(key, name, sizeof(name) - 1) == 0) \
+        return id
+    switch (len) {
+        case 3:
+            switch (key[0]) {
+                case 'c':
+                    KEY("chi", KEY_CHI);
+                    break;
+                case 'e':
+                    KEY("end", KEY_END);
+                    break;
+                case 'p':
+                    KEY("phi", KEY_PHI);
+                    break;
+            }
+            break;
+        case 4:
+            switch (key[0]) {
+                case 'd':
+                    KEY("data", KEY_DATA);
+                    break;
+                case 't':
+                    KEY("type", KEY_TYPE);
+                    break;
+            }
+            break;
+        case 5:
+            switch (key[0]) {
+                case 'i':
+                    KEY("image", KEY_IMAGE);
+                    break;
+                case 'k':
+                    KEY("kappa", KEY_KAPPA);
+                    break;
+                case 'o':
+                    KEY("omega", KEY_OMEGA);
+                    break;
+                case 's':
+                    KEY("start", KEY_START);
+                    break;
+            }
+            break;
+        case 8:
+            switch (key[0]) {
+                case 'a':
+                    KEY("arm_date", KEY_ARM_DATE);
+                    break;
+                case 'c':
+                    KEY("channels", KEY_CHANNELS);
+                    break;
+                case 'i':
+                    KEY("image_id", KEY_IMAGE_ID);
+                    break;
+            }
+            break;
+        case 9:
+            switch (key[0]) {
+                case 'f':
+                    KEY("flatfield", KEY_FLATFIELD);
+                    break;
+                case 'i':
+                    KEY("increment", KEY_INCREMENT);
+                    break;
+                case 'r':
+                    KEY("real_time", KEY_REAL_TIME);
+                    break;
+                case 's':
+                    KEY("series_id", KEY_SERIES_ID);
+                    KEY("stop_time", KEY_STOP_TIME);
+                    break;
+                case 't':
+                    KEY("two_theta", KEY_TWO_THETA);
+                    break;
+                case 'u':
+                    KEY("user_data", KEY_USER_DATA);
+                    break;
+            }
+            break;
+        case 10:
+            switch (key[0]) {
+                case 'c':
+                    KEY("count_time", KEY_COUNT_TIME);
+                    break;
+                case 'f':
+                    KEY("frame_time", KEY_FRAME_TIME);
+                    break;
+                case 'g':
+                    KEY("goniometer", KEY_GONIOMETER);
+                    break;
+                case 'p':
+                    KEY("pixel_mask", KEY_PIXEL_MASK);
+                    break;
+                case 's':
+                    KEY("start_time", KEY_START_TIME);
+                    break;
+            }
+            break;
+        case 11:
+            switch (key[0]) {
+                case 'i':
+                    KEY("image_dtype", KEY_IMAGE_DTYPE);
+                    break;
+                case 's':
+                    KEY("series_date", KEY_SERIES_DATE);
+                    break;
+            }
+            break;
+        case 12:
+            switch (key[0]) {
+                case 'i':
+                    KEY("image_size_x", KEY_IMAGE_SIZE_X);
+                    KEY("image_size_y", KEY_IMAGE_SIZE_Y);
+                    break;
+                case 'p':
+                    KEY("pixel_size_x", KEY_PIXEL_SIZE_X);
+                    KEY("pixel_size_y", KEY_PIXEL_SIZE_Y);
+                    break;
+            }
+            break;
+        case 13:
+            switch (key[0]) {
+                case 'b':
+                    KEY("beam_center_x", KEY_BEAM_CENTER_X);
+                    KEY("beam_center_y", KEY_BEAM_CENTER_Y);
+                    break;
+            }
+            break;
+        case 15:
+            switch (key[0]) {
+                case 'i':
+                    KEY("incident_energy", KEY_INCIDENT_ENERGY);
+                    break;
+                case 's':
+                    KEY("sensor_material", KEY_SENSOR_MATERIAL);
+                    break;
+            }
+            break;
+        case 16:
+            switch (key[0]) {
+                case 'n':
+                    KEY("number_of_images", KEY_NUMBER_OF_IMAGES);
+                    break;
+                case 's':
+                    KEY("saturation_value", KEY_SATURATION_VALUE);
+                    KEY("sensor_thickness", KEY_SENSOR_THICKNESS);
+                    KEY("series_unique_id", KEY_SERIES_UNIQUE_ID);
+                    break;
+                case 't':
+                    KEY("threshold_energy", KEY_THRESHOLD_ENERGY);
+                    break;
+            }
+            break;
+        case 17:
+            KEY("flatfield_enabled", KEY_FLATFIELD_ENABLED);
+            break;
+        case 18:
+            KEY("pixel_mask_enabled", KEY_PIXEL_MASK_ENABLED);
+            break;
+        case 19:
+            KEY("incident_wavelength", KEY_INCIDENT_WAVELENGTH);
+            break;
+        case 20:
+            switch (key[0]) {
+                case 'd':
+                    KEY("detector_description", KEY_DETECTOR_DESCRIPTION);
+                    KEY("detector_translation", KEY_DETECTOR_TRANSLATION);
+                    break;
+            }
+            break;
+        case 22:
+            KEY("detector_serial_number", KEY_DETECTOR_SERIAL_NUMBER);
+            break;
+        case 28:
+            KEY("countrate_correction_enabled",
+                KEY_COUNTRATE_CORRECTION_ENABLED);
+            break;
+        case 33:
+            KEY("countrate_correction_lookup_table",
+                KEY_COUNTRATE_CORRECTION_LOOKUP_TABLE);
+            break;
+        case 35:
+            KEY("virtual_pixel_interpolation_enabled",
+                KEY_VIRTUAL_PIXEL_INTERPOLATION_ENABLED);
+            break;
+    }
+#undef KEY
+    return KEY_UNKNOWN;
+}
 
 static const CborTag MULTI_DIMENSIONAL_ARRAY_ROW_MAJOR = 40;
 static const CborTag DECTRIS_COMPRESSION = 56500;
@@ -42,19 +286,105 @@ static enum stream2_result CBOR_RESULT(CborError e) {
     }
 }
 
+// Arena memory is handed out in multiples of this so that every allocation is
+// suitably aligned for the message structures.
+enum { ARENA_ALIGN = sizeof(max_align_t), ARENA_MIN_BLOCK = 4096 };
+
+struct stream2_arena_block {
+    struct stream2_arena_block* next;
+    size_t size;
+    size_t used;
+    max_align_t data[];
+};
+
+void stream2_arena_init(struct stream2_arena* arena) {
+    arena->head = NULL;
+    arena->reserve = 0;
+}
+
+void stream2_arena_reset(struct stream2_arena* arena) {
+    struct stream2_arena_block* block = arena->head;
+    if (block == NULL)
+        return;
+
+    if (block->next == NULL) {
+        block->used = 0;
+        return;
+    }
+
+    // The last message did not fit in one block. Replace the blocks with a
+    // single one large enough for all of them on the next allocation.
+    size_t reserve = 0;
+    while (block) {
+        struct stream2_arena_block* next = block->next;
+        reserve += block->size;
+        free(block);
+        block = next;
+    }
+    arena->head = NULL;
+    arena->reserve = reserve;
+}
+
+void stream2_arena_free(struct stream2_arena* arena) {
+    struct stream2_arena_block* block = arena->head;
+    while (block) {
+        struct stream2_arena_block* next = block->next;
+        free(block);
+        block = next;
+    }
+    stream2_arena_init(arena);
+}
+
+// Allocates zeroed memory from the arena, or from the heap if arena is NULL.
+static void* arena_calloc(struct stream2_arena* arena, size_t n, size_t size) {
+    if (arena == NULL)
+        return calloc(n, size);
+
+    if (size != 0 && n > SIZE_MAX / size)
+        return NULL;
+
+    size_t len = (n * size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+
+    struct stream2_arena_block* block = arena->head;
+    if (block == NULL || block->size - block->used < len) {
+        size_t block_size = block ? 2 * block->size : arena->reserve;
+        if (block_size < ARENA_MIN_BLOCK)
+            block_size = ARENA_MIN_BLOCK;
+        if (block_size < len)
+            block_size = len;
+
+        block = malloc(sizeof(struct stream2_arena_block) + block_size);
+        if (block == NULL)
+            return NULL;
+
+        block->next = arena->head;
+        block->size = block_size;
+        block->used = 0;
+        arena->head = block;
+    }
+
+    void* ptr = (uint8_t*)block->data + block->used;
+    block->used += len;
+    return memset(ptr, 0, n * size);
+}
+
 static enum stream2_result consume_byte_string_nocopy(const CborValue* it,
                                                       const uint8_t** bstr,
                                                       size_t* bstr_len,
                                                       CborValue* next) {
     enum stream2_result r;
 
-    assert(cbor_value_is_byte_string(it));
+    if (!cbor_value_is_byte_string(it))
+        return STREAM2_ERROR_PARSE;
 
     if ((r = CBOR_RESULT(cbor_value_get_string_length(it, bstr_len))))
         return r;
 
     const uint8_t* ptr = cbor_value_get_next_byte(it);
-    assert(*ptr >= 0x40 && *ptr <= 0x5b);
+    // A byte string of known length has its length in the initial byte or
+    // in the 1 to 8 bytes after it
+    if (*ptr < 0x40 || *ptr > 0x5b)
+        return STREAM2_ERROR_DECODE;
     switch (*ptr++) {
         case 0x58:
             ptr += 1;
@@ -79,19 +409,47 @@ static enum stream2_result consume_byte_string_nocopy(const CborValue* it,
     return STREAM2_OK;
 }
 
-static enum stream2_result parse_key(CborValue* it, char key[MAX_KEY_LEN]) {
+static enum stream2_result parse_key(CborValue* it, enum key* key) {
+    enum stream2_result r;
+
     if (!cbor_value_is_text_string(it))
         return STREAM2_ERROR_PARSE;
 
-    size_t key_len = MAX_KEY_LEN;
-    CborError e = cbor_value_copy_text_string(it, key, &key_len, it);
-    if (e == CborErrorOutOfMemory || key_len == MAX_KEY_LEN) {
-        // The key is longer than any we suppport. Return the empty key which
-        // should be handled by the caller like other unknown keys.
-        key[0] = '\0';
-        return STREAM2_OK;
+    // Keys in chunks are not sent by the detector and are treated like other
+    // unknown keys
+    if (!cbor_value_is_length_known(it)) {
+        *key = KEY_UNKNOWN;
+        return CBOR_RESULT(cbor_value_advance(it));
+    }
+
+    size_t len;
+    if ((r = CBOR_RESULT(cbor_value_get_string_length(it, &len))))
+        return r;
+
+    const uint8_t* ptr = cbor_value_get_next_byte(it);
+    if (*ptr < 0x60 || *ptr > 0x7b)
+        return STREAM2_ERROR_DECODE;
+    switch (*ptr++) {
+        case 0x78:
+            ptr += 1;
+            break;
+        case 0x79:
+            ptr += 2;
+            break;
+        case 0x7a:
+            ptr += 4;
+            break;
+        case 0x7b:
+            ptr += 8;
+            break;
     }
-    return CBOR_RESULT(e);
+
+    // Advancing checks that the key lies within the buffer
+    if ((r = CBOR_RESULT(cbor_value_advance(it))))
+        return r;
+
+    *key = lookup_key((const char*)ptr, len);
+    return STREAM2_OK;
 }
 
 static enum stream2_result parse_tag(CborValue* it, CborTag* value) {
@@ -163,12 +521,26 @@ static enum stream2_result parse_uint64(CborValue* it, uint64_t* value) {
     return CBOR_RESULT(cbor_value_advance_fixed(it));
 }
 
-static enum stream2_result parse_text_string(CborValue* it, char** tstr) {
+static enum stream2_result parse_text_string(CborValue* it,
+                                             char** tstr,
+                                             struct stream2_arena* arena) {
+    enum stream2_result r;
+
     if (!cbor_value_is_text_string(it))
         return STREAM2_ERROR_PARSE;
 
     size_t len;
-    return CBOR_RESULT(cbor_value_dup_text_string(it, tstr, &len, it));
+    if (arena == NULL)
+        return CBOR_RESULT(cbor_value_dup_text_string(it, tstr, &len, it));
+
+    if ((r = CBOR_RESULT(cbor_value_calculate_string_length(it, &len))))
+        return r;
+
+    len += 1;
+    if ((*tstr = arena_calloc(arena, len, 1)) == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    return CBOR_RESULT(cbor_value_copy_text_string(it, *tstr, &len, it));
 }
 
 static enum stream2_result parse_array_2_uint64(CborValue* it,
@@ -201,7 +573,8 @@ static enum stream2_result parse_dectris_compression(
         CborValue* it,
         struct stream2_compression* compression,
         const uint8_t** bstr,
-        size_t* bstr_len) {
+        size_t* bstr_len,
+        struct stream2_arena* arena) {
     enum stream2_result r;
 
     CborTag tag;
@@ -225,7 +598,7 @@ static enum stream2_result parse_dectris_compression(
     if ((r = CBOR_RESULT(cbor_value_enter_container(it, &elt))))
         return r;
 
-    if ((r = parse_text_string(&elt, &compression->algorithm)))
+    if ((r = parse_text_string(&elt, &compression->algorithm, arena)))
         return r;
 
     if ((r = parse_uint64(&elt, &compression->elem_size)))
@@ -252,7 +625,8 @@ static enum stream2_result parse_dectris_compression(
 }
 
 static enum stream2_result parse_bytes(CborValue* it,
-                                       struct stream2_bytes* bytes) {
+                                       struct stream2_bytes* bytes,
+                                       struct stream2_arena* arena) {
     enum stream2_result r;
 
     if (cbor_value_is_tag(it)) {
@@ -262,7 +636,7 @@ static enum stream2_result parse_bytes(CborValue* it,
 
         if (tag == DECTRIS_COMPRESSION) {
             return parse_dectris_compression(it, &bytes->compression,
-                                             &bytes->ptr, &bytes->len);
+                                             &bytes->ptr, &bytes->len, arena);
         } else {
             return STREAM2_ERROR_PARSE;
         }
@@ -284,13 +658,14 @@ static enum stream2_result parse_bytes(CborValue* it,
 // https://www.rfc-editor.org/rfc/rfc8746.html#name-typed-arrays
 static enum stream2_result parse_typed_array(CborValue* it,
                                              struct stream2_typed_array* array,
-                                             uint64_t* len) {
+                                             uint64_t* len,
+                                             struct stream2_arena* arena) {
     enum stream2_result r;
 
     if ((r = parse_tag(it, &array->tag)))
         return r;
 
-    if ((r = parse_bytes(it, &array->data)))
+    if ((r = parse_bytes(it, &array->data, arena)))
         return r;
 
     uint64_t elem_size;
@@ -316,7 +691,8 @@ static enum stream2_result parse_typed_array(CborValue* it,
 // https://www.rfc-editor.org/rfc/rfc8746.html#name-row-major-order
 static enum stream2_result parse_multidim_array(
         CborValue* it,
-        struct stream2_multidim_array* multidim) {
+        struct stream2_multidim_array* multidim,
+        struct stream2_arena* arena) {
     enum stream2_result r;
 
     CborTag tag;
@@ -344,7 +720,7 @@ static enum stream2_result parse_multidim_array(
         return r;
 
     uint64_t array_len;
-    if ((r = parse_typed_array(&elt, &multidim->array, &array_len)))
+    if ((r = parse_typed_array(&elt, &multidim->array, &array_len, arena)))
         return r;
 
     if (multidim->dim[0] * multidim->dim[1] != array_len)
@@ -366,22 +742,26 @@ static enum stream2_result parse_goniometer_axis(
         return r;
 
     while (cbor_value_is_valid(&field)) {
-        char key[MAX_KEY_LEN];
-        if ((r = parse_key(&field, key)))
+        enum key key;
+        if ((r = parse_key(&field, &key)))
             return r;
 
         if ((r = CBOR_RESULT(cbor_value_skip_tag(&field))))
             return r;
 
-        if (strcmp(key, "increment") == 0) {
-            if ((r = parse_double(&field, &axis->increment)))
-                return r;
-        } else if (strcmp(key, "start") == 0) {
-            if ((r = parse_double(&field, &axis->start)))
-                return r;
-        } else {
-            if ((r = CBOR_RESULT(cbor_value_advance(&field))))
-                return r;
+        switch (key) {
+            case KEY_INCREMENT:
+                if ((r = parse_double(&field, &axis->increment)))
+                    return r;
+                break;
+            case KEY_START:
+                if ((r = parse_double(&field, &axis->start)))
+                    return r;
+                break;
+            default:
+                if ((r = CBOR_RESULT(cbor_value_advance(&field))))
+                    return r;
+                break;
         }
     }
 
@@ -401,31 +781,38 @@ static enum stream2_result parse_goniometer(
         return r;
 
     while (cbor_value_is_valid(&field)) {
-        char key[MAX_KEY_LEN];
-        if ((r = parse_key(&field, key)))
+        enum key key;
+        if ((r = parse_key(&field, &key)))
             return r;
 
         if ((r = CBOR_RESULT(cbor_value_skip_tag(&field))))
             return r;
 
-        if (strcmp(key, "chi") == 0) {
-            if ((r = parse_goniometer_axis(&field, &goniometer->chi)))
-                return r;
-        } else if (strcmp(key, "kappa") == 0) {
-            if ((r = parse_goniometer_axis(&field, &goniometer->kappa)))
-                return r;
-        } else if (strcmp(key, "omega") == 0) {
-            if ((r = parse_goniometer_axis(&field, &goniometer->omega)))
-                return r;
-        } else if (strcmp(key, "phi") == 0) {
-            if ((r = parse_goniometer_axis(&field, &goniometer->phi)))
-                return r;
-        } else if (strcmp(key, "two_theta") == 0) {
-            if ((r = parse_goniometer_axis(&field, &goniometer->two_theta)))
-                return r;
-        } else {
-            if ((r = CBOR_RESULT(cbor_value_advance(&field))))
-                return r;
+        switch (key) {
+            case KEY_CHI:
+                if ((r = parse_goniometer_axis(&field, &goniometer->chi)))
+                    return r;
+                break;
+            case KEY_KAPPA:
+                if ((r = parse_goniometer_axis(&field, &goniometer->kappa)))
+                    return r;
+                break;
+            case KEY_OMEGA:
+                if ((r = parse_goniometer_axis(&field, &goniometer->omega)))
+                    return r;
+                break;
+            case KEY_PHI:
+                if ((r = parse_goniometer_axis(&field, &goniometer->phi)))
+                    return r;
+                break;
+            case KEY_TWO_THETA:
+                if ((r = parse_goniometer_axis(&field, &goniometer->two_theta)))
+                    return r;
+                break;
+            default:
+                if ((r = CBOR_RESULT(cbor_value_advance(&field))))
+                    return r;
+                break;
         }
     }
 
@@ -449,10 +836,12 @@ static enum stream2_result parse_user_data(
 }
 
 static enum stream2_result parse_start_msg(CborValue* it,
-                                           struct stream2_msg** msg_out) {
+                                           struct stream2_msg** msg_out,
+                                           struct stream2_arena* arena) {
     enum stream2_result r;
 
-    struct stream2_start_msg* msg = calloc(1, sizeof(struct stream2_start_msg));
+    struct stream2_start_msg* msg =
+            arena_calloc(arena, 1, sizeof(struct stream2_start_msg));
     *msg_out = (struct stream2_msg*)msg;
     if (msg == NULL)
         return STREAM2_ERROR_OUT_OF_MEMORY;
@@ -461,251 +850,395 @@ static enum stream2_result parse_start_msg(CborValue* it,
     msg->countrate_correction_lookup_table.tag = UINT64_MAX;
 
     while (cbor_value_is_valid(it)) {
-        char key[MAX_KEY_LEN];
-        if ((r = parse_key(it, key)))
+        enum key key;
+        if ((r = parse_key(it, &key)))
             return r;
 
         // skip any tag for a value, except where verified
-        if (strcmp(key, "countrate_correction_lookup_table") != 0) {
+        if (key != KEY_COUNTRATE_CORRECTION_LOOKUP_TABLE) {
             if ((r = CBOR_RESULT(cbor_value_skip_tag(it))))
                 return r;
         }
 
-        if (strcmp(key, "series_id") == 0) {
-            if ((r = parse_uint64(it, &msg->series_id)))
-                return r;
-        } else if (strcmp(key, "series_unique_id") == 0) {
-            if ((r = parse_text_string(it, &msg->series_unique_id)))
-                return r;
-        } else if (strcmp(key, "arm_date") == 0) {
-            if ((r = parse_text_string(it, &msg->arm_date)))
-                return r;
-        } else if (strcmp(key, "beam_center_x") == 0) {
-            if ((r = parse_double(it, &msg->beam_center_x)))
-                return r;
-        } else if (strcmp(key, "beam_center_y") == 0) {
-            if ((r = parse_double(it, &msg->beam_center_y)))
-                return r;
-        } else if (strcmp(key, "channels") == 0) {
-            if (!cbor_value_is_array(it))
-                return STREAM2_ERROR_PARSE;
+        switch (key) {
+            case KEY_SERIES_ID:
+                if ((r = parse_uint64(it, &msg->series_id)))
+                    return r;
+                break;
+            case KEY_SERIES_UNIQUE_ID:
+                if ((r = parse_text_string(it, &msg->series_unique_id, arena)))
+                    return r;
+                break;
+            case KEY_ARM_DATE:
+                if ((r = parse_text_string(it, &msg->arm_date, arena)))
+                    return r;
+                break;
+            case KEY_BEAM_CENTER_X:
+                if ((r = parse_double(it, &msg->beam_center_x)))
+                    return r;
+                break;
+            case KEY_BEAM_CENTER_Y:
+                if ((r = parse_double(it, &msg->beam_center_y)))
+                    return r;
+                break;
+            case KEY_CHANNELS: {
+                if (!cbor_value_is_array(it))
+                    return STREAM2_ERROR_PARSE;
 
-            size_t len;
-            if ((r = CBOR_RESULT(cbor_value_get_array_length(it, &len))))
-                return r;
+                size_t len;
+                if ((r = CBOR_RESULT(cbor_value_get_array_length(it, &len))))
+                    return r;
 
-            msg->channels.ptr = calloc(len, sizeof(char*));
-            if (msg->channels.ptr == NULL)
-                return STREAM2_ERROR_OUT_OF_MEMORY;
+                msg->channels.ptr = arena_calloc(arena, len, sizeof(char*));
+                if (msg->channels.ptr == NULL)
+                    return STREAM2_ERROR_OUT_OF_MEMORY;
 
-            msg->channels.len = len;
+                msg->channels.len = len;
 
-            CborValue elt;
-            if ((r = CBOR_RESULT(cbor_value_enter_container(it, &elt))))
-                return r;
+                CborValue elt;
+                if ((r = CBOR_RESULT(cbor_value_enter_container(it, &elt))))
+                    return r;
+
+                for (size_t i = 0; i < len; i++) {
+                    if ((r = parse_text_string(&elt, &msg->channels.ptr[i],
+                                               arena)))
+                        return r;
+                }
 
-            for (size_t i = 0; i < len; i++) {
-                if ((r = parse_text_string(&elt, &msg->channels.ptr[i])))
+                if ((r = CBOR_RESULT(cbor_value_leave_container(it, &elt))))
+                    return r;
+                break;
+            }
+            case KEY_COUNT_TIME:
+                if ((r = parse_double(it, &msg->count_time)))
+                    return r;
+                break;
+            case KEY_COUNTRATE_CORRECTION_ENABLED:
+                if ((r = parse_bool(it, &msg->countrate_correction_enabled)))
+                    return r;
+                break;
+            case KEY_COUNTRATE_CORRECTION_LOOKUP_TABLE: {
+                uint64_t len;
+                if ((r = parse_typed_array(
+                             it, &msg->countrate_correction_lookup_table, &len,
+                             arena)))
                     return r;
+                break;
             }
+            case KEY_DETECTOR_DESCRIPTION:
+                if ((r = parse_text_string(it, &msg->detector_description,
+                                           arena)))
+                    return r;
+                break;
+            case KEY_DETECTOR_SERIAL_NUMBER:
+                if ((r = parse_text_string(it, &msg->detector_serial_number,
+                                           arena)))
+                    return r;
+                break;
+            case KEY_DETECTOR_TRANSLATION: {
+                if (!cbor_value_is_array(it))
+                    return STREAM2_ERROR_PARSE;
 
-            if ((r = CBOR_RESULT(cbor_value_leave_container(it, &elt))))
-                return r;
-        } else if (strcmp(key, "count_time") == 0) {
-            if ((r = parse_double(it, &msg->count_time)))
-                return r;
-        } else if (strcmp(key, "countrate_correction_enabled") == 0) {
-            if ((r = parse_bool(it, &msg->countrate_correction_enabled)))
-                return r;
-        } else if (strcmp(key, "countrate_correction_lookup_table") == 0) {
-            uint64_t len;
-            if ((r = parse_typed_array(
-                         it, &msg->countrate_correction_lookup_table, &len)))
-                return r;
-        } else if (strcmp(key, "detector_description") == 0) {
-            if ((r = parse_text_string(it, &msg->detector_description)))
-                return r;
-        } else if (strcmp(key, "detector_serial_number") == 0) {
-            if ((r = parse_text_string(it, &msg->detector_serial_number)))
-                return r;
-        } else if (strcmp(key, "detector_translation") == 0) {
-            if (!cbor_value_is_array(it))
-                return STREAM2_ERROR_PARSE;
+                size_t len;
+                if ((r = CBOR_RESULT(cbor_value_get_array_length(it, &len))))
+                    return r;
 
-            size_t len;
-            if ((r = CBOR_RESULT(cbor_value_get_array_length(it, &len))))
-                return r;
+                if (len != 3)
+                    return STREAM2_ERROR_PARSE;
 
-            if (len != 3)
-                return STREAM2_ERROR_PARSE;
+                CborValue elt;
+                if ((r = CBOR_RESULT(cbor_value_enter_container(it, &elt))))
+                    return r;
 
-            CborValue elt;
-            if ((r = CBOR_RESULT(cbor_value_enter_container(it, &elt))))
-                return r;
+                for (size_t i = 0; i < len; i++) {
+                    if ((r = parse_double(&elt, &msg->detector_translation[i])))
+                        return r;
+                }
 
-            for (size_t i = 0; i < len; i++) {
-                if ((r = parse_double(&elt, &msg->detector_translation[i])))
+                if ((r = CBOR_RESULT(cbor_value_leave_container(it, &elt))))
                     return r;
+                break;
             }
+            case KEY_FLATFIELD: {
+                if (!cbor_value_is_map(it))
+                    return STREAM2_ERROR_PARSE;
 
-            if ((r = CBOR_RESULT(cbor_value_leave_container(it, &elt))))
-                return r;
-        } else if (strcmp(key, "flatfield") == 0) {
-            if (!cbor_value_is_map(it))
-                return STREAM2_ERROR_PARSE;
+                size_t len;
+                if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
+                    return r;
 
-            size_t len;
-            if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
-                return r;
+                msg->flatfield.ptr =
+                        arena_calloc(arena, len,
+                                     sizeof(struct stream2_flatfield));
+                if (msg->flatfield.ptr == NULL)
+                    return STREAM2_ERROR_OUT_OF_MEMORY;
 
-            msg->flatfield.ptr = calloc(len, sizeof(struct stream2_flatfield));
-            if (msg->flatfield.ptr == NULL)
-                return STREAM2_ERROR_OUT_OF_MEMORY;
+                msg->flatfield.len = len;
 
-            msg->flatfield.len = len;
+                CborValue field;
+                if ((r = CBOR_RESULT(cbor_value_enter_container(it, &field))))
+                    return r;
 
-            CborValue field;
-            if ((r = CBOR_RESULT(cbor_value_enter_container(it, &field))))
-                return r;
+                for (size_t i = 0; i < len; i++) {
+                    if ((r = parse_text_string(&field,
+                                               &msg->flatfield.ptr[i].channel,
+                                               arena)))
+                        return r;
 
-            for (size_t i = 0; i < len; i++) {
-                if ((r = parse_text_string(&field,
-                                           &msg->flatfield.ptr[i].channel)))
-                    return r;
+                    if ((r = parse_multidim_array(
+                                 &field, &msg->flatfield.ptr[i].flatfield,
+                                 arena)))
+                        return r;
+                }
 
-                if ((r = parse_multidim_array(
-                             &field, &msg->flatfield.ptr[i].flatfield)))
+                if ((r = CBOR_RESULT(cbor_value_leave_container(it, &field))))
                     return r;
+                break;
             }
+            case KEY_FLATFIELD_ENABLED:
+                if ((r = parse_bool(it, &msg->flatfield_enabled)))
+                    return r;
+                break;
+            case KEY_FRAME_TIME:
+                if ((r = parse_double(it, &msg->frame_time)))
+                    return r;
+                break;
+            case KEY_GONIOMETER:
+                if ((r = parse_goniometer(it, &msg->goniometer)))
+                    return r;
+                break;
+            case KEY_IMAGE_DTYPE:
+                if ((r = parse_text_string(it, &msg->image_dtype, arena)))
+                    return r;
+                break;
+            case KEY_IMAGE_SIZE_X:
+                if ((r = parse_uint64(it, &msg->image_size_x)))
+                    return r;
+                break;
+            case KEY_IMAGE_SIZE_Y:
+                if ((r = parse_uint64(it, &msg->image_size_y)))
+                    return r;
+                break;
+            case KEY_INCIDENT_ENERGY:
+                if ((r = parse_double(it, &msg->incident_energy)))
+                    return r;
+                break;
+            case KEY_INCIDENT_WAVELENGTH:
+                if ((r = parse_double(it, &msg->incident_wavelength)))
+                    return r;
+                break;
+            case KEY_NUMBER_OF_IMAGES:
+                if ((r = parse_uint64(it, &msg->number_of_images)))
+                    return r;
+                break;
+            case KEY_PIXEL_MASK: {
+                if (!cbor_value_is_map(it))
+                    return STREAM2_ERROR_PARSE;
 
-            if ((r = CBOR_RESULT(cbor_value_leave_container(it, &field))))
-                return r;
-        } else if (strcmp(key, "flatfield_enabled") == 0) {
-            if ((r = parse_bool(it, &msg->flatfield_enabled)))
-                return r;
-        } else if (strcmp(key, "frame_time") == 0) {
-            if ((r = parse_double(it, &msg->frame_time)))
-                return r;
-        } else if (strcmp(key, "goniometer") == 0) {
-            if ((r = parse_goniometer(it, &msg->goniometer)))
-                return r;
-        } else if (strcmp(key, "image_dtype") == 0) {
-            if ((r = parse_text_string(it, &msg->image_dtype)))
-                return r;
-        } else if (strcmp(key, "image_size_x") == 0) {
-            if ((r = parse_uint64(it, &msg->image_size_x)))
-                return r;
-        } else if (strcmp(key, "image_size_y") == 0) {
-            if ((r = parse_uint64(it, &msg->image_size_y)))
-                return r;
-        } else if (strcmp(key, "incident_energy") == 0) {
-            if ((r = parse_double(it, &msg->incident_energy)))
-                return r;
-        } else if (strcmp(key, "incident_wavelength") == 0) {
-            if ((r = parse_double(it, &msg->incident_wavelength)))
-                return r;
-        } else if (strcmp(key, "number_of_images") == 0) {
-            if ((r = parse_uint64(it, &msg->number_of_images)))
-                return r;
-        } else if (strcmp(key, "pixel_mask") == 0) {
-            if (!cbor_value_is_map(it))
-                return STREAM2_ERROR_PARSE;
+                size_t len;
+                if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
+                    return r;
 
-            size_t len;
-            if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
-                return r;
+                msg->pixel_mask.ptr =
+                        arena_calloc(arena, len,
+                                     sizeof(struct stream2_pixel_mask));
+                if (msg->pixel_mask.ptr == NULL)
+                    return STREAM2_ERROR_OUT_OF_MEMORY;
 
-            msg->pixel_mask.ptr =
-                    calloc(len, sizeof(struct stream2_pixel_mask));
-            if (msg->pixel_mask.ptr == NULL)
-                return STREAM2_ERROR_OUT_OF_MEMORY;
+                msg->pixel_mask.len = len;
 
-            msg->pixel_mask.len = len;
+                CborValue field;
+                if ((r = CBOR_RESULT(cbor_value_enter_container(it, &field))))
+                    return r;
 
-            CborValue field;
-            if ((r = CBOR_RESULT(cbor_value_enter_container(it, &field))))
-                return r;
+                for (size_t i = 0; i < len; i++) {
+                    if ((r = parse_text_string(&field,
+                                               &msg->pixel_mask.ptr[i].channel,
+                                               arena)))
+                        return r;
 
-            for (size_t i = 0; i < len; i++) {
-                if ((r = parse_text_string(&field,
-                                           &msg->pixel_mask.ptr[i].channel)))
-                    return r;
+                    if ((r = parse_multidim_array(
+                                 &field, &msg->pixel_mask.ptr[i].pixel_mask,
+                                 arena)))
+                        return r;
+                }
 
-                if ((r = parse_multidim_array(
-                             &field, &msg->pixel_mask.ptr[i].pixel_mask)))
+                if ((r = CBOR_RESULT(cbor_value_leave_container(it, &field))))
                     return r;
+                break;
             }
+            case KEY_PIXEL_MASK_ENABLED:
+                if ((r = parse_bool(it, &msg->pixel_mask_enabled)))
+                    return r;
+                break;
+            case KEY_PIXEL_SIZE_X:
+                if ((r = parse_double(it, &msg->pixel_size_x)))
+                    return r;
+                break;
+            case KEY_PIXEL_SIZE_Y:
+                if ((r = parse_double(it, &msg->pixel_size_y)))
+                    return r;
+                break;
+            case KEY_SATURATION_VALUE:
+                if ((r = parse_uint64(it, &msg->saturation_value)))
+                    return r;
+                break;
+            case KEY_SENSOR_MATERIAL:
+                if ((r = parse_text_string(it, &msg->sensor_material, arena)))
+                    return r;
+                break;
+            case KEY_SENSOR_THICKNESS:
+                if ((r = parse_double(it, &msg->sensor_thickness)))
+                    return r;
+                break;
+            case KEY_THRESHOLD_ENERGY: {
+                if (!cbor_value_is_map(it))
+                    return STREAM2_ERROR_PARSE;
 
-            if ((r = CBOR_RESULT(cbor_value_leave_container(it, &field))))
-                return r;
-        } else if (strcmp(key, "pixel_mask_enabled") == 0) {
-            if ((r = parse_bool(it, &msg->pixel_mask_enabled)))
-                return r;
-        } else if (strcmp(key, "pixel_size_x") == 0) {
-            if ((r = parse_double(it, &msg->pixel_size_x)))
-                return r;
-        } else if (strcmp(key, "pixel_size_y") == 0) {
-            if ((r = parse_double(it, &msg->pixel_size_y)))
-                return r;
-        } else if (strcmp(key, "saturation_value") == 0) {
-            if ((r = parse_uint64(it, &msg->saturation_value)))
-                return r;
-        } else if (strcmp(key, "sensor_material") == 0) {
-            if ((r = parse_text_string(it, &msg->sensor_material)))
-                return r;
-        } else if (strcmp(key, "sensor_thickness") == 0) {
-            if ((r = parse_double(it, &msg->sensor_thickness)))
-                return r;
-        } else if (strcmp(key, "threshold_energy") == 0) {
-            if (!cbor_value_is_map(it))
-                return STREAM2_ERROR_PARSE;
+                size_t len;
+                if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
+                    return r;
 
-            size_t len;
-            if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
-                return r;
+                msg->threshold_energy.ptr =
+                        arena_calloc(arena, len,
+                                     sizeof(struct stream2_threshold_energy));
+                if (msg->threshold_energy.ptr == NULL)
+                    return STREAM2_ERROR_OUT_OF_MEMORY;
 
-            msg->threshold_energy.ptr =
-                    calloc(len, sizeof(struct stream2_threshold_energy));
-            if (msg->threshold_energy.ptr == NULL)
-                return STREAM2_ERROR_OUT_OF_MEMORY;
+                msg->threshold_energy.len = len;
 
-            msg->threshold_energy.len = len;
+                CborValue field;
+                if ((r = CBOR_RESULT(cbor_value_enter_container(it, &field))))
+                    return r;
 
-            CborValue field;
-            if ((r = CBOR_RESULT(cbor_value_enter_container(it, &field))))
-                return r;
+                for (size_t i = 0; i < len; i++) {
+                    if ((r = parse_text_string(
+                                 &field, &msg->threshold_energy.ptr[i].channel,
+                                 arena)))
+                        return r;
 
-            for (size_t i = 0; i < len; i++) {
-                if ((r = parse_text_string(
-                             &field, &msg->threshold_energy.ptr[i].channel)))
-                    return r;
+                    if ((r = parse_double(
+                                 &field, &msg->threshold_energy.ptr[i].energy)))
+                        return r;
+                }
 
-                if ((r = parse_double(&field,
-                                      &msg->threshold_energy.ptr[i].energy)))
+                if ((r = CBOR_RESULT(cbor_value_leave_container(it, &field))))
                     return r;
+                break;
             }
-
-            if ((r = CBOR_RESULT(cbor_value_leave_container(it, &field))))
-                return r;
-        } else if (strcmp(key, "user_data") == 0) {
-            if ((r = parse_user_data(it, &msg->user_data)))
-                return r;
-        } else if (strcmp(key, "virtual_pixel_interpolation_enabled") == 0) {
-            if ((r = parse_bool(it, &msg->virtual_pixel_interpolation_enabled)))
-                return r;
-        } else {
-            if ((r = CBOR_RESULT(cbor_value_advance(it))))
-                return r;
+            case KEY_USER_DATA:
+                if ((r = parse_user_data(it, &msg->user_data)))
+                    return r;
+                break;
+            case KEY_VIRTUAL_PIXEL_INTERPOLATION_ENABLED:
+                if ((r = parse_bool(
+                             it, &msg->virtual_pixel_interpolation_enabled)))
+                    return r;
+                break;
+            default:
+                if ((r = CBOR_RESULT(cbor_value_advance(it))))
+                    return r;
+                break;
         }
     }
     return STREAM2_OK;
 }
 
+// Returns the bit number of the stream2_image_field for a key, or -1 for keys
+// that are not part of an image message.
+static int image_field_index(enum key key) {
+    switch (key) {
+        case KEY_SERIES_ID:
+            return 0;
+        case KEY_SERIES_UNIQUE_ID:
+            return 1;
+        case KEY_IMAGE_ID:
+            return 2;
+        case KEY_REAL_TIME:
+            return 3;
+        case KEY_SERIES_DATE:
+            return 4;
+        case KEY_START_TIME:
+            return 5;
+        case KEY_STOP_TIME:
+            return 6;
+        case KEY_USER_DATA:
+            return 7;
+        case KEY_DATA:
+            return 8;
+        default:
+            return -1;
+    }
+}
+
+static enum stream2_result parse_image_field(CborValue* it,
+                                             struct stream2_image_msg* msg,
+                                             int index,
+                                             struct stream2_arena* arena) {
+    enum stream2_result r;
+
+    switch (index) {
+        case 0:
+            return parse_uint64(it, &msg->series_id);
+        case 1:
+            return parse_text_string(it, &msg->series_unique_id, arena);
+        case 2:
+            return parse_uint64(it, &msg->image_id);
+        case 3:
+            return parse_array_2_uint64(it, msg->real_time);
+        case 4:
+            return parse_text_string(it, &msg->series_date, arena);
+        case 5:
+            return parse_array_2_uint64(it, msg->start_time);
+        case 6:
+            return parse_array_2_uint64(it, msg->stop_time);
+        case 7:
+            return parse_user_data(it, &msg->user_data);
+        case 8:
+            break;
+        default:
+            return STREAM2_ERROR_PARSE;
+    }
+
+    if (!cbor_value_is_map(it))
+        return STREAM2_ERROR_PARSE;
+
+    size_t len;
+    if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
+        return r;
+
+    msg->data.ptr =
+            arena_calloc(arena, len, sizeof(struct stream2_image_data));
+    if (msg->data.ptr == NULL)
+        return STREAM2_ERROR_OUT_OF_MEMORY;
+
+    msg->data.len = len;
+
+    CborValue field;
+    if ((r = CBOR_RESULT(cbor_value_enter_container(it, &field))))
+        return r;
+
+    for (size_t i = 0; i < len; i++) {
+        if ((r = parse_text_string(&field, &msg->data.ptr[i].channel,
+                                   arena)))
+            return r;
+
+        if ((r = parse_multidim_array(&field, &msg->data.ptr[i].data,
+                                      arena)))
+            return r;
+    }
+
+    return CBOR_RESULT(cbor_value_leave_container(it, &field));
+}
+
 static enum stream2_result parse_image_msg(CborValue* it,
-                                           struct stream2_msg** msg_out) {
+                                           struct stream2_msg** msg_out,
+                                           struct stream2_arena* arena,
+                                           uint32_t fields) {
     enum stream2_result r;
 
-    struct stream2_image_msg* msg = calloc(1, sizeof(struct stream2_image_msg));
+    struct stream2_image_msg* msg =
+            arena_calloc(arena, 1, sizeof(struct stream2_image_msg));
     *msg_out = (struct stream2_msg*)msg;
     if (msg == NULL)
         return STREAM2_ERROR_OUT_OF_MEMORY;
@@ -713,78 +1246,63 @@ static enum stream2_result parse_image_msg(CborValue* it,
     msg->type = STREAM2_MSG_IMAGE;
 
     while (cbor_value_is_valid(it)) {
-        char key[MAX_KEY_LEN];
-        if ((r = parse_key(it, key)))
+        enum key key;
+        if ((r = parse_key(it, &key)))
             return r;
 
         if ((r = CBOR_RESULT(cbor_value_skip_tag(it))))
             return r;
 
-        if (strcmp(key, "series_id") == 0) {
-            if ((r = parse_uint64(it, &msg->series_id)))
-                return r;
-        } else if (strcmp(key, "series_unique_id") == 0) {
-            if ((r = parse_text_string(it, &msg->series_unique_id)))
-                return r;
-        } else if (strcmp(key, "image_id") == 0) {
-            if ((r = parse_uint64(it, &msg->image_id)))
-                return r;
-        } else if (strcmp(key, "real_time") == 0) {
-            if ((r = parse_array_2_uint64(it, msg->real_time)))
-                return r;
-        } else if (strcmp(key, "series_date") == 0) {
-            if ((r = parse_text_string(it, &msg->series_date)))
-                return r;
-        } else if (strcmp(key, "start_time") == 0) {
-            if ((r = parse_array_2_uint64(it, msg->start_time)))
+        int index = image_field_index(key);
+        if (index >= 0 && (fields & (1u << index))) {
+            if ((r = parse_image_field(it, msg, index, arena)))
                 return r;
-        } else if (strcmp(key, "stop_time") == 0) {
-            if ((r = parse_array_2_uint64(it, msg->stop_time)))
-                return r;
-        } else if (strcmp(key, "user_data") == 0) {
-            if ((r = parse_user_data(it, &msg->user_data)))
-                return r;
-        } else if (strcmp(key, "data") == 0) {
-            if (!cbor_value_is_map(it))
-                return STREAM2_ERROR_PARSE;
-
-            size_t len;
-            if ((r = CBOR_RESULT(cbor_value_get_map_length(it, &len))))
+            msg->fields |= 1u << index;
+        } else {
+            // Keep the value of a known field, so it can be decoded later
+            const uint8_t* ptr = cbor_value_get_next_byte(it);
+            if ((r = CBOR_RESULT(cbor_value_advance(it))))
                 return r;
+            if (index >= 0) {
+                msg->raw[index].ptr = ptr;
+                msg->raw[index].len = cbor_value_get_next_byte(it) - ptr;
+            }
+        }
+    }
+    return STREAM2_OK;
+}
 
-            msg->data.ptr = calloc(len, sizeof(struct stream2_image_data));
-            if (msg->data.ptr == NULL)
-                return STREAM2_ERROR_OUT_OF_MEMORY;
-
-            msg->data.len = len;
-
-            CborValue field;
-            if ((r = CBOR_RESULT(cbor_value_enter_container(it, &field))))
-                return r;
+enum stream2_result stream2_image_msg_decode(struct stream2_image_msg* msg,
+                                             uint32_t fields,
+                                             struct stream2_arena* arena) {
+    enum stream2_result r;
 
-            for (size_t i = 0; i < len; i++) {
-                if ((r = parse_text_string(&field, &msg->data.ptr[i].channel)))
-                    return r;
+    for (int index = 0; index < STREAM2_IMAGE_NUM_FIELDS; index++) {
+        const uint32_t field = 1u << index;
+        const struct stream2_raw_value* raw = &msg->raw[index];
+        if (!(fields & field) || (msg->fields & field) || raw->ptr == NULL)
+            continue;
 
-                if ((r = parse_multidim_array(&field, &msg->data.ptr[i].data)))
-                    return r;
-            }
+        CborParser parser;
+        CborValue it;
+        if ((r = CBOR_RESULT(
+                     cbor_parser_init(raw->ptr, raw->len, 0, &parser, &it))))
+            return r;
 
-            if ((r = CBOR_RESULT(cbor_value_leave_container(it, &field))))
-                return r;
-        } else {
-            if ((r = CBOR_RESULT(cbor_value_advance(it))))
-                return r;
-        }
+        if ((r = parse_image_field(&it, msg, index, arena)))
+            return r;
+        msg->fields |= field;
     }
     return STREAM2_OK;
 }
 
 static enum stream2_result parse_end_msg(CborValue* it,
-                                         struct stream2_msg** msg_out) {
+                                         struct stream2_msg** msg_out,
+                                         struct stream2_arena* arena) {
     enum stream2_result r;
 
-    struct stream2_end_msg* msg = calloc(1, sizeof(struct stream2_end_msg));
+    struct stream2_end_msg* msg =
+            arena_calloc(arena, 1, sizeof(struct stream2_end_msg));
     *msg_out = (struct stream2_msg*)msg;
     if (msg == NULL)
         return STREAM2_ERROR_OUT_OF_MEMORY;
@@ -792,36 +1310,39 @@ static enum stream2_result parse_end_msg(CborValue* it,
     msg->type = STREAM2_MSG_END;
 
     while (cbor_value_is_valid(it)) {
-        char key[MAX_KEY_LEN];
-        if ((r = parse_key(it, key)))
+        enum key key;
+        if ((r = parse_key(it, &key)))
             return r;
 
         if ((r = CBOR_RESULT(cbor_value_skip_tag(it))))
             return r;
 
-        if (strcmp(key, "series_id") == 0) {
-            if ((r = parse_uint64(it, &msg->series_id)))
-                return r;
-        } else if (strcmp(key, "series_unique_id") == 0) {
-            if ((r = parse_text_string(it, &msg->series_unique_id)))
-                return r;
-        } else {
-            if ((r = CBOR_RESULT(cbor_value_advance(it))))
-                return r;
+        switch (key) {
+            case KEY_SERIES_ID:
+                if ((r = parse_uint64(it, &msg->series_id)))
+                    return r;
+                break;
+            case KEY_SERIES_UNIQUE_ID:
+                if ((r = parse_text_string(it, &msg->series_unique_id, arena)))
+                    return r;
+                break;
+            default:
+                if ((r = CBOR_RESULT(cbor_value_advance(it))))
+                    return r;
+                break;
         }
     }
     return STREAM2_OK;
 }
 
-static enum stream2_result parse_msg_type(CborValue* it,
-                                          char type[MAX_KEY_LEN]) {
+static enum stream2_result parse_msg_type(CborValue* it, enum key* type) {
     enum stream2_result r;
 
-    char key[MAX_KEY_LEN];
-    if ((r = parse_key(it, key)))
+    enum key key;
+    if ((r = parse_key(it, &key)))
         return r;
 
-    if (strcmp(key, "type") != 0)
+    if (key != KEY_TYPE)
         return STREAM2_ERROR_PARSE;
 
     if ((r = CBOR_RESULT(cbor_value_skip_tag(it))))
@@ -832,7 +1353,9 @@ static enum stream2_result parse_msg_type(CborValue* it,
 
 static enum stream2_result parse_msg(const uint8_t* buffer,
                                      size_t size,
-                                     struct stream2_msg** msg_out) {
+                                     struct stream2_msg** msg_out,
+                                     struct stream2_arena* arena,
+                                     uint32_t image_fields) {
     enum stream2_result r;
 
     // https://www.rfc-editor.org/rfc/rfc8949.html#name-self-described-cbor
@@ -855,21 +1378,25 @@ static enum stream2_result parse_msg(const uint8_t* buffer,
     if ((r = CBOR_RESULT(cbor_value_enter_container(&it, &field))))
         return r;
 
-    char type[MAX_KEY_LEN];
-    if ((r = parse_msg_type(&field, type)))
+    enum key type;
+    if ((r = parse_msg_type(&field, &type)))
         return r;
 
-    if (strcmp(type, "start") == 0) {
-        if ((r = parse_start_msg(&field, msg_out)))
-            return r;
-    } else if (strcmp(type, "image") == 0) {
-        if ((r = parse_image_msg(&field, msg_out)))
-            return r;
-    } else if (strcmp(type, "end") == 0) {
-        if ((r = parse_end_msg(&field, msg_out)))
-            return r;
-    } else {
-        return STREAM2_ERROR_PARSE;
+    switch (type) {
+        case KEY_START:
+            if ((r = parse_start_msg(&field, msg_out, arena)))
+                return r;
+            break;
+        case KEY_IMAGE:
+            if ((r = parse_image_msg(&field, msg_out, arena, image_fields)))
+                return r;
+            break;
+        case KEY_END:
+            if ((r = parse_end_msg(&field, msg_out, arena)))
+                return r;
+            break;
+        default:
+            return STREAM2_ERROR_PARSE;
     }
 
     return CBOR_RESULT(cbor_value_leave_container(&it, &field));
@@ -881,7 +1408,8 @@ enum stream2_result stream2_parse_msg(const uint8_t* buffer,
     enum stream2_result r;
 
     *msg_out = NULL;
-    if ((r = parse_msg(buffer, size, msg_out))) {
+    if ((r = parse_msg(buffer, size, msg_out, NULL,
+                       STREAM2_IMAGE_ALL_FIELDS))) {
         if (*msg_out) {
             stream2_free_msg(*msg_out);
             *msg_out = NULL;
@@ -891,6 +1419,22 @@ enum stream2_result stream2_parse_msg(const uint8_t* buffer,
     return STREAM2_OK;
 }
 
+enum stream2_result stream2_parse_msg_arena(const uint8_t* buffer,
+                                            size_t size,
+                                            struct stream2_arena* arena,
+                                            uint32_t image_fields,
+                                            struct stream2_msg** msg_out) {
+    enum stream2_result r;
+
+    // Anything allocated before an error stays in the arena until it is reset.
+    *msg_out = NULL;
+    if ((r = parse_msg(buffer, size, msg_out, arena, image_fields))) {
+        *msg_out = NULL;
+        return r;
+    }
+    return STREAM2_OK;
+}
+
 static void free_start_msg(struct stream2_start_msg* msg) {
     free(msg->arm_date);
     for (size_t i = 0; i < msg->channels.len; i++)
@@ -178,6 +178,28 @@ struct stream2_start_msg {
     bool virtual_pixel_interpolation_enabled;
 };
 
+// Fields of an image message, as a bit mask selecting which fields to decode.
+enum stream2_image_field {
+    STREAM2_IMAGE_SERIES_ID = 1 << 0,
+    STREAM2_IMAGE_SERIES_UNIQUE_ID = 1 << 1,
+    STREAM2_IMAGE_IMAGE_ID = 1 << 2,
+    STREAM2_IMAGE_REAL_TIME = 1 << 3,
+    STREAM2_IMAGE_SERIES_DATE = 1 << 4,
+    STREAM2_IMAGE_START_TIME = 1 << 5,
+    STREAM2_IMAGE_STOP_TIME = 1 << 6,
+    STREAM2_IMAGE_USER_DATA = 1 << 7,
+    STREAM2_IMAGE_DATA = 1 << 8,
+    STREAM2_IMAGE_ALL_FIELDS = (1 << 9) - 1,
+};
+
+enum { STREAM2_IMAGE_NUM_FIELDS = 9 };
+
+// The CBOR encoding of a value that has not been decoded.
+struct stream2_raw_value {
+    const uint8_t* ptr;
+    size_t len;
+};
+
 struct stream2_image_msg {
     enum stream2_msg_type type;
     uint64_t series_id;
@@ -190,6 +212,12 @@ struct stream2_image_msg {
     uint64_t stop_time[2];
     struct stream2_user_data user_data;
     struct stream2_image_data_map data;
+
+    // Fields that have been decoded. Fields present in the message but not
+    // decoded are kept in raw, indexed by the bit number of their
+    // stream2_image_field, and can be decoded by stream2_image_msg_decode().
+    uint32_t fields;
+    struct stream2_raw_value raw[STREAM2_IMAGE_NUM_FIELDS];
 };
 
 struct stream2_end_msg {
@@ -203,6 +231,44 @@ enum stream2_result stream2_parse_msg(const uint8_t* buffer,
                                       struct stream2_msg** msg_out);
 void stream2_free_msg(struct stream2_msg* msg);
 
+struct stream2_arena_block;
+
+// A bump allocator for parsed messages.
+//
+// A message parsed into an arena takes all of its memory from the arena and
+// is released, together with every other message in it, by
+// stream2_arena_reset(). The memory is kept for the next message, so once
+// the arena has grown to fit, parsing further images allocates nothing.
+// A zero-initialized arena is empty.
+struct stream2_arena {
+    struct stream2_arena_block* head;
+    // Size of the first block allocated after a reset.
+    size_t reserve;
+};
+
+void stream2_arena_init(struct stream2_arena* arena);
+// Releases all messages parsed into the arena, keeping its memory.
+void stream2_arena_reset(struct stream2_arena* arena);
+// Releases all messages parsed into the arena and frees its memory.
+void stream2_arena_free(struct stream2_arena* arena);
+
+// Same as stream2_parse_msg(), but the message is allocated from the arena.
+// It must not be passed to stream2_free_msg() and stays valid until the
+// arena is reset or freed. Only the image message fields in image_fields are
+// decoded, the others are skipped.
+enum stream2_result stream2_parse_msg_arena(const uint8_t* buffer,
+                                            const size_t size,
+                                            struct stream2_arena* arena,
+                                            uint32_t image_fields,
+                                            struct stream2_msg** msg_out);
+
+// Decodes fields of an image message that were skipped when it was parsed.
+// The arena must be the one the message was parsed into, or NULL if it came
+// from stream2_parse_msg(). Fields that are not in the message stay unset.
+enum stream2_result stream2_image_msg_decode(struct stream2_image_msg* msg,
+                                             uint32_t fields,
+                                             struct stream2_arena* arena);
+
 // Gets the element size of a typed array.
 enum stream2_result stream2_typed_array_elem_size(
         const struct stream2_typed_array* array,
@@ -3,10 +3,12 @@
 #include "epicsTypes.h"
 #include "stream2.h"
 #include "streamApi.h"
+#include "frameDecode.h"
 #include "rfc3339.h"
 
 #include <cstdlib>
 #include <ctime>
+#include <algorithm>
 #include <stdexcept>
 #include <stdlib.h>
 #include <stdint.h>
@@ -14,12 +16,15 @@
 #include <epicsString.h>
 #include <string.h>
 #include <lz4hdf5.h>
-#include <bitshuffle.h>
 #include "NDCodec.h"
 
 
 #define ZMQ_PORT        31001
 
+// Image message fields decoded when a message is received. The timestamp
+// fields are decoded later, only if they are used.
+#define IMAGE_FIELDS    (STREAM2_IMAGE_IMAGE_ID | STREAM2_IMAGE_DATA)
+
 #define ERR_PREFIX  "Stream2Api"
 #define ERR(msg) fprintf(stderr, ERR_PREFIX "::%s: %s\n", functionName, msg)
 
@@ -28,10 +33,12 @@
 
 using std::string;
 
-static int uncompress (const unsigned char *pInput, char *dest, char *encoding,
-                       size_t compressedSize, size_t uncompressedSize, NDDataType_t dataType)
+int stream2Uncompress (const unsigned char *pInput, char *dest, const char *encoding,
+                       size_t compressedSize, size_t uncompressedSize, NDDataType_t dataType,
+                       bslz4_kernel bsKernel, struct bslz4_mask *mask, struct roi_bin *roi,
+                       std::vector<char> *scratch)
 {
-    const char *functionName = "uncompress";
+    const char *functionName = "stream2Uncompress";
     size_t elemSize;
     size_t blockSize;
     int result;
@@ -45,7 +52,26 @@ static int uncompress (const unsigned char *pInput, char *dest, char *encoding,
             return STREAM_ERROR;
     }
     if (strcmp(encoding, "lz4") == 0) {
-        result = decompress_lz4hdf5((const char *)pInput, dest, uncompressedSize, &blockSize);
+        // The region is cut out of the whole decompressed frame, in the
+        // caller's scratch buffer if it has one
+        char *frameBuf = dest, *allocated = NULL;
+        if (roi && scratch)
+        {
+            if (scratch->size() < uncompressedSize)
+                scratch->resize(uncompressedSize);
+            frameBuf = &(*scratch)[0];
+        }
+        else if (roi && !(frameBuf = allocated = (char *)malloc(uncompressedSize)))
+        {
+            ERR("failed to allocate frame buffer");
+            return STREAM_ERROR;
+        }
+        result = decompress_lz4hdf5((const char *)pInput, frameBuf, uncompressedSize, &blockSize);
+        if (result > 0 && roi)
+            roi_bin_add(roi, frameBuf, 0, uncompressedSize/elemSize);
+        else if (result > 0 && mask)
+            bslz4_mask_pixels(dest, dest, uncompressedSize/elemSize, elemSize, mask);
+        free(allocated);
 
         if (result <= 0)
         {
@@ -54,13 +80,17 @@ static int uncompress (const unsigned char *pInput, char *dest, char *encoding,
         }
     }
     else if (strcmp(encoding, "bslz4") == 0)  {
-        pInput += 12;   // compressed sdata is 12 bytes into buffer
-
-        size_t numElements = uncompressedSize/elemSize;
-        int result = bshuf_decompress_lz4(pInput, dest, numElements, elemSize, 0);
+        // Only the blocks that hold the region are decompressed, and the
+        // region masks its own pixels
+        int64_t result = roi ?
+            bslz4_decompress_range(pInput, compressedSize, uncompressedSize,
+                    elemSize, bsKernel, NULL, roi_bin_first(roi), roi_bin_last(roi),
+                    roi_bin_add, roi) :
+            bslz4_decompress(pInput, compressedSize, dest,
+                    uncompressedSize, elemSize, bsKernel, mask);
         if (result < 0)
         {
-            ERR_ARGS("bshuf_decompress_lz4 failed, result=%d", result);
+            ERR_ARGS("bslz4_decompress failed, result=%d", (int) result);
             return STREAM_ERROR;
         }
     }
@@ -73,19 +103,7 @@ static int uncompress (const unsigned char *pInput, char *dest, char *encoding,
 
 int Stream2API::poll (int timeout)
 {
-    const char *functionName = "poll";
-    zmq_pollitem_t item = {};
-    item.socket = mSock;
-    item.events = ZMQ_POLLIN;
-
-    int rc = zmq_poll(&item, 1, timeout*1000);
-    if(rc < 0)
-    {
-        ERR("failed to poll socket");
-        return STREAM_ERROR;
-    }
-
-    return rc ? STREAM_SUCCESS : STREAM_TIMEOUT;
+    return mReceiver->wait(timeout);
 }
 
 epicsTimeStamp Stream2API::extractTimeStampFromMessage(stream2_image_msg *msg) {
@@ -93,12 +111,12 @@ epicsTimeStamp Stream2API::extractTimeStampFromMessage(stream2_image_msg *msg) {
 
     // Update cache if needed (series_date does not change for
     // the entirety of one acquisition)
-    if (mCachedTs.tsStr != mImageMsg->series_date) {
-        mCachedTs.tsStr = mImageMsg->series_date;
-        gm_tm_nano_sec parsedTs = rfc3339::parseRfc3339Timestamp(mImageMsg->series_date);
+    if (mCachedTs.tsStr != msg->series_date) {
+        mCachedTs.tsStr = msg->series_date;
+        gm_tm_nano_sec parsedTs = rfc3339::parseRfc3339Timestamp(msg->series_date);
 
         if (rfc3339::equals(parsedTs, rfc3339::ZERO))
-            ERR_ARGS("Failed to parse timestamp '%s' as an RFC3339-compliant timestamp", mImageMsg->series_date);
+            ERR_ARGS("Failed to parse timestamp '%s' as an RFC3339-compliant timestamp", msg->series_date);
 
         epicsTime ts = parsedTs;    // Convert gm_tm_nano_sec to epicsTime
         mCachedTs.ts = ts;          // Convert epicsTime to epicsTimeStamp
@@ -108,8 +126,8 @@ epicsTimeStamp Stream2API::extractTimeStampFromMessage(stream2_image_msg *msg) {
     epicsTimeStamp series_ts = mCachedTs.ts;
 
     // Calculate the frame start time relative to the series start time, in ns
-    epicsUInt64 ticks = mImageMsg->start_time[0];       // Ticks of the clock
-    epicsUInt64 time_base = mImageMsg->start_time[1];   // Clock freq (e.g 50000000 for 50 MHz)
+    epicsUInt64 ticks = msg->start_time[0];       // Ticks of the clock
+    epicsUInt64 time_base = msg->start_time[1];   // Clock freq (e.g 50000000 for 50 MHz)
     epicsUInt64 elapsed_ns = NSEC_PER_SEC * ticks / time_base;
 
     epicsUInt64 frame_sec = series_ts.secPastEpoch;
@@ -126,9 +144,12 @@ epicsTimeStamp Stream2API::extractTimeStampFromMessage(stream2_image_msg *msg) {
     };
 }
 
-Stream2API::Stream2API (const char *hostname)
-    : mHostname(epicsStrDup(hostname)), mImage_dtype(NULL), mImageMsg(NULL), mNumThresholds(0)
+Stream2API::Stream2API (const char *hostname, size_t ringSize)
+    : mHostname(epicsStrDup(hostname)), mImage_dtype(NULL), mImageMsg(NULL), mNumThresholds(0),
+      mReceiver(NULL)
 {
+    stream2_arena_init(&mArena);
+
     if(!(mCtx = zmq_ctx_new()))
         throw std::runtime_error("unable to create zmq context");
 
@@ -142,6 +163,9 @@ Stream2API::Stream2API (const char *hostname)
         throw std::runtime_error("address is too long");
 
     zmq_connect(mSock, addr);
+
+    // From now on the socket is only accessed by the receive thread
+    mReceiver = new StreamReceiver(mSock, ringSize);
 }
 
 Stream2API::~Stream2API (void)
@@ -154,6 +178,8 @@ Stream2API::~Stream2API (void)
         free(mThresholdEnergy[i].channel);
         mThresholdEnergy[i].channel = NULL;
     }
+    delete mReceiver;
+    stream2_arena_free(&mArena);
     zmq_close(mSock);
     zmq_ctx_destroy(mCtx);
     free(mHostname);
@@ -168,8 +194,7 @@ int Stream2API::getHeader (stream_header_t *header, int timeout)
         return err;
 
     // Get message
-    zmq_msg_init(&mMsg);
-    zmq_msg_recv(&mMsg, mSock, 0);
+    mReceiver->recv(&mMsg);
     struct stream2_msg *s2msg=0;
     stream2_start_msg* sm;
     if ((err = stream2_parse_msg((const uint8_t *)zmq_msg_data(&mMsg), zmq_msg_size(&mMsg), &s2msg))) {
@@ -214,10 +239,13 @@ int Stream2API::waitFrame (int *end, int *numThresholds, int timeout)
         return err;
 
     // Get message
-    zmq_msg_init(&mMsg);
-    zmq_msg_recv(&mMsg, mSock, 0);
+    // Parse into the arena, which already holds enough memory for an image
+    // message once a few frames have been received
+    mReceiver->recv(&mMsg, &mRecvTime);
+    stream2_arena_reset(&mArena);
     struct stream2_msg *s2msg=0;
-    if ((err = stream2_parse_msg((const uint8_t *)zmq_msg_data(&mMsg), zmq_msg_size(&mMsg), &s2msg))) {
+    if ((err = stream2_parse_msg_arena((const uint8_t *)zmq_msg_data(&mMsg), zmq_msg_size(&mMsg), &mArena,
+            IMAGE_FIELDS, &s2msg))) {
         fprintf(stderr, "error: error %i parsing message\n", err);
         goto done;
     }
@@ -230,121 +258,238 @@ int Stream2API::waitFrame (int *end, int *numThresholds, int timeout)
             break;
         case STREAM2_MSG_END:
             *end = true;
-            stream2_free_msg(s2msg);
             zmq_msg_close(&mMsg);
             break;
         default:
             err = STREAM_ERROR;
-            stream2_free_msg(s2msg);
             zmq_msg_close(&mMsg);
     }
     done:
     return err;
 }
 
-int Stream2API::getFrame (NDArray **pArrayOut, NDArrayPool *pNDArrayPool, int thresh, int decompress, bool extractTimeStamp)
+int Stream2API::readFrame (stream_frame_t *frame, bool extractTimeStamp)
 {
-    const char *functionName = "getFrame";
+    const char *functionName = "readFrame";
+
+    if (!mImageMsg) {
+        ERR("no image message pending");
+        return STREAM_ERROR;
+    }
+
+    // Hand the message over to the frame. The parsed message points into the
+    // message buffer, which is not moved because image messages are never
+    // small enough to be stored inline in the zmq_msg_t.
+    zmq_msg_init(&frame->msg);
+    zmq_msg_move(&frame->msg, &mMsg);
+    zmq_msg_close(&mMsg);
+
+    // The parsed message lives in mArena. Swap arenas with the frame, so the
+    // frame owns the message and its old, already reset, arena is reused for
+    // the next message.
+    std::swap(frame->arena, mArena);
+    frame->imageMsg = mImageMsg;
+    frame->frame = mImageMsg->image_id;
+    frame->recvTime = mRecvTime;
+    frame->numThresholds = mNumThresholds;
+    frame->data = NULL;
+    mImageMsg = NULL;
+
+    frame->hasTimeStamp = false;
+    if (extractTimeStamp) {
+        // The timestamp fields are only decoded when they are used
+        int err = stream2_image_msg_decode(frame->imageMsg,
+                STREAM2_IMAGE_SERIES_DATE | STREAM2_IMAGE_START_TIME, &frame->arena);
+        if (err || !frame->imageMsg->series_date) {
+            ERR_ARGS("failed to decode timestamp of frame %lu (error %d)", frame->frame, err);
+        } else {
+            frame->hasTimeStamp = true;
+            frame->timeStamp = extractTimeStampFromMessage(frame->imageMsg);
+        }
+    }
+
+    epicsTimeGetCurrent(&frame->parseTime);
+    return STREAM_SUCCESS;
+}
+
+int Stream2API::decodeFrame (stream_frame_t *frame, int thresh, NDArray **pArrayOut,
+        NDArrayPool *pNDArrayPool, stream_decode_t const & decode,
+        StreamArrayPool *pBorrowPool) const
+{
+    const char *functionName = "decodeFrame";
     int err = STREAM_SUCCESS;
-    size_t compressedSize, uncompressedSize;
+    size_t compressedSize, uncompressedSize, elemSize;
     size_t dims[3];
     int numDims;
     int thresholdNumber;
     NDArray *pArray;
     char encoding[32];
     NDDataType_t dataType;
+    stream2_image_msg *imageMsg = frame->imageMsg;
+    struct bslz4_mask mask = {(uint32_t) decode.maskFill, 0};
+    struct bslz4_mask *pMask = decode.maskFlagged ? &mask : NULL;
 
-    switch (mImageMsg->type) {
-       case STREAM2_MSG_IMAGE: {
-            struct stream2_image_data *pSID = &mImageMsg->data.ptr[thresh];
-            struct stream2_multidim_array mda = pSID->data;
-            dims[0] = mda.dim[1];
-            dims[1] = mda.dim[0];
-            numDims = 2;
-            struct stream2_typed_array *pS2Array = &mda.array;
-            stream2_typed_array_tag s2DataType = (stream2_typed_array_tag)pS2Array->tag;
-            struct stream2_bytes *pSB = &pS2Array->data;
-            compressedSize = pSB->len;
-            uncompressedSize = pSB->len;
-            struct stream2_compression *pCompression = &pSB->compression;
-            if (pCompression->algorithm != NULL) {
-                uncompressedSize = pCompression->orig_size;
-                strcpy(encoding, pCompression->algorithm);
-            }
-            switch (s2DataType) {
-                case STREAM2_TYPED_ARRAY_UINT8:
-                    dataType = NDUInt8;
-                    break;
-                case STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN:
-                    dataType = NDUInt16;
-                    break;
-                case STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN:
-                    dataType = NDUInt32;
-                    break;
-                default:
-                    ERR_ARGS("unknown dataType %d", s2DataType);
-                    err = STREAM_ERROR;
-                    goto error;
-            }
+    if (thresh >= (int)imageMsg->data.len) {
+        ERR_ARGS("threshold %d not in message", thresh);
+        return STREAM_ERROR;
+    }
 
-            if(!(pArray = pNDArrayPool->alloc(numDims, dims, dataType, 0, NULL)))
-            {
-                ERR("failed to allocate NDArray for frame");
-                err = STREAM_ERROR;
-                goto error;
-            }
+    struct stream2_image_data *pSID = &imageMsg->data.ptr[thresh];
+    struct stream2_multidim_array mda = pSID->data;
+    dims[0] = mda.dim[1];
+    dims[1] = mda.dim[0];
+    numDims = 2;
+    struct stream2_typed_array *pS2Array = &mda.array;
+    stream2_typed_array_tag s2DataType = (stream2_typed_array_tag)pS2Array->tag;
+    struct stream2_bytes *pSB = &pS2Array->data;
+    compressedSize = pSB->len;
+    uncompressedSize = pSB->len;
+    struct stream2_compression *pCompression = &pSB->compression;
+    if (pCompression->algorithm != NULL) {
+        uncompressedSize = pCompression->orig_size;
+        strncpy(encoding, pCompression->algorithm, sizeof(encoding)-1);
+        encoding[sizeof(encoding)-1] = '\0';
+    }
+    switch (s2DataType) {
+        case STREAM2_TYPED_ARRAY_UINT8:
+            dataType = NDUInt8;
+            elemSize = 1;
+            break;
+        case STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN:
+            dataType = NDUInt16;
+            elemSize = 2;
+            break;
+        case STREAM2_TYPED_ARRAY_UINT32_LITTLE_ENDIAN:
+            dataType = NDUInt32;
+            elemSize = 4;
+            break;
+        default:
+            ERR_ARGS("unknown dataType %d", s2DataType);
+            return STREAM_ERROR;
+    }
 
-            // Get frame data
-            // If data is uncompressed we can copy directly into NDArray
-            if (pCompression->algorithm == NULL)
+    // Crop and bin decoded data, but not the compressed data passed on
+    struct roi_bin roi;
+    struct roi_bin *pRoi = NULL;
+    if (decode.roi && (pCompression->algorithm == NULL || decode.decompress) &&
+        !roi_bin_init(&roi, dims[0], dims[1], elemSize, decode.roiMinX,
+                decode.roiMinY, decode.roiSizeX, decode.roiSizeY, decode.roiBin))
+    {
+        pRoi = &roi;
+        dims[0] = roi_bin_out_width(pRoi);
+        dims[1] = roi_bin_out_height(pRoi);
+    }
+
+    if (pCompression->algorithm == NULL)
+    {
+        // Uncompressed data can only be borrowed if it is suitably aligned,
+        // and if it does not have to be masked or cropped
+        if (pBorrowPool && !pMask && !pRoi && !((uintptr_t)pSB->ptr % elemSize))
+        {
+            pArray = pBorrowPool->borrow(numDims, dims, dataType, &frame->msg,
+                    pSB->ptr, uncompressedSize);
+        }
+        else if ((pArray = pNDArrayPool->alloc(numDims, dims, dataType, 0, NULL)))
+        {
+            if (pRoi)
             {
-                memcpy((char *)pArray->pData, pSB->ptr, uncompressedSize);
+                roi_bin_start(pRoi, pArray->pData, pMask);
+                roi_bin_add(pRoi, pSB->ptr, 0, uncompressedSize/elemSize);
             }
+            else if (pMask)
+                bslz4_mask_pixels(pSB->ptr, pArray->pData, uncompressedSize/elemSize,
+                        elemSize, pMask);
             else
-            {
-                if (decompress)
-                {
-                    uncompress(pSB->ptr, (char *)pArray->pData, encoding, compressedSize, uncompressedSize, dataType);
-                }
-                else
-                {
-                    const unsigned char *pInput = pSB->ptr;
-                    if (strcmp(encoding, "lz4") == 0)
-                    {
-                        pArray->codec.name = NDCodecName[NDCODEC_LZ4HDF5];
-                    }
-                    else if (strcmp(encoding, "bslz4") == 0)
-                    {
-                        pArray->codec.name = NDCodecName[NDCODEC_BSLZ4];
-                        pInput += 12;
-                        compressedSize -= 12;
-                    }
-                    else {
-                        ERR_ARGS("unknown encoding %s", encoding);
-                    }
-                    pArray->compressedSize = compressedSize;
-                    memcpy(pArray->pData, pInput, compressedSize);
-                }
-            }
-            if (extractTimeStamp) {
-                epicsTimeStamp ts = extractTimeStampFromMessage(mImageMsg);
-                pArray->epicsTS = ts;
-                pArray->timeStamp = ts.secPastEpoch + ts.nsec/1.e9;
-            }
-            sscanf(mThresholdEnergy[thresh].channel, "threshold_%d", &thresholdNumber);
-            pArray->pAttributeList->add("ThresholdNumber", "Threshold number", NDAttrInt32, &thresholdNumber);
-            pArray->pAttributeList->add("ThresholdEnergy", "Threshold energy (eV)", NDAttrFloat64, (void *)&(mThresholdEnergy[thresh].energy));
-            *pArrayOut = pArray;
-            break;
+                memcpy((char *)pArray->pData, pSB->ptr, uncompressedSize);
         }
-        default:
-        ERR_ARGS("unexpected message type %d", mImageMsg->type);
     }
-    error:
-    if (thresh == mNumThresholds-1) {
-        if (mImageMsg) stream2_free_msg((stream2_msg *)mImageMsg);
-        mImageMsg = 0;
-        zmq_msg_close(&mMsg);
+    else if (decode.decompress)
+    {
+        if ((pArray = pNDArrayPool->alloc(numDims, dims, dataType, 0, NULL)))
+        {
+            if (pRoi)
+                roi_bin_start(pRoi, pArray->pData, pMask);
+            err = stream2Uncompress(pSB->ptr, (char *)pArray->pData, encoding, compressedSize,
+                    uncompressedSize, dataType, decode.bsKernel, pMask, pRoi,
+                    decode.scratch);
+        }
+    }
+    else
+    {
+        // Compressed data is passed on as it is, without masking
+        pMask = NULL;
+
+        const unsigned char *pInput = pSB->ptr;
+        const char *codecName = NULL;
+        if (strcmp(encoding, "lz4") == 0)
+        {
+            codecName = NDCodecName[NDCODEC_LZ4HDF5];
+        }
+        else if (strcmp(encoding, "bslz4") == 0)
+        {
+            codecName = NDCodecName[NDCODEC_BSLZ4];
+            pInput += 12;
+            compressedSize -= 12;
+        }
+        else {
+            ERR_ARGS("unknown encoding %s", encoding);
+        }
+
+        // The NDArray only needs to hold the compressed data
+        if (pBorrowPool)
+        {
+            pArray = pBorrowPool->borrow(numDims, dims, dataType, &frame->msg,
+                    pInput, compressedSize);
+        }
+        else if ((pArray = pNDArrayPool->alloc(numDims, dims, dataType, compressedSize, NULL)))
+        {
+            memcpy(pArray->pData, pInput, compressedSize);
+        }
+        if (pArray)
+        {
+            if (codecName)
+                pArray->codec.name = codecName;
+            pArray->compressedSize = compressedSize;
+        }
+    }
+
+    if (!pArray)
+    {
+        ERR("failed to allocate NDArray for frame");
+        return STREAM_ERROR;
+    }
+    if (err) {
+        pArray->release();
+        return err;
+    }
+    if (pRoi) {
+        pArray->dims[0].offset = pRoi->min_x;
+        pArray->dims[1].offset = pRoi->min_y;
+        pArray->dims[0].binning = pArray->dims[1].binning = pRoi->bin;
+    }
+    if (frame->hasTimeStamp) {
+        pArray->epicsTS = frame->timeStamp;
+        pArray->timeStamp = frame->timeStamp.secPastEpoch + frame->timeStamp.nsec/1.e9;
+    }
+    if (thresh < (int)mThresholdEnergy.size()) {
+        sscanf(mThresholdEnergy[thresh].channel, "threshold_%d", &thresholdNumber);
+        pArray->pAttributeList->add("ThresholdNumber", "Threshold number", NDAttrInt32, &thresholdNumber);
+        pArray->pAttributeList->add("ThresholdEnergy", "Threshold energy (eV)", NDAttrFloat64, (void *)&(mThresholdEnergy[thresh].energy));
+    }
+    if (pMask) {
+        epicsInt32 maskedPixels = (epicsInt32) mask.count;
+        pArray->pAttributeList->add("MaskedPixels", "Masked gap and bad pixels", NDAttrInt32, &maskedPixels);
+    }
+    *pArrayOut = pArray;
+    return STREAM_SUCCESS;
+}
+
+void Stream2API::freeFrame (stream_frame_t *frame)
+{
+    if (frame->imageMsg) {
+        // Keep the arena memory for the next frame read into this one
+        stream2_arena_reset(&frame->arena);
+        frame->imageMsg = NULL;
+        zmq_msg_close(&frame->msg);
     }
-    return err;
 }
@@ -0,0 +1,208 @@
+// Measures the time taken to parse Stream2 messages, per message.
+//
+// Usage: stream2Bench [iterations] [message file ...]
+//
+// Each message file holds one CBOR message as received from the detector,
+// e.g. written out with zmq_msg_data()/zmq_msg_size(). Without files, image
+// messages shaped like those of a detector with two thresholds are
+// generated.
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "benchUtil.h"
+#include "cbor.h"
+#include "stream2.h"
+
+enum { DEFAULT_ITERATIONS = 200000, MAX_MESSAGES = 64 };
+
+struct message {
+    uint8_t* buf;
+    size_t size;
+};
+
+static CborError encode_array_2_uint64(CborEncoder* map,
+                                       const char* key,
+                                       uint64_t a,
+                                       uint64_t b) {
+    CborEncoder array;
+    CborError e = cbor_encode_text_stringz(map, key);
+    e |= cbor_encoder_create_array(map, &array, 2);
+    e |= cbor_encode_uint(&array, a);
+    e |= cbor_encode_uint(&array, b);
+    e |= cbor_encoder_close_container(map, &array);
+    return e;
+}
+
+// Encodes an image message with the fields and key order sent by the
+// detector. The image data is an opaque bslz4 blob of blob_size bytes.
+static size_t encode_image_msg(uint8_t* buf,
+                               size_t size,
+                               uint64_t image_id,
+                               int num_thresholds,
+                               size_t blob_size) {
+    CborEncoder enc, map, user_data, data, multidim, dims, compression;
+    CborError e;
+
+    uint8_t* blob = calloc(1, blob_size);
+    if (blob == NULL)
+        return 0;
+    // Uncompressed size, as the big-endian header of the bslz4 blob
+    const uint64_t orig_size = 4 * blob_size;
+    bench_write_be(blob, orig_size, 8);
+
+    cbor_encoder_init(&enc, buf, size, 0);
+    e = cbor_encode_tag(&enc, CborSignatureTag);
+    e |= cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "image");
+    e |= cbor_encode_text_stringz(&map, "image_id");
+    e |= cbor_encode_uint(&map, image_id);
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, 1);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, "01HMF2Y0RB8G0TXNK2ZJ7VYQ4A");
+    e |= cbor_encode_text_stringz(&map, "series_date");
+    e |= cbor_encode_tag(&map, CborDateTimeStringTag);
+    e |= cbor_encode_text_stringz(&map, "2024-01-19T10:32:12.345678Z");
+    e |= encode_array_2_uint64(&map, "start_time", image_id * 1000000,
+                               1000000000);
+    e |= encode_array_2_uint64(&map, "stop_time", image_id * 1000000 + 500000,
+                               1000000000);
+    e |= encode_array_2_uint64(&map, "real_time", 500000, 1000000000);
+    e |= cbor_encode_text_stringz(&map, "user_data");
+    e |= cbor_encoder_create_map(&map, &user_data, 0);
+    e |= cbor_encoder_close_container(&map, &user_data);
+    e |= cbor_encode_text_stringz(&map, "data");
+    e |= cbor_encoder_create_map(&map, &data, num_thresholds);
+    for (int i = 0; i < num_thresholds; i++) {
+        char channel[32];
+        snprintf(channel, sizeof(channel), "threshold_%d", i + 1);
+        e |= cbor_encode_text_stringz(&data, channel);
+        e |= cbor_encode_tag(&data, 40);
+        e |= cbor_encoder_create_array(&data, &multidim, 2);
+        e |= cbor_encoder_create_array(&multidim, &dims, 2);
+        e |= cbor_encode_uint(&dims, orig_size / 2 / 512);
+        e |= cbor_encode_uint(&dims, 512);
+        e |= cbor_encoder_close_container(&multidim, &dims);
+        e |= cbor_encode_tag(&multidim, STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN);
+        e |= cbor_encode_tag(&multidim, 56500);
+        e |= cbor_encoder_create_array(&multidim, &compression, 3);
+        e |= cbor_encode_text_stringz(&compression, "bslz4");
+        e |= cbor_encode_uint(&compression, 2);
+        e |= cbor_encode_byte_string(&compression, blob, blob_size);
+        e |= cbor_encoder_close_container(&multidim, &compression);
+        e |= cbor_encoder_close_container(&data, &multidim);
+    }
+    e |= cbor_encoder_close_container(&map, &data);
+    e |= cbor_encoder_close_container(&enc, &map);
+    free(blob);
+
+    return e ? 0 : cbor_encoder_get_buffer_size(&enc, buf);
+}
+
+static int read_message(const char* path, struct message* msg) {
+    FILE* file = fopen(path, "rb");
+    if (file == NULL) {
+        perror(path);
+        return -1;
+    }
+    fseek(file, 0, SEEK_END);
+    msg->size = (size_t)ftell(file);
+    fseek(file, 0, SEEK_SET);
+    msg->buf = malloc(msg->size);
+    if (msg->buf == NULL || fread(msg->buf, 1, msg->size, file) != msg->size) {
+        fprintf(stderr, "%s: read failed\n", path);
+        fclose(file);
+        return -1;
+    }
+    fclose(file);
+    return 0;
+}
+
+int main(int argc, char** argv) {
+    struct message messages[MAX_MESSAGES];
+    int num_messages = 0;
+    long iterations = argc > 1 ? atol(argv[1]) : DEFAULT_ITERATIONS;
+    if (iterations <= 0)
+        iterations = DEFAULT_ITERATIONS;
+
+    for (int i = 2; i < argc && num_messages < MAX_MESSAGES; i++) {
+        if (read_message(argv[i], &messages[num_messages]))
+            return 1;
+        num_messages++;
+    }
+
+    if (num_messages == 0) {
+        const size_t blob_size = 256 * 1024;
+        for (; num_messages < 16; num_messages++) {
+            struct message* msg = &messages[num_messages];
+            msg->size = blob_size * 2 + 1024;
+            msg->buf = malloc(msg->size);
+            if (msg->buf == NULL)
+                return 1;
+            msg->size = encode_image_msg(msg->buf, msg->size, num_messages + 1,
+                                         2, blob_size);
+            if (msg->size == 0) {
+                fprintf(stderr, "failed to encode message\n");
+                return 1;
+            }
+        }
+    }
+
+    for (int i = 0; i < num_messages; i++) {
+        struct stream2_msg* msg;
+        enum stream2_result r =
+                stream2_parse_msg(messages[i].buf, messages[i].size, &msg);
+        if (r) {
+            fprintf(stderr, "message %d: parse error %d\n", i, r);
+            return 1;
+        }
+        stream2_free_msg(msg);
+    }
+
+    double start = bench_now();
+    for (long n = 0; n < iterations; n++) {
+        const struct message* m = &messages[n % num_messages];
+        struct stream2_msg* msg;
+        stream2_parse_msg(m->buf, m->size, &msg);
+        stream2_free_msg(msg);
+    }
+    double heap = bench_now() - start;
+
+    struct stream2_arena arena;
+    stream2_arena_init(&arena);
+    start = bench_now();
+    for (long n = 0; n < iterations; n++) {
+        const struct message* m = &messages[n % num_messages];
+        struct stream2_msg* msg;
+        stream2_arena_reset(&arena);
+        stream2_parse_msg_arena(m->buf, m->size, &arena,
+                                STREAM2_IMAGE_ALL_FIELDS, &msg);
+    }
+    double arena_time = bench_now() - start;
+
+    // Only the fields the driver needs, as in Stream2API::waitFrame()
+    start = bench_now();
+    for (long n = 0; n < iterations; n++) {
+        const struct message* m = &messages[n % num_messages];
+        struct stream2_msg* msg;
+        stream2_arena_reset(&arena);
+        stream2_parse_msg_arena(m->buf, m->size, &arena,
+                                STREAM2_IMAGE_IMAGE_ID | STREAM2_IMAGE_DATA,
+                                &msg);
+    }
+    double selective_time = bench_now() - start;
+    stream2_arena_free(&arena);
+
+    printf("%d messages, %ld iterations\n", num_messages, iterations);
+    printf("stream2_parse_msg       %8.1f ns/msg\n", 1e9 * heap / iterations);
+    printf("stream2_parse_msg_arena %8.1f ns/msg\n",
+           1e9 * arena_time / iterations);
+    printf("  image_id and data only %8.1f ns/msg\n",
+           1e9 * selective_time / iterations);
+
+    for (int i = 0; i < num_messages; i++)
+        free(messages[i].buf);
+    return 0;
+}
@@ -0,0 +1,300 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <testMain.h>
+#include <epicsUnitTest.h>
+
+#include "benchUtil.h"
+#include "cbor.h"
+#include "stream2.h"
+
+enum { BLOB_SIZE = 64, NUM_THRESHOLDS = 2, MSG_SIZE = 1024 };
+
+// More messages than fit in the first block of an arena
+enum { ARENA_MESSAGES = 32 };
+
+static const char series_unique_id[] = "01HMF2Y0RB8G0TXNK2ZJ7VYQ4A";
+static const char series_date[] = "2024-01-19T10:32:12.345678Z";
+
+static CborError encode_array_2_uint64(CborEncoder* map,
+                                       const char* key,
+                                       uint64_t a,
+                                       uint64_t b) {
+    CborEncoder array;
+    CborError e = cbor_encode_text_stringz(map, key);
+    e |= cbor_encoder_create_array(map, &array, 2);
+    e |= cbor_encode_uint(&array, a);
+    e |= cbor_encode_uint(&array, b);
+    e |= cbor_encoder_close_container(map, &array);
+    return e;
+}
+
+// Encodes an image message with the fields and key order sent by the
+// detector, with a bslz4 blob of BLOB_SIZE bytes per threshold. Returns its
+// size, or 0 if it does not fit.
+static size_t encode_image_msg(uint8_t* buf, size_t size, uint64_t image_id) {
+    CborEncoder enc, map, user_data, data, multidim, dims, compression;
+    uint8_t blob[BLOB_SIZE];
+    CborError e;
+
+    memset(blob, 0, sizeof(blob));
+    bench_write_be(blob, 4 * BLOB_SIZE, 8);
+
+    cbor_encoder_init(&enc, buf, size, 0);
+    e = cbor_encode_tag(&enc, CborSignatureTag);
+    e |= cbor_encoder_create_map(&enc, &map, CborIndefiniteLength);
+    e |= cbor_encode_text_stringz(&map, "type");
+    e |= cbor_encode_text_stringz(&map, "image");
+    e |= cbor_encode_text_stringz(&map, "image_id");
+    e |= cbor_encode_uint(&map, image_id);
+    e |= cbor_encode_text_stringz(&map, "series_id");
+    e |= cbor_encode_uint(&map, 7);
+    e |= cbor_encode_text_stringz(&map, "series_unique_id");
+    e |= cbor_encode_text_stringz(&map, series_unique_id);
+    e |= cbor_encode_text_stringz(&map, "series_date");
+    e |= cbor_encode_tag(&map, CborDateTimeStringTag);
+    e |= cbor_encode_text_stringz(&map, series_date);
+    e |= encode_array_2_uint64(&map, "start_time", image_id * 1000, 1000000);
+    e |= encode_array_2_uint64(&map, "stop_time", image_id * 1000 + 500,
+                               1000000);
+    e |= encode_array_2_uint64(&map, "real_time", 500, 1000000);
+    e |= cbor_encode_text_stringz(&map, "user_data");
+    e |= cbor_encoder_create_map(&map, &user_data, 0);
+    e |= cbor_encoder_close_container(&map, &user_data);
+    e |= cbor_encode_text_stringz(&map, "data");
+    e |= cbor_encoder_create_map(&map, &data, NUM_THRESHOLDS);
+    for (int i = 0; i < NUM_THRESHOLDS; i++) {
+        char channel[32];
+        snprintf(channel, sizeof(channel), "threshold_%d", i + 1);
+        e |= cbor_encode_text_stringz(&data, channel);
+        e |= cbor_encode_tag(&data, 40);
+        e |= cbor_encoder_create_array(&data, &multidim, 2);
+        e |= cbor_encoder_create_array(&multidim, &dims, 2);
+        e |= cbor_encode_uint(&dims, 8);
+        e |= cbor_encode_uint(&dims, 16);
+        e |= cbor_encoder_close_container(&multidim, &dims);
+        e |= cbor_encode_tag(&multidim, STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN);
+        e |= cbor_encode_tag(&multidim, 56500);
+        e |= cbor_encoder_create_array(&multidim, &compression, 3);
+        e |= cbor_encode_text_stringz(&compression, "bslz4");
+        e |= cbor_encode_uint(&compression, 2);
+        e |= cbor_encode_byte_string(&compression, blob, sizeof(blob));
+        e |= cbor_encoder_close_container(&multidim, &compression);
+        e |= cbor_encoder_close_container(&data, &multidim);
+    }
+    e |= cbor_encoder_close_container(&map, &data);
+    e |= cbor_encoder_close_container(&enc, &map);
+
+    return e ? 0 : cbor_encoder_get_buffer_size(&enc, buf);
+}
+
+// Whether the data of an image message is that of encode_image_msg()
+static int data_ok(const struct stream2_image_msg* msg) {
+    if (msg->data.len != NUM_THRESHOLDS)
+        return 0;
+    for (size_t i = 0; i < msg->data.len; i++) {
+        const struct stream2_image_data* d = &msg->data.ptr[i];
+        char channel[32];
+        snprintf(channel, sizeof(channel), "threshold_%d", (int)i + 1);
+        if (strcmp(d->channel, channel) != 0 || d->data.dim[0] != 8 ||
+            d->data.dim[1] != 16 ||
+            d->data.array.tag != STREAM2_TYPED_ARRAY_UINT16_LITTLE_ENDIAN ||
+            d->data.array.data.len != BLOB_SIZE ||
+            strcmp(d->data.array.data.compression.algorithm, "bslz4") != 0 ||
+            d->data.array.data.compression.elem_size != 2 ||
+            d->data.array.data.compression.orig_size != 4 * BLOB_SIZE)
+            return 0;
+    }
+    return 1;
+}
+
+static void testParseAll(const uint8_t* buf, size_t size) {
+    struct stream2_msg* msg;
+    struct stream2_image_msg* image;
+
+    testDiag("Image message, all fields");
+    testOk(stream2_parse_msg(buf, size, &msg) == STREAM2_OK, "Parsed");
+    if (msg == NULL || msg->type != STREAM2_MSG_IMAGE) {
+        testFail("Not an image message");
+        testSkip(4, "No image message");
+        stream2_free_msg(msg);
+        return;
+    }
+    image = (struct stream2_image_msg*)msg;
+    testOk(image->fields == STREAM2_IMAGE_ALL_FIELDS, "All fields decoded");
+    testOk(image->series_id == 7 && image->image_id == 3 &&
+                   strcmp(image->series_unique_id, series_unique_id) == 0 &&
+                   strcmp(image->series_date, series_date) == 0,
+           "Ids and date");
+    testOk(image->start_time[0] == 3000 && image->stop_time[0] == 3500 &&
+                   image->real_time[0] == 500 &&
+                   image->real_time[1] == 1000000,
+           "Times");
+    testOk(data_ok(image), "Data");
+    testOk(image->data.ptr[0].data.array.data.ptr > buf &&
+                   image->data.ptr[0].data.array.data.ptr + BLOB_SIZE <=
+                           buf + size,
+           "Data points into the message");
+    stream2_free_msg(msg);
+}
+
+static void testSkippedFields(const uint8_t* buf, size_t size) {
+    const uint32_t fields = STREAM2_IMAGE_IMAGE_ID | STREAM2_IMAGE_DATA;
+    const uint32_t later =
+            STREAM2_IMAGE_SERIES_UNIQUE_ID | STREAM2_IMAGE_SERIES_DATE;
+    struct stream2_arena arena;
+    struct stream2_msg* msg;
+    struct stream2_image_msg* image;
+
+    testDiag("Image message, fields skipped and decoded later");
+    stream2_arena_init(&arena);
+    testOk(stream2_parse_msg_arena(buf, size, &arena, fields, &msg) ==
+                   STREAM2_OK,
+           "Parsed");
+    if (msg == NULL || msg->type != STREAM2_MSG_IMAGE) {
+        testFail("Not an image message");
+        testSkip(5, "No image message");
+        stream2_arena_free(&arena);
+        return;
+    }
+    image = (struct stream2_image_msg*)msg;
+    testOk(image->fields == fields, "Only the fields asked for decoded");
+    testOk(image->image_id == 3 && data_ok(image), "Id and data");
+    testOk(image->series_id == 0 && image->series_unique_id == NULL &&
+                   image->series_date == NULL && image->start_time[0] == 0,
+           "Skipped fields unset");
+    testOk(image->raw[0].ptr != NULL && image->raw[1].ptr != NULL &&
+                   image->raw[4].ptr != NULL && image->raw[2].ptr == NULL,
+           "Skipped fields kept raw");
+
+    testOk(stream2_image_msg_decode(image, later, &arena) == STREAM2_OK &&
+                   image->fields == (fields | later),
+           "Skipped fields decoded");
+    testOk(strcmp(image->series_unique_id, series_unique_id) == 0 &&
+                   strcmp(image->series_date, series_date) == 0 &&
+                   image->series_id == 0,
+           "Only the fields asked for");
+    stream2_arena_free(&arena);
+}
+
+static void testArenaExhausted(void) {
+    static uint8_t bufs[ARENA_MESSAGES][MSG_SIZE];
+    struct stream2_image_msg* images[ARENA_MESSAGES];
+    struct stream2_arena arena;
+    struct stream2_arena_block* head;
+    int parsed = 1, valid = 1;
+
+    testDiag("Arena outgrowing its first block");
+    stream2_arena_init(&arena);
+    for (int i = 0; i < ARENA_MESSAGES; i++) {
+        size_t size = encode_image_msg(bufs[i], MSG_SIZE, i);
+        struct stream2_msg* msg;
+        parsed = parsed && size &&
+                 stream2_parse_msg_arena(bufs[i], size, &arena,
+                                         STREAM2_IMAGE_ALL_FIELDS,
+                                         &msg) == STREAM2_OK;
+        images[i] = parsed ? (struct stream2_image_msg*)msg : NULL;
+    }
+    testOk(parsed, "All messages parsed into one arena");
+    for (int i = 0; parsed && i < ARENA_MESSAGES; i++)
+        valid = valid && images[i]->image_id == (uint64_t)i &&
+                strcmp(images[i]->series_date, series_date) == 0 &&
+                data_ok(images[i]);
+    testOk(parsed && valid, "Earlier messages intact after the arena grew");
+
+    stream2_arena_reset(&arena);
+    testOk(arena.head == NULL && arena.reserve > 4096,
+           "Reset replaces the blocks with a reserve");
+
+    for (int i = 0; i < ARENA_MESSAGES; i++) {
+        size_t size = encode_image_msg(bufs[i], MSG_SIZE, i);
+        struct stream2_msg* msg;
+        if (stream2_parse_msg_arena(bufs[i], size, &arena,
+                                    STREAM2_IMAGE_ALL_FIELDS, &msg))
+            parsed = 0;
+    }
+    head = arena.head;
+    stream2_arena_reset(&arena);
+    testOk(parsed && head != NULL && arena.head == head,
+           "All messages fit in the block of the reserve");
+    stream2_arena_free(&arena);
+}
+
+static void testTruncated(const uint8_t* buf, size_t size) {
+    struct stream2_arena arena;
+    struct stream2_msg* msg;
+    int failed = 1;
+
+    testDiag("Truncated image messages");
+    stream2_arena_init(&arena);
+    for (size_t len = 0; len < size; len++) {
+        if (stream2_parse_msg(buf, len, &msg) == STREAM2_OK) {
+            stream2_free_msg(msg);
+            failed = 0;
+        }
+        if (stream2_parse_msg_arena(buf, len, &arena,
+                                    STREAM2_IMAGE_ALL_FIELDS,
+                                    &msg) == STREAM2_OK)
+            failed = 0;
+        stream2_arena_reset(&arena);
+    }
+    testOk(failed, "Every truncation rejected");
+    stream2_arena_free(&arena);
+}
+
+static void testCorrupted(const uint8_t* buf, size_t size) {
+    // Initial bytes of each major type, and lengths the parser must check
+    static const uint8_t values[] = {0x00, 0x18, 0x1b, 0x40, 0x5b, 0x5f,
+                                     0x60, 0x7b, 0x7f, 0xa0, 0xc0, 0xff};
+    uint8_t* copy = malloc(size);
+    struct stream2_arena arena;
+    int consistent = 1;
+
+    testDiag("Corrupted image messages");
+    stream2_arena_init(&arena);
+    for (size_t pos = 0; copy && pos < size; pos++) {
+        for (size_t v = 0; v < sizeof(values); v++) {
+            struct stream2_msg* msg;
+            memcpy(copy, buf, size);
+            copy[pos] = values[v];
+            if (stream2_parse_msg_arena(copy, size, &arena,
+                                        STREAM2_IMAGE_IMAGE_ID, &msg) ==
+                STREAM2_OK) {
+                // Decoding what was skipped must not fail any other way
+                enum stream2_result r = STREAM2_OK;
+                if (msg->type == STREAM2_MSG_IMAGE)
+                    r = stream2_image_msg_decode(
+                            (struct stream2_image_msg*)msg,
+                            STREAM2_IMAGE_ALL_FIELDS, &arena);
+                if (r != STREAM2_OK && r != STREAM2_ERROR_PARSE &&
+                    r != STREAM2_ERROR_DECODE &&
+                    r != STREAM2_ERROR_NOT_IMPLEMENTED)
+                    consistent = 0;
+            }
+            stream2_arena_reset(&arena);
+        }
+    }
+    testOk(copy != NULL && consistent, "Parsed or rejected");
+    stream2_arena_free(&arena);
+    free(copy);
+}
+
+MAIN(stream2Test) {
+    uint8_t buf[MSG_SIZE];
+    size_t size;
+
+    testPlan(19);
+
+    size = encode_image_msg(buf, sizeof(buf), 3);
+    if (size == 0)
+        testAbort("Image message does not fit in %d bytes", MSG_SIZE);
+
+    testParseAll(buf, size);
+    testSkippedFields(buf, size);
+    testArenaExhausted();
+    testTruncated(buf, size);
+    testCorrupted(buf, size);
+
+    return testDone();
+}
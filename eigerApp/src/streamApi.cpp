@@ -1,20 +1,24 @@
 #include "streamApi.h"
+#include "frameDecode.h"
 
 #include <stdexcept>
 #include <stdlib.h>
 #include <epicsStdio.h>
 #include <epicsString.h>
+#include <epicsThread.h>
 #include <frozen.h>
 #include <zmq.h>
 #include <string.h>
 #include <lz4.h>
-#include <bitshuffle.h>
 #include "NDCodec.h"
 
 
 #define ZMQ_PORT        9999
 #define MAX_JSON_TOKENS 512
 
+// How often the receive thread checks if it was asked to stop
+#define RECEIVE_POLL_MS 100
+
 #define ERR_PREFIX  "StreamApi"
 #define ERR(msg) fprintf(stderr, ERR_PREFIX "::%s: %s\n", functionName, msg)
 
@@ -109,12 +113,44 @@ static int readToken (struct json_token *tokens, const char *name, string & valu
     return STREAM_SUCCESS;
 }
 
-static int uncompress (char *pInput, char *dest, char *encoding, size_t uncompressedSize, NDDataType_t dataType)
+int streamUncompress (char *pInput, char *dest, const char *encoding, size_t compressedSize,
+                      size_t uncompressedSize, NDDataType_t dataType, bslz4_kernel bsKernel,
+                      struct bslz4_mask *mask, struct roi_bin *roi,
+                      std::vector<char> *scratch)
 {
-    const char *functionName = "uncompress";
+    const char *functionName = "streamUncompress";
+    size_t elemSize;
+    switch (dataType)
+    {
+        case NDUInt32: elemSize=4; break;
+        case NDUInt16: elemSize=2; break;
+        case NDUInt8:  elemSize=1; break;
+        default:
+            ERR_ARGS("unknown frame type=%d", dataType);
+            return STREAM_ERROR;
+    }
 
    if (strcmp(encoding, "lz4<") == 0) {
-        int result = LZ4_decompress_fast(pInput, dest, (int)uncompressedSize);
+        // The region is cut out of the whole decompressed frame, in the
+        // caller's scratch buffer if it has one
+        char *frameBuf = dest, *allocated = NULL;
+        if (roi && scratch)
+        {
+            if (scratch->size() < uncompressedSize)
+                scratch->resize(uncompressedSize);
+            frameBuf = &(*scratch)[0];
+        }
+        else if (roi && !(frameBuf = allocated = (char *)malloc(uncompressedSize)))
+        {
+            ERR("failed to allocate frame buffer");
+            return STREAM_ERROR;
+        }
+        int result = LZ4_decompress_fast(pInput, frameBuf, (int)uncompressedSize);
+        if (result >= 0 && roi)
+            roi_bin_add(roi, frameBuf, 0, uncompressedSize/elemSize);
+        else if (result >= 0 && mask)
+            bslz4_mask_pixels(dest, dest, uncompressedSize/elemSize, elemSize, mask);
+        free(allocated);
         if (result < 0)
         {
             ERR_ARGS("LZ4_decompress failed, result=%d\n", result);
@@ -124,22 +160,17 @@ static int uncompress (char *pInput, char *dest, char *encoding, size_t uncompre
     else if ((strcmp(encoding, "bs32-lz4<") == 0) ||
              (strcmp(encoding, "bs16-lz4<") == 0) ||
              (strcmp(encoding, "bs8-lz4<") == 0)) {
-        pInput += 12;   // compressed sdata is 12 bytes into buffer
-        size_t elemSize;
-        switch (dataType) 
-        {
-            case NDUInt32: elemSize=4; break;
-            case NDUInt16: elemSize=2; break;
-            case NDUInt8:  elemSize=1; break;
-            default:
-                ERR_ARGS("unknown frame type=%d", dataType);
-                return STREAM_ERROR;
-        }
-        size_t numElements = uncompressedSize/elemSize;
-        int result = bshuf_decompress_lz4(pInput, dest, numElements, elemSize, 0);
+        // Only the blocks that hold the region are decompressed, and the
+        // region masks its own pixels
+        int64_t result = roi ?
+            bslz4_decompress_range(pInput, compressedSize, uncompressedSize,
+                    elemSize, bsKernel, NULL, roi_bin_first(roi), roi_bin_last(roi),
+                    roi_bin_add, roi) :
+            bslz4_decompress(pInput, compressedSize, dest,
+                    uncompressedSize, elemSize, bsKernel, mask);
         if (result < 0)
         {
-            ERR_ARGS("bshuf_decompress_lz4 failed, result=%d", result);
+            ERR_ARGS("bslz4_decompress failed, result=%d", (int) result);
             return STREAM_ERROR;
         }
     }
@@ -151,24 +182,167 @@ static int uncompress (char *pInput, char *dest, char *encoding, size_t uncompre
     return STREAM_SUCCESS;
 }
 
-int StreamAPI::poll (int timeout)
+static void receiveTaskC (void *drvPvt)
+{
+    ((StreamReceiver *)drvPvt)->receiveTask();
+}
+
+StreamReceiver::StreamReceiver (void *sock, size_t capacity)
+    : mSock(sock), mCapacity(capacity < 4 ? 4 : capacity), mRing(NULL),
+      mRecvTimes(NULL), mHead(0), mTail(0), mOverflows(0), mStop(false)
 {
-    const char *functionName = "poll";
+    mRing = new zmq_msg_t[mCapacity];
+    mRecvTimes = new epicsTimeStamp[mCapacity];
+
+    if(!epicsThreadCreate("eigerStreamRecvTask", epicsThreadPriorityHigh,
+            epicsThreadGetStackSize(epicsThreadStackMedium),
+            (EPICSTHREADFUNC)receiveTaskC, this))
+    {
+        delete [] mRing;
+        delete [] mRecvTimes;
+        throw std::runtime_error("unable to create receive thread");
+    }
+}
+
+StreamReceiver::~StreamReceiver (void)
+{
+    mStop = true;
+    mNotFull.signal();
+    mDone.wait();
+
+    for(size_t i = mTail; i != mHead; ++i)
+        zmq_msg_close(&mRing[i % mCapacity]);
+    delete [] mRing;
+    delete [] mRecvTimes;
+}
+
+void StreamReceiver::receiveTask (void)
+{
+    const char *functionName = "receiveTask";
     zmq_pollitem_t item = {};
     item.socket = mSock;
     item.events = ZMQ_POLLIN;
 
-    int rc = zmq_poll(&item, 1, timeout*1000);
-    if(rc < 0)
+    while(!mStop)
     {
-        ERR("failed to poll socket");
-        return STREAM_ERROR;
+        int rc = zmq_poll(&item, 1, RECEIVE_POLL_MS);
+        if(rc < 0)
+        {
+            ERR("failed to poll socket");
+            epicsThreadSleep(RECEIVE_POLL_MS/1000.0);
+            continue;
+        }
+        if(!rc)
+            continue;
+
+        // Only this thread moves mHead
+        size_t head = mHead.load(std::memory_order_relaxed);
+        if(head - mTail.load(std::memory_order_acquire) == mCapacity)
+        {
+            ++mOverflows;
+            while(!mStop && head - mTail.load(std::memory_order_acquire) == mCapacity)
+                mNotFull.wait(RECEIVE_POLL_MS/1000.0);
+            if(mStop)
+                break;
+        }
+
+        zmq_msg_t *msg = &mRing[head % mCapacity];
+        zmq_msg_init(msg);
+        if(zmq_msg_recv(msg, mSock, ZMQ_DONTWAIT) < 0)
+        {
+            zmq_msg_close(msg);
+            continue;
+        }
+        epicsTimeGetCurrent(&mRecvTimes[head % mCapacity]);
+
+        mHead.store(head + 1, std::memory_order_release);
+        mNotEmpty.signal();
     }
 
-    return rc ? STREAM_SUCCESS : STREAM_TIMEOUT;
+    mDone.signal();
 }
 
-StreamAPI::StreamAPI (const char *hostname) : mHostname(epicsStrDup(hostname))
+int StreamReceiver::wait (double timeout)
+{
+    while(mHead.load(std::memory_order_acquire) == mTail.load(std::memory_order_relaxed))
+    {
+        if(timeout <= 0)
+            mNotEmpty.wait();
+        else if(!mNotEmpty.wait(timeout))
+            return STREAM_TIMEOUT;
+    }
+    return STREAM_SUCCESS;
+}
+
+void StreamReceiver::recv (zmq_msg_t *msg, epicsTimeStamp *recvTime)
+{
+    wait(0);
+
+    // Only the consumer moves mTail
+    size_t tail = mTail.load(std::memory_order_relaxed);
+    zmq_msg_t *slot = &mRing[tail % mCapacity];
+    if(recvTime)
+        *recvTime = mRecvTimes[tail % mCapacity];
+    zmq_msg_init(msg);
+    zmq_msg_move(msg, slot);
+    zmq_msg_close(slot);
+
+    mTail.store(tail + 1, std::memory_order_release);
+    mNotFull.signal();
+}
+
+// The buffers are owned by the ZMQ messages, so no memory is accounted to
+// this pool
+StreamArrayPool::StreamArrayPool (asynNDArrayDriver *pDriver)
+    : NDArrayPool(pDriver, 0)
+{}
+
+NDArray *StreamArrayPool::borrow (int ndims, size_t *dims, NDDataType_t dataType,
+        zmq_msg_t *msg, const void *pData, size_t dataSize)
+{
+    StreamArray *pArray = (StreamArray *) alloc(ndims, dims, dataType, dataSize, (void *) pData);
+    if(!pArray)
+        return NULL;
+
+    zmq_msg_init(&pArray->msg);
+    mCopyLock.lock();
+    zmq_msg_copy(&pArray->msg, msg);
+    mCopyLock.unlock();
+    pArray->hasMsg = true;
+    return pArray;
+}
+
+NDArray *StreamArrayPool::createArray (void)
+{
+    return new StreamArray;
+}
+
+void StreamArrayPool::onReleaseArray (NDArray *pArray)
+{
+    StreamArray *pStreamArray = (StreamArray *) pArray;
+    if(!pStreamArray->hasMsg)
+    {
+        // Allocated by the pool itself, its buffer is the pool's as usual
+        NDArrayPool::onReleaseArray(pArray);
+        return;
+    }
+
+    zmq_msg_close(&pStreamArray->msg);
+    pStreamArray->hasMsg = false;
+
+    // The buffer belonged to the message, make sure the pool never reuses or
+    // frees it
+    pArray->pData = NULL;
+    pArray->dataSize = 0;
+}
+
+int StreamAPI::poll (int timeout)
+{
+    return mReceiver->wait(timeout);
+}
+
+StreamAPI::StreamAPI (const char *hostname, size_t ringSize)
+    : mHostname(epicsStrDup(hostname)), mReceiver(NULL)
 {
     if(!(mCtx = zmq_ctx_new()))
         throw std::runtime_error("unable to create zmq context");
@@ -183,10 +357,14 @@ StreamAPI::StreamAPI (const char *hostname) : mHostname(epicsStrDup(hostname))
         throw std::runtime_error("address is too long");
 
     zmq_connect(mSock, addr);
+
+    // From now on the socket is only accessed by the receive thread
+    mReceiver = new StreamReceiver(mSock, ringSize);
 }
 
 StreamAPI::~StreamAPI (void)
 {
+    delete mReceiver;
     zmq_close(mSock);
     zmq_ctx_destroy(mCtx);
     free(mHostname);
@@ -201,8 +379,7 @@ int StreamAPI::getHeader (stream_header_t *header, int timeout)
         return err;
 
     zmq_msg_t header_msg;
-    zmq_msg_init(&header_msg);
-    zmq_msg_recv(&header_msg, mSock, 0);
+    mReceiver->recv(&header_msg);
 
     if(header)
     {
@@ -263,8 +440,7 @@ int StreamAPI::waitFrame (int *end, int timeout)
     zmq_msg_t header;
 
     // Get Header
-    zmq_msg_init(&header);
-    zmq_msg_recv(&header, mSock, 0);
+    mReceiver->recv(&header, &mRecvTime);
 
     struct json_token tokens[MAX_JSON_TOKENS];
     size_t size = zmq_msg_size(&header);
@@ -299,126 +475,234 @@ closeHeader:
     return err;
 }
 
-int StreamAPI::getFrame (NDArray **pArrayOut, NDArrayPool *pNDArrayPool, int decompress)
+int StreamAPI::readFrame (stream_frame_t *frame)
 {
-    const char *functionName = "getFrame";
+    const char *functionName = "readFrame";
     int err = STREAM_SUCCESS;
 
     zmq_msg_t shape, timestamp;
-    char dataType[8] = "";
-    char encoding[32] = {0};
+
+    frame->frame = mFrame;
+    frame->recvTime = mRecvTime;
+    frame->numThresholds = 1;
+    frame->data = NULL;
 
     // Get Shape
-    zmq_msg_init(&shape);
-    zmq_msg_recv(&shape, mSock, 0);
+    mReceiver->recv(&shape);
+
+    if((err = streamParseShape((const char*) zmq_msg_data(&shape), zmq_msg_size(&shape), frame)))
+        goto closeShape;
+
+    // Keep the data message, it is decoded later straight into the NDArray,
+    // possibly on another thread
+    mReceiver->recv(&frame->msg);
+    frame->data = (char *) zmq_msg_data(&frame->msg);
+
+    if (strcmp(frame->encoding, "<") == 0)
+        frame->compressedSize = frame->uncompressedSize;
+
+    // As when the data was received into a buffer of the expected size, the
+    // bytes past it are ignored, and a short frame is decoded with the rest
+    // of the buffer zeroed instead of read past the message
+    if(zmq_msg_size(&frame->msg) < frame->compressedSize)
+    {
+        zmq_msg_t padded;
+
+        ERR_ARGS("frame %lu has %lu bytes, expected %lu", mFrame,
+                (unsigned long) zmq_msg_size(&frame->msg),
+                (unsigned long) frame->compressedSize);
+
+        if(zmq_msg_init_size(&padded, frame->compressedSize))
+        {
+            ERR_ARGS("failed to allocate %lu bytes for frame %lu",
+                    (unsigned long) frame->compressedSize, mFrame);
+            err = STREAM_ERROR;
+        }
+        else
+        {
+            size_t size = zmq_msg_size(&frame->msg);
+
+            memcpy(zmq_msg_data(&padded), frame->data, size);
+            memset((char *) zmq_msg_data(&padded) + size, 0,
+                    frame->compressedSize - size);
+            zmq_msg_move(&frame->msg, &padded);
+            zmq_msg_close(&padded);
+            frame->data = (char *) zmq_msg_data(&frame->msg);
+        }
+    }
+
+    // Get timestamp
+    mReceiver->recv(&timestamp);
+
+    // Deallocate everything
+    zmq_msg_close(&timestamp);
+
+closeShape:
+    zmq_msg_close(&shape);
+
+    epicsTimeGetCurrent(&frame->parseTime);
+    return err;
+}
+
+int streamParseShape (const char *data, size_t size, stream_frame_t *frame)
+{
+    const char *functionName = "streamParseShape";
+    int err = STREAM_SUCCESS;
+    char dataType[8] = "";
 
     struct json_token tokens[MAX_JSON_TOKENS];
-    size_t size = zmq_msg_size(&shape);
-    const char *data = (const char*) zmq_msg_data(&shape);
 
     if(parse_json(data, size, tokens, MAX_JSON_TOKENS) < 0)
     {
         ERR("failed to parse image shape JSON");
-        err = STREAM_ERROR;
-        goto closeShape;
+        return STREAM_ERROR;
     }
 
-    size_t frameShape[2];
-    size_t compressedSize;
-    size_t uncompressedSize;
-    NDDataType_t frameType;
-
-    err |= readToken(tokens, "shape",    frameShape, 3);
+    memset(frame->encoding, 0, sizeof(frame->encoding));
+    err |= readToken(tokens, "shape",    frame->dims, 3);
     err |= readToken(tokens, "type",     dataType, sizeof(dataType));
-    err |= readToken(tokens, "encoding", encoding, sizeof(encoding));
-    err |= readToken(tokens, "size",     &compressedSize);
+    err |= readToken(tokens, "encoding", frame->encoding, sizeof(frame->encoding));
+    err |= readToken(tokens, "size",     &frame->compressedSize);
 
     if(err)
     {
         ERR("failed to read token from shape message");
-        goto closeShape;
+        return err;
     }
 
     // Calculate uncompressed size
-    uncompressedSize = frameShape[0]*frameShape[1];
+    frame->uncompressedSize = frame->dims[0]*frame->dims[1];
 
     if(!strncmp(dataType, "uint32", 6))
     {
-        frameType = NDUInt32;
-        uncompressedSize *= 4;
+        frame->dataType = NDUInt32;
+        frame->uncompressedSize *= 4;
     }
     else if (!strncmp(dataType, "uint16", 6))
     {
-        frameType = NDUInt16;
-        uncompressedSize *= 2;
+        frame->dataType = NDUInt16;
+        frame->uncompressedSize *= 2;
     }
     else if (!strncmp(dataType, "uint8", 5))
     {
-        frameType = NDUInt8;
-        uncompressedSize *= 1;
+        frame->dataType = NDUInt8;
+        frame->uncompressedSize *= 1;
     }
     else
     {
-        frameType = NDUInt32;
-        uncompressedSize *= 4;
+        frame->dataType = NDUInt32;
+        frame->uncompressedSize *= 4;
         ERR_ARGS("unknown dataType %s", dataType);
-        err = STREAM_ERROR;
-        goto closeShape;
+        return STREAM_ERROR;
     }
 
-    NDArray *pArray;
-    if(!(pArray = pNDArrayPool->alloc(2, frameShape, frameType, 0, NULL)))
+    return STREAM_SUCCESS;
+}
+
+int StreamAPI::decodeFrame (stream_frame_t *frame, NDArray **pArrayOut,
+        NDArrayPool *pNDArrayPool, stream_decode_t const & decode)
+{
+    const char *functionName = "decodeFrame";
+    int err = STREAM_SUCCESS;
+    char *encoding = frame->encoding;
+    struct bslz4_mask mask = {(uint32_t) decode.maskFill, 0};
+    struct bslz4_mask *pMask = decode.maskFlagged ? &mask : NULL;
+    size_t dims[2] = {frame->dims[0], frame->dims[1]};
+    size_t elemSize = frame->dataType == NDUInt8 ? 1 : frame->dataType == NDUInt16 ? 2 : 4;
+    bool uncompressed = strcmp(encoding, "<") == 0;
+
+    // Crop and bin decoded data, but not the compressed data passed on
+    struct roi_bin roi;
+    struct roi_bin *pRoi = NULL;
+    if (decode.roi && (uncompressed || decode.decompress) &&
+        !roi_bin_init(&roi, dims[0], dims[1], elemSize, decode.roiMinX,
+                decode.roiMinY, decode.roiSizeX, decode.roiSizeY, decode.roiBin))
     {
-        ERR_ARGS("failed to allocate NDArray for frame %lu", mFrame);
-        err = STREAM_ERROR;
-        goto closeShape;
+        pRoi = &roi;
+        dims[0] = roi_bin_out_width(pRoi);
+        dims[1] = roi_bin_out_height(pRoi);
     }
 
-    // Get frame data
-    // If data is uncompressed we can copy directly into NDArray
-    if (strcmp(encoding, "<") == 0)
+    NDArray *pArray;
+    if(!(pArray = pNDArrayPool->alloc(2, dims, frame->dataType, 0, NULL)))
     {
-        zmq_recv(mSock, pArray->pData, uncompressedSize, 0);
+        ERR_ARGS("failed to allocate NDArray for frame %lu", frame->frame);
+        return STREAM_ERROR;
     }
-    else 
+    if (pRoi)
     {
-        char *temp = (char *)malloc(compressedSize);
-        zmq_recv(mSock, temp, compressedSize, 0);
-        if (decompress) 
+        roi_bin_start(pRoi, pArray->pData, pMask);
+        pArray->dims[0].offset = pRoi->min_x;
+        pArray->dims[1].offset = pRoi->min_y;
+        pArray->dims[0].binning = pArray->dims[1].binning = pRoi->bin;
+    }
+
+    // If data is uncompressed we can copy directly into NDArray
+    if (uncompressed)
+    {
+        if (pRoi)
+            roi_bin_add(pRoi, frame->data, 0, frame->uncompressedSize/elemSize);
+        else if (pMask)
         {
-            uncompress(temp, (char *)pArray->pData, encoding, uncompressedSize, frameType);
+            NDArrayInfo_t info;
+            pArray->getInfo(&info);
+            bslz4_mask_pixels(frame->data, pArray->pData, info.nElements,
+                    info.bytesPerElement, pMask);
         }
         else
-        {
-            char *pInput = temp;
-            if (strcmp(encoding, "lz4<") == 0) {
-                pArray->codec.name = NDCodecName[NDCODEC_LZ4];
-            }
-            else if ((strcmp(encoding, "bs32-lz4<") == 0) ||
-                     (strcmp(encoding, "bs16-lz4<") == 0) ||
-                     (strcmp(encoding, "bs8-lz4<") == 0)) {
-                pArray->codec.name = NDCodecName[NDCODEC_BSLZ4];
-                pInput += 12;
-                compressedSize -= 12;
-            }
-            else {
-                ERR_ARGS("unknown encoding %s", encoding);
-            }
-            pArray->compressedSize = compressedSize;
-            memcpy(pArray->pData, pInput, compressedSize);
+            memcpy(pArray->pData, frame->data, frame->uncompressedSize);
+    }
+    else if (decode.decompress)
+    {
+        err = streamUncompress(frame->data, (char *)pArray->pData, encoding,
+                frame->compressedSize, frame->uncompressedSize, frame->dataType,
+                decode.bsKernel, pMask, pRoi, decode.scratch);
+    }
+    else
+    {
+        // Compressed data is passed on as it is, without masking
+        pMask = NULL;
+
+        char *pInput = frame->data;
+        size_t compressedSize = frame->compressedSize;
+        if (strcmp(encoding, "lz4<") == 0) {
+            pArray->codec.name = NDCodecName[NDCODEC_LZ4];
+        }
+        else if ((strcmp(encoding, "bs32-lz4<") == 0) ||
+                 (strcmp(encoding, "bs16-lz4<") == 0) ||
+                 (strcmp(encoding, "bs8-lz4<") == 0)) {
+            pArray->codec.name = NDCodecName[NDCODEC_BSLZ4];
+            pInput += 12;
+            compressedSize -= 12;
         }
-        free(temp);
+        else {
+            ERR_ARGS("unknown encoding %s", encoding);
+        }
+        pArray->compressedSize = compressedSize;
+        memcpy(pArray->pData, pInput, compressedSize);
     }
-    *pArrayOut = pArray;
-    // Get timestamp
-    zmq_msg_init(&timestamp);
-    zmq_msg_recv(&timestamp, mSock, 0);
 
-    // Deallocate everything
-    zmq_msg_close(&timestamp);
+    if(err)
+    {
+        pArray->release();
+        return err;
+    }
 
-closeShape:
-    zmq_msg_close(&shape);
+    if (pMask)
+    {
+        epicsInt32 maskedPixels = (epicsInt32) mask.count;
+        pArray->pAttributeList->add("MaskedPixels", "Masked gap and bad pixels",
+                NDAttrInt32, &maskedPixels);
+    }
 
-    return err;
+    *pArrayOut = pArray;
+    return STREAM_SUCCESS;
+}
+
+void StreamAPI::freeFrame (stream_frame_t *frame)
+{
+    if (frame->data) {
+        zmq_msg_close(&frame->msg);
+        frame->data = NULL;
+    }
 }
@@ -3,10 +3,17 @@
 
 #include <stdlib.h>
 #include <stdint.h>
+#include <atomic>
 #include <vector>
+#include <epicsEvent.h>
+#include <epicsMutex.h>
 #include <NDArray.h>
 #include <zmq.h>
 #include <stream2.h>
+#include <bslz4.h>
+#include <roibin.h>
+
+#include "streamFrameTracker.h"
 
 enum stream_err
 {
@@ -21,6 +28,126 @@ typedef struct
     size_t series;
 }stream_header_t;
 
+// A frame that was received from the socket but not yet decoded. It owns its
+// message buffers, so it can be decoded on any thread. It is filled by
+// readFrame(), turned into NDArrays by decodeFrame() and released by freeFrame().
+typedef struct
+{
+    size_t frame;
+    int numThresholds;
+
+    // Stream
+    size_t dims[2];
+    NDDataType_t dataType;
+    char encoding[32];
+    size_t compressedSize, uncompressedSize;
+    char *data;             // Points into msg
+
+    // When the first message of the frame was received, and when the frame
+    // was parsed
+    epicsTimeStamp recvTime, parseTime;
+
+    // Stream: the data part, Stream2: the whole image message
+    zmq_msg_t msg;
+
+    // Stream2
+    stream2_image_msg *imageMsg;    // Allocated from arena
+    struct stream2_arena arena;
+    bool hasTimeStamp;
+    epicsTimeStamp timeStamp;
+}stream_frame_t;
+
+// How decodeFrame() turns a frame into NDArrays
+typedef struct
+{
+    int decompress;
+    bslz4_kernel bsKernel;
+
+    // Replace the values of the gap and bad pixels with maskFill, and count
+    // them in the MaskedPixels attribute. Only done for decompressed data.
+    int maskFlagged;
+    int maskFill;
+
+    // Crop the frame to the region of interest and sum roiBin x roiBin
+    // pixels. A size of 0 extends the region to the edge of the frame. Only
+    // done for decoded data, and skipped if the region is outside the frame.
+    int roi;
+    int roiMinX, roiMinY, roiSizeX, roiSizeY;
+    int roiBin;
+
+    // Holds the whole decompressed frame when a region is cut out of an lz4
+    // frame, which can only be decompressed whole. Owned by the decoding
+    // thread and reused from frame to frame. If NULL, a buffer is allocated
+    // for each frame.
+    std::vector<char> *scratch;
+}stream_decode_t;
+
+#define DEFAULT_RING_SIZE 256
+
+// NDArray whose data buffer is borrowed from a ZMQ message
+class StreamArray : public NDArray
+{
+public:
+    StreamArray (void) : NDArray(), hasMsg(false) {}
+    zmq_msg_t msg;
+    bool hasMsg;
+};
+
+// NDArrayPool that hands out NDArrays pointing into ZMQ message buffers. Each
+// NDArray holds its own reference to the message, which is dropped when the
+// last user releases the NDArray.
+class StreamArrayPool : public NDArrayPool
+{
+public:
+    StreamArrayPool (asynNDArrayDriver *pDriver);
+    NDArray *borrow (int ndims, size_t *dims, NDDataType_t dataType,
+            zmq_msg_t *msg, const void *pData, size_t dataSize);
+
+protected:
+    virtual NDArray *createArray (void);
+    virtual void onReleaseArray (NDArray *pArray);
+
+private:
+    // The thresholds of one frame may be borrowed from the same message on
+    // several threads, but the first zmq_msg_copy() of a message is not
+    // thread safe
+    epicsMutex mCopyLock;
+};
+
+// Receives the messages of a ZMQ socket on a dedicated thread into a bounded
+// single-producer single-consumer ring, so that a consumer that is busy
+// decoding or doing callbacks does not stall the socket. When the ring is full
+// the receive thread counts an overflow and waits for a free slot.
+class StreamReceiver
+{
+private:
+    void *mSock;
+    size_t mCapacity;
+    zmq_msg_t *mRing;
+    epicsTimeStamp *mRecvTimes;
+    std::atomic<size_t> mHead, mTail;
+    std::atomic<size_t> mOverflows;
+    std::atomic<bool> mStop;
+    epicsEvent mNotEmpty, mNotFull, mDone;
+
+public:
+    StreamReceiver  (void *sock, size_t capacity);
+    ~StreamReceiver (void);
+
+    // Wait for a message to be available. A timeout of 0 waits forever.
+    int wait        (double timeout);
+    // Move the next message into msg, waiting for it if needed. recvTime is
+    // set to when the message was received from the socket.
+    void recv       (zmq_msg_t *msg, epicsTimeStamp *recvTime = NULL);
+
+    size_t capacity  (void) const { return mCapacity; }
+    size_t occupancy (void) const { return mHead - mTail; }
+    size_t overflows (void) const { return mOverflows; }
+
+    // Should be private but is called from C so must be public
+    void receiveTask (void);
+};
+
 class StreamAPI
 {
 private:
@@ -28,15 +155,22 @@ private:
     void *mCtx, *mSock;
     size_t mSeries;
     size_t mFrame;
+    epicsTimeStamp mRecvTime;
+    StreamReceiver *mReceiver;
 
     int poll       (int timeout);   // timeout in seconds
 
 public:
-    StreamAPI      (const char *hostname);
+    StreamAPI      (const char *hostname, size_t ringSize = DEFAULT_RING_SIZE);
     ~StreamAPI     (void);
     int getHeader  (stream_header_t *header, int timeout = 0);
     int waitFrame  (int *end, int timeout = 0);
-    int getFrame   (NDArray **pArray, NDArrayPool *pNDArrayPool, int decompress);
+    int readFrame  (stream_frame_t *frame);
+    StreamReceiver *getReceiver (void) { return mReceiver; }
+
+    static int decodeFrame (stream_frame_t *frame, NDArray **pArray,
+            NDArrayPool *pNDArrayPool, stream_decode_t const & decode);
+    static void freeFrame  (stream_frame_t *frame);
 };
 
 class Stream2API
@@ -47,26 +181,39 @@ private:
     uint64_t mSeries_id;
     char* mImage_dtype;
     zmq_msg_t mMsg;
+    struct stream2_arena mArena;
     stream2_image_msg *mImageMsg;
     uint64_t mImage_size_x;
     uint64_t mImage_size_y;
     uint64_t mNumber_of_images;
     int mNumThresholds;
+    epicsTimeStamp mRecvTime;
     std::vector<stream2_threshold_energy> mThresholdEnergy;
     struct {
         std::string tsStr;
         epicsTimeStamp ts;
     } mCachedTs;
+    StreamReceiver *mReceiver;
 
     epicsTimeStamp extractTimeStampFromMessage(stream2_image_msg *message);
     int poll (int timeout);   // timeout in seconds
 
 public:
-    Stream2API     (const char *hostname);
+    Stream2API     (const char *hostname, size_t ringSize = DEFAULT_RING_SIZE);
     ~Stream2API    (void);
     int getHeader  (stream_header_t *header, int timeout = 0);
     int waitFrame  (int *end, int *numThresholds, int timeout = 0);
-    int getFrame   (NDArray **pArray, NDArrayPool *pNDArrayPool, int thresh, int decompress, bool extractTimeStamp);
+    int readFrame  (stream_frame_t *frame, bool extractTimeStamp);
+    StreamReceiver *getReceiver (void) { return mReceiver; }
+
+    // Only reads the series header information, so it is safe to call from
+    // several threads at once while a series is being received
+    // If pBorrowPool is not NULL, frames that are not decompressed are passed
+    // on without copying them out of the ZMQ message
+    int decodeFrame (stream_frame_t *frame, int thresh, NDArray **pArray,
+            NDArrayPool *pNDArrayPool, stream_decode_t const & decode,
+            StreamArrayPool *pBorrowPool = NULL) const;
+    static void freeFrame  (stream_frame_t *frame);
 };
 
 
@@ -0,0 +1,45 @@
+#include "streamFrameTracker.h"
+
+void StreamFrameTracker::reset (uint64_t firstId)
+{
+    mNext = firstId;
+    mGaps.clear();
+    mMissing = mDuplicates = mReordered = 0;
+}
+
+uint64_t StreamFrameTracker::add (uint64_t id, bool *stale)
+{
+    if (stale)
+        *stale = id < mNext;
+
+    if (id >= mNext)
+    {
+        uint64_t gap = id - mNext;
+        if (gap)
+        {
+            mGaps[mNext] = id;
+            mMissing += gap;
+            if (mGaps.size() > MAX_FRAME_GAPS)
+                mGaps.erase(mGaps.begin());
+        }
+        mNext = id + 1;
+        return gap;
+    }
+
+    // An earlier id is either a missing frame arriving late or a duplicate
+    std::map<uint64_t, uint64_t>::iterator it = mGaps.upper_bound(id);
+    if (it != mGaps.begin() && id < (--it)->second)
+    {
+        uint64_t first = it->first, end = it->second;
+        mGaps.erase(it);
+        if (first < id)
+            mGaps[first] = id;
+        if (id + 1 < end)
+            mGaps[id + 1] = end;
+        --mMissing;
+        ++mReordered;
+    }
+    else
+        ++mDuplicates;
+    return 0;
+}
@@ -0,0 +1,39 @@
+#ifndef STREAM_FRAME_TRACKER_H
+#define STREAM_FRAME_TRACKER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <map>
+
+// Largest number of missing ranges that are remembered
+#define MAX_FRAME_GAPS 1024
+
+// Follows the ids of the frames of a series as they arrive, to detect lost,
+// duplicated and reordered frames. A frame is missing when a later id arrives
+// before it, and reordered if it arrives after that. The missing ranges are
+// kept up to a limit; frames in older ranges are counted as lost for good.
+class StreamFrameTracker
+{
+private:
+    uint64_t mNext;
+    std::map<uint64_t, uint64_t> mGaps;     // First id -> end of each missing range
+    uint64_t mMissing, mDuplicates, mReordered;
+
+public:
+    StreamFrameTracker (void) { reset(); }
+
+    void reset (uint64_t firstId = 0);
+    // Returns the number of frames missing right before id. If stale is not
+    // NULL, it is set when id comes after a later frame, either late or as a
+    // duplicate.
+    uint64_t add (uint64_t id, bool *stale = NULL);
+
+    uint64_t missing    (void) const { return mMissing; }
+    uint64_t duplicates (void) const { return mDuplicates; }
+    uint64_t reordered  (void) const { return mReordered; }
+    // First id that is still missing, or -1 if none
+    int64_t firstMissing (void) const
+        { return mGaps.empty() ? -1 : (int64_t) mGaps.begin()->first; }
+};
+
+#endif
@@ -0,0 +1,140 @@
+#include <testMain.h>
+#include <epicsUnitTest.h>
+
+#include "streamFrameTracker.h"
+
+static void testInOrder (void)
+{
+    StreamFrameTracker tracker;
+    bool noGaps = true;
+
+    testDiag("In order");
+    for (uint64_t id = 0; id < 10; ++id)
+        noGaps = !tracker.add(id) && noGaps;
+
+    testOk(noGaps, "No gap returned");
+    testOk(tracker.missing() == 0, "None missing");
+    testOk(tracker.duplicates() == 0, "No duplicates");
+    testOk(tracker.reordered() == 0, "None reordered");
+    testOk(tracker.firstMissing() == -1, "No first missing");
+}
+
+static void testGapAndLateFrames (void)
+{
+    StreamFrameTracker tracker;
+
+    testDiag("Gap, then the missing frames arriving late");
+    testOk(tracker.add(0) == 0, "First frame");
+    testOk(tracker.add(5) == 4, "Gap of 4 returned");
+    testOk(tracker.missing() == 4, "4 missing");
+    testOk(tracker.firstMissing() == 1, "First missing is 1");
+
+    // Splits the gap in two
+    testOk(tracker.add(3) == 0, "Late frame returns no gap");
+    testOk(tracker.reordered() == 1, "1 reordered");
+    testOk(tracker.missing() == 3, "3 missing");
+    testOk(tracker.firstMissing() == 1, "First missing still 1");
+
+    tracker.add(1);
+    tracker.add(2);
+    testOk(tracker.firstMissing() == 4, "First missing is 4");
+    tracker.add(4);
+    testOk(tracker.missing() == 0, "None missing once all arrived");
+    testOk(tracker.reordered() == 4, "4 reordered");
+    testOk(tracker.firstMissing() == -1, "No first missing");
+    testOk(tracker.duplicates() == 0, "No duplicates");
+}
+
+static void testDuplicates (void)
+{
+    StreamFrameTracker tracker;
+
+    testDiag("Duplicates");
+    tracker.add(0);
+    tracker.add(2);
+    tracker.add(3);
+
+    testOk(tracker.add(3) == 0, "Repeat of the last frame returns no gap");
+    testOk(tracker.duplicates() == 1, "Repeat of the last frame");
+    tracker.add(0);
+    testOk(tracker.duplicates() == 2, "Repeat of an earlier frame");
+    tracker.add(1);
+    tracker.add(1);
+    testOk(tracker.duplicates() == 3, "Repeat of a late frame");
+    testOk(tracker.reordered() == 1, "Only its first arrival reordered");
+    testOk(tracker.missing() == 0, "None missing");
+}
+
+static void testGapLimit (void)
+{
+    StreamFrameTracker tracker;
+    uint64_t i;
+
+    testDiag("More gaps than are remembered");
+    // Frames 0, 2, ..., 2 * MAX_FRAME_GAPS missing, one gap each
+    for (i = 0; i <= MAX_FRAME_GAPS; ++i)
+        tracker.add(2 * i + 1);
+
+    testOk(tracker.missing() == MAX_FRAME_GAPS + 1, "All gaps counted");
+    testOk(tracker.firstMissing() == 2, "Oldest gap forgotten");
+
+    tracker.add(0);
+    testOk(tracker.duplicates() == 1 && tracker.reordered() == 0,
+            "Late frame of a forgotten gap counted as a duplicate");
+    testOk(tracker.missing() == MAX_FRAME_GAPS + 1, "It stays missing");
+
+    tracker.add(2);
+    testOk(tracker.reordered() == 1, "Late frame of a remembered gap reordered");
+    testOk(tracker.missing() == MAX_FRAME_GAPS, "It is no longer missing");
+    testOk(tracker.firstMissing() == 4, "First missing is 4");
+}
+
+static void testStale (void)
+{
+    StreamFrameTracker tracker;
+    bool stale = true;
+
+    testDiag("Late and duplicate frames reported as stale");
+    tracker.add(0, &stale);
+    testOk(!stale, "First frame not stale");
+    testOk(tracker.add(3, &stale) == 2 && !stale, "Frame after a gap not stale");
+    tracker.add(1, &stale);
+    testOk(stale && tracker.reordered() == 1, "Late frame stale");
+    tracker.add(3, &stale);
+    testOk(stale && tracker.duplicates() == 1, "Duplicate of the last frame stale");
+    tracker.add(1, &stale);
+    testOk(stale && tracker.duplicates() == 2, "Duplicate of a late frame stale");
+    tracker.add(4, &stale);
+    testOk(!stale, "Next frame not stale");
+}
+
+static void testReset (void)
+{
+    StreamFrameTracker tracker;
+
+    testDiag("Reset");
+    tracker.add(0);
+    tracker.add(3);
+    tracker.add(3);
+    tracker.reset(10);
+
+    testOk(tracker.missing() == 0 && tracker.duplicates() == 0 &&
+            tracker.reordered() == 0, "Counts cleared");
+    testOk(tracker.firstMissing() == -1, "Gaps cleared");
+    testOk(tracker.add(10) == 0, "Series starts at the first id");
+    testOk(tracker.add(12) == 1, "Gap after the first id");
+}
+
+MAIN(streamFrameTrackerTest)
+{
+    testPlan(41);
+
+    testInOrder();
+    testGapAndLateFrames();
+    testDuplicates();
+    testGapLimit();
+    testStale();
+    testReset();
+
+    return testDone();
+}
@@ -19,6 +19,8 @@ epicsEnvSet("CBUFFS", "500")
 epicsEnvSet("EIGERIP", "10.54.160.198")
 epicsEnvSet("EPICS_DB_INCLUDE_PATH", "$(ADCORE)/db:$(ADEIGER)/db")
 epicsEnvSet("EPICS_CA_MAX_ARRAY_BYTES", "5000000")
+# Uncomment to cache the detector parameter metadata, which shortens the IOC startup
+#epicsEnvSet("EIGER_PARAM_CACHE_DIR", ".")
 
 eigerDetectorConfig("$(PORT)", "$(EIGERIP)", 0, 0)
 dbLoadRecords("$(ADEIGER)/db/eiger2.template", "P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")
@@ -17,6 +17,8 @@ epicsEnvSet("CBUFFS", "500")
 epicsEnvSet("PILATUS_IP", "10.54.160.111")
 epicsEnvSet("EPICS_DB_INCLUDE_PATH", "$(ADCORE)/db:$(ADEIGER)/db")
 epicsEnvSet("EPICS_CA_MAX_ARRAY_BYTES", "5000000")
+# Uncomment to cache the detector parameter metadata, which shortens the IOC startup
+#epicsEnvSet("EIGER_PARAM_CACHE_DIR", ".")
 
 eigerDetectorConfig("$(PORT)", "$(PILATUS_IP)", 0, 0)
 dbLoadRecords("$(ADEIGER)/db/pilatus4.template", "P=$(PREFIX),R=cam1:,PORT=$(PORT),ADDR=0,TIMEOUT=1")